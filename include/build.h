@@ -0,0 +1,52 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_BUILD_H
+#define VFBFS_BUILD_H
+
+#include <vfbfs.h>
+
+/*
+ * Bulk construction of the tree before the filesystem is mounted. The nodes
+ * and their names are carved out of large chunks, and they are inserted
+ * without taking any of the locks, so it must not run concurrently with
+ * anything else touching the tree. Nodes made this way are never freed one
+ * by one (VFBFS_FILE_BUILT).
+*/
+#define VFBFS_BUILD_CHUNK   (256 << 10)
+
+struct vfbfs_build {
+    struct vfbfs     *b_fs;
+    char             *b_chunk;      /* the free part of the current chunk */
+    size_t            b_chunk_left;
+    size_t            b_nfiles;     /* added to sb_file_count at the end */
+    struct vfbfs_dir *b_last_dir;   /* the last directory vfbfs_build_path() found */
+    char             *b_last_path;
+};
+
+void                vfbfs_build_begin(struct vfbfs_build *b, struct vfbfs *fs);
+struct vfbfs_dir   *vfbfs_build_dir(struct vfbfs_build *b, struct vfbfs_dir *parent
+                        , const char *name, mode_t mode);
+struct vfbfs_file  *vfbfs_build_file(struct vfbfs_build *b, struct vfbfs_dir *parent
+                        , const char *name, mode_t mode);
+struct vfbfs_dir   *vfbfs_build_path(struct vfbfs_build *b, const char *path, const char **name);
+void                vfbfs_build_end(struct vfbfs_build *b);
+
+#endif /* VFBFS_BUILD_H */
@@ -0,0 +1,42 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_CONFIG_H
+#define VFBFS_CONFIG_H
+
+#include <vfbfs.h>
+
+/*
+ * A generated file type, the "gen" lines of the configuration name one of
+ * these. g_setup() gets the newly created file and the rest of the line.
+*/
+struct vfbfs_generator {
+    const char              *g_name;
+    int                    (*g_setup)(struct vfbfs *, struct vfbfs_file *, const char *args);
+    struct vfbfs_generator  *g_next;   /* next registered generator */
+};
+
+void                    vfbfs_generator_register(struct vfbfs_generator *gen);
+struct vfbfs_generator *vfbfs_generator_find(const char *name);
+
+int vfbfs_config_load(struct vfbfs *fs, const char *path);
+int vfbfs_config_load_string(struct vfbfs *fs, const char *text, const char *source);
+
+#endif /* VFBFS_CONFIG_H */
@@ -0,0 +1,345 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_FB_H
+#define VFBFS_FB_H
+
+#include <vfbfs.h>
+#include <stdint.h>
+
+/*
+ * Used when no --fb= option is given: the ST7781 panel's geometry.
+ * The full syntax is "WxH[/VH][:format][@hz][,device[:args]]", VH is the
+ * height of the virtual buffer the panel can be panned in.
+*/
+#define VFBFS_FB_DEFAULT_SPEC "240x320:rgb565@60,virtual"
+
+enum VfbfsFbFormat {
+      VFBFS_FB_RGB565, VFBFS_FB_RGB888, VFBFS_FB_XRGB8888
+    , VFBFS_FB_FORMAT_MAX
+};
+
+unsigned            vfbfs_fb_format_bpp(enum VfbfsFbFormat fmt);
+const char         *vfbfs_fb_format_name(enum VfbfsFbFormat fmt);
+int                 vfbfs_fb_format_parse(const char *name, enum VfbfsFbFormat *fmt);
+void                vfbfs_fb_convert(enum VfbfsFbFormat dfmt, void *dst
+                        , enum VfbfsFbFormat sfmt, const void *src, unsigned npix);
+
+/* How the flush reduces the colors for a device with fewer bits, see fbdither.c */
+enum VfbfsFbDither {
+      VFBFS_FB_DITHER_NONE, VFBFS_FB_DITHER_ORDERED, VFBFS_FB_DITHER_DIFFUSION
+    , VFBFS_FB_DITHER_MAX
+};
+
+int                 vfbfs_fb_convert_dither(enum VfbfsFbDither mode, enum VfbfsFbFormat dfmt, void *dst
+                        , size_t dstride, enum VfbfsFbFormat sfmt, const void *src, size_t sstride
+                        , unsigned width, unsigned height, unsigned x, unsigned y);
+
+/* A rectangle, r_x1 and r_y1 are exclusive. Empty if r_x1 <= r_x0. */
+struct vfbfs_fb_rect {
+    unsigned r_x0, r_y0;
+    unsigned r_x1, r_y1;
+};
+
+static inline bool vfbfs_fb_rect_empty(const struct vfbfs_fb_rect *r)
+{
+    return r->r_x1 <= r->r_x0 || r->r_y1 <= r->r_y0;
+}
+
+void vfbfs_fb_rect_union(struct vfbfs_fb_rect *dst, const struct vfbfs_fb_rect *r);
+void vfbfs_fb_rect_turn(struct vfbfs_fb_rect *dst, const struct vfbfs_fb_rect *r, unsigned quarters
+        , unsigned width, unsigned height);
+
+/*
+ * A static region: page rows [rg_y0, rg_y1) which are not flushed with the
+ * rest, see fbregion.c. As many as the ST7781 has partial images.
+*/
+struct vfbfs_fb_region {
+    unsigned rg_y0, rg_y1;
+};
+
+#define VFBFS_FB_MAX_REGIONS 2
+
+/* Side of the damage tiles in pixels, see fbtile.c */
+#define VFBFS_FB_TILE 32
+
+struct vfbfs_fb;
+struct vfbfs_fb_poller;
+struct vfbfs_fb_console;
+struct vfbfs_fb_image;
+struct vfbfs_fb_history;
+struct vfbfs_fb_layers;
+struct vfbfs_fb_color;
+struct vfbfs_fb_xform;
+
+/* Layers of /fb/<n>/layers, see fblayer.c */
+#define VFBFS_FB_MAX_LAYERS         4
+
+/* Frames kept by /fb/<n>/history at most, and its default memory budget */
+#define VFBFS_FB_HISTORY_MAX        256
+#define VFBFS_FB_HISTORY_BUDGET     (16 << 20)
+
+/*
+ * Operations of a display driver. fd_flush() gets the damaged rectangle
+ * already converted to the device's format (dev_format), pixels points to
+ * the rectangle's first pixel and stride is the distance of its rows in bytes.
+ * fd_scroll() is optional, a driver with it scrolls in hardware: the panel
+ * shows its memory from row origin on, wrapping around, and the rows given
+ * to fd_flush() are the rows of the panel's memory instead of the screen's.
+ * fd_regions() is optional too, it gets the static regions when they change.
+ * fd_rotate() is optional as well, a driver with it turns the pixels by
+ * quarters * 90 degrees clockwise as the panel writes them: the following
+ * rectangles are given in the turned orientation, see fbxform.c.
+*/
+struct vfbfs_fb_device_ops {
+    const char *fd_name;
+    int  (*fd_open)(struct vfbfs_fb *, const char *args);
+    int  (*fd_flush)(struct vfbfs_fb *, const struct vfbfs_fb_rect *, const void *pixels, size_t stride);
+    int  (*fd_scroll)(struct vfbfs_fb *, unsigned origin);
+    int  (*fd_regions)(struct vfbfs_fb *, const struct vfbfs_fb_region *, unsigned n);
+    int  (*fd_rotate)(struct vfbfs_fb *, unsigned quarters);
+    void (*fd_close)(struct vfbfs_fb *);
+    struct vfbfs_fb_device_ops *fd_next;  /* next registered driver */
+};
+
+void                        vfbfs_fb_device_register(struct vfbfs_fb_device_ops *ops);
+struct vfbfs_fb_device_ops *vfbfs_fb_device_find(const char *name);
+
+/*
+ * Flushing statistics, the latency is measured from the first write
+ * which made the framebuffer dirty to the completion of the flush.
+*/
+struct vfbfs_fb_stats {
+    uint64_t st_writes;
+    uint64_t st_flushes;
+    uint64_t st_flushed_bytes;
+    uint64_t st_vsyncs;
+    uint64_t st_latency_ns;          /* sum of the write-to-flush latencies */
+    uint64_t st_latency_max_ns;
+    uint64_t st_flush_ns;            /* time spent in fd_flush() */
+    uint64_t st_stream_frames;       /* frames shown from the stream */
+    uint64_t st_stream_dropped;      /* stream frames dropped by the policy */
+    uint64_t st_stream_blocked_ns;   /* time producers waited with the block policy */
+    uint64_t st_scrolls;             /* origin changes pushed to the device */
+    uint64_t st_static_held;         /* flushes which left out static regions */
+    uint64_t st_cmds;                /* drawing commands run from /fb/<n>/cmd */
+    uint64_t st_cons_cells;          /* character cells drawn by the console */
+    uint64_t st_cons_atlas_misses;   /* glyphs the console had to rasterize */
+    uint64_t st_images;              /* images shown from /fb/<n>/image */
+    uint64_t st_image_hits;          /* of those, found already converted */
+    uint64_t st_layer_pixels;        /* layer pixels blended for the device */
+    uint64_t st_tile_rects;          /* rectangles flushed from the damage tiles */
+    uint64_t st_xform_pixels;        /* panel pixels scaled or turned */
+    uint64_t st_renames;             /* files renamed onto the frame */
+};
+
+/* What a write to /fb/<n>/stream does when the ring is full */
+enum VfbfsFbStreamPolicy {
+      VFBFS_FB_STREAM_BLOCK, VFBFS_FB_STREAM_DROP_OLDEST, VFBFS_FB_STREAM_DROP_NEWEST
+    , VFBFS_FB_STREAM_POLICY_MAX
+};
+
+#define VFBFS_FB_STREAM_DEPTH       3
+#define VFBFS_FB_STREAM_MAX_DEPTH   64
+
+/*
+ * The frame queue behind /fb/<n>/stream, protected by fb_lock. The flush
+ * thread shows one queued frame per vsync by swapping its buffer with the
+ * frame's content (copying it into the shown page if there is a virtual
+ * buffer). The slots are allocated on the first complete frame.
+*/
+struct vfbfs_fb_stream {
+    enum VfbfsFbStreamPolicy    s_policy;
+    unsigned                    s_depth;
+    char                      **s_slots;       /* s_depth frame buffers, or NULL */
+    unsigned                    s_head;        /* the oldest queued frame */
+    unsigned                    s_count;       /* queued frames */
+};
+
+/*
+ * One framebuffer, shown as /fb/<n>. The pixels are the content of the
+ * /fb/<n>/frame file. fb_lock protects the pixels, the damage and the
+ * statistics, fb_cond is broadcasted on every vsync and flush.
+ *
+ * The shown page is a ring of rows like the panel's memory: screen row y
+ * is row (y + fb_scroll) % fb_height of the page, see fbscroll.c. The
+ * damage is kept in page rows.
+*/
+struct vfbfs_fb {
+    int                         fb_index;
+    unsigned                    fb_width;
+    unsigned                    fb_height;     /* visible rows */
+    unsigned                    fb_vheight;    /* rows of the virtual buffer, >= fb_height */
+    unsigned                    fb_yoffset;    /* first visible row, see vfbfs_fb_pan() */
+    unsigned                    fb_scroll;     /* page row shown at the top of the screen */
+    enum VfbfsFbFormat          fb_format;
+    unsigned                    fb_bpp;        /* bytes per pixel */
+    size_t                      fb_stride;     /* bytes per row */
+    size_t                      fb_size;       /* bytes per visible frame */
+    size_t                      fb_vsize;      /* bytes of the virtual buffer, the frame file */
+    unsigned                    fb_refresh_hz; /* vsync rate of the flush thread */
+
+    struct vfbfs_dir           *fb_dir;        /* /fb/<n> */
+    struct vfbfs_file          *fb_frame;      /* /fb/<n>/frame */
+
+    pthread_mutex_t             fb_lock;
+    pthread_cond_t              fb_cond;
+    struct vfbfs_fb_rect        fb_damage;     /* not yet flushed area */
+    uint64_t                    fb_damage_since;
+    uint64_t                    fb_write_seq;  /* incremented on every write */
+    uint64_t                    fb_flush_seq;  /* last write_seq on the device */
+    uint64_t                    fb_flip_seq;   /* incremented when another buffer is shown */
+    uint64_t                    fb_vsync_ns;   /* time of the last vsync tick */
+    struct vfbfs_fb_poller     *fb_pollers;    /* poll()s to notify on the next vsync */
+    struct vfbfs_fb_stats       fb_stats;
+
+    struct vfbfs_fb_device_ops *fb_dev_oprs;
+    char                       *fb_dev_args;
+    enum VfbfsFbFormat          fb_dev_format; /* set by fd_open(), defaults to fb_format */
+    unsigned                    fb_dev_width;  /* the panel, set by fd_open(), defaults to */
+    unsigned                    fb_dev_height; /* fb_width x fb_height */
+    void                       *fb_dev_private;
+    unsigned                    fb_dev_scroll; /* the origin the device has, flush thread only */
+    unsigned                    fb_dev_rotate; /* the quarters the device turns, flush thread only */
+    char                       *fb_staging;    /* flushed pixels in the device format */
+    struct vfbfs_fb_stream      fb_stream;     /* see fbstream.c */
+    struct vfbfs_fb_console    *fb_console;    /* see fbcons.c */
+    struct vfbfs_fb_image      *fb_image;      /* see fbimage.c */
+    struct vfbfs_fb_history    *fb_history;    /* see fbhist.c */
+    struct vfbfs_fb_layers     *fb_layers;     /* see fblayer.c */
+    struct vfbfs_fb_color      *fb_color;      /* see fbcolor.c */
+    struct vfbfs_fb_xform      *fb_xform;      /* see fbxform.c */
+    uint8_t                    *fb_row;        /* a row as XRGB8888, flush thread only */
+    enum VfbfsFbDither          fb_dither;     /* see fbdither.c */
+    uint8_t                    *fb_dither_rows; /* a flushed part as XRGB8888, for the diffusion */
+
+    /* Static regions, see fbregion.c */
+    struct vfbfs_fb_region      fb_regions[VFBFS_FB_MAX_REGIONS];
+    unsigned                    fb_nregions;
+    struct vfbfs_fb_rect        fb_static_damage;   /* held back until a commit */
+    bool                        fb_regions_commit;  /* the next flush includes them */
+    uint64_t                    fb_regions_seq;     /* incremented on every change */
+    uint64_t                    fb_dev_regions_seq; /* what the device has, flush thread only */
+
+    /* Damage tiles of the shown page, see fbtile.c */
+    unsigned                    fb_tiles_x, fb_tiles_y;
+    unsigned                    fb_tile_words;      /* bitmap words per row of tiles */
+    uint64_t                   *fb_tile_dirty;      /* damaged since the last flush */
+    uint64_t                   *fb_tile_gen;        /* fb_write_seq of each tile's last damage */
+    unsigned                   *fb_tile_runs;       /* flush thread only */
+    struct vfbfs_fb_rect       *fb_tile_rects;      /* flush thread only */
+    struct vfbfs_fb_rect       *fb_flush_parts;     /* flush thread only */
+
+    bool                        fb_running;
+    pthread_t                   fb_thread;
+    struct vfbfs_fb            *fb_next;       /* next framebuffer of the superblock */
+};
+
+struct vfbfs_fb *vfbfs_fb_create(struct vfbfs *fs, int index, unsigned width, unsigned height
+                    , unsigned vheight, enum VfbfsFbFormat fmt, unsigned refresh_hz, const char *device);
+struct vfbfs_fb *vfbfs_fb_create_spec(struct vfbfs *fs, const char *spec);
+struct vfbfs_fb *vfbfs_fb_from_file(struct vfbfs_file *f);
+int              vfbfs_fb_start_all(struct vfbfs *fs);
+void             vfbfs_fb_stop_all(struct vfbfs *fs);
+
+void            *vfbfs_fb_span(struct vfbfs_fb *fb, unsigned x, unsigned y, unsigned *npix);
+void             vfbfs_fb_damage(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r);
+void             vfbfs_fb_damage_screen(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r);
+void             vfbfs_fb_damage_bytes(struct vfbfs_fb *fb, off_t off, size_t size);
+int              vfbfs_fb_wait_flush(struct vfbfs_fb *fb, uint64_t seq);
+int              vfbfs_fb_wait_vsync(struct vfbfs_fb *fb);
+int              vfbfs_fb_pan(struct vfbfs_fb *fb, unsigned yoffset);
+int              vfbfs_fb_ioctl(struct vfbfs *fs, struct vfbfs_file *f, const char *path, int cmd
+                    , void *arg, struct fuse_file_info *fi, unsigned flags, void *data);
+
+struct vfbfs_font;
+
+uint32_t         vfbfs_fb_color(struct vfbfs_fb *fb, uint32_t rgb);
+bool             vfbfs_fb_clip(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r);
+void             vfbfs_fb_fill_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r, uint32_t px);
+void             vfbfs_fb_copy_locked(struct vfbfs_fb *fb, unsigned sx, unsigned sy
+                    , struct vfbfs_fb_rect *r);
+void             vfbfs_fb_blit_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r
+                    , const void *src, size_t stride);
+void             vfbfs_fb_line_locked(struct vfbfs_fb *fb, int x0, int y0, int x1, int y1
+                    , uint32_t px, struct vfbfs_fb_rect *r);
+void             vfbfs_fb_glyph_locked(struct vfbfs_fb *fb, const struct vfbfs_font *fn, unsigned c
+                    , unsigned x, unsigned y, uint32_t fg, const uint32_t *bg, struct vfbfs_fb_rect *r);
+int              vfbfs_fb_cmd_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+int              vfbfs_fb_console_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+int              vfbfs_fb_image_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+int              vfbfs_fb_snapshot_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+
+void             vfbfs_fb_history_capture_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r);
+void             vfbfs_fb_history_record(struct vfbfs_fb *fb);
+int              vfbfs_fb_history_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+void             vfbfs_fb_history_free(struct vfbfs_fb *fb);
+
+bool             vfbfs_fb_layers_compose_locked(struct vfbfs_fb *fb, uint8_t *row, unsigned y
+                    , unsigned x0, unsigned npix);
+void             vfbfs_fb_layers_damage_locked(struct vfbfs_fb *fb);
+int              vfbfs_fb_layers_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+
+bool             vfbfs_fb_color_apply_locked(struct vfbfs_fb *fb, uint8_t *row, const void *src
+                    , enum VfbfsFbFormat sfmt, unsigned npix);
+int              vfbfs_fb_color_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+
+void             vfbfs_fb_dither_row_locked(struct vfbfs_fb *fb, void *dst, const void *src
+                    , enum VfbfsFbFormat sfmt, unsigned npix, unsigned x, unsigned y, unsigned i);
+void             vfbfs_fb_dither_part_locked(struct vfbfs_fb *fb, void *dst, size_t dstride
+                    , unsigned npix, unsigned nrows, unsigned x, unsigned y);
+int              vfbfs_fb_dither_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+
+const void      *vfbfs_fb_flush_row_locked(struct vfbfs_fb *fb, unsigned row, unsigned x0
+                    , unsigned npix, enum VfbfsFbFormat *sfmt);
+bool             vfbfs_fb_xform_active_locked(struct vfbfs_fb *fb);
+unsigned         vfbfs_fb_xform_quarters_locked(struct vfbfs_fb *fb);
+unsigned         vfbfs_fb_xform_fit_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *parts, unsigned n);
+char            *vfbfs_fb_xform_part_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r, char *dst);
+int              vfbfs_fb_xform_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+void             vfbfs_fb_xform_free(struct vfbfs_fb *fb);
+
+int              vfbfs_fb_scroll(struct vfbfs_fb *fb, int lines);
+int              vfbfs_fb_set_origin(struct vfbfs_fb *fb, unsigned origin);
+int              vfbfs_fb_scroll_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+
+int              vfbfs_fb_set_regions(struct vfbfs_fb *fb, const struct vfbfs_fb_region *regions
+                    , unsigned n);
+int              vfbfs_fb_regions_commit(struct vfbfs_fb *fb);
+unsigned         vfbfs_fb_regions_split_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r
+                    , unsigned n, struct vfbfs_fb_rect *parts);
+int              vfbfs_fb_regions_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+
+void             vfbfs_fb_tiles_damage_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r);
+unsigned         vfbfs_fb_tiles_split_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r
+                    , struct vfbfs_fb_rect *rects);
+int              vfbfs_fb_tiles_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+void             vfbfs_fb_tiles_free(struct vfbfs_fb *fb);
+
+int              vfbfs_fb_stream_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+bool             vfbfs_fb_stream_next(struct vfbfs_fb *fb);
+
+int              vfbfs_fb_poll_add_locked(struct vfbfs_fb *fb, struct fuse_pollhandle *ph);
+void             vfbfs_fb_poll_wake_locked(struct vfbfs_fb *fb);
+int              vfbfs_fb_frame_poll(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+                    , struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *revents);
+int              vfbfs_fb_events_create(struct vfbfs *fs, struct vfbfs_fb *fb);
+
+#endif /* VFBFS_FB_H */
@@ -0,0 +1,89 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_FBCMD_H
+#define VFBFS_FBCMD_H
+
+/*
+ * The drawing commands of /fb/<n>/cmd, for clients too. A write is a batch
+ * of commands, each starting with a struct vfbfs_fb_cmd whose c_len is the
+ * length of the whole command. The fields are little-endian, the coordinates
+ * are screen pixels and the colors are 0xRRGGBB.
+*/
+#include <stdint.h>
+
+enum VfbfsFbCmdOp {
+      VFBFS_FB_CMD_FILL = 1
+    , VFBFS_FB_CMD_LINE
+    , VFBFS_FB_CMD_COPY
+    , VFBFS_FB_CMD_BLIT
+    , VFBFS_FB_CMD_TEXT
+};
+
+struct vfbfs_fb_cmd {
+    uint16_t    c_op;
+    uint16_t    c_len;
+};
+
+struct vfbfs_fb_cmd_fill {
+    struct vfbfs_fb_cmd c_hdr;
+    uint16_t    c_x, c_y, c_w, c_h;
+    uint32_t    c_color;
+};
+
+/* Both end points are drawn */
+struct vfbfs_fb_cmd_line {
+    struct vfbfs_fb_cmd c_hdr;
+    int16_t     c_x0, c_y0, c_x1, c_y1;
+    uint32_t    c_color;
+};
+
+/* The rectangles may overlap */
+struct vfbfs_fb_cmd_copy {
+    struct vfbfs_fb_cmd c_hdr;
+    uint16_t    c_sx, c_sy;
+    uint16_t    c_dx, c_dy, c_w, c_h;
+};
+
+/*
+ * Followed by the NUL-terminated path of a plain file in the filesystem,
+ * holding c_w * c_h pixels in the framebuffer's format from its beginning.
+*/
+struct vfbfs_fb_cmd_blit {
+    struct vfbfs_fb_cmd c_hdr;
+    uint16_t    c_dx, c_dy, c_w, c_h;
+};
+
+#define VFBFS_FB_CMD_TEXT_OPAQUE   0x0001   /* draw the background of the glyphs too */
+
+/*
+ * Followed by the NUL-terminated path of a plain PSF font file in the
+ * filesystem and the text up to c_len, every byte is a glyph index. A '\n'
+ * starts a new line at c_x.
+*/
+struct vfbfs_fb_cmd_text {
+    struct vfbfs_fb_cmd c_hdr;
+    uint16_t    c_x, c_y;
+    uint32_t    c_fg, c_bg;
+    uint16_t    c_flags;
+    uint16_t    c_pad;
+};
+
+#endif /* VFBFS_FBCMD_H */
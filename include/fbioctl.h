@@ -0,0 +1,41 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_FBIOCTL_H
+#define VFBFS_FBIOCTL_H
+
+/*
+ * The fbdev ioctls of /fb/<n>/frame, for clients too. FUSE only moves the
+ * argument of an ioctl whose number encodes its size and direction, while
+ * the classic fbdev numbers (FBIOGET_VSCREENINFO = 0x4600, ...) do not.
+ * These have the same type and number with the size encoded, so an fbdev
+ * client only has to use these names.
+*/
+#include <linux/fb.h>
+#include <linux/types.h>
+#include <sys/ioctl.h>
+
+#define VFBFS_FBIOGET_VSCREENINFO   _IOR('F', 0x00, struct fb_var_screeninfo)
+#define VFBFS_FBIOGET_FSCREENINFO   _IOR('F', 0x02, struct fb_fix_screeninfo)
+#define VFBFS_FBIOPAN_DISPLAY       _IOW('F', 0x06, struct fb_var_screeninfo)
+/* The same as the kernel's, which is already size-encoded */
+#define VFBFS_FBIO_WAITFORVSYNC     _IOW('F', 0x20, __u32)
+
+#endif /* VFBFS_FBIOCTL_H */
@@ -0,0 +1,39 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_FBVEC_H
+#define VFBFS_FBVEC_H
+
+#include <stdint.h>
+
+/*
+ * Vectors of the pixel loops, GCC lowers them to the SIMD registers of
+ * the target (NEON, SSE2) or to plain integer code where there are none.
+ * The names give the lane count and type: h is 16 bit, w the widened
+ * 16 bit lanes of fb_v8, u and i 32 bit.
+*/
+typedef uint8_t  fb_v16 __attribute__((vector_size(16)));
+typedef uint8_t  fb_v8  __attribute__((vector_size(8)));
+typedef uint16_t fb_v8w __attribute__((vector_size(16)));
+typedef uint16_t fb_v4h __attribute__((vector_size(8)));
+typedef uint32_t fb_v4u __attribute__((vector_size(16)));
+typedef int32_t  fb_v4i __attribute__((vector_size(16)));
+
+#endif
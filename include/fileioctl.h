@@ -0,0 +1,47 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_FILEIOCTL_H
+#define VFBFS_FILEIOCTL_H
+
+/*
+ * Copying between the files of the mount without reading and writing the
+ * data through the client, an ioctl on the destination, for clients too.
+ * FUSE can't pass the descriptor of the source like FICLONE does, the
+ * source is named by its path inside the mount. The whole of a file onto
+ * a file no longer than it is a clone, the two share the content until
+ * either of them is modified. Any other range is copied by the daemon,
+ * like copy_file_range().
+*/
+#include <linux/types.h>
+#include <sys/ioctl.h>
+
+#define VFBFS_CLONE_PATH_MAX    1024
+
+struct vfbfs_clone_range {
+    char    cr_src[VFBFS_CLONE_PATH_MAX];   /* "/dir/file", from the mount point */
+    __u64   cr_src_off;
+    __u64   cr_len;                         /* 0 for up to the end of the source */
+    __u64   cr_dst_off;
+};
+
+#define VFBFS_IOC_CLONE_RANGE   _IOW('V', 0x01, struct vfbfs_clone_range)
+
+#endif /* VFBFS_FILEIOCTL_H */
@@ -0,0 +1,55 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_FONT_H
+#define VFBFS_FONT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Bitmap fonts in the PSF1 and PSF2 formats of the Linux console. The
+ * glyphs point into the font file's data, which must stay valid while
+ * the font is used. vfbfs_font_glyph() takes glyph indexes, the unicode
+ * table of a font maps code points to them (vfbfs_font_index()).
+*/
+struct vfbfs_font {
+    unsigned        fn_width;
+    unsigned        fn_height;
+    unsigned        fn_count;       /* number of glyphs */
+    unsigned        fn_row_bytes;   /* bytes per glyph row, MSB is the leftmost pixel */
+    size_t          fn_glyph_size;  /* bytes per glyph */
+    const uint8_t  *fn_glyphs;
+    const uint8_t  *fn_unicode;     /* the unicode table, or NULL */
+    size_t          fn_unicode_len;
+    bool            fn_psf1;        /* the table has 16 bit entries */
+};
+
+int      vfbfs_font_parse(struct vfbfs_font *fn, const void *data, size_t len);
+unsigned vfbfs_font_index(const struct vfbfs_font *fn, uint32_t cp);
+
+/* The glyph of c, characters without one are drawn with glyph 0 */
+static inline const uint8_t *vfbfs_font_glyph(const struct vfbfs_font *fn, unsigned c)
+{
+    return fn->fn_glyphs + ((c < fn->fn_count) ? c : 0) * fn->fn_glyph_size;
+}
+
+#endif /* VFBFS_FONT_H */
@@ -0,0 +1,72 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_GEN_H
+#define VFBFS_GEN_H
+
+#include <vfbfs.h>
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Generated files. The content is produced by g_render() when the file is
+ * opened, and every open() keeps its own reference to the snapshot it got,
+ * so a reader always sees one consistent rendering however long it reads.
+ * A rendering is shared by the opens within g_ttl_ns of it, polling a
+ * status file at a high rate renders it at most once per TTL. A generator
+ * with g_version() also renders again when its source changed.
+*/
+
+/* g_ttl_ns: render on every open, or keep the content until vfbfs_gen_invalidate() */
+#define VFBFS_GEN_TTL_NONE      0
+#define VFBFS_GEN_TTL_FOREVER   UINT64_MAX
+
+struct vfbfs_gen_snap;
+
+struct vfbfs_gen {
+    /* Prints the content to out, returns 0 or -errno */
+    int                  (*g_render)(struct vfbfs *, struct vfbfs_file *, void *priv, FILE *out);
+    /* Optional, the file is read-only without it */
+    int                  (*g_write)(struct vfbfs *, struct vfbfs_file *, void *priv
+                                , const char *data, size_t size, off_t off);
+    /* Optional, the cached rendering is stale once this returns another value */
+    uint64_t             (*g_version)(struct vfbfs *, struct vfbfs_file *, void *priv);
+    void                  *g_private;
+    uint64_t               g_ttl_ns;
+    /* The file's f_lock protects the fields below */
+    struct vfbfs_gen_snap *g_snap;        /* the cached rendering, or NULL */
+    uint64_t               g_snap_ns;     /* when g_snap was rendered */
+    uint64_t               g_snap_version; /* g_version() before g_snap was rendered */
+    uint64_t               g_renders;
+    uint64_t               g_hits;        /* opens served from g_snap */
+};
+
+struct vfbfs_gen  *vfbfs_gen_attach(struct vfbfs_file *f
+                        , int (*render)(struct vfbfs *, struct vfbfs_file *, void *, FILE *)
+                        , void *priv, uint64_t ttl_ns);
+struct vfbfs_file *vfbfs_gen_create_in(struct vfbfs *fs, struct vfbfs_dir *parent, const char *name
+                        , int (*render)(struct vfbfs *, struct vfbfs_file *, void *, FILE *)
+                        , void *priv, uint64_t ttl_ns);
+struct vfbfs_gen  *vfbfs_gen_from_file(struct vfbfs_file *f);
+void               vfbfs_gen_invalidate(struct vfbfs_file *f);
+void               vfbfs_gen_free(struct vfbfs_file *f);
+
+#endif /* VFBFS_GEN_H */
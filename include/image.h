@@ -0,0 +1,71 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_IMAGE_H
+#define VFBFS_IMAGE_H
+
+#include <vfbfs.h>
+#include <stdint.h>
+
+/*
+ * Snapshot image layout: a vfbfs_image_header, ih_nentries entries (every
+ * directory comes before its entries, entry 0 is the root), the NUL
+ * terminated names, then the file contents, each aligned to
+ * VFBFS_IMAGE_ALIGN. Offsets are from the start of the image.
+*/
+#define VFBFS_IMAGE_MAGIC    "VFBI"
+#define VFBFS_IMAGE_VERSION  1
+#define VFBFS_IMAGE_ALIGN    64
+
+struct vfbfs_image_header {
+    char     ih_magic[4];
+    uint32_t ih_version;
+    uint32_t ih_nentries;
+    uint32_t ih_pad;
+    uint64_t ih_names_off;
+    uint64_t ih_data_off;
+    uint64_t ih_size;           /* size of the whole image */
+};
+
+struct vfbfs_image_entry {
+    uint32_t ie_parent;         /* index of the directory */
+    uint32_t ie_name_off;       /* from ih_names_off */
+    uint32_t ie_mode;
+    uint32_t ie_uid;
+    uint32_t ie_gid;
+    uint32_t ie_pad;
+    int64_t  ie_atime;
+    int64_t  ie_mtime;
+    int64_t  ie_ctime;
+    uint64_t ie_size;
+    uint64_t ie_data_off;       /* files only */
+};
+
+/* The mapped image, file contents point into it until they are modified */
+struct vfbfs_image {
+    char   *im_path;
+    void   *im_map;
+    size_t  im_size;
+};
+
+int vfbfs_image_load(struct vfbfs *fs, const char *path);
+int vfbfs_image_save(struct vfbfs *fs, const char *path);
+
+#endif /* VFBFS_IMAGE_H */
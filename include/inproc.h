@@ -0,0 +1,35 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_INPROC_H
+#define VFBFS_INPROC_H
+
+#include <vfbfs.h>
+
+/*
+ * Runs a filesystem without mounting it, for the benchmark and replay
+ * tools: the operations in sb_fs_oprs are called directly. inproc.c
+ * replaces libfuse's fuse_get_context(), so it must not be linked into
+ * the daemon.
+*/
+void vfbfs_inproc_start(struct vfbfs *fs);
+void vfbfs_inproc_stop(struct vfbfs *fs);
+
+#endif /* VFBFS_INPROC_H */
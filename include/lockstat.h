@@ -0,0 +1,117 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_LOCKSTAT_H
+#define VFBFS_LOCKSTAT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct vfbfs;
+
+/*
+ * Every lock in the filesystem belongs to one of these classes, the
+ * statistics are aggregated per class and per call site.
+*/
+enum VfbfsLockClass {
+      VFBFS_LC_F_LOCK, VFBFS_LC_E_WLOCK, VFBFS_LC_D_RWLOCK, VFBFS_LC_SB_WLOCK
+    , VFBFS_LC_FB_LOCK, VFBFS_LC_TRACE_LOCK, VFBFS_LC_H_LOCK, VFBFS_LC_H_POOL
+    , VFBFS_LC_WORKERS, VFBFS_LC_HISTORY
+    , VFBFS_LC_MAX
+};
+
+#ifdef VFBFS_LOCKSTAT
+
+/*
+ * One of these is statically allocated for each place where a lock is taken,
+ * it registers itself on the first acquisition. All counters are in nanoseconds
+ * and updated atomically.
+*/
+struct vfbfs_lockstat_site {
+    enum VfbfsLockClass          ls_class;
+    const char                  *ls_func;
+    const char                  *ls_file;
+    int                          ls_line;
+    int                          ls_registered;
+    uint64_t                     ls_acquired;    /* number of acquisitions */
+    uint64_t                     ls_contended;   /* acquisitions which had to wait */
+    uint64_t                     ls_wait_ns;     /* total time spent waiting */
+    uint64_t                     ls_wait_max_ns;
+    uint64_t                     ls_hold_ns;     /* total time the lock was held */
+    uint64_t                     ls_hold_max_ns;
+    struct vfbfs_lockstat_site  *ls_next;        /* next registered site */
+};
+
+#define VFBFS_LOCKSTAT_SITE(cls) ({                         \
+    static struct vfbfs_lockstat_site __ls_site = {         \
+        .ls_class = (cls), .ls_func = __func__              \
+      , .ls_file = __FILE__, .ls_line = __LINE__            \
+    };                                                      \
+    &__ls_site;                                             \
+})
+
+void vfbfs_lockstat_mutex_lock(pthread_mutex_t *m, struct vfbfs_lockstat_site *site);
+void vfbfs_lockstat_mutex_unlock(pthread_mutex_t *m);
+void vfbfs_lockstat_rdlock(pthread_rwlock_t *l, struct vfbfs_lockstat_site *site);
+void vfbfs_lockstat_wrlock(pthread_rwlock_t *l, struct vfbfs_lockstat_site *site);
+void vfbfs_lockstat_rwunlock(pthread_rwlock_t *l);
+int  vfbfs_lockstat_cond_wait(pthread_cond_t *c, pthread_mutex_t *m
+        , const struct timespec *abstime, struct vfbfs_lockstat_site *site);
+
+void vfbfs_lockstat_print(FILE *fp);
+void vfbfs_lockstat_reset(void);
+int  vfbfs_lockstat_init(struct vfbfs *fs);
+int  vfbfs_lockstat_start(struct vfbfs *fs);
+
+# define vfbfs_mutex_lock(m, cls)    vfbfs_lockstat_mutex_lock((m), VFBFS_LOCKSTAT_SITE(cls))
+# define vfbfs_mutex_unlock(m, cls)  vfbfs_lockstat_mutex_unlock((m))
+# define vfbfs_rwlock_rdlock(l, cls) vfbfs_lockstat_rdlock((l), VFBFS_LOCKSTAT_SITE(cls))
+# define vfbfs_rwlock_wrlock(l, cls) vfbfs_lockstat_wrlock((l), VFBFS_LOCKSTAT_SITE(cls))
+# define vfbfs_rwlock_unlock(l, cls) vfbfs_lockstat_rwunlock((l))
+# define vfbfs_cond_wait(c, m, cls)  vfbfs_lockstat_cond_wait((c), (m), NULL, VFBFS_LOCKSTAT_SITE(cls))
+# define vfbfs_cond_timedwait(c, m, ts, cls) \
+    vfbfs_lockstat_cond_wait((c), (m), (ts), VFBFS_LOCKSTAT_SITE(cls))
+
+#else /* !VFBFS_LOCKSTAT */
+
+/* Compiled out: the wrappers are the plain pthread calls */
+# define vfbfs_mutex_lock(m, cls)    pthread_mutex_lock(m)
+# define vfbfs_mutex_unlock(m, cls)  pthread_mutex_unlock(m)
+# define vfbfs_rwlock_rdlock(l, cls) pthread_rwlock_rdlock(l)
+# define vfbfs_rwlock_wrlock(l, cls) pthread_rwlock_wrlock(l)
+# define vfbfs_rwlock_unlock(l, cls) pthread_rwlock_unlock(l)
+# define vfbfs_cond_wait(c, m, cls)  pthread_cond_wait(c, m)
+# define vfbfs_cond_timedwait(c, m, ts, cls) pthread_cond_timedwait(c, m, ts)
+
+static inline int vfbfs_lockstat_init(struct vfbfs *fs)
+{
+    (void) fs;
+    return 0;
+}
+
+static inline int vfbfs_lockstat_start(struct vfbfs *fs)
+{
+    (void) fs;
+    return 0;
+}
+
+#endif /* VFBFS_LOCKSTAT */
+#endif /* VFBFS_LOCKSTAT_H */
@@ -0,0 +1,74 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_TRACE_H
+#define VFBFS_TRACE_H
+
+#include <vfbfs.h>
+#include <stdint.h>
+
+/*
+ * Trace file format: a vfbfs_trace_header, then the records in the order
+ * the operations completed. Each record is followed by tr_pathlen bytes of
+ * path (not terminated), padded to VFBFS_TRACE_ALIGN. Only the sizes of
+ * reads and writes are recorded, not the data. The path of a rename is the
+ * source, a NUL and the target, tr_size is the length of the source.
+*/
+#define VFBFS_TRACE_MAGIC    "VFBT"
+#define VFBFS_TRACE_VERSION  1
+#define VFBFS_TRACE_ALIGN    8
+#define VFBFS_TRACE_RING     (4 << 20)      /* bytes buffered before records are dropped */
+
+enum VfbfsTraceOperation {
+      VFBFS_TR_GETATTR, VFBFS_TR_OPEN, VFBFS_TR_READ, VFBFS_TR_WRITE
+    , VFBFS_TR_TRUNCATE, VFBFS_TR_FSYNC, VFBFS_TR_RELEASE, VFBFS_TR_IOCTL
+    , VFBFS_TR_CREATE, VFBFS_TR_MKDIR, VFBFS_TR_OPENDIR, VFBFS_TR_READDIR
+    , VFBFS_TR_RELEASEDIR, VFBFS_TR_UNLINK, VFBFS_TR_RENAME, VFBFS_TR_POLL
+    , VFBFS_TR_MAX
+};
+
+struct vfbfs_trace_header {
+    char     th_magic[4];
+    uint32_t th_version;
+    uint64_t th_start_ns;       /* CLOCK_REALTIME of the first timestamp */
+};
+
+struct vfbfs_trace_rec {
+    uint16_t tr_op;             /* enum VfbfsTraceOperation */
+    uint16_t tr_pathlen;
+    uint32_t tr_tid;            /* calling thread */
+    int32_t  tr_result;         /* return value of the operation */
+    uint32_t tr_flags;          /* open flags, mode, ioctl command, datasync or revents */
+    uint64_t tr_start_ns;       /* since th_start_ns */
+    uint64_t tr_dur_ns;
+    uint64_t tr_fh;             /* fi->fh, after open, create and opendir */
+    uint64_t tr_off;            /* offset, or truncate size */
+    uint64_t tr_size;           /* read/write size, or st_size for getattr */
+};
+
+static inline size_t vfbfs_trace_rec_len(const struct vfbfs_trace_rec *rec)
+{
+    return (sizeof(*rec) + rec->tr_pathlen + VFBFS_TRACE_ALIGN - 1) & ~(size_t)(VFBFS_TRACE_ALIGN - 1);
+}
+
+const char *vfbfs_trace_op_name(enum VfbfsTraceOperation op);
+int         vfbfs_trace_open(struct vfbfs *fs, const char *path);
+
+#endif /* VFBFS_TRACE_H */
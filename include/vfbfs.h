@@ -30,15 +30,25 @@
 #include <stdbool.h>
 #include <syslog.h>
 
+#include <lockstat.h>
+
 #ifndef MIN
 # define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef MAX
+# define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 struct vfbfs;
 struct vfbfs_entry;
 struct vfbfs_file;
 struct vfbfs_superblock;
 struct vfbfs_dir;
+struct vfbfs_fb;
+struct vfbfs_trace;
+struct vfbfs_image;
+struct vfbfs_content;
 
 struct vfbfs_entry_ops {
     int (*e_getattr)(struct vfbfs *, struct vfbfs_entry *, const char *, struct stat *);
@@ -58,12 +68,13 @@ struct vfbfs_dir_ops {
     int (*d_read)(struct vfbfs *, struct vfbfs_dir *, const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info *);
     int (*d_getattr)(struct vfbfs *, struct vfbfs_dir *, const char *, struct stat *);
     int (*d_release)(struct vfbfs *, struct vfbfs_dir *, const char *, struct fuse_file_info *);
-    int (*d_mkdir)(struct vfbfs *, struct vfbfs_dir *, const char *, const char *, mode_t, struct fuse_file_info *);
+    int (*d_mkdir)(struct vfbfs *, struct vfbfs_dir *, const char *, const char *, mode_t);
 };
 
 enum VfbfsFileOperation {
       VFBFS_F_OPEN, VFBFS_F_CLOSE, VFBFS_F_READ, VFBFS_F_WRITE
-    , VFBFS_F_TRUNCATE, VFBFS_F_GETATTR, VFBFS_F_RELEASE
+    , VFBFS_F_TRUNCATE, VFBFS_F_GETATTR, VFBFS_F_RELEASE, VFBFS_F_FSYNC
+    , VFBFS_F_POLL, VFBFS_F_IOCTL, VFBFS_F_REPLACE
 };
 
 struct vfbfs_file_ops {
@@ -74,6 +85,15 @@ struct vfbfs_file_ops {
     int (*f_truncate)(struct vfbfs *, struct vfbfs_file *, const char *, off_t);
     int (*f_getattr)(struct vfbfs *, struct vfbfs_file *, const char *, struct stat *);
     int (*f_release)(struct vfbfs *, struct vfbfs_file *, const char *, struct fuse_file_info *);
+    int (*f_fsync)(struct vfbfs *, struct vfbfs_file *, const char *, int, struct fuse_file_info *);
+    /* Must store or destroy the pollhandle, see fuse_notify_poll() */
+    int (*f_poll)(struct vfbfs *, struct vfbfs_file *, const char *, struct fuse_file_info *
+                , struct fuse_pollhandle *, unsigned *);
+    /* data is the _IOC_SIZE(cmd) long in/out buffer */
+    int (*f_ioctl)(struct vfbfs *, struct vfbfs_file *, const char *, int cmd, void *arg
+                , struct fuse_file_info *, unsigned flags, void *data);
+    /* rename() onto the file, takes over the content of from, which is unlinked after it */
+    int (*f_replace)(struct vfbfs *, struct vfbfs_file *, const char *, struct vfbfs_file *from);
 };
 
 /*
@@ -106,6 +126,9 @@ struct vfbfs_entry       *vfbfs_entry_alloc(struct vfbfs *fs);
 struct vfbfs_entry       *vfbfs_entry_file_alloc(struct vfbfs *fs);
 struct vfbfs_entry       *vfbfs_entry_dir_alloc(struct vfbfs *fs);
 struct vfbfs_entry       *vfbfs_entry_lookup(struct vfbfs *fs, const char *path);
+struct vfbfs_entry       *vfbfs_entry_find_in(struct vfbfs *fs, struct vfbfs_dir *d, const char *name);
+struct vfbfs_entry       *vfbfs_entry_get(struct vfbfs *fs, const char *path);
+void                     vfbfs_entry_put(struct vfbfs *fs, struct vfbfs_entry *e);
 struct vfbfs_entry_ops   *vfbfs_entry_get_mem_ops(void);
 struct vfbfs_file        *vfbfs_entry_get_file(struct vfbfs_entry *e);
 struct vfbfs_dir         *vfbfs_entry_get_dir(struct vfbfs_entry *e);
@@ -122,9 +145,62 @@ struct vfbfs_file {
     pthread_mutex_t         f_lock;        /* must held a lock to access file */
     char                   *f_content;
     off_t                   f_content_size; /* size of the allocated memory for f_content */
+    unsigned                f_flags;       /* VFBFS_FILE_* */
+    struct vfbfs_content   *f_shared;      /* with VFBFS_FILE_SHARED */
     void                   *f_private;
 };
 
+/*
+ * Content shared by a file and its clones, f_content of each of them is
+ * c_data. The first write to one of them gives it a copy, the last one
+ * left takes the buffer over.
+*/
+struct vfbfs_content {
+    unsigned                c_refs;
+    char                   *c_data;
+};
+
+/* f_content points into a read-only image mapping, it's copied on the first modification */
+#define VFBFS_FILE_MAPPED   0x1
+/* The file and its entry were allocated by vfbfs_build_file(), see build.h */
+#define VFBFS_FILE_BUILT    0x2
+/* Something keeps a pointer to the file, it can't be unlinked or replaced */
+#define VFBFS_FILE_PINNED   0x4
+/* f_content is shared with clones of the file, see vfbfs_content */
+#define VFBFS_FILE_SHARED   0x8
+/* e_name is in the arena of vfbfs_build_file() until a rename, it isn't freed */
+#define VFBFS_FILE_ARENA_NAME 0x10
+
+/*
+ * Per-open state of a file, fi->fh points to one of these from open() until
+ * release(). h_private belongs to the file's operations, they have to free
+ * it in their f_release. The dispatcher keeps track of the position and the
+ * access pattern, backends reading from slow sources can ask for a
+ * readahead window when the reader is streaming (vfbfs_handle_readahead()).
+ * The handles are recycled through a pool, h_lock is initialized only once.
+*/
+struct vfbfs_handle {
+    struct vfbfs_entry     *h_entry;
+    void                   *h_private;
+    pthread_mutex_t         h_lock;        /* protects everything below and h_private */
+    off_t                   h_pos;         /* where the last read or write ended */
+    unsigned                h_seq_run;     /* reads in a row starting at h_pos */
+    uint64_t                h_reads;
+    uint64_t                h_read_bytes;
+    uint64_t                h_seq_reads;
+    uint64_t                h_writes;
+    uint64_t                h_write_bytes;
+    struct vfbfs_handle    *h_next;        /* next free handle in the pool */
+};
+
+/* This many sequential reads in a row make a stream */
+#define VFBFS_HANDLE_SEQ_MIN    2
+
+struct vfbfs_handle     *vfbfs_handle_get(struct fuse_file_info *fi);
+struct vfbfs_entry      *vfbfs_handle_entry(struct fuse_file_info *fi);
+bool                     vfbfs_handle_is_sequential(struct vfbfs_handle *h);
+size_t                   vfbfs_handle_readahead(struct vfbfs_handle *h, size_t size, size_t max);
+
 struct vfbfs_file       *vfbfs_file_new(struct vfbfs *fs, char *name);
 void                     vfbfs_file_init(struct vfbfs_file *f);
 struct vfbfs_file       *vfbfs_file_alloc(struct vfbfs *fs);
@@ -132,8 +208,20 @@ off_t                    vfbfs_file_get_size(struct vfbfs_file *f);
 off_t                    vfbfs_file_set_size(struct vfbfs_file *f, off_t new_size);
 struct vfbfs_file       *vfbfs_file_add_to(struct vfbfs *fs, struct vfbfs_dir *dir, struct vfbfs_file *f);
 struct vfbfs_file       *vfbfs_file_create_in(struct vfbfs *fs, struct vfbfs_dir *parent, const char *fname);
+struct vfbfs_file       *vfbfs_file_lookup(struct vfbfs *fs, const char *path);
+struct vfbfs_file       *vfbfs_file_get(struct vfbfs *fs, const char *path);
+void                     vfbfs_file_put(struct vfbfs *fs, struct vfbfs_file *f);
 void                     vfbfs_file_free(struct vfbfs *fs, struct vfbfs_file *f);
+bool                     vfbfs_file_is_removable(struct vfbfs_file *f);
+int                      vfbfs_file_unshare(struct vfbfs_file *f, off_t size);
+int                      vfbfs_file_clone(struct vfbfs *fs, struct vfbfs_file *dst, struct vfbfs_file *src
+                                    , off_t soff, off_t len, off_t doff);
+int                      vfbfs_file_unlink(struct vfbfs *fs, struct vfbfs_file *f);
+int                      vfbfs_file_rename(struct vfbfs *fs, struct vfbfs_file *f, struct vfbfs_dir *dir
+                                    , const char *name, const char *path);
 struct vfbfs_file_ops   *vfbfs_file_get_mem_ops(void);
+int                      vfbfs_mem_file_open(struct vfbfs *, struct vfbfs_file *, const char *, struct fuse_file_info *);
+int                      vfbfs_mem_file_close(struct vfbfs *, struct vfbfs_file *, const char *, struct fuse_file_info *);
 int                      vfbfs_file_call_operation_with(struct vfbfs *, struct vfbfs_file *, struct vfbfs_file_ops *, enum VfbfsFileOperation op, ...);
 int                      vfbfs_file_call_operation(struct vfbfs *, struct vfbfs_file *, enum VfbfsFileOperation op, ...);
 
@@ -157,9 +245,12 @@ struct vfbfs_dir {
 
 struct vfbfs_dir        *vfbfs_dir_new(struct vfbfs *fs, char *name);
 struct vfbfs_dir        *vfbfs_dir_alloc(struct vfbfs *fs);
+struct vfbfs_dir        *vfbfs_dir_init(struct vfbfs_dir *d);
 struct vfbfs_dir        *vfbfs_dir_add_to(struct vfbfs *fs, struct vfbfs_dir *parent, struct vfbfs_dir *d);
 struct vfbfs_dir        *vfbfs_dir_create_in(struct vfbfs *fs, struct vfbfs_dir *parent, const char *dname);
+void                     vfbfs_dir_free(struct vfbfs *fs, struct vfbfs_dir *d);
 struct vfbfs_dir_ops    *vfbfs_dir_get_generic_ops(void);
+struct vfbfs_dir_ops    *vfbfs_dir_get_fixed_ops(void);
 int                      vfbfs_dir_call_operation_with(struct vfbfs *, struct vfbfs_dir *
                                     , struct vfbfs_dir_ops *, enum VfbfsDirOperation op, ...);
 int                      vfbfs_dir_call_operation(struct vfbfs *, struct vfbfs_dir *, enum VfbfsDirOperation op, ...);
@@ -173,6 +264,9 @@ struct vfbfs_superblock {
     struct vfbfs_file_ops  *sb_dfile_oprs;  /* default operations for files in this filesystem */
     struct vfbfs_dir_ops   *sb_ddir_oprs;   /* default operations for directories in this filesystem */
     struct vfbfs           *sb_fs;          /* parent filesystem */
+    struct vfbfs_fb        *sb_fbs;         /* framebuffers, see fb.h */
+    struct vfbfs_trace     *sb_trace;       /* operation trace recorder, see trace.h */
+    struct vfbfs_image     *sb_image;       /* mapped snapshot image, see image.h */
     struct fuse_operations  sb_fs_oprs;     /* FUSE basic operations */
 };
 
@@ -189,6 +283,7 @@ struct vfbfs            *vfbfs_fs_alloc(void);
 struct vfbfs            *vfbfs_init(struct vfbfs *fs);
 struct vfbfs            *vfbfs_new(void);
 int                      vfbfs_main(struct vfbfs *fs, int argc, char *argv[]);
+void                     vfbfs_set_default_config(const char *text);
 struct vfbfs_file       *vfbfs_lookup(struct vfbfs *fs, const char *path);
 int vfbfs_entry_lookup_parent(struct vfbfs *fs, const char *path
     , struct vfbfs_dir **parent, struct vfbfs_entry **entry, char **file_name);
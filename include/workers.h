@@ -0,0 +1,35 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef VFBFS_WORKERS_H
+#define VFBFS_WORKERS_H
+
+/*
+ * A process-wide pool of worker threads for data-parallel jobs. A job is
+ * fn(arg, i) for every i in [0, n), vfbfs_workers_run() returns when all
+ * of them ran. The calling thread works on its own job too, so a job
+ * always makes progress even when every worker is busy with another one.
+*/
+#define VFBFS_WORKERS_MAX   16
+
+void        vfbfs_workers_run(void (*fn)(void *arg, unsigned i), void *arg, unsigned n);
+unsigned    vfbfs_workers_count(void);
+
+#endif /* VFBFS_WORKERS_H */
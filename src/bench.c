@@ -0,0 +1,547 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * In-process microbenchmarks. The filesystem is never mounted, the FUSE
+ * operations in sb_fs_oprs are called directly, so the numbers do not
+ * include the kernel round trips. The results are printed as JSON.
+ *
+ *   make bench && ./vfbfs-bench -t 4 -n 100000 > before.json
+*/
+#include <vfbfs.h>
+#include <inproc.h>
+#include <fb.h>
+#include <fileioctl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_PATH_MAX    4096
+
+struct bench_options {
+    int         threads;
+    long        iterations;
+    int         max_depth;
+    int         width;
+    const char *only;
+};
+
+struct bench_workload;
+
+struct bench_thread {
+    const struct bench_workload *bt_wl;
+    struct fuse_operations      *bt_oprs;
+    int                          bt_id;
+    long                         bt_iterations;
+    long                         bt_param;
+    char                         bt_path[BENCH_PATH_MAX];
+    struct fuse_file_info        bt_fi;
+    char                        *bt_buf;
+    size_t                       bt_bufsize;
+    uint64_t                    *bt_lat;    /* per-operation latency (ns) */
+    long                         bt_errors;
+    uint64_t                     bt_start;  /* when the timed loop started */
+    uint64_t                     bt_end;
+    pthread_t                    bt_thread;
+};
+
+struct bench_workload {
+    const char *w_name;
+    const char *w_param_name;
+    int  (*w_setup)(struct bench_thread *);
+    int  (*w_op)(struct bench_thread *, long);
+    void (*w_teardown)(struct bench_thread *);
+};
+
+static struct vfbfs       *bench_fs;
+static pthread_barrier_t   bench_barrier;
+
+static inline uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_mkdir_p(const char *path)
+{
+    struct vfbfs_dir *parent = vfbfs_get_rootdir(bench_fs), *d;
+    struct vfbfs_entry *e;
+    char *p = strdup(path), *svptr, *name, *ptr = p;
+    char cur[BENCH_PATH_MAX] = "";
+
+    while ((name = strtok_r(ptr, "/", &svptr)) != NULL) {
+        ptr = NULL;
+        strcat(cur, "/");
+        strcat(cur, name);
+        e = vfbfs_entry_lookup(bench_fs, cur);
+        if (e != NULL) {
+            parent = vfbfs_entry_get_dir(e);
+            continue;
+        }
+        if ((d = vfbfs_dir_create_in(bench_fs, parent, name)) == NULL) {
+            free(p);
+            return -ENOMEM;
+        }
+        parent = d;
+    }
+    free(p);
+    return 0;
+}
+
+/* Creates (or truncates) a file through the FUSE operations and opens it */
+static int bench_open_file(struct bench_thread *bt, size_t fill)
+{
+    struct fuse_operations *o = bt->bt_oprs;
+    struct stat st;
+    size_t chunk, done;
+    int r;
+
+    memset(&bt->bt_fi, 0, sizeof(bt->bt_fi));
+    if (o->getattr(bt->bt_path, &st) != 0) {
+        bt->bt_fi.flags = O_CREAT | O_RDWR;
+        r = o->create(bt->bt_path, 0644, &bt->bt_fi);
+    } else {
+        bt->bt_fi.flags = O_RDWR;
+        r = o->open(bt->bt_path, &bt->bt_fi);
+    }
+    if (r != 0) {
+        return r;
+    }
+    for (done = 0; done < fill; done += chunk) {
+        chunk = MIN(fill - done, bt->bt_bufsize);
+        r = o->write(bt->bt_path, bt->bt_buf, chunk, done, &bt->bt_fi);
+        if (r < 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+static void bench_release_file(struct bench_thread *bt)
+{
+    bt->bt_oprs->release(bt->bt_path, &bt->bt_fi);
+}
+
+/*
+ * Lookup: getattr() on a file 'depth' directories deep, every thread
+ * walks the same shared path.
+*/
+static int bench_lookup_setup(struct bench_thread *bt)
+{
+    char *p = bt->bt_path;
+    int i, r = 0;
+    p += sprintf(p, "/bench/deep");
+    for (i = 0; i < bt->bt_param; i++) {
+        p += sprintf(p, "/d%d", i);
+    }
+    if (bt->bt_id == 0 && (r = bench_mkdir_p(bt->bt_path)) == 0) {
+        strcat(bt->bt_path, "/file");
+        if ((r = bench_open_file(bt, 0)) == 0) {
+            bench_release_file(bt);
+        }
+    } else {
+        strcat(bt->bt_path, "/file");
+    }
+    pthread_barrier_wait(&bench_barrier);
+    return r;
+}
+
+static int bench_lookup_op(struct bench_thread *bt, long i)
+{
+    struct stat st;
+    return bt->bt_oprs->getattr(bt->bt_path, &st);
+}
+
+/* Read and write: 'size' bytes at a time over a private 16 MiB file */
+#define BENCH_RW_FILE_SIZE (16 << 20)
+
+static int bench_rw_setup(struct bench_thread *bt)
+{
+    int r = 0;
+    snprintf(bt->bt_path, BENCH_PATH_MAX, "/bench/rw/t%d-%ld", bt->bt_id, bt->bt_param);
+    if (bt->bt_id == 0) {
+        r = bench_mkdir_p("/bench/rw");
+    }
+    pthread_barrier_wait(&bench_barrier);
+    return r ? r : bench_open_file(bt, BENCH_RW_FILE_SIZE);
+}
+
+static int bench_read_op(struct bench_thread *bt, long i)
+{
+    off_t off = (i * bt->bt_param) % BENCH_RW_FILE_SIZE;
+    int r = bt->bt_oprs->read(bt->bt_path, bt->bt_buf, bt->bt_param, off, &bt->bt_fi);
+    return (r == bt->bt_param) ? 0 : -EIO;
+}
+
+static int bench_write_op(struct bench_thread *bt, long i)
+{
+    off_t off = (i * bt->bt_param) % BENCH_RW_FILE_SIZE;
+    int r = bt->bt_oprs->write(bt->bt_path, bt->bt_buf, bt->bt_param, off, &bt->bt_fi);
+    return (r == bt->bt_param) ? 0 : -EIO;
+}
+
+/* Truncate-grow: truncate() to ever larger sizes, restarting at 64 steps */
+static int bench_truncate_setup(struct bench_thread *bt)
+{
+    int r = 0;
+    snprintf(bt->bt_path, BENCH_PATH_MAX, "/bench/trunc/t%d", bt->bt_id);
+    if (bt->bt_id == 0) {
+        r = bench_mkdir_p("/bench/trunc");
+    }
+    pthread_barrier_wait(&bench_barrier);
+    return r ? r : bench_open_file(bt, 0);
+}
+
+static int bench_truncate_op(struct bench_thread *bt, long i)
+{
+    return bt->bt_oprs->truncate(bt->bt_path, ((i % 64) + 1) * bt->bt_param);
+}
+
+/* Readdir: list a directory of 'width' entries, shared by all threads */
+static int bench_count_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    (*(long *)buf)++;
+    return 0;
+}
+
+static int bench_readdir_setup(struct bench_thread *bt)
+{
+    struct vfbfs_entry *e;
+    struct vfbfs_dir *d;
+    char name[32];
+    long i;
+    int r = 0;
+
+    snprintf(bt->bt_path, BENCH_PATH_MAX, "/bench/wide%ld", bt->bt_param);
+    if (bt->bt_id == 0 && (r = bench_mkdir_p(bt->bt_path)) == 0) {
+        e = vfbfs_entry_lookup(bench_fs, bt->bt_path);
+        d = vfbfs_entry_get_dir(e);
+        for (i = 0; i < bt->bt_param && r == 0; i++) {
+            snprintf(name, sizeof(name), "f%06ld", i);
+            if (vfbfs_file_create_in(bench_fs, d, name) == NULL) {
+                r = -ENOMEM;
+            }
+        }
+    }
+    pthread_barrier_wait(&bench_barrier);
+    if (r != 0) {
+        return r;
+    }
+    memset(&bt->bt_fi, 0, sizeof(bt->bt_fi));
+    return bt->bt_oprs->opendir(bt->bt_path, &bt->bt_fi);
+}
+
+static int bench_readdir_op(struct bench_thread *bt, long i)
+{
+    long count = 0;
+    int r = bt->bt_oprs->readdir(bt->bt_path, &count, bench_count_filler, 0, &bt->bt_fi);
+    if (r != 0) {
+        return r;
+    }
+    return (count == bt->bt_param + 2) ? 0 : -EIO;
+}
+
+static void bench_readdir_teardown(struct bench_thread *bt)
+{
+    bt->bt_oprs->releasedir(bt->bt_path, &bt->bt_fi);
+}
+
+/* Clone: the whole of a 'size' byte file onto another one, see fileioctl.h */
+static int bench_clone_setup(struct bench_thread *bt)
+{
+    int r = 0;
+    snprintf(bt->bt_path, BENCH_PATH_MAX, "/bench/clone/t%d-%ld.src", bt->bt_id, bt->bt_param);
+    if (bt->bt_id == 0) {
+        r = bench_mkdir_p("/bench/clone");
+    }
+    pthread_barrier_wait(&bench_barrier);
+    if (r != 0 || (r = bench_open_file(bt, bt->bt_param)) != 0) {
+        return r;
+    }
+    bench_release_file(bt);
+    snprintf(bt->bt_path, BENCH_PATH_MAX, "/bench/clone/t%d-%ld", bt->bt_id, bt->bt_param);
+    return bench_open_file(bt, 0);
+}
+
+static int bench_clone_op(struct bench_thread *bt, long i)
+{
+    struct vfbfs_clone_range cr = { .cr_src_off = 0, .cr_len = 0, .cr_dst_off = 0 };
+    snprintf(cr.cr_src, sizeof(cr.cr_src), "/bench/clone/t%d-%ld.src", bt->bt_id, bt->bt_param);
+    return bt->bt_oprs->ioctl(bt->bt_path, VFBFS_IOC_CLONE_RANGE, NULL, &bt->bt_fi, 0, &cr);
+}
+
+/*
+ * Dither: converts a megapixel gradient of XRGB8888 to RGB565, 'mode' as
+ * in enum VfbfsFbDither, so the latency is the cost per megapixel
+*/
+#define BENCH_DITHER_WIDTH      1024
+#define BENCH_DITHER_HEIGHT     1024
+#define BENCH_DITHER_ITERATIONS 100
+
+static int bench_dither_setup(struct bench_thread *bt)
+{
+    size_t npix = (size_t)BENCH_DITHER_WIDTH * BENCH_DITHER_HEIGHT;
+    char *buf = realloc(bt->bt_buf, npix * 6);
+    uint32_t *px;
+    unsigned x, y;
+
+    pthread_barrier_wait(&bench_barrier);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    bt->bt_buf     = buf;
+    bt->bt_bufsize = npix * 6;
+    px = (uint32_t *)buf;
+    for (y = 0; y < BENCH_DITHER_HEIGHT; y++) {
+        for (x = 0; x < BENCH_DITHER_WIDTH; x++) {
+            *px++ = ((x * 255 / (BENCH_DITHER_WIDTH - 1)) << 16) | ((y * 255 / (BENCH_DITHER_HEIGHT - 1)) << 8)
+                | ((x + y) * 255 / (BENCH_DITHER_WIDTH + BENCH_DITHER_HEIGHT - 2));
+        }
+    }
+    return 0;
+}
+
+static int bench_dither_op(struct bench_thread *bt, long i)
+{
+    size_t npix = (size_t)BENCH_DITHER_WIDTH * BENCH_DITHER_HEIGHT;
+    return vfbfs_fb_convert_dither(bt->bt_param, VFBFS_FB_RGB565, bt->bt_buf + npix * 4
+        , BENCH_DITHER_WIDTH * 2, VFBFS_FB_XRGB8888, bt->bt_buf, BENCH_DITHER_WIDTH * 4
+        , BENCH_DITHER_WIDTH, BENCH_DITHER_HEIGHT, 0, 0);
+}
+
+static const struct bench_workload bench_workloads[] = {
+    { "lookup",   "depth", bench_lookup_setup,   bench_lookup_op,   NULL },
+    { "read",     "size",  bench_rw_setup,       bench_read_op,     bench_release_file },
+    { "write",    "size",  bench_rw_setup,       bench_write_op,    bench_release_file },
+    { "truncate", "step",  bench_truncate_setup, bench_truncate_op, bench_release_file },
+    { "readdir",  "width", bench_readdir_setup,  bench_readdir_op,  bench_readdir_teardown },
+    { "clone",    "size",  bench_clone_setup,    bench_clone_op,    bench_release_file },
+    { "dither",   "mode",  bench_dither_setup,   bench_dither_op,   NULL },
+};
+
+static void *bench_thread_main(void *arg)
+{
+    struct bench_thread *bt = (struct bench_thread *)arg;
+    const struct bench_workload *wl = bt->bt_wl;
+    uint64_t start;
+    long i;
+
+    if (wl->w_setup != NULL && wl->w_setup(bt) != 0) {
+        bt->bt_errors = bt->bt_iterations;
+    }
+    pthread_barrier_wait(&bench_barrier);
+    bt->bt_start = bench_now();
+    for (i = 0; i < bt->bt_iterations && bt->bt_errors == 0; i++) {
+        start = bench_now();
+        if (wl->w_op(bt, i) != 0) {
+            bt->bt_errors++;
+        }
+        bt->bt_lat[i] = bench_now() - start;
+    }
+    bt->bt_end = bench_now();
+    pthread_barrier_wait(&bench_barrier);
+    if (wl->w_teardown != NULL) {
+        wl->w_teardown(bt);
+    }
+    return NULL;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t bench_percentile(uint64_t *sorted, long n, double p)
+{
+    long idx = (long)(p * (n - 1) + 0.5);
+    return (n > 0) ? sorted[idx] : 0;
+}
+
+static int bench_run(const struct bench_options *opts, const struct bench_workload *wl
+    , long param, bool first)
+{
+    struct bench_thread *threads = calloc(opts->threads, sizeof(*threads));
+    long total = opts->threads * opts->iterations, errors = 0, n = 0;
+    uint64_t *all = malloc(total * sizeof(uint64_t));
+    size_t bufsize = MAX(param, 4096);
+    uint64_t start = UINT64_MAX, end = 0, elapsed;
+    int i;
+
+    if (threads == NULL || all == NULL) {
+        free(threads);
+        free(all);
+        return -ENOMEM;
+    }
+
+    pthread_barrier_init(&bench_barrier, NULL, opts->threads + 1);
+    for (i = 0; i < opts->threads; i++) {
+        struct bench_thread *bt = &threads[i];
+        bt->bt_wl         = wl;
+        bt->bt_oprs       = &bench_fs->fs_superblock->sb_fs_oprs;
+        bt->bt_id         = i;
+        bt->bt_param      = param;
+        bt->bt_iterations = opts->iterations;
+        bt->bt_buf        = malloc(bufsize);
+        bt->bt_bufsize    = bufsize;
+        bt->bt_lat        = all + i * opts->iterations;
+        memset(bt->bt_buf, 'v', bufsize);
+        pthread_create(&bt->bt_thread, NULL, bench_thread_main, bt);
+    }
+
+    /* Every setup waits once, after thread 0 has built the shared part */
+    pthread_barrier_wait(&bench_barrier);
+    pthread_barrier_wait(&bench_barrier);
+    pthread_barrier_wait(&bench_barrier);
+
+    /* The wall clock time from the first thread starting to the last one finishing */
+    for (i = 0; i < opts->threads; i++) {
+        pthread_join(threads[i].bt_thread, NULL);
+        errors += threads[i].bt_errors;
+        start   = MIN(start, threads[i].bt_start);
+        end     = MAX(end, threads[i].bt_end);
+        free(threads[i].bt_buf);
+    }
+    pthread_barrier_destroy(&bench_barrier);
+    elapsed = end - start;
+
+    if (errors == 0) {
+        n = total;
+        qsort(all, n, sizeof(uint64_t), bench_cmp_u64);
+    }
+    printf("%s    {\"workload\": \"%s\", \"%s\": %ld, \"threads\": %d, \"ops\": %ld"
+           ", \"errors\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f"
+           ", \"latency_ns\": {\"min\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+           ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}}"
+        , first ? "" : ",\n", wl->w_name, wl->w_param_name, param, opts->threads, n
+        , errors, elapsed / 1e9, elapsed ? n / (elapsed / 1e9) : 0.0
+        , n ? all[0] : 0, bench_percentile(all, n, 0.50), bench_percentile(all, n, 0.90)
+        , bench_percentile(all, n, 0.99), bench_percentile(all, n, 0.999)
+        , n ? all[n-1] : 0);
+    fflush(stdout);
+
+    free(all);
+    free(threads);
+    return errors ? -EIO : 0;
+}
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-n iterations] [-d max-depth] [-w width] [-o workload]\n"
+                    "workloads: lookup, read, write, truncate, readdir, clone, dither\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts = {
+        .threads    = 1,
+        .iterations = 10000,
+        .max_depth  = 32,
+        .width      = 4096,
+        .only       = NULL,
+    };
+    static const long rw_sizes[] = { 4096, 1 << 20 };
+    static const long clone_sizes[] = { 1 << 20, 32 << 20 };
+    const struct bench_workload *wl;
+    struct bench_options few;
+    bool first = true;
+    long depth, width, mode;
+    size_t i, j;
+    int c, r = 0;
+
+    while ((c = getopt(argc, argv, "t:n:d:w:o:h")) != -1) {
+        switch (c) {
+            case 't': opts.threads    = atoi(optarg); break;
+            case 'n': opts.iterations = atol(optarg); break;
+            case 'd': opts.max_depth  = atoi(optarg); break;
+            case 'w': opts.width      = atoi(optarg); break;
+            case 'o': opts.only       = optarg;       break;
+            default:
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.threads < 1 || opts.threads > BENCH_MAX_THREADS || opts.iterations < 1) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    if ((bench_fs = vfbfs_new()) == NULL) {
+        fprintf(stderr, "cannot allocate the filesystem\n");
+        return 1;
+    }
+    vfbfs_inproc_start(bench_fs);
+
+    printf("{\"threads\": %d, \"iterations\": %ld, \"results\": [\n"
+        , opts.threads, opts.iterations);
+    for (i = 0; i < sizeof(bench_workloads)/sizeof(bench_workloads[0]); i++) {
+        wl = &bench_workloads[i];
+        if (opts.only != NULL && strcmp(opts.only, wl->w_name) != 0) {
+            continue;
+        }
+        if (wl->w_setup == bench_lookup_setup) {
+            for (depth = 1; depth <= opts.max_depth; depth *= 2) {
+                r |= bench_run(&opts, wl, depth, first);
+                first = false;
+            }
+        } else if (wl->w_setup == bench_rw_setup) {
+            for (j = 0; j < sizeof(rw_sizes)/sizeof(rw_sizes[0]); j++) {
+                r |= bench_run(&opts, wl, rw_sizes[j], first);
+                first = false;
+            }
+        } else if (wl->w_setup == bench_clone_setup) {
+            for (j = 0; j < sizeof(clone_sizes)/sizeof(clone_sizes[0]); j++) {
+                r |= bench_run(&opts, wl, clone_sizes[j], first);
+                first = false;
+            }
+        } else if (wl->w_setup == bench_dither_setup) {
+            /* A megapixel per operation, fewer of them */
+            few = opts;
+            few.iterations = MIN(opts.iterations, BENCH_DITHER_ITERATIONS);
+            for (mode = 0; mode < VFBFS_FB_DITHER_MAX; mode++) {
+                r |= bench_run(&few, wl, mode, first);
+                first = false;
+            }
+        } else if (wl->w_setup == bench_readdir_setup) {
+            for (width = 16; width <= opts.width; width *= 16) {
+                r |= bench_run(&opts, wl, width, first);
+                first = false;
+            }
+        } else {
+            r |= bench_run(&opts, wl, 4096, first);
+            first = false;
+        }
+    }
+    printf("\n]}\n");
+    vfbfs_inproc_stop(bench_fs);
+
+#ifdef VFBFS_LOCKSTAT
+    vfbfs_lockstat_print(stderr);
+#endif
+    return r ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <build.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+struct build_dir_node {
+    struct vfbfs_entry  n_entry;
+    struct vfbfs_dir    n_dir;
+};
+
+struct build_file_node {
+    struct vfbfs_entry  n_entry;
+    struct vfbfs_file   n_file;
+};
+
+void vfbfs_build_begin(struct vfbfs_build *b, struct vfbfs *fs)
+{
+    memset(b, 0, sizeof(*b));
+    b->b_fs = fs;
+}
+
+/* The chunks are never freed, the nodes live as long as the filesystem */
+static void *build_alloc(struct vfbfs_build *b, size_t size)
+{
+    void *p;
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (size > b->b_chunk_left) {
+        if (size > VFBFS_BUILD_CHUNK / 4) {
+            return malloc(size);
+        }
+        if ((b->b_chunk = malloc(VFBFS_BUILD_CHUNK)) == NULL) {
+            b->b_chunk_left = 0;
+            return NULL;
+        }
+        b->b_chunk_left = VFBFS_BUILD_CHUNK;
+    }
+    p = b->b_chunk;
+    b->b_chunk      += size;
+    b->b_chunk_left -= size;
+    return p;
+}
+
+static char *build_strdup(struct vfbfs_build *b, const char *s, size_t len)
+{
+    char *p = (char *)build_alloc(b, len + 1);
+    if (p != NULL) {
+        memcpy(p, s, len);
+        p[len] = '\0';
+    }
+    return p;
+}
+
+static struct vfbfs_entry *build_find(struct vfbfs_dir *parent, const char *name)
+{
+    struct vfbfs_entry ent;
+    ent.e_name = (char *)name;
+    return RB_FIND(VFBFS_ENTRY_TREE, &parent->d_entries, &ent);
+}
+
+/*
+ * Adds a directory to parent, or returns the existing one with that name.
+ * mode 0 gives the same permissions as vfbfs_dir_create_in().
+*/
+struct vfbfs_dir *vfbfs_build_dir(struct vfbfs_build *b, struct vfbfs_dir *parent
+    , const char *name, mode_t mode)
+{
+    struct build_dir_node *n;
+    struct vfbfs_entry *e;
+    struct vfbfs_dir *d;
+
+    if ((e = build_find(parent, name)) != NULL) {
+        return vfbfs_entry_get_dir(e);
+    }
+    if ((n = build_alloc(b, sizeof(*n))) == NULL) {
+        return NULL;
+    }
+    e = &n->n_entry;
+    d = &n->n_dir;
+    vfbfs_entry_init(e);
+    vfbfs_entry_init_generic(e);
+    e->e_stat.st_mode = S_IFDIR | ((mode != 0) ? mode : (e->e_stat.st_mode | 0744));
+    e->e_stat.st_size = 4096;
+    if ((e->e_name = build_strdup(b, name, strlen(name))) == NULL) {
+        return NULL;
+    }
+    vfbfs_dir_init(d);
+    e->e_elem.dir    = d;
+    e->e_parent      = parent;
+    e->e_oprs        = parent->d_dentry_oprs;
+    d->d_entry       = e;
+    d->d_dentry_oprs = parent->d_dentry_oprs;
+    d->d_dfile_oprs  = parent->d_dfile_oprs;
+    d->d_ddir_oprs   = parent->d_ddir_oprs;
+    d->d_superblock  = parent->d_superblock;
+    d->d_oprs        = parent->d_ddir_oprs;
+    RB_INSERT(VFBFS_ENTRY_TREE, &parent->d_entries, e);
+    return d;
+}
+
+/* Adds an empty file to parent, fails with EEXIST if there is an entry with that name */
+struct vfbfs_file *vfbfs_build_file(struct vfbfs_build *b, struct vfbfs_dir *parent
+    , const char *name, mode_t mode)
+{
+    struct build_file_node *n;
+    struct vfbfs_entry *e;
+    struct vfbfs_file *f;
+
+    if (build_find(parent, name) != NULL) {
+        errno = EEXIST;
+        return NULL;
+    }
+    if ((n = build_alloc(b, sizeof(*n))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    e = &n->n_entry;
+    f = &n->n_file;
+    vfbfs_entry_init(e);
+    vfbfs_entry_init_generic(e);
+    e->e_stat.st_mode = S_IFREG | ((mode != 0) ? mode : e->e_stat.st_mode);
+    if ((e->e_name = build_strdup(b, name, strlen(name))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    vfbfs_file_init(f);
+    f->f_flags     = VFBFS_FILE_BUILT | VFBFS_FILE_ARENA_NAME;
+    f->f_entry     = e;
+    f->f_oprs      = parent->d_dfile_oprs;
+    e->e_elem.file = f;
+    e->e_parent    = parent;
+    e->e_oprs      = parent->d_dentry_oprs;
+    RB_INSERT(VFBFS_ENTRY_TREE, &parent->d_entries, e);
+    b->b_nfiles++;
+    return f;
+}
+
+/*
+ * Returns the directory containing path, creating the missing directories,
+ * and points name to the last component of path. Consecutive entries of the
+ * same directory only look it up once.
+*/
+struct vfbfs_dir *vfbfs_build_path(struct vfbfs_build *b, const char *path, const char **name)
+{
+    struct vfbfs_dir *dir = vfbfs_get_rootdir(b->b_fs);
+    const char *slash = strrchr(path, '/'), *p, *end;
+    size_t dlen = (slash != NULL) ? (size_t)(slash - path) : 0;
+    char *comp;
+
+    *name = (slash != NULL) ? slash + 1 : path;
+    if (b->b_last_path != NULL && strlen(b->b_last_path) == dlen
+            && strncmp(b->b_last_path, path, dlen) == 0) {
+        return b->b_last_dir;
+    }
+    for (p = path; p < path + dlen && dir != NULL; p = end) {
+        while (*p == '/') {
+            p++;
+        }
+        if ((end = memchr(p, '/', path + dlen - p)) == NULL) {
+            end = path + dlen;
+        }
+        if (end == p) {
+            continue;
+        }
+        if ((comp = strndup(p, end - p)) == NULL) {
+            return NULL;
+        }
+        dir = vfbfs_build_dir(b, dir, comp, 0);
+        free(comp);
+    }
+    if (dir != NULL) {
+        free(b->b_last_path);
+        b->b_last_path = strndup(path, dlen);
+        b->b_last_dir  = dir;
+    }
+    return dir;
+}
+
+/* Publishes the counters, after this the tree may be used concurrently again */
+void vfbfs_build_end(struct vfbfs_build *b)
+{
+    struct vfbfs_superblock *sb = b->b_fs->fs_superblock;
+    vfbfs_mutex_lock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+    sb->sb_file_count += b->b_nfiles;
+    vfbfs_mutex_unlock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+    free(b->b_last_path);
+    b->b_last_path = NULL;
+    b->b_last_dir  = NULL;
+    b->b_nfiles    = 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Tree configuration (--config=FILE). One node per line, # starts a comment:
+ *
+ *   dir  /assets                      [mode=0755]
+ *   file /config/readme.txt           [mode=0644] ["content, with \n escapes" | @host/file]
+ *   gen  /config/opencount.txt        [mode=0444] generator [arguments...]
+ *   fb   240x320:rgb565@60,virtual    (same as --fb=)
+ *
+ * Missing parent directories are created. Host files given with @ are
+ * relative to the configuration file. Everything is inserted with the bulk
+ * builder (build.h), so the configuration must be loaded before mounting.
+*/
+#include <config.h>
+#include <build.h>
+#include <fb.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+static struct vfbfs_generator *config_generators = NULL;
+
+void vfbfs_generator_register(struct vfbfs_generator *gen)
+{
+    gen->g_next = config_generators;
+    config_generators = gen;
+}
+
+struct vfbfs_generator *vfbfs_generator_find(const char *name)
+{
+    struct vfbfs_generator *gen;
+    for (gen = config_generators; gen != NULL; gen = gen->g_next) {
+        if (strcmp(gen->g_name, name) == 0) {
+            return gen;
+        }
+    }
+    return NULL;
+}
+
+struct config_ctx {
+    struct vfbfs        *c_fs;
+    struct vfbfs_build   c_build;
+    const char          *c_source;     /* file name for the messages */
+    char                *c_basedir;    /* @ paths are relative to this */
+    int                  c_line;
+};
+
+static int config_error(struct config_ctx *c, int err, const char *msg, const char *arg)
+{
+    fprintf(stderr, "vfbfs: %s:%d: %s%s%s\n", c->c_source, c->c_line, msg
+        , (arg != NULL) ? " " : "", (arg != NULL) ? arg : "");
+    return err;
+}
+
+/*
+ * Cuts the next word or "quoted string" off *pp in place, *len is its
+ * length (a quoted string may contain \0). Returns false at the end.
+*/
+static bool config_token(char **pp, char **tok, size_t *len)
+{
+    char *p = *pp, *out;
+    unsigned v;
+    int n;
+
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (*p == '\0') {
+        return false;
+    }
+    if (*p != '"') {
+        *tok = p;
+        while (*p != '\0' && !isspace((unsigned char)*p)) {
+            p++;
+        }
+        *len = p - *tok;
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+        *pp = p;
+        return true;
+    }
+    *tok = out = ++p;
+    while (*p != '\0' && *p != '"') {
+        if (*p != '\\' || p[1] == '\0') {
+            *out++ = *p++;
+            continue;
+        }
+        switch (*++p) {
+            case 'n': *out++ = '\n'; p++; break;
+            case 't': *out++ = '\t'; p++; break;
+            case 'r': *out++ = '\r'; p++; break;
+            case '0': *out++ = '\0'; p++; break;
+            case 'x':
+            if (sscanf(p + 1, "%2x%n", &v, &n) == 1) {
+                *out++ = (char)v;
+                p += 1 + n;
+                break;
+            }
+            /* fall through */
+            default:  *out++ = *p++;        break;
+        }
+    }
+    *len = out - *tok;
+    if (*p == '"') {
+        p++;
+    }
+    *out = '\0';
+    *pp  = p;
+    return true;
+}
+
+/* Takes a leading mode=OCT token if there is one */
+static bool config_mode(char **pp, mode_t *mode)
+{
+    char *p = *pp, *end;
+    unsigned long m;
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    if (strncmp(p, "mode=", 5) != 0) {
+        return false;
+    }
+    m = strtoul(p + 5, &end, 8);
+    *mode = m & 07777;
+    *pp   = end;
+    return true;
+}
+
+static int config_read_host_file(struct config_ctx *c, const char *name, char **buf, size_t *len)
+{
+    char *path = NULL;
+    struct stat st;
+    ssize_t r;
+    size_t off = 0;
+    int fd, err;
+
+    if (name[0] != '/' && c->c_basedir != NULL) {
+        if (asprintf(&path, "%s/%s", c->c_basedir, name) < 0) {
+            return -ENOMEM;
+        }
+        name = path;
+    }
+    fd = open(name, O_RDONLY|O_CLOEXEC);
+    free(path);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        err = -errno;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return err;
+    }
+    if ((*buf = malloc(MAX(st.st_size, 1))) == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    while (off < (size_t)st.st_size && (r = read(fd, *buf + off, st.st_size - off)) > 0) {
+        off += r;
+    }
+    close(fd);
+    *len = off;
+    return 0;
+}
+
+static int config_line(struct config_ctx *c, char *p)
+{
+    struct vfbfs_generator *gen;
+    struct vfbfs_dir *parent;
+    struct vfbfs_file *f;
+    char *kw, *path, *tok, *content = NULL, *end;
+    const char *name;
+    size_t len, clen = 0;
+    mode_t mode = 0;
+    bool quoted;
+    int r;
+
+    if (!config_token(&p, &kw, &len) || kw[0] == '#') {
+        return 0;
+    }
+    if (strcmp(kw, "fb") == 0) {
+        if (!config_token(&p, &tok, &len)) {
+            return config_error(c, -EINVAL, "missing framebuffer", NULL);
+        }
+        if (vfbfs_fb_create_spec(c->c_fs, tok) == NULL) {
+            return config_error(c, -EINVAL, "invalid framebuffer", tok);
+        }
+        return 0;
+    }
+    if (strcmp(kw, "dir") != 0 && strcmp(kw, "file") != 0 && strcmp(kw, "gen") != 0) {
+        return config_error(c, -EINVAL, "unknown keyword", kw);
+    }
+    if (!config_token(&p, &path, &len) || path[0] != '/' || path[1] == '\0') {
+        return config_error(c, -EINVAL, "missing or invalid path after", kw);
+    }
+    config_mode(&p, &mode);
+    if ((parent = vfbfs_build_path(&c->c_build, path, &name)) == NULL || name[0] == '\0') {
+        return config_error(c, -ENOTDIR, "cannot create the parent of", path);
+    }
+
+    if (strcmp(kw, "dir") == 0) {
+        if (vfbfs_build_dir(&c->c_build, parent, name, mode) == NULL) {
+            return config_error(c, -EEXIST, "not a directory:", path);
+        }
+        return 0;
+    }
+
+    if (strcmp(kw, "file") == 0) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        quoted = (*p == '"');
+        if (config_token(&p, &tok, &len)) {
+            if (tok[0] == '@' && !quoted) {
+                if ((r = config_read_host_file(c, tok + 1, &content, &clen)) != 0) {
+                    return config_error(c, r, "cannot read", tok + 1);
+                }
+            } else if ((content = malloc(MAX(len, 1))) != NULL) {
+                memcpy(content, tok, len);
+                clen = len;
+            }
+        }
+        if ((f = vfbfs_build_file(&c->c_build, parent, name, mode)) == NULL) {
+            free(content);
+            return config_error(c, -errno, "cannot create", path);
+        }
+        f->f_content      = content;
+        f->f_content_size = clen;
+        f->f_entry->e_stat.st_size = clen;
+        return 0;
+    }
+
+    /* gen */
+    if (!config_token(&p, &tok, &len)) {
+        return config_error(c, -EINVAL, "missing generator for", path);
+    }
+    if ((gen = vfbfs_generator_find(tok)) == NULL) {
+        return config_error(c, -ENOENT, "unknown generator", tok);
+    }
+    /* The arguments are the rest of the line as it is */
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    for (end = p + strlen(p); end > p && isspace((unsigned char)end[-1]); end--)
+        ;
+    *end = '\0';
+    if ((f = vfbfs_build_file(&c->c_build, parent, name, mode)) == NULL) {
+        return config_error(c, -errno, "cannot create", path);
+    }
+    if ((r = gen->g_setup(c->c_fs, f, p)) != 0) {
+        return config_error(c, r, "generator failed:", gen->g_name);
+    }
+    return 0;
+}
+
+int vfbfs_config_load_string(struct vfbfs *fs, const char *text, const char *source)
+{
+    struct config_ctx c;
+    char *buf = strdup(text), *line, *next;
+    int r = 0;
+
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    memset(&c, 0, sizeof(c));
+    c.c_fs     = fs;
+    c.c_source = source;
+    if (strchr(source, '/') != NULL) {
+        char *tmp = strdup(source);
+        c.c_basedir = strdup(dirname(tmp));
+        free(tmp);
+    }
+    vfbfs_build_begin(&c.c_build, fs);
+    for (line = buf; line != NULL && r == 0; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        c.c_line++;
+        r = config_line(&c, line);
+    }
+    vfbfs_build_end(&c.c_build);
+    free(c.c_basedir);
+    free(buf);
+    return r;
+}
+
+int vfbfs_config_load(struct vfbfs *fs, const char *path)
+{
+    char *text = NULL, *buf;
+    size_t len = 0;
+    struct config_ctx c;
+    int r;
+
+    memset(&c, 0, sizeof(c));
+    if ((r = config_read_host_file(&c, path, &text, &len)) != 0) {
+        fprintf(stderr, "vfbfs: %s: %s\n", path, strerror(-r));
+        return r;
+    }
+    if ((buf = realloc(text, len + 1)) == NULL) {
+        free(text);
+        return -ENOMEM;
+    }
+    buf[len] = '\0';
+    r = vfbfs_config_load_string(fs, buf, path);
+    free(buf);
+    return r;
+}
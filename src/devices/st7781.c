@@ -1,5 +1,20 @@
+/*
+ * ST7781 240x320 TFT panel on an 8 bit parallel bus, driven over GPIO with
+ * wiringPi. The panel scrolls in hardware: GATE_SCAN_CTRL3 holds the GRAM
+ * row shown at the top, so a scroll is one register write and the flush
+ * only sends the exposed rows. The static regions are shown from the
+ * partial images, in place. The entry mode turns the written pixels, so a
+ * landscape framebuffer costs no software rotation.
+ *
+ *   --fb=240x320:rgb565@60,st7781
+ *   --fb=320x240:rgb565@60,st7781   then "rotate 90" to /fb/0/transform
+*/
+#include <fb.h>
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <wiringPi.h>
 #include <inttypes.h>
 
@@ -39,6 +54,7 @@
 #define TFTLCD_VER_END_AD           0x53
 #define TFTLCD_GATE_SCAN_CTRL1      0x60
 #define TFTLCD_GATE_SCAN_CTRL2      0x61
+#define TFTLCD_GATE_SCAN_CTRL3      0x6A
 #define TFTLCD_PART_IMG1_DISP_POS   0x80
 #define TFTLCD_PART_IMG1_START_AD   0x81
 #define TFTLCD_PART_IMG1_END_AD     0x82
@@ -55,25 +71,35 @@ struct st7781_pins {
     int rs;
     int wr;
     int rd;
-} default_pins {
-    .data = { },
-    .rst  =
-    .cs  =
-    .rs  =
-    .wr  =
-    .rd  =
 };
 
+// wiringPi pin numbers of the shield
+static struct st7781_pins default_pins = {
+    .data = { 0, 1, 2, 3, 4, 5, 6, 7 },
+    .rst  = 21,
+    .cs   = 22,
+    .rs   = 23,
+    .wr   = 24,
+    .rd   = 25,
+};
+
+#define ST7781_WIDTH    240
+#define ST7781_HEIGHT   320
+
 struct st7781_lcd {
     struct st7781_pins *pins;
     int cursor_x;
     int cursor_y;
+    unsigned quarters;  // the rotation of the entry mode
 };
 
-void st7781_set_data_mode(struct st7781_pins *pins, int mode)
+static void st7781_write_register(struct st7781_lcd *lcd, uint16_t addr, uint16_t data);
+static void st7781_reset(struct st7781_lcd *lcd);
+
+static void st7781_set_data_mode(struct st7781_pins *pins, int mode)
 {
     int i;
-    for (i = 0; i < sizeof(pins->data); i++) {
+    for (i = 0; i < 8; i++) {
         pinMode(pins->data[i], mode);
     }
 }
@@ -121,21 +147,35 @@ static const uint16_t init_regs[] = {
     TFTLCD_VER_END_AD, 0x013F,
     //-----FRAME RATE SETTING-------//
     TFTLCD_GATE_SCAN_CTRL1, 0xA700,
-    TFTLCD_GATE_SCAN_CTRL2, 0x0001,
+    TFTLCD_GATE_SCAN_CTRL2, 0x0003, // REV, VLE: scrolling by CTRL3
+    TFTLCD_GATE_SCAN_CTRL3, 0x0000,
     TFTLCD_PANEL_IF_CTRL1, 0x0033, //RTNI setting
     //-------DISPLAY ON------//
     TFTLCD_DISP_CTRL1, 0x0133,
 };
 
-void st7781_init_registers(struct st7781_lcd *lcd, uint16_t *regs, sizeof relems)
+// TFTLCD_ENTRY_MOD per clockwise quarter turn: BGR, then I/D1 I/D0 (bits 5, 4)
+// and AM (bit 3) walk the GRAM so the written rows land turned
+static const uint16_t entry_modes[4] = { 0x1030, 0x1028, 0x1000, 0x1018 };
+
+#define ST7781_DISP_ON          0x0133
+#define ST7781_DISP_PTDE(i)     (0x1000 << (i))   // partial image i on
+
+// DISP_POS, START_AD and END_AD of the partial images
+static const uint16_t part_img_regs[][3] = {
+    { TFTLCD_PART_IMG1_DISP_POS, TFTLCD_PART_IMG1_START_AD, TFTLCD_PART_IMG1_END_AD },
+    { TFTLCD_PART_IMG2_DISP_POS, TFTLCD_PART_IMG2_START_AD, TFTLCD_PART_IMG2_END_AD },
+};
+
+static void st7781_init_registers(struct st7781_lcd *lcd, const uint16_t *regs, size_t relems)
 {
-    int i;
+    size_t i;
     for (i = 0; i < relems/2; i++) {
-        st7781_write_register(regs[i*2], regs[i*2+1]);
+        st7781_write_register(lcd, regs[i*2], regs[i*2+1]);
     }
 }
 
-void st7781_init(struct st7781_lcd *lcd, struct st7781_pins *pins)
+static void st7781_init(struct st7781_lcd *lcd, struct st7781_pins *pins)
 {
     wiringPiSetup();
     st7781_set_data_mode(pins, OUTPUT);
@@ -159,15 +199,18 @@ void st7781_init(struct st7781_lcd *lcd, struct st7781_pins *pins)
     lcd->cursor_y = 0;
     lcd->pins     = pins;
 
-    init_registers(lcd, init_regs, sizeof(init_regs));
+    st7781_reset(lcd);
+    st7781_init_registers(lcd, init_regs, sizeof(init_regs) / sizeof(init_regs[0]));
 }
 
-void st7781_reset(struct st7781_lcd *lcd)
+static void st7781_write_data(struct st7781_lcd *lcd, uint16_t data);
+
+static void st7781_reset(struct st7781_lcd *lcd)
 {
     struct st7781_pins *pins = lcd->pins;
-    digitalWrite(pins->rst, HIGH);
-    usleep(2000); // 2 ms
     digitalWrite(pins->rst, LOW);
+    usleep(2000); // 2 ms
+    digitalWrite(pins->rst, HIGH);
 
     // resync
     st7781_write_data(lcd, 0);
@@ -180,7 +223,7 @@ void st7781_reset(struct st7781_lcd *lcd)
 #define CS_LOW(pins) (digitalWrite((pins)->cs, LOW))
 
 #define RD_HIGH(pins) (digitalWrite((pins)->rd, HIGH))
-#define RD_LOW(pins) (digitalWrite((pins)->rd, HIGH))
+#define RD_LOW(pins) (digitalWrite((pins)->rd, LOW))
 
 #define WR_HIGH(pins) (digitalWrite((pins)->wr, HIGH))
 #define WR_LOW(pins) (digitalWrite((pins)->wr, LOW))
@@ -191,7 +234,7 @@ void st7781_reset(struct st7781_lcd *lcd)
 #define st7781_set_write_dir(pins) (st7781_set_data_mode(pins, OUTPUT))
 #define st7781_set_read_dir(pins) (st7781_set_data_mode(pins, INPUT))
 
-void st7781_write_byte(struct st7781_pins *pins, uint8_t data)
+static void st7781_write_byte(struct st7781_pins *pins, uint8_t data)
 {
     int i;
     for (i = 0; i < 8; i++) {
@@ -199,7 +242,7 @@ void st7781_write_byte(struct st7781_pins *pins, uint8_t data)
     }
 }
 
-uint8_t st7781_write_byte(struct st7781_pins *pins)
+static uint8_t st7781_read_byte(struct st7781_pins *pins)
 {
     int i;
     uint8_t data = 0;
@@ -210,7 +253,7 @@ uint8_t st7781_write_byte(struct st7781_pins *pins)
     return data;
 }
 
-void st7781_write_data(struct st7781_lcd *lcd, uint16_t data)
+static void st7781_write_data(struct st7781_lcd *lcd, uint16_t data)
 {
     struct st7781_pins *pins = lcd->pins;
     CS_LOW(pins);
@@ -220,19 +263,19 @@ void st7781_write_data(struct st7781_lcd *lcd, uint16_t data)
     WR_HIGH(pins);
 
     st7781_set_write_dir(pins);
-    st7781_write_byte(lcd, data >> 8);
+    st7781_write_byte(pins, data >> 8);
 
     WR_LOW(pins);
     WR_HIGH(pins);
 
-    st7781_write_byte(lcd, data);
+    st7781_write_byte(pins, data);
     WR_LOW(pins);
     WR_HIGH(pins);
 
     CS_HIGH(pins);
 }
 
-void st7781_write_command(struct st7781_lcd *lcd, uint16_t cmd)
+static void st7781_write_command(struct st7781_lcd *lcd, uint16_t cmd)
 {
     struct st7781_pins *pins = lcd->pins;
     CS_LOW(pins);
@@ -241,19 +284,19 @@ void st7781_write_command(struct st7781_lcd *lcd, uint16_t cmd)
     RD_HIGH(pins);
     WR_HIGH(pins);
     st7781_set_write_dir(pins);
-    st7781_write_byte(lcd, cmd >> 8);
+    st7781_write_byte(pins, cmd >> 8);
 
     WR_LOW(pins);
     WR_HIGH(pins);
 
-    st7781_write_byte(lcd, cmd);
+    st7781_write_byte(pins, cmd);
 
     WR_LOW(pins);
     WR_HIGH(pins);
     CS_HIGH(pins);
 }
 
-uint16_t st7781_read_data(struct st7781_lcd *lcd)
+static uint16_t st7781_read_data(struct st7781_lcd *lcd)
 {
     uint16_t d = 0;
     struct st7781_pins *pins = lcd->pins;
@@ -262,12 +305,12 @@ uint16_t st7781_read_data(struct st7781_lcd *lcd)
     RS_DATA(pins);
     RD_HIGH(pins);
     WR_HIGH(pins);
-    st7781_read_dir(lcd);
+    st7781_set_read_dir(pins);
 
     RD_LOW(pins);
     usleep(10);
     /* Read the higher byte first */
-    d = st7781_read_byte(lcd);
+    d = st7781_read_byte(pins);
     d <<= 8;
 
     RD_HIGH(pins);
@@ -275,26 +318,118 @@ uint16_t st7781_read_data(struct st7781_lcd *lcd)
 
     usleep(10);
     /* Lower byte */
-    d |= st7781_read_byte(lcd);
+    d |= st7781_read_byte(pins);
     RD_HIGH(pins);
     CS_HIGH(pins);
     return d;
 }
 
-uint16_t st7781_read_register(struct st7781_lcd *lcd, uint16_t addr)
+static uint16_t st7781_read_register(struct st7781_lcd *lcd, uint16_t addr)
 {
     st7781_write_command(lcd, addr);
     return st7781_read_data(lcd);
 }
 
-void st7781_write_register(struct st7781_lcd *lcd, uint16_t addr, uint16_t data)
+static void st7781_write_register(struct st7781_lcd *lcd, uint16_t addr, uint16_t data)
 {
     st7781_write_command(lcd, addr);
-    st7781_write_data(lcd, addr);
+    st7781_write_data(lcd, data);
+}
+
+static int st7781_fb_open(struct vfbfs_fb *fb, const char *args)
+{
+    struct st7781_lcd *lcd;
+    if ((lcd = calloc(1, sizeof(*lcd))) == NULL) {
+        return -ENOMEM;
+    }
+    st7781_init(lcd, &default_pins);
+    syslog(LOG_INFO, "fb%d: st7781 driver id %04x", fb->fb_index
+        , st7781_read_register(lcd, TFTLCD_DRIV_ID_READ));
+    // Other framebuffer sizes are scaled, see fbxform.c
+    fb->fb_dev_format  = VFBFS_FB_RGB565;
+    fb->fb_dev_width   = ST7781_WIDTH;
+    fb->fb_dev_height  = ST7781_HEIGHT;
+    fb->fb_dev_private = lcd;
+    return 0;
 }
 
-int main(int argc, char *argv[])
+// The rows of r are GRAM rows, the scroll origin is applied by the panel.
+// When turned, r is in the turned orientation and the window is where it lands.
+static int st7781_fb_flush(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r
+    , const void *pixels, size_t stride)
+{
+    struct st7781_lcd *lcd = (struct st7781_lcd *)fb->fb_dev_private;
+    struct vfbfs_fb_rect g;
+    const uint16_t *px;
+    unsigned x, y, ax, ay;
+
+    vfbfs_fb_rect_turn(&g, r, lcd->quarters, ST7781_WIDTH, ST7781_HEIGHT);
+    // The address counter starts where the first pixel lands
+    ax = (lcd->quarters == 1 || lcd->quarters == 2) ? g.r_x1 - 1 : g.r_x0;
+    ay = (lcd->quarters == 2 || lcd->quarters == 3) ? g.r_y1 - 1 : g.r_y0;
+    st7781_write_register(lcd, TFTLCD_HOR_START_AD, g.r_x0);
+    st7781_write_register(lcd, TFTLCD_HOR_END_AD, g.r_x1 - 1);
+    st7781_write_register(lcd, TFTLCD_VER_START_AD, g.r_y0);
+    st7781_write_register(lcd, TFTLCD_VER_END_AD, g.r_y1 - 1);
+    st7781_write_register(lcd, TFTLCD_GRAM_HOR_AD, ax);
+    st7781_write_register(lcd, TFTLCD_GRAM_VER_AD, ay);
+    st7781_write_command(lcd, TFTLCD_RW_GRAM);
+    for (y = r->r_y0; y < r->r_y1; y++) {
+        px = (const uint16_t *)((const char *)pixels + (y - r->r_y0) * stride);
+        for (x = r->r_x0; x < r->r_x1; x++) {
+            st7781_write_data(lcd, *px++);
+        }
+    }
+    return 0;
+}
+
+static int st7781_fb_scroll(struct vfbfs_fb *fb, unsigned origin)
+{
+    st7781_write_register((struct st7781_lcd *)fb->fb_dev_private, TFTLCD_GATE_SCAN_CTRL3, origin);
+    return 0;
+}
+
+static int st7781_fb_rotate(struct vfbfs_fb *fb, unsigned quarters)
+{
+    struct st7781_lcd *lcd = (struct st7781_lcd *)fb->fb_dev_private;
+    lcd->quarters = quarters & 3;
+    st7781_write_register(lcd, TFTLCD_ENTRY_MOD, entry_modes[lcd->quarters]);
+    return 0;
+}
+
+static int st7781_fb_regions(struct vfbfs_fb *fb, const struct vfbfs_fb_region *regions, unsigned n)
+{
+    struct st7781_lcd *lcd = (struct st7781_lcd *)fb->fb_dev_private;
+    uint16_t ctrl = ST7781_DISP_ON;
+    unsigned i;
+
+    for (i = 0; i < n && i < 2; i++) {
+        st7781_write_register(lcd, part_img_regs[i][0], regions[i].rg_y0);
+        st7781_write_register(lcd, part_img_regs[i][1], regions[i].rg_y0);
+        st7781_write_register(lcd, part_img_regs[i][2], regions[i].rg_y1 - 1);
+        ctrl |= ST7781_DISP_PTDE(i);
+    }
+    st7781_write_register(lcd, TFTLCD_DISP_CTRL1, ctrl);
+    return 0;
+}
+
+static void st7781_fb_close(struct vfbfs_fb *fb)
+{
+    free(fb->fb_dev_private);
+    fb->fb_dev_private = NULL;
+}
+
+static struct vfbfs_fb_device_ops st7781_fb_oprs = {
+    .fd_name    = "st7781",
+    .fd_open    = st7781_fb_open,
+    .fd_flush   = st7781_fb_flush,
+    .fd_scroll  = st7781_fb_scroll,
+    .fd_regions = st7781_fb_regions,
+    .fd_rotate  = st7781_fb_rotate,
+    .fd_close   = st7781_fb_close,
+};
+
+static void __attribute__((constructor)) st7781_fb_register(void)
 {
-    struct st7781_lcd lcd;
-    st7781_init(&lcd, &default_pins);
+    vfbfs_fb_device_register(&st7781_fb_oprs);
 }
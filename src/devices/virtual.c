@@ -0,0 +1,154 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Simulated display, keeps the flushed pixels in its own memory (the "GRAM")
+ * and scrolls and turns the written pixels like the ST7781: vf_origin is the
+ * GRAM row shown at the top, vf_quarters the entry mode. The static regions
+ * are only recorded.
+ * Optionally the speed of the panel's bus can be simulated, to size real
+ * deployments on ordinary machines, and the panel can have another size
+ * than the framebuffer (see fbxform.c):
+ *
+ *   --fb=320x240:rgb565@60,virtual:panel=240x320:bps=2000000
+*/
+#include <fb.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+struct virtual_fb {
+    char     *vf_gram;
+    size_t    vf_stride;
+    uint64_t  vf_bytes_per_sec;   /* simulated bus speed, 0 means unlimited */
+    unsigned  vf_origin;          /* the scroll register */
+    unsigned  vf_quarters;        /* the entry mode, see fd_rotate() */
+    struct vfbfs_fb_region vf_regions[VFBFS_FB_MAX_REGIONS];   /* the partial images */
+    unsigned  vf_nregions;
+};
+
+static int virtual_fb_open(struct vfbfs_fb *fb, const char *args)
+{
+    struct virtual_fb *vf = calloc(1, sizeof(*vf));
+    const char *p;
+
+    if (vf == NULL) {
+        return -1;
+    }
+    if (args != NULL && (p = strstr(args, "bps=")) != NULL) {
+        sscanf(p, "bps=%" SCNu64, &vf->vf_bytes_per_sec);
+    }
+    if (args != NULL && (p = strstr(args, "panel=")) != NULL
+            && (sscanf(p, "panel=%ux%u", &fb->fb_dev_width, &fb->fb_dev_height) != 2
+                || fb->fb_dev_width == 0 || fb->fb_dev_height == 0)) {
+        free(vf);
+        return -1;
+    }
+    vf->vf_stride = fb->fb_dev_width * vfbfs_fb_format_bpp(fb->fb_dev_format);
+    vf->vf_gram   = calloc(fb->fb_dev_height, vf->vf_stride);
+    if (vf->vf_gram == NULL) {
+        free(vf);
+        return -1;
+    }
+    fb->fb_dev_private = vf;
+    return 0;
+}
+
+static int virtual_fb_flush(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r
+    , const void *pixels, size_t stride)
+{
+    struct virtual_fb *vf = (struct virtual_fb *)fb->fb_dev_private;
+    unsigned bpp = vfbfs_fb_format_bpp(fb->fb_dev_format), y;
+    const char *src = (const char *)pixels;
+    struct vfbfs_fb_rect px, g;
+    uint64_t ns;
+    struct timespec ts;
+    unsigned x;
+
+    for (y = r->r_y0; y < r->r_y1; y++, src += stride) {
+        if (vf->vf_quarters == 0) {
+            memcpy(vf->vf_gram + y * vf->vf_stride + r->r_x0 * bpp, src, stride);
+            continue;
+        }
+        /* The address counter walks the GRAM turned */
+        for (x = r->r_x0; x < r->r_x1; x++) {
+            px = (struct vfbfs_fb_rect){ x, y, x + 1, y + 1 };
+            vfbfs_fb_rect_turn(&g, &px, vf->vf_quarters, fb->fb_dev_width, fb->fb_dev_height);
+            memcpy(vf->vf_gram + g.r_y0 * vf->vf_stride + g.r_x0 * bpp, src + (x - r->r_x0) * bpp, bpp);
+        }
+    }
+    if (vf->vf_bytes_per_sec != 0) {
+        ns = stride * (r->r_y1 - r->r_y0) * 1000000000ULL / vf->vf_bytes_per_sec;
+        ts.tv_sec  = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+static int virtual_fb_scroll(struct vfbfs_fb *fb, unsigned origin)
+{
+    struct virtual_fb *vf = (struct virtual_fb *)fb->fb_dev_private;
+    vf->vf_origin = origin;
+    return 0;
+}
+
+static int virtual_fb_rotate(struct vfbfs_fb *fb, unsigned quarters)
+{
+    struct virtual_fb *vf = (struct virtual_fb *)fb->fb_dev_private;
+    vf->vf_quarters = quarters & 3;
+    return 0;
+}
+
+static int virtual_fb_regions(struct vfbfs_fb *fb, const struct vfbfs_fb_region *regions, unsigned n)
+{
+    struct virtual_fb *vf = (struct virtual_fb *)fb->fb_dev_private;
+    memcpy(vf->vf_regions, regions, n * sizeof(*regions));
+    vf->vf_nregions = n;
+    return 0;
+}
+
+static void virtual_fb_close(struct vfbfs_fb *fb)
+{
+    struct virtual_fb *vf = (struct virtual_fb *)fb->fb_dev_private;
+    if (vf != NULL) {
+        free(vf->vf_gram);
+        free(vf);
+        fb->fb_dev_private = NULL;
+    }
+}
+
+static struct vfbfs_fb_device_ops virtual_fb_oprs = {
+    .fd_name    = "virtual",
+    .fd_open    = virtual_fb_open,
+    .fd_flush   = virtual_fb_flush,
+    .fd_scroll  = virtual_fb_scroll,
+    .fd_regions = virtual_fb_regions,
+    .fd_rotate  = virtual_fb_rotate,
+    .fd_close   = virtual_fb_close,
+};
+
+static void __attribute__((constructor)) virtual_fb_register(void)
+{
+    vfbfs_fb_device_register(&virtual_fb_oprs);
+}
@@ -19,6 +19,7 @@
  */
 
 #include <vfbfs.h>
+#include <gen.h>
 
 #include <stdlib.h>
 #include <fcntl.h>
@@ -38,14 +39,14 @@ int vfbfs_gen_dir_open(struct vfbfs *fs, struct vfbfs_dir *d, const char *path,
 int vfbfs_gen_dir_read(struct vfbfs *fs, struct vfbfs_dir *dir
     , const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi)
 {
-    pthread_rwlock_rdlock(&dir->d_rwlock);
+    vfbfs_rwlock_rdlock(&dir->d_rwlock, VFBFS_LC_D_RWLOCK);
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
     struct vfbfs_entry *e;
     RB_FOREACH(e, VFBFS_ENTRY_TREE, &dir->d_entries) {
         filler(buf, e->e_name, NULL, 0);
     }
-    pthread_rwlock_unlock(&dir->d_rwlock);
+    vfbfs_rwlock_unlock(&dir->d_rwlock, VFBFS_LC_D_RWLOCK);
     return 0;
 }
 
@@ -60,6 +61,17 @@ int vfbfs_gen_dir_create(struct vfbfs *fs, struct vfbfs_dir *dir
     return -EIO;
 }
 
+int vfbfs_gen_dir_mkdir(struct vfbfs *fs, struct vfbfs_dir *dir
+    , const char *path, const char *dname, mode_t mode)
+{
+    struct vfbfs_dir *d = vfbfs_dir_create_in(fs, dir, dname);
+    if (d != NULL) {
+        vfbfs_entry_set_mode(d->d_entry, mode);
+        return 0;
+    }
+    return -EIO;
+}
+
 struct vfbfs_dir *vfbfs_get_rootdir(struct vfbfs *fs)
 {
     if (fs != NULL && fs->fs_superblock != NULL && fs->fs_superblock->sb_root != NULL) {
@@ -93,6 +105,7 @@ struct vfbfs_dir *vfbfs_dir_alloc(struct vfbfs *fs)
 
 static struct vfbfs_dir_ops vfbfs_dir_gen_oprs = {
     .d_create   = vfbfs_gen_dir_create,
+    .d_mkdir    = vfbfs_gen_dir_mkdir,
     .d_read     = vfbfs_gen_dir_read,
     .d_open     = vfbfs_gen_dir_open,
     .d_close    = NULL,
@@ -104,6 +117,21 @@ struct vfbfs_dir_ops *vfbfs_dir_get_generic_ops(void)
     return &vfbfs_dir_gen_oprs;
 }
 
+/* For directories whose entries are only made by the daemon, nothing can be created or moved in */
+static struct vfbfs_dir_ops vfbfs_dir_fixed_oprs = {
+    .d_create   = NULL,
+    .d_mkdir    = NULL,
+    .d_read     = vfbfs_gen_dir_read,
+    .d_open     = vfbfs_gen_dir_open,
+    .d_close    = NULL,
+    .d_getattr  = NULL,
+};
+
+struct vfbfs_dir_ops *vfbfs_dir_get_fixed_ops(void)
+{
+    return &vfbfs_dir_fixed_oprs;
+}
+
 struct vfbfs_dir *vfbfs_dir_new(struct vfbfs *fs, char *name)
 {
     struct vfbfs_entry *e = vfbfs_entry_dir_alloc(fs);
@@ -141,8 +169,8 @@ vfbfs_dir_add_to(struct vfbfs *fs, struct vfbfs_dir *parent, struct vfbfs_dir *d
         if (vfbfs_entry_add_to(fs, parent, e) != 0) {
             return NULL;
         }
-        pthread_rwlock_wrlock(&d->d_rwlock);
-        pthread_rwlock_rdlock(&parent->d_rwlock);
+        vfbfs_rwlock_wrlock(&d->d_rwlock, VFBFS_LC_D_RWLOCK);
+        vfbfs_rwlock_rdlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
         /* Inherit everything from the parent, (overwriting superblock inheritance) */
         d->d_dentry_oprs = parent->d_dentry_oprs;
         d->d_dfile_oprs  = parent->d_dfile_oprs;
@@ -150,8 +178,8 @@ vfbfs_dir_add_to(struct vfbfs *fs, struct vfbfs_dir *parent, struct vfbfs_dir *d
         d->d_superblock  = parent->d_superblock;
 
         d->d_oprs        = parent->d_ddir_oprs;
-        pthread_rwlock_unlock(&parent->d_rwlock);
-        pthread_rwlock_unlock(&d->d_rwlock);
+        vfbfs_rwlock_unlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
+        vfbfs_rwlock_unlock(&d->d_rwlock, VFBFS_LC_D_RWLOCK);
     }
     return d;
 }
@@ -166,6 +194,47 @@ vfbfs_dir_create_in(struct vfbfs *fs, struct vfbfs_dir *parent, const char *dnam
     return vfbfs_dir_add_to(fs, parent, d);
 }
 
+/* Frees d, its entry and everything in it, returns the number of files freed */
+static size_t vfbfs_dir_free_tree(struct vfbfs *fs, struct vfbfs_dir *d)
+{
+    struct vfbfs_entry *e;
+    struct vfbfs_file *f;
+    size_t nfiles = 0;
+
+    while ((e = RB_MIN(VFBFS_ENTRY_TREE, &d->d_entries)) != NULL) {
+        RB_REMOVE(VFBFS_ENTRY_TREE, &d->d_entries, e);
+        if ((f = vfbfs_entry_get_file(e)) != NULL) {
+            vfbfs_gen_free(f);
+            vfbfs_file_free(fs, f);
+            nfiles++;
+        } else if (vfbfs_entry_is_dir(e)) {
+            nfiles += vfbfs_dir_free_tree(fs, e->e_elem.dir);
+        }
+    }
+    e = d->d_entry;
+    pthread_rwlock_destroy(&d->d_rwlock);
+    pthread_mutex_destroy(&e->e_wlock);
+    free(e->e_name);
+    free(e);
+    free(d);
+    return nfiles;
+}
+
+/*
+ * Frees a directory which is already out of its parent's tree and which
+ * nothing can reach any more, with everything in it. Like an unlink, its
+ * files are taken off sb_file_count.
+*/
+void vfbfs_dir_free(struct vfbfs *fs, struct vfbfs_dir *d)
+{
+    struct vfbfs_superblock *sb = fs->fs_superblock;
+    size_t nfiles = vfbfs_dir_free_tree(fs, d);
+
+    vfbfs_mutex_lock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+    sb->sb_file_count -= nfiles;
+    vfbfs_mutex_unlock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+}
+
 int vfbfs_dir_call_operation_va_with(struct vfbfs *fs, struct vfbfs_dir *dir
                     , struct vfbfs_dir_ops *oprs, enum VfbfsDirOperation op, va_list ap)
 {
@@ -192,7 +261,14 @@ int vfbfs_dir_call_operation_va_with(struct vfbfs *fs, struct vfbfs_dir *dir
             return oprs->d_create(fs, dir, path, fname, mode
                 , va_arg(ap, struct fuse_file_info *));
         }
-        break;
+        return -EPERM;
+
+        case VFBFS_D_MKDIR:
+        if (oprs->d_mkdir != NULL) {
+            fname = va_arg(ap, const char *);
+            return oprs->d_mkdir(fs, dir, path, fname, va_arg(ap, mode_t));
+        }
+        return -EPERM;
 
         case VFBFS_D_OPEN:
         if (oprs->d_open != NULL) {
@@ -0,0 +1,877 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Framebuffers. Every framebuffer is a directory under /fb:
+ *
+ *   /fb/<n>/frame   raw pixels, fb_stride * fb_vheight bytes, fbdev ioctls
+ *   /fb/<n>/info    geometry and format, as 'key value' lines
+ *   /fb/<n>/stats   flushing statistics, as 'key value' lines
+ *   /fb/<n>/stream  write-only queue of whole frames, see fbstream.c
+ *   /fb/<n>/events  vsync, flush and flip notifications, see fbpoll.c
+ *   /fb/<n>/scroll  the scroll origin of the shown page, see fbscroll.c
+ *   /fb/<n>/regions static rows which are flushed on demand, see fbregion.c
+ *   /fb/<n>/cmd     write-only batches of drawing commands, see fbcmd.c
+ *   /fb/<n>/console write-only text console, drawn with /fb/<n>/font, see fbcons.c
+ *   /fb/<n>/image   write-only, shows PPM, BMP and PNG images, see fbimage.c
+ *   /fb/<n>/snapshot.ppm, snapshot.png
+ *                   the screen as an image, encoded once per change, see fbsnap.c
+ *   /fb/<n>/history the last flushed screens, see fbhist.c
+ *   /fb/<n>/layers  pixels blended over the frame on the device, see fblayer.c
+ *   /fb/<n>/tiles   when each 32x32 tile last changed, see fbtile.c
+ *   /fb/<n>/color   matrix and tables correcting the flushed colors, see fbcolor.c
+ *   /fb/<n>/dither  how the colors are reduced for an RGB565 device, see fbdither.c
+ *   /fb/<n>/transform
+ *                   scaling and rotation to the panel's geometry, see fbxform.c
+ *
+ * Writes to the frame only damage the framebuffer, the flush thread pushes
+ * the damaged rectangle to the device on the next vsync tick. An fsync()
+ * on the frame waits until every earlier write reached the device. A file
+ * of the frame's size renamed onto it becomes the new frame as a whole,
+ * its buffer is swapped in without a copy.
+*/
+#include <fb.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+static struct vfbfs_fb_device_ops *fb_devices = NULL;
+
+static inline uint64_t fb_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void vfbfs_fb_rect_union(struct vfbfs_fb_rect *dst, const struct vfbfs_fb_rect *r)
+{
+    if (vfbfs_fb_rect_empty(r)) {
+        return;
+    }
+    if (vfbfs_fb_rect_empty(dst)) {
+        *dst = *r;
+        return;
+    }
+    dst->r_x0 = MIN(dst->r_x0, r->r_x0);
+    dst->r_y0 = MIN(dst->r_y0, r->r_y0);
+    dst->r_x1 = MAX(dst->r_x1, r->r_x1);
+    dst->r_y1 = MAX(dst->r_y1, r->r_y1);
+}
+
+/* Drivers register themselves from a constructor, see devices/ */
+void vfbfs_fb_device_register(struct vfbfs_fb_device_ops *ops)
+{
+    ops->fd_next = fb_devices;
+    fb_devices   = ops;
+}
+
+struct vfbfs_fb_device_ops *vfbfs_fb_device_find(const char *name)
+{
+    struct vfbfs_fb_device_ops *ops;
+    for (ops = fb_devices; ops != NULL; ops = ops->fd_next) {
+        if (strcmp(ops->fd_name, name) == 0) {
+            return ops;
+        }
+    }
+    return NULL;
+}
+
+struct vfbfs_fb *vfbfs_fb_from_file(struct vfbfs_file *f)
+{
+    return (f != NULL) ? (struct vfbfs_fb *)f->f_private : NULL;
+}
+
+/* Row of the shown page, with fb_lock held */
+static inline char *fb_page_row(struct vfbfs_fb *fb, unsigned row)
+{
+    return fb->fb_frame->f_content + (row + fb->fb_yoffset) * fb->fb_stride;
+}
+
+/*
+ * Returns the address of the pixel shown at (x, y) on the screen and the
+ * number of pixels which are contiguous in memory from there. Must be called
+ * with fb_lock held.
+*/
+void *vfbfs_fb_span(struct vfbfs_fb *fb, unsigned x, unsigned y, unsigned *npix)
+{
+    if (npix != NULL) {
+        *npix = fb->fb_width - x;
+    }
+    return fb_page_row(fb, (y + fb->fb_scroll) % fb->fb_height) + x * fb->fb_bpp;
+}
+
+/* Damages a rectangle of the shown page, must be called with fb_lock held */
+void vfbfs_fb_damage(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r)
+{
+    struct vfbfs_fb_rect c = {
+        .r_x0 = MIN(r->r_x0, fb->fb_width),  .r_y0 = MIN(r->r_y0, fb->fb_height),
+        .r_x1 = MIN(r->r_x1, fb->fb_width),  .r_y1 = MIN(r->r_y1, fb->fb_height),
+    };
+    if (vfbfs_fb_rect_empty(&c)) {
+        return;
+    }
+    if (vfbfs_fb_rect_empty(&fb->fb_damage)) {
+        fb->fb_damage_since = fb_now();
+    }
+    vfbfs_fb_rect_union(&fb->fb_damage, &c);
+    fb->fb_write_seq++;
+    vfbfs_fb_tiles_damage_locked(fb, &c);
+    fb->fb_stats.st_writes++;
+}
+
+/*
+ * Damages a rectangle in screen coordinates, with fb_lock held. The rows
+ * are mapped through the scroll origin, a rectangle wrapping around the
+ * end of the page damages every row.
+*/
+void vfbfs_fb_damage_screen(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r)
+{
+    struct vfbfs_fb_rect p = *r;
+    unsigned h = fb->fb_height;
+    if (vfbfs_fb_rect_empty(r) || r->r_y0 >= h) {
+        return;
+    }
+    p.r_y1 = MIN(r->r_y1, h);
+    p.r_y0 = (r->r_y0 + fb->fb_scroll) % h;
+    p.r_y1 = p.r_y0 + (p.r_y1 - r->r_y0);
+    if (p.r_y1 > h) {
+        p.r_y0 = 0;
+        p.r_y1 = h;
+    }
+    vfbfs_fb_damage(fb, &p);
+}
+
+/*
+ * Damages the visible rows covered by a byte range of the virtual buffer,
+ * with fb_lock held. Writes outside of the visible area are only counted.
+*/
+void vfbfs_fb_damage_bytes(struct vfbfs_fb *fb, off_t off, size_t size)
+{
+    struct vfbfs_fb_rect r;
+    unsigned y0, y1;
+    if (size == 0) {
+        return;
+    }
+    y0 = off / fb->fb_stride;
+    y1 = (off + size - 1) / fb->fb_stride + 1;
+    if (y1 <= fb->fb_yoffset || y0 >= fb->fb_yoffset + fb->fb_height) {
+        fb->fb_write_seq++;
+        fb->fb_stats.st_writes++;
+        return;
+    }
+    r.r_y0 = MAX(y0, fb->fb_yoffset) - fb->fb_yoffset;
+    r.r_y1 = MIN(y1, fb->fb_yoffset + fb->fb_height) - fb->fb_yoffset;
+    if (y1 - y0 == 1) {
+        /* Within one row, only the touched pixels */
+        r.r_x0 = (off % fb->fb_stride) / fb->fb_bpp;
+        r.r_x1 = ((off + size - 1) % fb->fb_stride) / fb->fb_bpp + 1;
+    } else {
+        r.r_x0 = 0;
+        r.r_x1 = fb->fb_width;
+    }
+    vfbfs_fb_damage(fb, &r);
+}
+
+/* Waits until the write with the given sequence number is on the device */
+int vfbfs_fb_wait_flush(struct vfbfs_fb *fb, uint64_t seq)
+{
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    while (fb->fb_running && fb->fb_flush_seq < seq) {
+        vfbfs_cond_wait(&fb->fb_cond, &fb->fb_lock, VFBFS_LC_FB_LOCK);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+/* Waits for the next vsync tick */
+int vfbfs_fb_wait_vsync(struct vfbfs_fb *fb)
+{
+    uint64_t vsyncs;
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    vsyncs = fb->fb_stats.st_vsyncs;
+    while (fb->fb_running && fb->fb_stats.st_vsyncs == vsyncs) {
+        vfbfs_cond_wait(&fb->fb_cond, &fb->fb_lock, VFBFS_LC_FB_LOCK);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+/*
+ * Shows the rows from yoffset of the virtual buffer, nothing is copied.
+ * The flush thread pushes the new view on the next vsync.
+*/
+int vfbfs_fb_pan(struct vfbfs_fb *fb, unsigned yoffset)
+{
+    struct vfbfs_fb_rect all = { 0, 0, fb->fb_width, fb->fb_height };
+    if (yoffset > fb->fb_vheight - fb->fb_height) {
+        return -EINVAL;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    if (fb->fb_yoffset != yoffset) {
+        fb->fb_yoffset = yoffset;
+        fb->fb_flip_seq++;
+        vfbfs_fb_damage(fb, &all);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+/*
+ * Maps damaged page rows to screen rows, for the devices which cannot
+ * scroll. Rows wrapping around the origin are cut in two, the number of
+ * screen rectangles stored in parts is returned.
+*/
+static unsigned fb_page_to_screen(struct vfbfs_fb *fb, unsigned origin, const struct vfbfs_fb_rect *r
+    , struct vfbfs_fb_rect *parts)
+{
+    unsigned h = fb->fb_height;
+    if (r->r_y0 < origin && origin < r->r_y1) {
+        parts[0] = *r;
+        parts[0].r_y0 = 0;
+        parts[0].r_y1 = r->r_y1 - origin;
+        parts[1] = *r;
+        parts[1].r_y0 = r->r_y0 + h - origin;
+        parts[1].r_y1 = h;
+        return 2;
+    }
+    parts[0] = *r;
+    parts[0].r_y0 = (r->r_y0 + h - origin) % h;
+    parts[0].r_y1 = parts[0].r_y0 + (r->r_y1 - r->r_y0);
+    return 1;
+}
+
+/* The scroll origin for the device, the transformed screen is scrolled in software */
+static inline unsigned fb_device_origin(struct vfbfs_fb *fb)
+{
+    return vfbfs_fb_xform_active_locked(fb) ? 0 : fb->fb_scroll;
+}
+
+/* True if the device has to be told about a new scroll origin, new regions or a rotation */
+static inline bool fb_device_pending(struct vfbfs_fb *fb)
+{
+    return (fb->fb_dev_oprs->fd_scroll != NULL && fb_device_origin(fb) != fb->fb_dev_scroll)
+        || (fb->fb_dev_oprs->fd_regions != NULL && fb->fb_regions_seq != fb->fb_dev_regions_seq)
+        || (fb->fb_dev_oprs->fd_rotate != NULL && vfbfs_fb_xform_quarters_locked(fb) != fb->fb_dev_rotate);
+}
+
+/*
+ * Pixels [x0, x0 + npix) of page row 'row' as they go to the device, with
+ * the layers and the color correction applied. Called by the flush thread
+ * with fb_lock held, the result may be in fb_row.
+*/
+const void *vfbfs_fb_flush_row_locked(struct vfbfs_fb *fb, unsigned row, unsigned x0, unsigned npix
+    , enum VfbfsFbFormat *sfmt)
+{
+    const char *src = fb_page_row(fb, row) + x0 * fb->fb_bpp;
+
+    *sfmt = fb->fb_format;
+    if (vfbfs_fb_layers_compose_locked(fb, fb->fb_row, (row + fb->fb_height - fb->fb_scroll) % fb->fb_height
+            , x0, npix)) {
+        src   = (const char *)fb->fb_row;
+        *sfmt = VFBFS_FB_XRGB8888;
+    }
+    if (vfbfs_fb_color_apply_locked(fb, fb->fb_row, src, *sfmt, npix)) {
+        src   = (const char *)fb->fb_row;
+        *sfmt = VFBFS_FB_XRGB8888;
+    }
+    return src;
+}
+
+/*
+ * Converts the damaged area into fb_staging and hands it to the driver,
+ * called from the flush thread with fb_lock held. The lock is dropped while
+ * the driver works, so writers are never blocked by a slow device. The
+ * static regions are cut out of the damage (see fbregion.c), and a new
+ * scroll origin is pushed after the pixels, so the rows it exposes are
+ * already there when the panel shows them. A rotation is pushed before
+ * them, they are already turned.
+*/
+static void fb_flush_locked(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_device_ops *dev = fb->fb_dev_oprs;
+    struct vfbfs_fb_rect r = fb->fb_damage, *parts = fb->fb_flush_parts;
+    struct vfbfs_fb_region regions[VFBFS_FB_MAX_REGIONS];
+    uint64_t seq = fb->fb_write_seq, since = fb->fb_damage_since, rseq = fb->fb_regions_seq;
+    uint64_t start, end;
+    unsigned dbpp = vfbfs_fb_format_bpp(fb->fb_dev_format), origin = fb->fb_scroll;
+    unsigned dorigin = fb_device_origin(fb), quarters = vfbfs_fb_xform_quarters_locked(fb);
+    unsigned nregions = fb->fb_nregions, nparts = 0, ntiles, i, y, row, x0, npix;
+    enum VfbfsFbFormat sfmt;
+    const void *src;
+    bool xform = vfbfs_fb_xform_active_locked(fb);
+    bool scroll = dev->fd_scroll != NULL && dorigin != fb->fb_dev_scroll;
+    bool reg = dev->fd_regions != NULL && rseq != fb->fb_dev_regions_seq;
+    bool rotate = dev->fd_rotate != NULL && quarters != fb->fb_dev_rotate;
+    size_t dstride, bytes = 0;
+    char *dst = fb->fb_staging;
+
+    memset(&fb->fb_damage, 0, sizeof(fb->fb_damage));
+    memcpy(regions, fb->fb_regions, sizeof(regions));
+    vfbfs_fb_history_capture_locked(fb, &r);
+    ntiles = vfbfs_fb_tiles_split_locked(fb, &r, fb->fb_tile_rects);
+    if (xform || (dev->fd_scroll == NULL && origin != 0)) {
+        /* Scrolled in software, the regions don't apply */
+        for (i = 0; i < ntiles; i++) {
+            nparts += fb_page_to_screen(fb, origin, &fb->fb_tile_rects[i], parts + nparts);
+        }
+    } else if (ntiles > 0) {
+        nparts = vfbfs_fb_regions_split_locked(fb, fb->fb_tile_rects, ntiles, parts);
+    }
+    if (xform) {
+        nparts   = vfbfs_fb_xform_fit_locked(fb, parts, nparts);
+        nregions = 0;
+    }
+    for (i = 0; i < nparts; i++) {
+        if (xform) {
+            /* Scaled and turned for the panel, see fbxform.c */
+            dst = vfbfs_fb_xform_part_locked(fb, &parts[i], dst);
+            continue;
+        }
+        x0      = parts[i].r_x0;
+        npix    = parts[i].r_x1 - x0;
+        dstride = npix * dbpp;
+        for (y = parts[i].r_y0; y < parts[i].r_y1; y++, dst += dstride) {
+            row = (dev->fd_scroll != NULL) ? y : (y + origin) % fb->fb_height;
+            src = vfbfs_fb_flush_row_locked(fb, row, x0, npix, &sfmt);
+            vfbfs_fb_dither_row_locked(fb, dst, src, sfmt, npix, x0, y, y - parts[i].r_y0);
+        }
+        vfbfs_fb_dither_part_locked(fb, dst - dstride * (parts[i].r_y1 - parts[i].r_y0), dstride
+            , npix, parts[i].r_y1 - parts[i].r_y0, x0, parts[i].r_y0);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    start = fb_now();
+    if (rotate) {
+        dev->fd_rotate(fb, quarters);
+        fb->fb_dev_rotate = quarters;
+    }
+    for (dst = fb->fb_staging, i = 0; i < nparts; i++) {
+        dstride = (parts[i].r_x1 - parts[i].r_x0) * dbpp;
+        if (dev->fd_flush != NULL) {
+            dev->fd_flush(fb, &parts[i], dst, dstride);
+        }
+        bytes += dstride * (parts[i].r_y1 - parts[i].r_y0);
+        dst   += dstride * (parts[i].r_y1 - parts[i].r_y0);
+    }
+    if (reg) {
+        dev->fd_regions(fb, regions, nregions);
+        fb->fb_dev_regions_seq = rseq;
+    }
+    if (scroll) {
+        dev->fd_scroll(fb, dorigin);
+        fb->fb_dev_scroll = dorigin;
+    }
+    end = fb_now();
+    vfbfs_fb_history_record(fb);
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    fb->fb_flush_seq = seq;
+    fb->fb_stats.st_scrolls += scroll;
+    if (nparts == 0) {
+        return;
+    }
+    fb->fb_stats.st_flushes++;
+    fb->fb_stats.st_flushed_bytes += bytes;
+    fb->fb_stats.st_flush_ns      += end - start;
+    fb->fb_stats.st_latency_ns    += end - since;
+    fb->fb_stats.st_latency_max_ns = MAX(fb->fb_stats.st_latency_max_ns, end - since);
+}
+
+static void *fb_flush_thread(void *arg)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)arg;
+    uint64_t period = 1000000000ULL / fb->fb_refresh_hz;
+    uint64_t next = fb_now() + period;
+    struct timespec ts;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    while (fb->fb_running) {
+        ts.tv_sec  = next / 1000000000ULL;
+        ts.tv_nsec = next % 1000000000ULL;
+        if (vfbfs_cond_timedwait(&fb->fb_cond, &fb->fb_lock, &ts, VFBFS_LC_FB_LOCK) != ETIMEDOUT) {
+            continue;
+        }
+        fb->fb_stats.st_vsyncs++;
+        fb->fb_vsync_ns = fb_now();
+        vfbfs_fb_stream_next(fb);
+        if (!vfbfs_fb_rect_empty(&fb->fb_damage) || fb_device_pending(fb)) {
+            fb_flush_locked(fb);
+        } else {
+            /* Only writes outside of the visible area, nothing to push */
+            fb->fb_flush_seq = fb->fb_write_seq;
+        }
+        pthread_cond_broadcast(&fb->fb_cond);
+        vfbfs_fb_poll_wake_locked(fb);
+        /* Skip the missed ticks if the device was too slow */
+        next += period;
+        if (next < fb_now()) {
+            next = fb_now() + period;
+        }
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return NULL;
+}
+
+/*
+ * Frame bytes copied ahead for a streaming reader (see vfbfs_handle_readahead()),
+ * valid while fb_write_seq is ra_seq. Serving the next reads from here takes
+ * fb_lock once per window instead of once per read.
+*/
+struct fb_readahead {
+    uint64_t    ra_seq;
+    off_t       ra_off;
+    size_t      ra_len;
+    char        ra_data[];
+};
+
+static int fb_frame_read_ahead(struct vfbfs_fb *fb, struct vfbfs_file *f, struct vfbfs_handle *h
+    , char *data, size_t size, off_t off)
+{
+    struct fb_readahead *ra;
+    size_t window;
+
+    vfbfs_mutex_lock(&h->h_lock, VFBFS_LC_H_LOCK);
+    if ((ra = h->h_private) == NULL
+            && (ra = h->h_private = calloc(1, sizeof(*ra) + fb->fb_vsize)) == NULL) {
+        vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+        return -ENOMEM;
+    }
+    if (ra->ra_len == 0 || off < ra->ra_off || off + size > ra->ra_off + ra->ra_len
+            || ra->ra_seq != __atomic_load_n(&fb->fb_write_seq, __ATOMIC_ACQUIRE)) {
+        window = vfbfs_handle_readahead(h, size, fb->fb_vsize - off);
+        vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        memcpy(ra->ra_data, f->f_content + off, window);
+        ra->ra_seq = fb->fb_write_seq;
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        ra->ra_off = off;
+        ra->ra_len = window;
+    }
+    memcpy(data, ra->ra_data + (off - ra->ra_off), size);
+    vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+    return size;
+}
+
+static int fb_frame_read(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (off >= fb->fb_vsize) {
+        return 0;
+    }
+    size = MIN(size, fb->fb_vsize - off);
+    if (vfbfs_handle_is_sequential(h) && fb_frame_read_ahead(fb, f, h, data, size, off) == (int)size) {
+        return size;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    memcpy(data, f->f_content + off, size);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return size;
+}
+
+static int fb_frame_write(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    if (off >= fb->fb_vsize) {
+        return -ENOSPC;
+    }
+    size = MIN(size, fb->fb_vsize - off);
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    memcpy(f->f_content + off, data, size);
+    vfbfs_fb_damage_bytes(fb, off, size);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return size;
+}
+
+/* The frame has a fixed size, O_TRUNC is accepted but ignored */
+static int fb_frame_truncate(struct vfbfs *fs, struct vfbfs_file *f, const char *path, off_t size)
+{
+    return 0;
+}
+
+static int fb_frame_fsync(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , int datasync, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    uint64_t seq;
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    seq = fb->fb_write_seq;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return vfbfs_fb_wait_flush(fb, seq);
+}
+
+static int fb_frame_release(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h != NULL) {
+        free(h->h_private);
+        h->h_private = NULL;
+    }
+    return 0;
+}
+
+/*
+ * rename() onto the frame. The frame takes the buffer of from and leaves
+ * its own to it, from is unlinked afterwards.
+*/
+static int fb_frame_replace(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct vfbfs_file *from)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_fb_rect all = { 0, 0, fb->fb_width, fb->fb_height };
+    char *tmp;
+    int r;
+
+    if (vfbfs_file_get_size(from) != fb->fb_vsize) {
+        return -EINVAL;
+    }
+    vfbfs_mutex_lock(&from->f_lock, VFBFS_LC_F_LOCK);
+    /* An image mapping or a buffer shared with clones can't become the frame */
+    if ((r = vfbfs_file_unshare(from, fb->fb_vsize)) != 0) {
+        vfbfs_mutex_unlock(&from->f_lock, VFBFS_LC_F_LOCK);
+        return r;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    tmp = f->f_content;
+    f->f_content         = from->f_content;
+    from->f_content      = tmp;
+    from->f_content_size = fb->fb_vsize;
+    fb->fb_stats.st_renames++;
+    vfbfs_fb_damage(fb, &all);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    vfbfs_mutex_unlock(&from->f_lock, VFBFS_LC_F_LOCK);
+    return 0;
+}
+
+static struct vfbfs_file_ops fb_frame_oprs = {
+    .f_open     = vfbfs_mem_file_open,
+    .f_close    = vfbfs_mem_file_close,
+    .f_read     = fb_frame_read,
+    .f_write    = fb_frame_write,
+    .f_truncate = fb_frame_truncate,
+    .f_fsync    = fb_frame_fsync,
+    .f_release  = fb_frame_release,
+    .f_poll     = vfbfs_fb_frame_poll,
+    .f_ioctl    = vfbfs_fb_ioctl,
+    .f_replace  = fb_frame_replace,
+};
+
+/*
+ * The info and stats files are generated, see gen.h. The info only changes
+ * with the geometry, the stats are rendered at most once per frame period.
+*/
+static int fb_info_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    fprintf(out, "width %u\nheight %u\nformat %s\nbpp %u\nstride %zu\n"
+                 "size %zu\nrefresh_hz %u\ndevice %s\ndevice_format %s\n"
+                 "device_width %u\ndevice_height %u\nvirtual_height %u\nvirtual_size %zu\n"
+        , fb->fb_width, fb->fb_height, vfbfs_fb_format_name(fb->fb_format), fb->fb_bpp
+        , fb->fb_stride, fb->fb_size, fb->fb_refresh_hz, fb->fb_dev_oprs->fd_name
+        , vfbfs_fb_format_name(fb->fb_dev_format), fb->fb_dev_width, fb->fb_dev_height
+        , fb->fb_vheight, fb->fb_vsize);
+    return 0;
+}
+
+static int fb_stats_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_stats st;
+    uint64_t wseq, fseq;
+    unsigned yoffset, scroll;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    st      = fb->fb_stats;
+    wseq    = fb->fb_write_seq;
+    fseq    = fb->fb_flush_seq;
+    yoffset = fb->fb_yoffset;
+    scroll  = fb->fb_scroll;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    fprintf(out, "writes %" PRIu64 "\nflushes %" PRIu64 "\nvsyncs %" PRIu64 "\n"
+                 "flushed_bytes %" PRIu64 "\nlatency_avg_ns %" PRIu64 "\nlatency_max_ns %" PRIu64 "\n"
+                 "flush_avg_ns %" PRIu64 "\nwrite_seq %" PRIu64 "\nflush_seq %" PRIu64 "\n"
+                 "stream_frames %" PRIu64 "\nstream_dropped %" PRIu64 "\n"
+                 "stream_blocked_ns %" PRIu64 "\nyoffset %u\nscroll %u\nscrolls %" PRIu64 "\n"
+                 "static_held %" PRIu64 "\ncmds %" PRIu64 "\nconsole_cells %" PRIu64 "\n"
+                 "console_atlas_misses %" PRIu64 "\nimages %" PRIu64 "\nimage_hits %" PRIu64 "\n"
+                 "layer_pixels %" PRIu64 "\ntile_rects %" PRIu64 "\nxform_pixels %" PRIu64 "\n"
+                 "renames %" PRIu64 "\n"
+        , st.st_writes, st.st_flushes, st.st_vsyncs, st.st_flushed_bytes
+        , st.st_flushes ? st.st_latency_ns / st.st_flushes : 0, st.st_latency_max_ns
+        , st.st_flushes ? st.st_flush_ns / st.st_flushes : 0, wseq, fseq
+        , st.st_stream_frames, st.st_stream_dropped, st.st_stream_blocked_ns, yoffset
+        , scroll, st.st_scrolls, st.st_static_held, st.st_cmds
+        , st.st_cons_cells, st.st_cons_atlas_misses, st.st_images, st.st_image_hits
+        , st.st_layer_pixels, st.st_tile_rects, st.st_xform_pixels, st.st_renames);
+    return 0;
+}
+
+static struct vfbfs_file *fb_file_create(struct vfbfs *fs, struct vfbfs_fb *fb
+    , const char *name, struct vfbfs_file_ops *oprs, mode_t mode)
+{
+    struct vfbfs_file *f = vfbfs_file_create_in(fs, fb->fb_dir, name);
+    if (f != NULL) {
+        f->f_oprs    = oprs;
+        f->f_private = fb;
+        f->f_entry->e_stat.st_mode = S_IFREG | mode;
+    }
+    return f;
+}
+
+static struct vfbfs_file *fb_gen_create(struct vfbfs *fs, struct vfbfs_fb *fb, const char *name
+    , int (*render)(struct vfbfs *, struct vfbfs_file *, void *, FILE *), uint64_t ttl_ns)
+{
+    struct vfbfs_file *f = vfbfs_gen_create_in(fs, fb->fb_dir, name, render, fb, ttl_ns);
+    if (f != NULL) {
+        f->f_entry->e_stat.st_mode = S_IFREG | 0444;
+    }
+    return f;
+}
+
+/* Returns /fb, creating it if needed */
+static struct vfbfs_dir *fb_root_dir(struct vfbfs *fs)
+{
+    struct vfbfs_entry *e = vfbfs_entry_lookup(fs, "/fb");
+    if (e != NULL) {
+        return vfbfs_entry_get_dir(e);
+    }
+    return vfbfs_dir_create_in(fs, NULL, "fb");
+}
+
+/*
+ * Undoes a vfbfs_fb_create() which failed half way. Nothing has seen fb
+ * yet: the half-built directory is taken out of /fb, so the index can be
+ * used again, and freed with its files, then fb goes with what the parts
+ * allocated.
+*/
+static void fb_discard(struct vfbfs *fs, struct vfbfs_dir *root, struct vfbfs_fb *fb)
+{
+    if (fb->fb_dir != NULL) {
+        vfbfs_rwlock_wrlock(&root->d_rwlock, VFBFS_LC_D_RWLOCK);
+        RB_REMOVE(VFBFS_ENTRY_TREE, &root->d_entries, fb->fb_dir->d_entry);
+        vfbfs_rwlock_unlock(&root->d_rwlock, VFBFS_LC_D_RWLOCK);
+        vfbfs_dir_free(fs, fb->fb_dir);
+    }
+    vfbfs_fb_tiles_free(fb);
+    vfbfs_fb_history_free(fb);
+    vfbfs_fb_xform_free(fb);
+    /* Nothing is allocated in these before the first write */
+    free(fb->fb_console);
+    free(fb->fb_image);
+    free(fb->fb_layers);
+    free(fb->fb_color);
+    free(fb->fb_staging);
+    free(fb->fb_row);
+    pthread_cond_destroy(&fb->fb_cond);
+    pthread_mutex_destroy(&fb->fb_lock);
+    free(fb->fb_dev_args);
+    free(fb);
+}
+
+/* vheight 0 means no virtual buffer beyond the visible rows */
+struct vfbfs_fb *vfbfs_fb_create(struct vfbfs *fs, int index, unsigned width, unsigned height
+    , unsigned vheight, enum VfbfsFbFormat fmt, unsigned refresh_hz, const char *device)
+{
+    struct vfbfs_superblock *sb = fs->fs_superblock;
+    struct vfbfs_fb_device_ops *dev;
+    struct vfbfs_dir *root = fb_root_dir(fs);
+    const char *args = strchr(device, ':');
+    pthread_condattr_t ca;
+    struct vfbfs_fb *fb;
+    char *dname, name[16];
+    bool opened = false;
+
+    dname = (args != NULL) ? strndup(device, args - device) : strdup(device);
+    dev   = vfbfs_fb_device_find(dname);
+    free(dname);
+    vheight = (vheight != 0) ? vheight : height;
+    if (root == NULL || dev == NULL || width == 0 || height == 0 || refresh_hz == 0
+            || vheight < height) {
+        return NULL;
+    }
+    if ((fb = calloc(1, sizeof(*fb))) == NULL) {
+        return NULL;
+    }
+    fb->fb_index      = index;
+    fb->fb_width      = width;
+    fb->fb_height     = height;
+    fb->fb_format     = fmt;
+    fb->fb_bpp        = vfbfs_fb_format_bpp(fmt);
+    fb->fb_stride     = width * fb->fb_bpp;
+    fb->fb_size       = fb->fb_stride * height;
+    fb->fb_vheight    = vheight;
+    fb->fb_vsize      = fb->fb_stride * vheight;
+    fb->fb_refresh_hz = refresh_hz;
+    fb->fb_dev_oprs   = dev;
+    fb->fb_dev_args   = (args != NULL) ? strdup(args + 1) : NULL;
+    fb->fb_dev_format = fmt;
+    fb->fb_dev_width  = width;
+    fb->fb_dev_height = height;
+    pthread_mutex_init(&fb->fb_lock, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&fb->fb_cond, &ca);
+    pthread_condattr_destroy(&ca);
+
+    snprintf(name, sizeof(name), "%d", index);
+    if ((fb->fb_dir = vfbfs_dir_create_in(fs, root, name)) == NULL) {
+        goto fail;
+    }
+    fb->fb_dir->d_private = fb;
+    fb->fb_frame = fb_file_create(fs, fb, "frame", &fb_frame_oprs, 0666);
+    if (fb->fb_frame == NULL
+            || (fb->fb_frame->f_content = calloc(1, fb->fb_vsize)) == NULL) {
+        goto fail;
+    }
+    fb->fb_frame->f_content_size = fb->fb_vsize;
+    vfbfs_file_set_size(fb->fb_frame, fb->fb_vsize);
+    if (fb_gen_create(fs, fb, "info", fb_info_render, VFBFS_GEN_TTL_FOREVER) == NULL
+            || fb_gen_create(fs, fb, "stats", fb_stats_render, 1000000000ULL / refresh_hz) == NULL
+            || vfbfs_fb_tiles_create(fs, fb) != 0
+            || vfbfs_fb_stream_create(fs, fb) != 0
+            || vfbfs_fb_events_create(fs, fb) != 0
+            || vfbfs_fb_scroll_create(fs, fb) != 0
+            || vfbfs_fb_regions_create(fs, fb) != 0
+            || vfbfs_fb_cmd_create(fs, fb) != 0
+            || vfbfs_fb_console_create(fs, fb) != 0
+            || vfbfs_fb_image_create(fs, fb) != 0
+            || vfbfs_fb_snapshot_create(fs, fb) != 0
+            || vfbfs_fb_history_create(fs, fb) != 0
+            || vfbfs_fb_layers_create(fs, fb) != 0
+            || vfbfs_fb_color_create(fs, fb) != 0
+            || vfbfs_fb_dither_create(fs, fb) != 0) {
+        goto fail;
+    }
+
+    if (dev->fd_open != NULL && dev->fd_open(fb, fb->fb_dev_args) != 0) {
+        syslog(LOG_ERR, "fb%d: cannot open the '%s' device", index, dev->fd_name);
+        goto fail;
+    }
+    opened = dev->fd_open != NULL;
+    if (vfbfs_fb_xform_create(fs, fb) != 0) {
+        goto fail;
+    }
+    /* The screen or the panel, whichever is larger */
+    fb->fb_staging = malloc(MAX((size_t)width * height, (size_t)fb->fb_dev_width * fb->fb_dev_height)
+        * vfbfs_fb_format_bpp(fb->fb_dev_format));
+    fb->fb_row     = malloc((size_t)width * 4);
+    if (fb->fb_staging == NULL || fb->fb_row == NULL) {
+        goto fail;
+    }
+
+    vfbfs_mutex_lock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+    fb->fb_next = sb->sb_fbs;
+    sb->sb_fbs  = fb;
+    vfbfs_mutex_unlock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+    return fb;
+
+fail:
+    if (opened && dev->fd_close != NULL) {
+        dev->fd_close(fb);
+    }
+    fb_discard(fs, root, fb);
+    return NULL;
+}
+
+/*
+ * Creates a framebuffer from a "WxH[/VH][:format][@hz][,device[:args]]"
+ * specification, e.g. "240x320/640:rgb565@60,virtual".
+*/
+struct vfbfs_fb *vfbfs_fb_create_spec(struct vfbfs *fs, const char *spec)
+{
+    struct vfbfs_fb *fb;
+    enum VfbfsFbFormat fmt = VFBFS_FB_RGB565;
+    unsigned width, height, vheight = 0, hz = 60;
+    const char *device = "virtual";
+    char *s = strdup(spec), *p;
+    int index = 0;
+
+    if (s == NULL) {
+        return NULL;
+    }
+    if ((p = strchr(s, ',')) != NULL) {
+        *p = '\0';
+        device = p + 1;
+    }
+    if ((p = strchr(s, '@')) != NULL) {
+        *p = '\0';
+        hz = atoi(p + 1);
+    }
+    if ((p = strchr(s, ':')) != NULL) {
+        *p = '\0';
+        if (vfbfs_fb_format_parse(p + 1, &fmt) != 0) {
+            free(s);
+            return NULL;
+        }
+    }
+    if (sscanf(s, "%ux%u/%u", &width, &height, &vheight) < 2) {
+        free(s);
+        return NULL;
+    }
+    for (fb = fs->fs_superblock->sb_fbs; fb != NULL; fb = fb->fb_next) {
+        index = MAX(index, fb->fb_index + 1);
+    }
+    fb = vfbfs_fb_create(fs, index, width, height, vheight, fmt, hz, device);
+    free(s);
+    return fb;
+}
+
+/* Starts the flush threads, called from the FUSE init */
+int vfbfs_fb_start_all(struct vfbfs *fs)
+{
+    struct vfbfs_fb *fb;
+    int r;
+    for (fb = fs->fs_superblock->sb_fbs; fb != NULL; fb = fb->fb_next) {
+        fb->fb_running = true;
+        if ((r = pthread_create(&fb->fb_thread, NULL, fb_flush_thread, fb)) != 0) {
+            fb->fb_running = false;
+            return -r;
+        }
+    }
+    return 0;
+}
+
+void vfbfs_fb_stop_all(struct vfbfs *fs)
+{
+    struct vfbfs_fb *fb;
+    for (fb = fs->fs_superblock->sb_fbs; fb != NULL; fb = fb->fb_next) {
+        if (!fb->fb_running) {
+            continue;
+        }
+        vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        fb->fb_running = false;
+        pthread_cond_broadcast(&fb->fb_cond);
+        vfbfs_fb_poll_wake_locked(fb);
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        pthread_join(fb->fb_thread, NULL);
+        if (fb->fb_dev_oprs->fd_close != NULL) {
+            fb->fb_dev_oprs->fd_close(fb);
+        }
+    }
+}
@@ -0,0 +1,359 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * /fb/<n>/cmd takes batches of drawing commands (see fbcmd.h), so a client
+ * changing a few widgets sends tens of bytes instead of a frame. A write
+ * runs every complete command it holds in one pass under fb_lock and
+ * damages their bounding box, a command cut by the end of the write is
+ * kept in the handle until the next write. The files the commands read
+ * (images, fonts) are copied before fb_lock is taken, as their locks may
+ * be taken in the other order elsewhere. An invalid command fails the
+ * whole write, nothing of it is drawn.
+*/
+#include <fb.h>
+#include <fbcmd.h>
+#include <font.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static const size_t fb_cmd_sizes[] = {
+    [VFBFS_FB_CMD_FILL] = sizeof(struct vfbfs_fb_cmd_fill),
+    [VFBFS_FB_CMD_LINE] = sizeof(struct vfbfs_fb_cmd_line),
+    [VFBFS_FB_CMD_COPY] = sizeof(struct vfbfs_fb_cmd_copy),
+    [VFBFS_FB_CMD_BLIT] = sizeof(struct vfbfs_fb_cmd_blit),
+    [VFBFS_FB_CMD_TEXT] = sizeof(struct vfbfs_fb_cmd_text),
+};
+
+#define FB_CMD_OP_MAX (sizeof(fb_cmd_sizes) / sizeof(fb_cmd_sizes[0]))
+
+/* A file read by the batch */
+struct fb_cmd_src {
+    char               *cs_path;
+    char               *cs_data;
+    size_t              cs_len;
+    bool                cs_font_ok;
+    struct vfbfs_font   cs_font;
+    struct fb_cmd_src  *cs_next;
+};
+
+/* The bytes of an incomplete command, per open() */
+struct fb_cmd_carry {
+    char               *cc_buf;
+    size_t              cc_len;
+    size_t              cc_size;
+};
+
+static void fb_cmd_src_free(struct fb_cmd_src *s)
+{
+    struct fb_cmd_src *next;
+    for (; s != NULL; s = next) {
+        next = s->cs_next;
+        free(s->cs_path);
+        free(s->cs_data);
+        free(s);
+    }
+}
+
+static struct fb_cmd_src *fb_cmd_src_find(struct fb_cmd_src *s, const char *path)
+{
+    for (; s != NULL && strcmp(s->cs_path, path) != 0; s = s->cs_next)
+        ;
+    return s;
+}
+
+/*
+ * Copies the content of path into *sp, once per batch. Only plain files are
+ * read, the content of the others (a frame) is under locks of their own.
+*/
+static int fb_cmd_src_get(struct vfbfs *fs, struct fb_cmd_src **list, const char *path
+    , struct fb_cmd_src **sp)
+{
+    struct fb_cmd_src *s = fb_cmd_src_find(*list, path);
+    struct vfbfs_file *f;
+    int r = 0;
+
+    if ((*sp = s) != NULL) {
+        return 0;
+    }
+    /* The reference keeps an unlink() from freeing f while it's copied */
+    if ((f = vfbfs_file_get(fs, path)) == NULL) {
+        return -ENOENT;
+    }
+    if (f->f_oprs != vfbfs_file_get_mem_ops()) {
+        r = -EINVAL;
+        goto put;
+    }
+    if ((s = calloc(1, sizeof(*s))) == NULL || (s->cs_path = strdup(path)) == NULL) {
+        free(s);
+        r = -ENOMEM;
+        goto put;
+    }
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    s->cs_len = (f->f_content != NULL) ? f->f_content_size : 0;
+    if (s->cs_len > 0 && (s->cs_data = malloc(s->cs_len)) != NULL) {
+        memcpy(s->cs_data, f->f_content, s->cs_len);
+    }
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    if (s->cs_len > 0 && s->cs_data == NULL) {
+        fb_cmd_src_free(s);
+        r = -ENOMEM;
+        goto put;
+    }
+    s->cs_font_ok = vfbfs_font_parse(&s->cs_font, s->cs_data, s->cs_len) == 0;
+    s->cs_next = *list;
+    *list      = s;
+    *sp        = s;
+put:
+    vfbfs_file_put(fs, f);
+    return r;
+}
+
+/* The path following the fixed part of a command, or NULL if it is not terminated */
+static const char *fb_cmd_path(const char *cmd, size_t fixed, size_t len)
+{
+    return (memchr(cmd + fixed, '\0', len - fixed) != NULL) ? cmd + fixed : NULL;
+}
+
+/*
+ * Validates the commands in buf and loads the files they read. Returns the
+ * length of the complete commands or -errno.
+*/
+static int fb_cmd_prepare(struct vfbfs *fs, struct vfbfs_fb *fb, const char *buf, size_t len
+    , struct fb_cmd_src **srcs)
+{
+    struct vfbfs_fb_cmd_blit blit;
+    struct vfbfs_fb_cmd hdr;
+    struct fb_cmd_src *s;
+    const char *path;
+    size_t off = 0;
+    int r;
+
+    while (len - off >= sizeof(hdr)) {
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        if (hdr.c_op == 0 || hdr.c_op >= FB_CMD_OP_MAX || hdr.c_len < fb_cmd_sizes[hdr.c_op]) {
+            return -EINVAL;
+        }
+        if (hdr.c_len > len - off) {
+            break;
+        }
+        switch (hdr.c_op) {
+        case VFBFS_FB_CMD_BLIT:
+            memcpy(&blit, buf + off, sizeof(blit));
+            if ((path = fb_cmd_path(buf + off, sizeof(blit), hdr.c_len)) == NULL) {
+                return -EINVAL;
+            }
+            if ((r = fb_cmd_src_get(fs, srcs, path, &s)) != 0) {
+                return r;
+            }
+            if (s->cs_len < (size_t)blit.c_w * blit.c_h * fb->fb_bpp) {
+                return -EINVAL;
+            }
+            break;
+        case VFBFS_FB_CMD_TEXT:
+            if ((path = fb_cmd_path(buf + off, sizeof(struct vfbfs_fb_cmd_text), hdr.c_len)) == NULL) {
+                return -EINVAL;
+            }
+            if ((r = fb_cmd_src_get(fs, srcs, path, &s)) != 0) {
+                return r;
+            }
+            if (!s->cs_font_ok) {
+                return -EINVAL;
+            }
+            break;
+        }
+        off += hdr.c_len;
+    }
+    return off;
+}
+
+static void fb_cmd_text_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_cmd_text *t
+    , const struct vfbfs_font *fn, const char *text, size_t len, struct vfbfs_fb_rect *damage)
+{
+    uint32_t fg = vfbfs_fb_color(fb, t->c_fg), bg = vfbfs_fb_color(fb, t->c_bg);
+    unsigned x = t->c_x, y = t->c_y;
+    struct vfbfs_fb_rect r;
+    size_t i;
+
+    for (i = 0; i < len && text[i] != '\0'; i++) {
+        if (text[i] == '\n') {
+            x  = t->c_x;
+            y += fn->fn_height;
+            continue;
+        }
+        vfbfs_fb_glyph_locked(fb, fn, (uint8_t)text[i], x, y, fg
+            , (t->c_flags & VFBFS_FB_CMD_TEXT_OPAQUE) ? &bg : NULL, &r);
+        vfbfs_fb_rect_union(damage, &r);
+        x += fn->fn_width;
+    }
+}
+
+/* Runs the prepared commands with fb_lock held, damage gets their bounding box */
+static unsigned fb_cmd_run_locked(struct vfbfs_fb *fb, const char *buf, size_t len
+    , struct fb_cmd_src *srcs, struct vfbfs_fb_rect *damage)
+{
+    struct vfbfs_fb_cmd_fill fill;
+    struct vfbfs_fb_cmd_line line;
+    struct vfbfs_fb_cmd_copy copy;
+    struct vfbfs_fb_cmd_blit blit;
+    struct vfbfs_fb_cmd_text text;
+    struct vfbfs_fb_cmd hdr;
+    struct vfbfs_fb_rect r;
+    struct fb_cmd_src *s;
+    const char *cmd, *path;
+    unsigned count = 0;
+    size_t off;
+
+    for (off = 0; off < len; off += hdr.c_len, count++) {
+        cmd = buf + off;
+        memcpy(&hdr, cmd, sizeof(hdr));
+        switch (hdr.c_op) {
+        case VFBFS_FB_CMD_FILL:
+            memcpy(&fill, cmd, sizeof(fill));
+            r = (struct vfbfs_fb_rect){ fill.c_x, fill.c_y, fill.c_x + fill.c_w, fill.c_y + fill.c_h };
+            vfbfs_fb_fill_locked(fb, &r, vfbfs_fb_color(fb, fill.c_color));
+            break;
+        case VFBFS_FB_CMD_LINE:
+            memcpy(&line, cmd, sizeof(line));
+            vfbfs_fb_line_locked(fb, line.c_x0, line.c_y0, line.c_x1, line.c_y1
+                , vfbfs_fb_color(fb, line.c_color), &r);
+            break;
+        case VFBFS_FB_CMD_COPY:
+            memcpy(&copy, cmd, sizeof(copy));
+            r = (struct vfbfs_fb_rect){ copy.c_dx, copy.c_dy, copy.c_dx + copy.c_w, copy.c_dy + copy.c_h };
+            vfbfs_fb_copy_locked(fb, copy.c_sx, copy.c_sy, &r);
+            break;
+        case VFBFS_FB_CMD_BLIT:
+            memcpy(&blit, cmd, sizeof(blit));
+            s = fb_cmd_src_find(srcs, cmd + sizeof(blit));
+            r = (struct vfbfs_fb_rect){ blit.c_dx, blit.c_dy, blit.c_dx + blit.c_w, blit.c_dy + blit.c_h };
+            vfbfs_fb_blit_locked(fb, &r, s->cs_data, (size_t)blit.c_w * fb->fb_bpp);
+            break;
+        case VFBFS_FB_CMD_TEXT:
+            memcpy(&text, cmd, sizeof(text));
+            path = cmd + sizeof(text);
+            s    = fb_cmd_src_find(srcs, path);
+            memset(&r, 0, sizeof(r));
+            fb_cmd_text_locked(fb, &text, &s->cs_font, path + strlen(path) + 1
+                , hdr.c_len - sizeof(text) - strlen(path) - 1, &r);
+            break;
+        }
+        vfbfs_fb_rect_union(damage, &r);
+    }
+    return count;
+}
+
+static int fb_cmd_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h == NULL) {
+        return -EBADF;
+    }
+    if ((h->h_private = calloc(1, sizeof(struct fb_cmd_carry))) == NULL) {
+        return -ENOMEM;
+    }
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fb_cmd_write(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct vfbfs_fb_rect damage = { 0, 0, 0, 0 };
+    struct fb_cmd_src *srcs = NULL;
+    struct fb_cmd_carry *cc;
+    unsigned count;
+    char *nbuf;
+    int n;
+
+    if (h == NULL || h->h_private == NULL) {
+        return -EBADF;
+    }
+    vfbfs_mutex_lock(&h->h_lock, VFBFS_LC_H_LOCK);
+    cc = h->h_private;
+    if (cc->cc_len + size > cc->cc_size) {
+        if ((nbuf = realloc(cc->cc_buf, cc->cc_len + size)) == NULL) {
+            vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+            return -ENOMEM;
+        }
+        cc->cc_buf  = nbuf;
+        cc->cc_size = cc->cc_len + size;
+    }
+    memcpy(cc->cc_buf + cc->cc_len, data, size);
+    cc->cc_len += size;
+
+    if ((n = fb_cmd_prepare(fs, fb, cc->cc_buf, cc->cc_len, &srcs)) < 0) {
+        /* Drops the batch, the next write starts a new one */
+        cc->cc_len = 0;
+    } else if (n > 0) {
+        vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        count = fb_cmd_run_locked(fb, cc->cc_buf, n, srcs, &damage);
+        vfbfs_fb_damage_screen(fb, &damage);
+        fb->fb_stats.st_cmds += count;
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        memmove(cc->cc_buf, cc->cc_buf + n, cc->cc_len - n);
+        cc->cc_len -= n;
+    }
+    vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+    fb_cmd_src_free(srcs);
+    return (n < 0) ? n : (int)size;
+}
+
+static int fb_cmd_truncate(struct vfbfs *fs, struct vfbfs_file *f, const char *path, off_t size)
+{
+    return 0;
+}
+
+static int fb_cmd_release(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_cmd_carry *cc = (h != NULL) ? h->h_private : NULL;
+    if (cc != NULL) {
+        free(cc->cc_buf);
+        free(cc);
+        h->h_private = NULL;
+    }
+    return 0;
+}
+
+static struct vfbfs_file_ops fb_cmd_oprs = {
+    .f_open     = fb_cmd_open,
+    .f_write    = fb_cmd_write,
+    .f_truncate = fb_cmd_truncate,
+    .f_release  = fb_cmd_release,
+};
+
+int vfbfs_fb_cmd_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f = vfbfs_file_create_in(fs, fb->fb_dir, "cmd");
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    f->f_oprs    = &fb_cmd_oprs;
+    f->f_private = fb;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0222;
+    return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Color correction on the way to the device. The panels' own gamma
+ * registers (see TFTLCD_GAMMA_CTRL* of the ST7781) are fixed at init and
+ * coarse, this stage corrects every flushed pixel instead: a 3x3 matrix
+ * mixing the channels, then a 256-entry table per channel, like the CTM
+ * and gamma LUT of a display controller. The frame keeps the uncorrected
+ * pixels, only the device gets the corrected ones.
+ *
+ * /fb/<n>/color reads the "matrix m00 .. m22" line and a "lut c v0 .. v255"
+ * line per channel. Writing lines changes them, for every flush after:
+ *
+ *   matrix m00 m01 m02 m10 m11 m12 m20 m21 m22
+ *                          r' = m00 r + m01 g + m02 b, g' and b' alike,
+ *                          the coefficients from -16 to 16
+ *   lut r|g|b|rgb v0 .. vN the table, 2 to 256 entries from 0 to 255
+ *                          interpolated linearly to 256
+ *   gamma r|g|b|rgb E      the table of 255 * (v / 255) ^ E
+ *   reset                  no correction
+*/
+#include <fb.h>
+#include <fbvec.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+/* Bound of the matrix coefficients, 3 * 255 * 16 in 16.16 fits in 32 bits */
+#define FB_COLOR_MAX_COEF 16.0
+
+/* Protected by fb_lock */
+struct vfbfs_fb_color {
+    bool        c_on;
+    bool        c_matrix_on;
+    double      c_matrix[9];        /* as written */
+    int32_t     c_fixed[9];         /* c_matrix in 16.16 fixed point */
+    bool        c_lut_on;
+    uint8_t     c_lut[3][256];      /* r, g, b */
+    uint32_t    c_shifted[3][256];  /* c_lut moved to the channel's bits of XRGB8888 */
+};
+
+static const char fb_color_channels[] = "rgb";
+
+static void fb_color_reset(struct vfbfs_fb_color *c)
+{
+    unsigned i, ch;
+    memset(c, 0, sizeof(*c));
+    for (i = 0; i < 3; i++) {
+        c->c_matrix[i * 4] = 1.0;
+    }
+    for (ch = 0; ch < 3; ch++) {
+        for (i = 0; i < 256; i++) {
+            c->c_lut[ch][i] = i;
+        }
+    }
+}
+
+/*
+ * Derives the tables used while flushing from the written ones, the
+ * matrix is finite and within FB_COLOR_MAX_COEF (fb_color_command())
+*/
+static void fb_color_prepare(struct vfbfs_fb_color *c)
+{
+    unsigned i, ch;
+
+    c->c_matrix_on = false;
+    for (i = 0; i < 9; i++) {
+        c->c_fixed[i] = lround(c->c_matrix[i] * 65536.0);
+        c->c_matrix_on |= c->c_fixed[i] != ((i % 4 == 0) ? 65536 : 0);
+    }
+    c->c_lut_on = false;
+    for (ch = 0; ch < 3; ch++) {
+        for (i = 0; i < 256; i++) {
+            /* XRGB8888 is B, G, R, X: red is the third byte */
+            c->c_shifted[ch][i] = (uint32_t)c->c_lut[ch][i] << (16 - 8 * ch);
+            c->c_lut_on |= c->c_lut[ch][i] != i;
+        }
+    }
+    c->c_on = c->c_matrix_on || c->c_lut_on;
+}
+
+/* m r + m g + m b of the 16.16 coefficients, clamped to a byte */
+static inline fb_v4i fb_color_mix(const int32_t *m, fb_v4i r, fb_v4i g, fb_v4i b)
+{
+    fb_v4i v = (((fb_v4i){ 0 } + m[0]) * r + ((fb_v4i){ 0 } + m[1]) * g
+        + ((fb_v4i){ 0 } + m[2]) * b + 32768) >> 16;
+    v &= ~(v >> 31);
+    return (v | (fb_v4i)(v > 255)) & 255;
+}
+
+/* Corrects npix XRGB8888 pixels in place */
+static void fb_color_row(const struct vfbfs_fb_color *c, uint8_t *row, unsigned npix)
+{
+    fb_v4i p, r, g, b;
+    uint32_t px[4];
+    unsigned i, k, n;
+
+    for (i = 0; i < npix; i += 4) {
+        n = MIN(npix - i, 4U);
+        memcpy(px, row + i * 4, n * 4);
+        if (c->c_matrix_on) {
+            memcpy(&p, px, sizeof(p));
+            r = (p >> 16) & 255;
+            g = (p >> 8) & 255;
+            b = p & 255;
+            p = (fb_color_mix(c->c_fixed, r, g, b) << 16) | (fb_color_mix(c->c_fixed + 3, r, g, b) << 8)
+                | fb_color_mix(c->c_fixed + 6, r, g, b);
+            memcpy(px, &p, sizeof(p));
+        }
+        if (c->c_lut_on) {
+            for (k = 0; k < 4; k++) {
+                px[k] = c->c_shifted[0][(px[k] >> 16) & 255] | c->c_shifted[1][(px[k] >> 8) & 255]
+                    | c->c_shifted[2][px[k] & 255];
+            }
+        }
+        memcpy(row + i * 4, px, n * 4);
+    }
+}
+
+/*
+ * Stores npix pixels of src (of the sfmt format) corrected in row as
+ * XRGB8888, called by the flush thread with fb_lock held. Returns false
+ * without touching row if there is nothing to correct.
+*/
+bool vfbfs_fb_color_apply_locked(struct vfbfs_fb *fb, uint8_t *row, const void *src
+    , enum VfbfsFbFormat sfmt, unsigned npix)
+{
+    const struct vfbfs_fb_color *c = fb->fb_color;
+    if (c == NULL || !c->c_on) {
+        return false;
+    }
+    if (src != row) {
+        vfbfs_fb_convert(VFBFS_FB_XRGB8888, row, sfmt, src, npix);
+    }
+    fb_color_row(c, row, npix);
+    return true;
+}
+
+static int fb_color_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_color c;
+    unsigned i, ch;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    c = *fb->fb_color;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    fprintf(out, "matrix");
+    for (i = 0; i < 9; i++) {
+        fprintf(out, " %g", c.c_matrix[i]);
+    }
+    for (ch = 0; ch < 3; ch++) {
+        fprintf(out, "\nlut %c", fb_color_channels[ch]);
+        for (i = 0; i < 256; i++) {
+            fprintf(out, " %u", c.c_lut[ch][i]);
+        }
+    }
+    fputc('\n', out);
+    return 0;
+}
+
+/* The channels of "r", "g", "b" or "rgb" as a mask, 0 if unknown */
+static unsigned fb_color_mask(const char *name)
+{
+    const char *p;
+    if (strcmp(name, "rgb") == 0) {
+        return 7;
+    }
+    if (name[0] == '\0' || name[1] != '\0' || (p = strchr(fb_color_channels, name[0])) == NULL) {
+        return 0;
+    }
+    return 1 << (p - fb_color_channels);
+}
+
+/* Runs one control line on c */
+static int fb_color_command(struct vfbfs_fb_color *c, char *line)
+{
+    unsigned mask, ch, i, j, n = 0;
+    double e[256], x;
+    char cmd[16], chans[8], *p, *end;
+    int off;
+
+    if (sscanf(line, "%15s %n", cmd, &off) < 1) {
+        return -EINVAL;
+    }
+    p = line + off;
+    if (strcmp(cmd, "reset") == 0) {
+        fb_color_reset(c);
+        return 0;
+    }
+    if (strcmp(cmd, "matrix") == 0) {
+        for (i = 0; i < 9; i++, p = end) {
+            e[i] = strtod(p, &end);
+            if (end == p || !isfinite(e[i]) || fabs(e[i]) > FB_COLOR_MAX_COEF) {
+                return -EINVAL;
+            }
+        }
+        memcpy(c->c_matrix, e, sizeof(c->c_matrix));
+        return 0;
+    }
+    if (sscanf(p, "%7s %n", chans, &off) < 1 || (mask = fb_color_mask(chans)) == 0) {
+        return -EINVAL;
+    }
+    p += off;
+    if (strcmp(cmd, "gamma") == 0) {
+        x = strtod(p, &end);
+        if (end == p || !isfinite(x) || x <= 0.0) {
+            return -EINVAL;
+        }
+        for (i = 0; i < 256; i++) {
+            e[i] = 255.0 * pow(i / 255.0, x);
+        }
+        n = 256;
+    } else if (strcmp(cmd, "lut") == 0) {
+        for (; n < 256; n++, p = end) {
+            e[n] = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            if (e[n] < 0 || e[n] > 255) {
+                return -EINVAL;
+            }
+        }
+        if (n < 2) {
+            return -EINVAL;
+        }
+    } else {
+        return -EINVAL;
+    }
+    for (ch = 0; ch < 3; ch++) {
+        if (!(mask & (1 << ch))) {
+            continue;
+        }
+        for (i = 0; i < 256; i++) {
+            x = i * (n - 1) / 255.0;
+            j = MIN((unsigned)x, n - 2);
+            c->c_lut[ch][i] = lround(e[j] + (e[j + 1] - e[j]) * (x - j));
+        }
+    }
+    return 0;
+}
+
+static int fb_color_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_rect all = { 0, 0, fb->fb_width, fb->fb_height };
+    struct vfbfs_fb_color *c;
+    char *buf, *line, *next;
+    int r = 0;
+
+    if (off != 0 || size > 16384) {
+        return -EINVAL;
+    }
+    if ((c = malloc(sizeof(*c))) == NULL || (buf = malloc(size + 1)) == NULL) {
+        free(c);
+        return -ENOMEM;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    /*
+     * The file's f_lock orders the writers, so none commits over lines
+     * parsed meanwhile. fb_lock is held for the copies only, the flush
+     * doesn't wait for the parsing.
+    */
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    *c = *fb->fb_color;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    /* All lines or none */
+    for (line = buf; r == 0 && line != NULL && *line != '\0'; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        if (*line != '\0') {
+            r = fb_color_command(c, line);
+        }
+    }
+    if (r == 0) {
+        fb_color_prepare(c);
+        vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        *fb->fb_color = *c;
+        vfbfs_fb_damage(fb, &all);
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    }
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    free(buf);
+    free(c);
+    return (r == 0) ? (int)size : r;
+}
+
+int vfbfs_fb_color_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f;
+
+    if ((fb->fb_color = malloc(sizeof(*fb->fb_color))) == NULL) {
+        return -ENOMEM;
+    }
+    fb_color_reset(fb->fb_color);
+    fb_color_prepare(fb->fb_color);
+    f = vfbfs_gen_create_in(fs, fb->fb_dir, "color", fb_color_render, fb, VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_gen_from_file(f)->g_write = fb_color_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
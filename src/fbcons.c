@@ -0,0 +1,525 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Text console. /fb/<n>/console takes UTF-8 text and draws it in the
+ * character cells of the framebuffer with the PSF font stored in
+ * /fb/<n>/font (e.g. "zcat Lat2-Terminus16.psf.gz > font"), writes fail
+ * with ENODATA until there is a valid font. The console owns the screen:
+ * it keeps what every cell shows, and after a write only the cells which
+ * changed are drawn, from an atlas of glyphs already rasterized in the
+ * framebuffer's format with their colors. Scrolling goes through
+ * vfbfs_fb_scroll(), so a panel which scrolls in hardware only gets the
+ * new line.
+ *
+ * Control characters: \n (also returns), \r, \b, \t, \f (clears).
+ * Escape sequences: ESC c (reset), ESC [ row;col H, ESC [ n A/B/C/D,
+ * ESC [ n J and ESC [ n K (n 0 erases to the end of the screen or line,
+ * 1 from its start, 2 all of it) and ESC [ ... m with the 16 colors, 1 for
+ * bright.
+*/
+#include <fb.h>
+#include <font.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define FB_CONS_ATLAS_SIZE  512         /* direct-mapped glyph slots */
+#define FB_CONS_PARAMS      4
+#define FB_CONS_DEFAULT_FG  7
+#define FB_CONS_DEFAULT_BG  0
+#define FB_CONS_UNKNOWN     UINT32_MAX  /* a cell whose pixels are not known */
+#define FB_CONS_REPLACEMENT 0xFFFD
+
+static const uint32_t fb_cons_palette[16] = {
+    0x000000, 0xaa0000, 0x00aa00, 0xaa5500, 0x0000aa, 0xaa00aa, 0x00aaaa, 0xaaaaaa,
+    0x555555, 0xff5555, 0x55ff55, 0xffff55, 0x5555ff, 0xff55ff, 0x55ffff, 0xffffff,
+};
+
+struct fb_cons_cell {
+    uint32_t    c_cp;
+    uint8_t     c_fg;
+    uint8_t     c_bg;
+};
+
+struct fb_cons_glyph {
+    uint32_t    g_cp;
+    uint8_t     g_fg;
+    uint8_t     g_bg;
+    bool        g_valid;
+};
+
+enum FbConsState {
+    FB_CONS_NORMAL, FB_CONS_ESC, FB_CONS_CSI
+};
+
+/* Protected by the console file's f_lock */
+struct vfbfs_fb_console {
+    struct vfbfs_file      *cn_font_file;    /* /fb/<n>/font */
+    char                   *cn_font_data;    /* the copy cn_font points into */
+    size_t                  cn_font_len;
+    struct vfbfs_font       cn_font;
+    bool                    cn_font_ok;
+
+    unsigned                cn_cols, cn_rows;
+    struct fb_cons_cell    *cn_cells;        /* the text */
+    struct fb_cons_cell    *cn_shown;        /* what the framebuffer shows */
+    unsigned                cn_x, cn_y;      /* the cursor */
+    uint8_t                 cn_fg, cn_bg;
+    unsigned                cn_scrolled;     /* lines scrolled since the last redraw */
+
+    enum FbConsState        cn_state;
+    unsigned                cn_params[FB_CONS_PARAMS];
+    unsigned                cn_nparams;
+    uint32_t                cn_utf8;         /* the code point being decoded */
+    unsigned                cn_utf8_left;    /* its missing continuation bytes */
+
+    struct fb_cons_glyph    cn_atlas[FB_CONS_ATLAS_SIZE];
+    char                   *cn_atlas_pixels; /* the glyphs of cn_atlas, cn_glyph_bytes each */
+    size_t                  cn_glyph_bytes;
+};
+
+static void fb_cons_clear(struct vfbfs_fb_console *cn, unsigned from, unsigned to)
+{
+    unsigned i;
+    for (i = from; i < to; i++) {
+        cn->cn_cells[i].c_cp = ' ';
+        cn->cn_cells[i].c_fg = cn->cn_fg;
+        cn->cn_cells[i].c_bg = cn->cn_bg;
+    }
+}
+
+/* Whether a and b are drawn alike, the padding of the cells is not known */
+static inline bool fb_cons_cell_eq(const struct fb_cons_cell *a, const struct fb_cons_cell *b)
+{
+    return a->c_cp == b->c_cp && a->c_fg == b->c_fg && a->c_bg == b->c_bg;
+}
+
+/*
+ * Erases the cells of [start, end) from the cursor on (mode 0), up to and
+ * including the cursor (1) or all of them (2), for CSI J and K
+*/
+static void fb_cons_erase(struct vfbfs_fb_console *cn, unsigned mode, unsigned start, unsigned end)
+{
+    /* Past the last column the cursor is still on the row's last cell */
+    unsigned pos = cn->cn_y * cn->cn_cols + MIN(cn->cn_x, cn->cn_cols - 1);
+
+    if (mode == 0) {
+        fb_cons_clear(cn, pos, end);
+    } else if (mode == 1) {
+        fb_cons_clear(cn, start, pos + 1);
+    } else if (mode == 2) {
+        fb_cons_clear(cn, start, end);
+    }
+}
+
+/* Forgets what the framebuffer shows, the next redraw draws every cell */
+static void fb_cons_unknown(struct vfbfs_fb_console *cn, unsigned from, unsigned to)
+{
+    unsigned i;
+    for (i = from; i < to; i++) {
+        cn->cn_shown[i].c_cp = FB_CONS_UNKNOWN;
+    }
+}
+
+static void fb_cons_reset(struct vfbfs_fb_console *cn)
+{
+    cn->cn_fg        = FB_CONS_DEFAULT_FG;
+    cn->cn_bg        = FB_CONS_DEFAULT_BG;
+    cn->cn_x         = 0;
+    cn->cn_y         = 0;
+    cn->cn_scrolled  = 0;
+    cn->cn_state     = FB_CONS_NORMAL;
+    cn->cn_utf8_left = 0;
+    fb_cons_clear(cn, 0, cn->cn_cols * cn->cn_rows);
+    fb_cons_unknown(cn, 0, cn->cn_cols * cn->cn_rows);
+}
+
+/*
+ * Takes the font from /fb/<n>/font if it changed, the grid and the atlas
+ * are rebuilt then. Returns false if there is no valid font.
+*/
+static bool fb_cons_font_sync(struct vfbfs_fb *fb, struct vfbfs_fb_console *cn)
+{
+    struct vfbfs_file *f = cn->cn_font_file;
+    struct vfbfs_font fn;
+    size_t len, cells;
+    char *data = NULL;
+
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    len = (f->f_content != NULL) ? MIN((off_t)f->f_content_size, vfbfs_file_get_size(f)) : 0;
+    if (len == cn->cn_font_len && (len == 0 || memcmp(f->f_content, cn->cn_font_data, len) == 0)) {
+        vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+        return cn->cn_font_ok;
+    }
+    if (len > 0 && (data = malloc(len)) != NULL) {
+        memcpy(data, f->f_content, len);
+    }
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+
+    free(cn->cn_font_data);
+    cn->cn_font_data = data;
+    cn->cn_font_len  = (data != NULL) ? len : 0;
+    cn->cn_font_ok   = false;
+    if (data == NULL || vfbfs_font_parse(&fn, data, len) != 0
+            || fn.fn_width > fb->fb_width || fn.fn_height > fb->fb_height) {
+        return false;
+    }
+    cn->cn_font  = fn;
+    cn->cn_cols  = fb->fb_width / fn.fn_width;
+    cn->cn_rows  = fb->fb_height / fn.fn_height;
+    cells        = cn->cn_cols * cn->cn_rows;
+    cn->cn_glyph_bytes = (size_t)fn.fn_width * fn.fn_height * fb->fb_bpp;
+    free(cn->cn_cells);
+    free(cn->cn_shown);
+    free(cn->cn_atlas_pixels);
+    cn->cn_cells        = malloc(cells * sizeof(*cn->cn_cells));
+    cn->cn_shown        = malloc(cells * sizeof(*cn->cn_shown));
+    cn->cn_atlas_pixels = malloc(FB_CONS_ATLAS_SIZE * cn->cn_glyph_bytes);
+    memset(cn->cn_atlas, 0, sizeof(cn->cn_atlas));
+    if (cn->cn_cells == NULL || cn->cn_shown == NULL || cn->cn_atlas_pixels == NULL) {
+        return false;
+    }
+    fb_cons_reset(cn);
+    cn->cn_font_ok = true;
+    return true;
+}
+
+static void fb_cons_newline(struct vfbfs_fb_console *cn)
+{
+    unsigned cols = cn->cn_cols;
+    if (++cn->cn_y < cn->cn_rows) {
+        return;
+    }
+    cn->cn_y = cn->cn_rows - 1;
+    memmove(cn->cn_cells, cn->cn_cells + cols, (cn->cn_rows - 1) * cols * sizeof(*cn->cn_cells));
+    fb_cons_clear(cn, (cn->cn_rows - 1) * cols, cn->cn_rows * cols);
+    cn->cn_scrolled++;
+}
+
+static void fb_cons_put(struct vfbfs_fb_console *cn, uint32_t cp)
+{
+    struct fb_cons_cell *c;
+    if (cn->cn_x >= cn->cn_cols) {
+        cn->cn_x = 0;
+        fb_cons_newline(cn);
+    }
+    c = &cn->cn_cells[cn->cn_y * cn->cn_cols + cn->cn_x++];
+    c->c_cp = cp;
+    c->c_fg = cn->cn_fg;
+    c->c_bg = cn->cn_bg;
+}
+
+static void fb_cons_sgr(struct vfbfs_fb_console *cn)
+{
+    unsigned i, p;
+    if (cn->cn_nparams == 0) {
+        cn->cn_params[cn->cn_nparams++] = 0;
+    }
+    for (i = 0; i < cn->cn_nparams; i++) {
+        p = cn->cn_params[i];
+        if (p == 0) {
+            cn->cn_fg = FB_CONS_DEFAULT_FG;
+            cn->cn_bg = FB_CONS_DEFAULT_BG;
+        } else if (p == 1) {
+            cn->cn_fg |= 8;
+        } else if (p == 22) {
+            cn->cn_fg &= 7;
+        } else if (p >= 30 && p <= 37) {
+            cn->cn_fg = (cn->cn_fg & 8) | (p - 30);
+        } else if (p == 39) {
+            cn->cn_fg = FB_CONS_DEFAULT_FG;
+        } else if (p >= 40 && p <= 47) {
+            cn->cn_bg = p - 40;
+        } else if (p == 49) {
+            cn->cn_bg = FB_CONS_DEFAULT_BG;
+        } else if (p >= 90 && p <= 97) {
+            cn->cn_fg = 8 + p - 90;
+        } else if (p >= 100 && p <= 107) {
+            cn->cn_bg = 8 + p - 100;
+        }
+    }
+}
+
+static void fb_cons_csi(struct vfbfs_fb_console *cn, char final)
+{
+    unsigned *p = cn->cn_params, n = (cn->cn_nparams > 0 && p[0] > 0) ? p[0] : 1;
+    unsigned cols = cn->cn_cols;
+
+    if (cn->cn_nparams == 0) {
+        p[0] = 0;
+    }
+    switch (final) {
+    case 'H':
+    case 'f':
+        cn->cn_y = MIN((cn->cn_nparams > 0 && p[0] > 0) ? p[0] - 1 : 0, cn->cn_rows - 1);
+        cn->cn_x = MIN((cn->cn_nparams > 1 && p[1] > 0) ? p[1] - 1 : 0, cols - 1);
+        break;
+    case 'A':
+        cn->cn_y -= MIN(n, cn->cn_y);
+        break;
+    case 'B':
+        cn->cn_y = MIN(cn->cn_y + n, cn->cn_rows - 1);
+        break;
+    case 'C':
+        cn->cn_x = MIN(cn->cn_x + n, cols - 1);
+        break;
+    case 'D':
+        cn->cn_x -= MIN(n, cn->cn_x);
+        break;
+    case 'J':
+        fb_cons_erase(cn, p[0], 0, cols * cn->cn_rows);
+        break;
+    case 'K':
+        fb_cons_erase(cn, p[0], cn->cn_y * cols, (cn->cn_y + 1) * cols);
+        break;
+    case 'm':
+        fb_cons_sgr(cn);
+        break;
+    }
+}
+
+static void fb_cons_char(struct vfbfs_fb_console *cn, uint32_t cp)
+{
+    switch (cp) {
+    case '\n':
+        cn->cn_x = 0;
+        fb_cons_newline(cn);
+        break;
+    case '\r':
+        cn->cn_x = 0;
+        break;
+    case '\b':
+        cn->cn_x -= (cn->cn_x > 0);
+        break;
+    case '\t':
+        cn->cn_x = MIN((cn->cn_x / 8 + 1) * 8, cn->cn_cols - 1);
+        break;
+    case '\f':
+        fb_cons_clear(cn, 0, cn->cn_cols * cn->cn_rows);
+        cn->cn_x = 0;
+        cn->cn_y = 0;
+        break;
+    case 0x1b:
+        cn->cn_state = FB_CONS_ESC;
+        break;
+    default:
+        if (cp >= 0x20) {
+            fb_cons_put(cn, cp);
+        }
+        break;
+    }
+}
+
+/* Runs one byte through the escape parser and the UTF-8 decoder */
+static void fb_cons_byte(struct vfbfs_fb_console *cn, uint8_t b)
+{
+    switch (cn->cn_state) {
+    case FB_CONS_ESC:
+        cn->cn_state = FB_CONS_NORMAL;
+        if (b == '[') {
+            cn->cn_state   = FB_CONS_CSI;
+            cn->cn_nparams = 0;
+            memset(cn->cn_params, 0, sizeof(cn->cn_params));
+        } else if (b == 'c') {
+            fb_cons_reset(cn);
+        }
+        return;
+    case FB_CONS_CSI:
+        if (b >= '0' && b <= '9') {
+            if (cn->cn_nparams == 0) {
+                cn->cn_nparams = 1;
+            }
+            cn->cn_params[cn->cn_nparams - 1] = MIN(cn->cn_params[cn->cn_nparams - 1] * 10 + (b - '0'), 9999);
+        } else if (b == ';') {
+            cn->cn_nparams = MIN(MAX(cn->cn_nparams, 1) + 1, FB_CONS_PARAMS);
+        } else if (b >= 0x40 && b <= 0x7e) {
+            cn->cn_state = FB_CONS_NORMAL;
+            fb_cons_csi(cn, b);
+        }
+        return;
+    case FB_CONS_NORMAL:
+        break;
+    }
+
+    if (cn->cn_utf8_left > 0 && (b & 0xC0) == 0x80) {
+        cn->cn_utf8 = (cn->cn_utf8 << 6) | (b & 0x3F);
+        if (--cn->cn_utf8_left == 0) {
+            fb_cons_char(cn, cn->cn_utf8);
+        }
+        return;
+    }
+    if (cn->cn_utf8_left > 0) {
+        /* A cut sequence */
+        cn->cn_utf8_left = 0;
+        fb_cons_char(cn, FB_CONS_REPLACEMENT);
+    }
+    if (b < 0x80) {
+        fb_cons_char(cn, b);
+    } else if ((b & 0xE0) == 0xC0) {
+        cn->cn_utf8      = b & 0x1F;
+        cn->cn_utf8_left = 1;
+    } else if ((b & 0xF0) == 0xE0) {
+        cn->cn_utf8      = b & 0x0F;
+        cn->cn_utf8_left = 2;
+    } else if ((b & 0xF8) == 0xF0) {
+        cn->cn_utf8      = b & 0x07;
+        cn->cn_utf8_left = 3;
+    } else {
+        fb_cons_char(cn, FB_CONS_REPLACEMENT);
+    }
+}
+
+/* The rasterized glyph of a cell, with fb_lock held */
+static const char *fb_cons_atlas(struct vfbfs_fb *fb, struct vfbfs_fb_console *cn
+    , const struct fb_cons_cell *c)
+{
+    const struct vfbfs_font *fn = &cn->cn_font;
+    unsigned slot = ((c->c_cp * 2654435761u) ^ (c->c_fg << 4) ^ c->c_bg) % FB_CONS_ATLAS_SIZE;
+    struct fb_cons_glyph *g = &cn->cn_atlas[slot];
+    char *pixels = cn->cn_atlas_pixels + slot * cn->cn_glyph_bytes, *dst = pixels;
+    const uint8_t *bits, *row;
+    uint32_t fg, bg;
+    unsigned x, y;
+
+    if (g->g_valid && g->g_cp == c->c_cp && g->g_fg == c->c_fg && g->g_bg == c->c_bg) {
+        return pixels;
+    }
+    fg   = vfbfs_fb_color(fb, fb_cons_palette[c->c_fg]);
+    bg   = vfbfs_fb_color(fb, fb_cons_palette[c->c_bg]);
+    bits = vfbfs_font_glyph(fn, vfbfs_font_index(fn, c->c_cp));
+    for (y = 0; y < fn->fn_height; y++) {
+        row = bits + y * fn->fn_row_bytes;
+        for (x = 0; x < fn->fn_width; x++, dst += fb->fb_bpp) {
+            memcpy(dst, (row[x / 8] & (0x80 >> (x % 8))) ? &fg : &bg, fb->fb_bpp);
+        }
+    }
+    g->g_cp    = c->c_cp;
+    g->g_fg    = c->c_fg;
+    g->g_bg    = c->c_bg;
+    g->g_valid = true;
+    fb->fb_stats.st_cons_atlas_misses++;
+    return pixels;
+}
+
+/* Scrolls the framebuffer like the text was, then draws the changed cells */
+static void fb_cons_redraw(struct vfbfs_fb *fb, struct vfbfs_fb_console *cn)
+{
+    unsigned cols = cn->cn_cols, rows = cn->cn_rows, fw = cn->cn_font.fn_width;
+    unsigned fh = cn->cn_font.fn_height, s = cn->cn_scrolled, i, y;
+    struct vfbfs_fb_rect damage = { 0, 0, 0, 0 }, r;
+    const char *pixels;
+
+    cn->cn_scrolled = 0;
+    if (s >= rows) {
+        fb_cons_unknown(cn, 0, cols * rows);
+    } else if (s > 0) {
+        memmove(cn->cn_shown, cn->cn_shown + s * cols, (rows - s) * cols * sizeof(*cn->cn_shown));
+        /* The rows scrolled in are cleared, or were below the grid */
+        fb_cons_unknown(cn, (rows - s) * cols, rows * cols);
+        vfbfs_fb_scroll(fb, s * fh);
+    }
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    for (i = 0; i < cols * rows; i++) {
+        if (fb_cons_cell_eq(&cn->cn_cells[i], &cn->cn_shown[i])) {
+            continue;
+        }
+        pixels = fb_cons_atlas(fb, cn, &cn->cn_cells[i]);
+        r.r_x0 = (i % cols) * fw;
+        r.r_y0 = (i / cols) * fh;
+        r.r_x1 = r.r_x0 + fw;
+        r.r_y1 = r.r_y0 + fh;
+        for (y = 0; y < fh; y++) {
+            memcpy(vfbfs_fb_span(fb, r.r_x0, r.r_y0 + y, NULL), pixels + y * fw * fb->fb_bpp
+                , (size_t)fw * fb->fb_bpp);
+        }
+        vfbfs_fb_rect_union(&damage, &r);
+        cn->cn_shown[i] = cn->cn_cells[i];
+        fb->fb_stats.st_cons_cells++;
+    }
+    vfbfs_fb_damage_screen(fb, &damage);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+}
+
+static int fb_cons_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fb_cons_write(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_fb_console *cn = fb->fb_console;
+    size_t i;
+
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    if (!fb_cons_font_sync(fb, cn)) {
+        vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+        return -ENODATA;
+    }
+    for (i = 0; i < size; i++) {
+        fb_cons_byte(cn, (uint8_t)data[i]);
+    }
+    fb_cons_redraw(fb, cn);
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    return size;
+}
+
+static int fb_cons_truncate(struct vfbfs *fs, struct vfbfs_file *f, const char *path, off_t size)
+{
+    return 0;
+}
+
+static struct vfbfs_file_ops fb_cons_oprs = {
+    .f_open     = fb_cons_open,
+    .f_write    = fb_cons_write,
+    .f_truncate = fb_cons_truncate,
+};
+
+int vfbfs_fb_console_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_console *cn = calloc(1, sizeof(*cn));
+    struct vfbfs_file *f;
+
+    if (cn == NULL) {
+        return -ENOMEM;
+    }
+    /* A plain file, the font is read from its content */
+    if ((cn->cn_font_file = vfbfs_file_create_in(fs, fb->fb_dir, "font")) == NULL) {
+        free(cn);
+        return -ENOMEM;
+    }
+    cn->cn_font_file->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    cn->cn_font_file->f_flags |= VFBFS_FILE_PINNED;
+    if ((f = vfbfs_file_create_in(fs, fb->fb_dir, "console")) == NULL) {
+        free(cn);
+        return -ENOMEM;
+    }
+    f->f_oprs    = &fb_cons_oprs;
+    f->f_private = fb;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0222;
+    fb->fb_console = cn;
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Pixel formats and the conversion between them. All formats are stored
+ * little-endian: RGB565 as 16 bit words, RGB888 as R, G, B bytes and
+ * XRGB8888 as 32 bit words (B, G, R, X bytes, like fbdev).
+*/
+#include <fb.h>
+
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+static const struct {
+    const char *name;
+    unsigned    bpp;
+} fb_formats[VFBFS_FB_FORMAT_MAX] = {
+    [VFBFS_FB_RGB565]   = { "rgb565",   2 },
+    [VFBFS_FB_RGB888]   = { "rgb888",   3 },
+    [VFBFS_FB_XRGB8888] = { "xrgb8888", 4 },
+};
+
+unsigned vfbfs_fb_format_bpp(enum VfbfsFbFormat fmt)
+{
+    return (fmt < VFBFS_FB_FORMAT_MAX) ? fb_formats[fmt].bpp : 0;
+}
+
+const char *vfbfs_fb_format_name(enum VfbfsFbFormat fmt)
+{
+    return (fmt < VFBFS_FB_FORMAT_MAX) ? fb_formats[fmt].name : "unknown";
+}
+
+int vfbfs_fb_format_parse(const char *name, enum VfbfsFbFormat *fmt)
+{
+    int i;
+    for (i = 0; i < VFBFS_FB_FORMAT_MAX; i++) {
+        if (strcasecmp(name, fb_formats[i].name) == 0) {
+            *fmt = (enum VfbfsFbFormat)i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+/* Reads one pixel as 0x00RRGGBB */
+static inline uint32_t fb_load_rgb(enum VfbfsFbFormat fmt, const uint8_t *p)
+{
+    uint16_t v;
+    uint32_t r, g, b;
+    switch (fmt) {
+        case VFBFS_FB_RGB565:
+        v = p[0] | (p[1] << 8);
+        r = (v >> 11) & 0x1f;
+        g = (v >> 5) & 0x3f;
+        b = v & 0x1f;
+        return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+
+        case VFBFS_FB_RGB888:
+        return (p[0] << 16) | (p[1] << 8) | p[2];
+
+        case VFBFS_FB_XRGB8888:
+        default:
+        return (p[0] | (p[1] << 8) | (p[2] << 16)) & 0xffffff;
+    }
+}
+
+static inline void fb_store_rgb(enum VfbfsFbFormat fmt, uint8_t *p, uint32_t rgb)
+{
+    uint16_t v;
+    switch (fmt) {
+        case VFBFS_FB_RGB565:
+        v = ((rgb >> 8) & 0xf800) | ((rgb >> 5) & 0x07e0) | ((rgb >> 3) & 0x001f);
+        p[0] = v & 0xff;
+        p[1] = v >> 8;
+        break;
+
+        case VFBFS_FB_RGB888:
+        p[0] = rgb >> 16;
+        p[1] = rgb >> 8;
+        p[2] = rgb;
+        break;
+
+        case VFBFS_FB_XRGB8888:
+        default:
+        p[0] = rgb;
+        p[1] = rgb >> 8;
+        p[2] = rgb >> 16;
+        p[3] = 0;
+        break;
+    }
+}
+
+/* Converts npix pixels from the sfmt format to dfmt */
+void vfbfs_fb_convert(enum VfbfsFbFormat dfmt, void *dst
+    , enum VfbfsFbFormat sfmt, const void *src, unsigned npix)
+{
+    unsigned dbpp = vfbfs_fb_format_bpp(dfmt), sbpp = vfbfs_fb_format_bpp(sfmt);
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    unsigned i;
+
+    if (dfmt == sfmt) {
+        memcpy(dst, src, (size_t)npix * dbpp);
+        return;
+    }
+    for (i = 0; i < npix; i++, s += sbpp, d += dbpp) {
+        fb_store_rgb(dfmt, d, fb_load_rgb(sfmt, s));
+    }
+}
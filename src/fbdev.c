@@ -0,0 +1,165 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * fbdev ioctls on /fb/<n>/frame, so fbdev clients can query the geometry,
+ * pan the virtual buffer and wait for the vsync. The numbers are the ones
+ * of fbioctl.h, see there why they are not the kernel's. The frame also
+ * takes the copies of fileioctl.h from plain files.
+*/
+#include <fb.h>
+#include <fbioctl.h>
+#include <fileioctl.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+static void fb_dev_bitfields(struct vfbfs_fb *fb, struct fb_var_screeninfo *var)
+{
+    switch (fb->fb_format) {
+    case VFBFS_FB_RGB565:
+        var->red.offset   = 11; var->red.length   = 5;
+        var->green.offset = 5;  var->green.length = 6;
+        var->blue.offset  = 0;  var->blue.length  = 5;
+        break;
+    case VFBFS_FB_RGB888:
+        var->red.offset   = 0;  var->red.length   = 8;
+        var->green.offset = 8;  var->green.length = 8;
+        var->blue.offset  = 16; var->blue.length  = 8;
+        break;
+    case VFBFS_FB_XRGB8888:
+    default:
+        var->red.offset   = 16; var->red.length   = 8;
+        var->green.offset = 8;  var->green.length = 8;
+        var->blue.offset  = 0;  var->blue.length  = 8;
+        break;
+    }
+}
+
+static void fb_dev_get_var(struct vfbfs_fb *fb, struct fb_var_screeninfo *var)
+{
+    memset(var, 0, sizeof(*var));
+    var->xres           = fb->fb_width;
+    var->yres           = fb->fb_height;
+    var->xres_virtual   = fb->fb_width;
+    var->yres_virtual   = fb->fb_vheight;
+    var->bits_per_pixel = fb->fb_bpp * 8;
+    var->height         = ~0U;
+    var->width          = ~0U;
+    var->vmode          = FB_VMODE_NONINTERLACED;
+    /* Read without fb_lock, a concurrent pan makes it stale anyway */
+    var->yoffset        = fb->fb_yoffset;
+    if (fb->fb_refresh_hz > 0) {
+        /* The pixel clock is in picoseconds, as if there were no blanking */
+        var->pixclock = 1000000000000ULL / ((uint64_t)fb->fb_refresh_hz * fb->fb_width * fb->fb_height);
+    }
+    fb_dev_bitfields(fb, var);
+}
+
+static void fb_dev_get_fix(struct vfbfs_fb *fb, struct fb_fix_screeninfo *fix)
+{
+    memset(fix, 0, sizeof(*fix));
+    snprintf(fix->id, sizeof(fix->id), "vfbfs%d", fb->fb_index);
+    fix->smem_len    = fb->fb_vsize;
+    fix->type        = FB_TYPE_PACKED_PIXELS;
+    fix->visual      = FB_VISUAL_TRUECOLOR;
+    fix->ypanstep    = (fb->fb_vheight > fb->fb_height) ? 1 : 0;
+    fix->line_length = fb->fb_stride;
+}
+
+/*
+ * VFBFS_IOC_CLONE_RANGE onto the frame. The frame can't share a buffer, the
+ * range of the plain file is copied in by the daemon, in one go.
+*/
+static int fb_dev_copy_from(struct vfbfs *fs, struct vfbfs_fb *fb, struct vfbfs_file *f
+    , struct vfbfs_clone_range *cr)
+{
+    struct vfbfs_file *src;
+    uint64_t ssize, len;
+    int r = 0;
+
+    cr->cr_src[sizeof(cr->cr_src) - 1] = '\0';
+    if (cr->cr_dst_off >= fb->fb_vsize) {
+        return -ENOSPC;
+    }
+    /* The reference keeps an unlink() from freeing src in the middle of the copy */
+    if ((src = vfbfs_file_get(fs, cr->cr_src)) == NULL) {
+        return -ENOENT;
+    }
+    if (src->f_oprs != vfbfs_file_get_mem_ops()) {
+        r = -EINVAL;
+        goto put;
+    }
+    vfbfs_mutex_lock(&src->f_lock, VFBFS_LC_F_LOCK);
+    ssize = src->f_content_size;
+    len   = (cr->cr_src_off < ssize) ? ssize - cr->cr_src_off : 0;
+    len   = (cr->cr_len != 0) ? MIN(len, cr->cr_len) : len;
+    len   = MIN(len, fb->fb_vsize - cr->cr_dst_off);
+    if (len > 0) {
+        vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        memcpy(f->f_content + cr->cr_dst_off, src->f_content + cr->cr_src_off, len);
+        vfbfs_fb_damage_bytes(fb, cr->cr_dst_off, len);
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    }
+    vfbfs_mutex_unlock(&src->f_lock, VFBFS_LC_F_LOCK);
+put:
+    vfbfs_file_put(fs, src);
+    return r;
+}
+
+int vfbfs_fb_ioctl(struct vfbfs *fs, struct vfbfs_file *f, const char *path, int cmd
+    , void *arg, struct fuse_file_info *fi, unsigned flags, void *data)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    const struct fb_var_screeninfo *var;
+
+    if (fb == NULL) {
+        return -ENOTTY;
+    }
+    /* The structures differ for 32-bit callers on a 64-bit kernel */
+    if (flags & FUSE_IOCTL_COMPAT) {
+        return -ENOSYS;
+    }
+    switch ((unsigned)cmd) {
+    case VFBFS_FBIOGET_VSCREENINFO:
+        fb_dev_get_var(fb, (struct fb_var_screeninfo *)data);
+        return 0;
+    case VFBFS_FBIOGET_FSCREENINFO:
+        fb_dev_get_fix(fb, (struct fb_fix_screeninfo *)data);
+        return 0;
+    case VFBFS_FBIOPAN_DISPLAY:
+        var = (const struct fb_var_screeninfo *)data;
+        if (var->xoffset != 0) {
+            return -EINVAL;
+        }
+        return vfbfs_fb_pan(fb, var->yoffset);
+    case VFBFS_FBIO_WAITFORVSYNC:
+        /* Only the first (and only) CRTC */
+        if (*(const __u32 *)data != 0) {
+            return -ENODEV;
+        }
+        return vfbfs_fb_wait_vsync(fb);
+    case VFBFS_IOC_CLONE_RANGE:
+        return fb_dev_copy_from(fs, fb, f, (struct vfbfs_clone_range *)data);
+    default:
+        return -ENOTTY;
+    }
+}
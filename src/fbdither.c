@@ -0,0 +1,336 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Dithering for the devices with fewer bits per channel than the pixels
+ * they get, the RGB565 panels. Truncating 8 bit channels to 5 or 6 bits
+ * bands the gradients, the dropped bits are spread instead:
+ *
+ *   ordered    an 8x8 Bayer threshold is added below the dropped bits,
+ *              4 pixels at a time. Stable from frame to frame, for video.
+ *   diffusion  Floyd-Steinberg, the rounding error goes to the neighbours
+ *              right and below. A row only depends on the row above, so
+ *              the rows run on the worker pool, each one a few pixels
+ *              behind the one above. For stills.
+ *
+ * /fb/<n>/dither reads "mode M", writing "none", "ordered" or "diffusion"
+ * selects the mode for the following flushes. Every flushed rectangle is
+ * dithered on its own, the error does not cross into the unchanged area.
+*/
+#include <fb.h>
+#include <fbvec.h>
+#include <gen.h>
+#include <workers.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+/* Pixels converted to XRGB8888 at a time, and between two progress updates of a row */
+#define FB_DITHER_CHUNK 64
+
+static const char *fb_dither_names[VFBFS_FB_DITHER_MAX] = {
+    [VFBFS_FB_DITHER_NONE]      = "none",
+    [VFBFS_FB_DITHER_ORDERED]   = "ordered",
+    [VFBFS_FB_DITHER_DIFFUSION] = "diffusion",
+};
+
+static const uint8_t fb_bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/* A Floyd-Steinberg run, see fb_dither_fs_row() */
+struct fb_dither_fs {
+    uint8_t            *fs_dst;
+    size_t              fs_dstride;
+    const uint8_t      *fs_src;
+    size_t              fs_sstride;
+    enum VfbfsFbFormat  fs_sfmt;
+    unsigned            fs_width;
+    int16_t            *fs_err;         /* per row, the error left for the next one, in 16ths */
+    unsigned           *fs_progress;    /* per row, the pixels done */
+};
+
+static inline uint16_t fb_dither_pack(uint32_t p)
+{
+    return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f);
+}
+
+/* XRGB8888 to RGB565, 4 pixels */
+static inline void fb_dither_pack4(uint8_t *dst, fb_v16 px)
+{
+    fb_v4u p;
+    fb_v4h h;
+    memcpy(&p, &px, 16);
+    p = ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) | ((p >> 3) & 0x001f);
+    h = __builtin_convertvector(p, fb_v4h);
+    memcpy(dst, &h, 8);
+}
+
+/* npix XRGB8888 pixels landing at (x, y) to RGB565 */
+static void fb_dither_ordered_row(uint8_t *dst, const uint8_t *src, unsigned npix, unsigned x, unsigned y)
+{
+    uint8_t pat[32], c[3];
+    fb_v16 t0, t1, s, v;
+    unsigned i, k, b;
+    uint16_t px;
+
+    /* B, G, R, X thresholds of the 8 pixels of the period, as big as the dropped bits */
+    for (k = 0; k < 8; k++) {
+        b = fb_bayer8[y & 7][(x + k) & 7];
+        pat[k * 4]     = b >> 3;
+        pat[k * 4 + 1] = b >> 4;
+        pat[k * 4 + 2] = b >> 3;
+        pat[k * 4 + 3] = 0;
+    }
+    memcpy(&t0, pat, 16);
+    memcpy(&t1, pat + 16, 16);
+    for (i = 0; i + 4 <= npix; i += 4) {
+        memcpy(&s, src + i * 4, 16);
+        v  = s + ((i & 4) ? t1 : t0);
+        /* Saturated, what wrapped around is below what it was */
+        v |= (fb_v16)(v < s);
+        fb_dither_pack4(dst + i * 2, v);
+    }
+    for (; i < npix; i++) {
+        for (k = 0; k < 3; k++) {
+            c[k] = MIN(src[i * 4 + k] + pat[(i & 7) * 4 + k], 255);
+        }
+        px = fb_dither_pack(c[0] | (c[1] << 8) | (c[2] << 16));
+        memcpy(dst + i * 2, &px, 2);
+    }
+}
+
+/* Waits until row y has done n pixels */
+static void fb_dither_fs_wait(struct fb_dither_fs *fs, unsigned y, unsigned n)
+{
+    while (__atomic_load_n(&fs->fs_progress[y], __ATOMIC_ACQUIRE) < n) {
+        sched_yield();
+    }
+}
+
+/* One row, once the row above is a chunk ahead */
+static void fb_dither_fs_row(void *arg, unsigned y)
+{
+    struct fb_dither_fs *fs = (struct fb_dither_fs *)arg;
+    size_t elen = (size_t)(fs->fs_width + 2) * 3;
+    int16_t *below = fs->fs_err + y * elen, *above = (y > 0) ? below - elen : NULL;
+    const uint8_t *row = fs->fs_src + y * fs->fs_sstride, *s = NULL;
+    uint8_t *dst = fs->fs_dst + y * fs->fs_dstride, chunk[FB_DITHER_CHUNK * 4];
+    unsigned w = fs->fs_width, sbpp = vfbfs_fb_format_bpp(fs->fs_sfmt), x, c, n, q, bits, rec;
+    int right[3] = { 0, 0, 0 }, v, e;
+    uint8_t out[3];
+    uint16_t px;
+
+    memset(below, 0, elen * sizeof(*below));
+    for (x = 0; x < w; x++) {
+        if (x % FB_DITHER_CHUNK == 0) {
+            n = MIN(w - x, FB_DITHER_CHUNK);
+            if (fs->fs_sfmt == VFBFS_FB_XRGB8888) {
+                s = row + x * 4;
+            } else {
+                vfbfs_fb_convert(VFBFS_FB_XRGB8888, chunk, fs->fs_sfmt, row + x * sbpp, n);
+                s = chunk;
+            }
+            __atomic_store_n(&fs->fs_progress[y], x, __ATOMIC_RELEASE);
+            /* The error below pixel j is complete once the pixel j + 1 is done */
+            if (above != NULL) {
+                fb_dither_fs_wait(fs, y - 1, MIN(x + n + 1, w));
+            }
+        }
+        for (c = 0; c < 3; c++) {
+            v = s[(x % FB_DITHER_CHUNK) * 4 + c]
+                + ((((above != NULL) ? above[(x + 1) * 3 + c] : 0) + right[c] + 8) >> 4);
+            v = MIN(MAX(v, 0), 255);
+            /* B, G, R: green keeps 6 bits */
+            bits = (c == 1) ? 6 : 5;
+            q    = (v * ((1 << bits) - 1) + 127) / 255;
+            rec  = (q << (8 - bits)) | (q >> (2 * bits - 8));
+            e    = v - (int)rec;
+            right[c] = 7 * e;
+            below[x * 3 + c]       += 3 * e;
+            below[(x + 1) * 3 + c] += 5 * e;
+            below[(x + 2) * 3 + c] += e;
+            out[c] = rec;
+        }
+        px = fb_dither_pack(out[0] | (out[1] << 8) | (out[2] << 16));
+        memcpy(dst + x * 2, &px, 2);
+    }
+    __atomic_store_n(&fs->fs_progress[y], w, __ATOMIC_RELEASE);
+}
+
+static int fb_dither_diffuse(uint8_t *dst, size_t dstride, enum VfbfsFbFormat sfmt, const uint8_t *src
+    , size_t sstride, unsigned width, unsigned height)
+{
+    struct fb_dither_fs fs = {
+        .fs_dst = dst, .fs_dstride = dstride, .fs_src = src, .fs_sstride = sstride
+        , .fs_sfmt = sfmt, .fs_width = width,
+    };
+
+    fs.fs_err      = malloc((size_t)height * (width + 2) * 3 * sizeof(*fs.fs_err));
+    fs.fs_progress = calloc(height, sizeof(*fs.fs_progress));
+    if (fs.fs_err == NULL || fs.fs_progress == NULL) {
+        free(fs.fs_err);
+        free(fs.fs_progress);
+        return -ENOMEM;
+    }
+    vfbfs_workers_run(fb_dither_fs_row, &fs, height);
+    free(fs.fs_err);
+    free(fs.fs_progress);
+    return 0;
+}
+
+/*
+ * Converts a width x height rectangle from sfmt to dfmt, dithered if dfmt
+ * has fewer bits per channel. (x, y) is where the rectangle lands, the
+ * ordered pattern is aligned to it. Without the memory for the error
+ * diffusion the rectangle is dithered in order and -ENOMEM is returned.
+*/
+int vfbfs_fb_convert_dither(enum VfbfsFbDither mode, enum VfbfsFbFormat dfmt, void *dst, size_t dstride
+    , enum VfbfsFbFormat sfmt, const void *src, size_t sstride, unsigned width, unsigned height
+    , unsigned x, unsigned y)
+{
+    uint8_t *d = (uint8_t *)dst, chunk[FB_DITHER_CHUNK * 4];
+    const uint8_t *s = (const uint8_t *)src;
+    unsigned sbpp = vfbfs_fb_format_bpp(sfmt), i, j, n;
+    int r = 0;
+
+    if (dfmt != VFBFS_FB_RGB565 || sfmt == VFBFS_FB_RGB565) {
+        mode = VFBFS_FB_DITHER_NONE;
+    }
+    if (mode == VFBFS_FB_DITHER_DIFFUSION) {
+        if ((r = fb_dither_diffuse(d, dstride, sfmt, s, sstride, width, height)) == 0) {
+            return 0;
+        }
+        mode = VFBFS_FB_DITHER_ORDERED;
+    }
+    for (i = 0; i < height; i++, d += dstride, s += sstride) {
+        if (mode == VFBFS_FB_DITHER_NONE) {
+            vfbfs_fb_convert(dfmt, d, sfmt, s, width);
+        } else if (sfmt == VFBFS_FB_XRGB8888) {
+            fb_dither_ordered_row(d, s, width, x, y + i);
+        } else {
+            for (j = 0; j < width; j += n) {
+                n = MIN(width - j, FB_DITHER_CHUNK);
+                vfbfs_fb_convert(VFBFS_FB_XRGB8888, chunk, sfmt, s + j * sbpp, n);
+                fb_dither_ordered_row(d + j * 2, chunk, n, x + j, y + i);
+            }
+        }
+    }
+    return r;
+}
+
+/*
+ * Converts a row of a flushed part for the device, called by the flush
+ * thread with fb_lock held: i is the row's index in the part, (x, y) where
+ * it lands. The error diffusion needs the whole part, its rows are kept
+ * until vfbfs_fb_dither_part_locked().
+*/
+void vfbfs_fb_dither_row_locked(struct vfbfs_fb *fb, void *dst, const void *src
+    , enum VfbfsFbFormat sfmt, unsigned npix, unsigned x, unsigned y, unsigned i)
+{
+    if (fb->fb_dither == VFBFS_FB_DITHER_DIFFUSION && fb->fb_dev_format == VFBFS_FB_RGB565) {
+        vfbfs_fb_convert(VFBFS_FB_XRGB8888, fb->fb_dither_rows + (size_t)i * npix * 4, sfmt, src, npix);
+        return;
+    }
+    vfbfs_fb_convert_dither(fb->fb_dither, fb->fb_dev_format, dst, 0, sfmt, src, 0, npix, 1, x, y);
+}
+
+/* Finishes a part of nrows rows starting at dst, see above */
+void vfbfs_fb_dither_part_locked(struct vfbfs_fb *fb, void *dst, size_t dstride, unsigned npix
+    , unsigned nrows, unsigned x, unsigned y)
+{
+    if (fb->fb_dither == VFBFS_FB_DITHER_DIFFUSION && fb->fb_dev_format == VFBFS_FB_RGB565) {
+        vfbfs_fb_convert_dither(VFBFS_FB_DITHER_DIFFUSION, VFBFS_FB_RGB565, dst, dstride
+            , VFBFS_FB_XRGB8888, fb->fb_dither_rows, (size_t)npix * 4, npix, nrows, x, y);
+    }
+}
+
+static int fb_dither_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    fprintf(out, "mode %s\n", fb_dither_names[__atomic_load_n(&fb->fb_dither, __ATOMIC_RELAXED)]);
+    return 0;
+}
+
+static int fb_dither_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_rect all = { 0, 0, fb->fb_width, fb->fb_height };
+    size_t len = size;
+    uint8_t *rows = NULL;
+    int mode;
+
+    if (off != 0) {
+        return -EINVAL;
+    }
+    while (len > 0 && (data[len - 1] == '\n' || data[len - 1] == ' ')) {
+        len--;
+    }
+    for (mode = 0; mode < VFBFS_FB_DITHER_MAX; mode++) {
+        if (strlen(fb_dither_names[mode]) == len && strncmp(data, fb_dither_names[mode], len) == 0) {
+            break;
+        }
+    }
+    if (mode == VFBFS_FB_DITHER_MAX) {
+        return -EINVAL;
+    }
+    /* The rows of the largest part, the whole screen or panel */
+    if (mode == VFBFS_FB_DITHER_DIFFUSION && fb->fb_dither_rows == NULL
+            && (rows = malloc(MAX((size_t)fb->fb_width * fb->fb_height
+                , (size_t)fb->fb_dev_width * fb->fb_dev_height) * 4)) == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    if (fb->fb_dither_rows == NULL) {
+        fb->fb_dither_rows = rows;
+        rows = NULL;
+    }
+    if (fb->fb_dither != (enum VfbfsFbDither)mode) {
+        fb->fb_dither = mode;
+        vfbfs_fb_damage(fb, &all);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    free(rows);
+    return size;
+}
+
+int vfbfs_fb_dither_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f;
+
+    f = vfbfs_gen_create_in(fs, fb->fb_dir, "dither", fb_dither_render, fb, VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_gen_from_file(f)->g_write = fb_dither_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Software rasterizer for the drawing commands and the console. Everything
+ * works in screen coordinates with fb_lock held, clips to the screen and
+ * leaves the rectangle it drew in the rectangle it got, the caller damages
+ * it. Rows are reached through vfbfs_fb_span(), so they follow the scroll
+ * origin.
+*/
+#include <fb.h>
+#include <fbvec.h>
+#include <font.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* 48 bytes hold a whole number of pixels of every format */
+#define FB_PATTERN_SIZE 48
+
+/* A pixel of the framebuffer's format for an 0xRRGGBB color */
+uint32_t vfbfs_fb_color(struct vfbfs_fb *fb, uint32_t rgb)
+{
+    uint32_t px = 0;
+    vfbfs_fb_convert(fb->fb_format, &px, VFBFS_FB_XRGB8888, &rgb, 1);
+    return px;
+}
+
+/* Clips r to the screen, returns false if nothing is left */
+bool vfbfs_fb_clip(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r)
+{
+    r->r_x1 = MIN(r->r_x1, fb->fb_width);
+    r->r_y1 = MIN(r->r_y1, fb->fb_height);
+    if (vfbfs_fb_rect_empty(r)) {
+        memset(r, 0, sizeof(*r));
+        return false;
+    }
+    return true;
+}
+
+static void fb_fill_row(char *dst, size_t len, const uint8_t *pattern)
+{
+    fb_v16 v0, v1, v2;
+    memcpy(&v0, pattern, 16);
+    memcpy(&v1, pattern + 16, 16);
+    memcpy(&v2, pattern + 32, 16);
+    for (; len >= FB_PATTERN_SIZE; len -= FB_PATTERN_SIZE, dst += FB_PATTERN_SIZE) {
+        memcpy(dst, &v0, 16);
+        memcpy(dst + 16, &v1, 16);
+        memcpy(dst + 32, &v2, 16);
+    }
+    memcpy(dst, pattern, len);
+}
+
+void vfbfs_fb_fill_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r, uint32_t px)
+{
+    uint8_t pattern[FB_PATTERN_SIZE];
+    unsigned i, y;
+
+    if (!vfbfs_fb_clip(fb, r)) {
+        return;
+    }
+    for (i = 0; i < FB_PATTERN_SIZE; i += fb->fb_bpp) {
+        memcpy(pattern + i, &px, fb->fb_bpp);
+    }
+    for (y = r->r_y0; y < r->r_y1; y++) {
+        fb_fill_row(vfbfs_fb_span(fb, r->r_x0, y, NULL), (r->r_x1 - r->r_x0) * fb->fb_bpp, pattern);
+    }
+}
+
+/* Copies the pixels from (sx, sy) to r, the areas may overlap */
+void vfbfs_fb_copy_locked(struct vfbfs_fb *fb, unsigned sx, unsigned sy, struct vfbfs_fb_rect *r)
+{
+    unsigned w, h, i, y;
+    if (sx >= fb->fb_width || sy >= fb->fb_height || !vfbfs_fb_clip(fb, r)) {
+        memset(r, 0, sizeof(*r));
+        return;
+    }
+    w = MIN(r->r_x1 - r->r_x0, fb->fb_width - sx);
+    h = MIN(r->r_y1 - r->r_y0, fb->fb_height - sy);
+    r->r_x1 = r->r_x0 + w;
+    r->r_y1 = r->r_y0 + h;
+    for (i = 0; i < h; i++) {
+        /* Bottom-up if the destination is below the source */
+        y = (r->r_y0 > sy) ? h - 1 - i : i;
+        memmove(vfbfs_fb_span(fb, r->r_x0, r->r_y0 + y, NULL), vfbfs_fb_span(fb, sx, sy + y, NULL)
+            , (size_t)w * fb->fb_bpp);
+    }
+}
+
+/* Copies pixels of the framebuffer's format to r, stride is the distance of the rows of src */
+void vfbfs_fb_blit_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r, const void *src, size_t stride)
+{
+    const char *s = (const char *)src;
+    unsigned y;
+    if (!vfbfs_fb_clip(fb, r)) {
+        return;
+    }
+    for (y = r->r_y0; y < r->r_y1; y++, s += stride) {
+        memcpy(vfbfs_fb_span(fb, r->r_x0, y, NULL), s, (size_t)(r->r_x1 - r->r_x0) * fb->fb_bpp);
+    }
+}
+
+/* Bresenham, r gets the bounding box of the drawn pixels */
+void vfbfs_fb_line_locked(struct vfbfs_fb *fb, int x0, int y0, int x1, int y1, uint32_t px
+    , struct vfbfs_fb_rect *r)
+{
+    int dx = abs(x1 - x0), dy = -abs(y1 - y0), sx = (x0 < x1) ? 1 : -1, sy = (y0 < y1) ? 1 : -1;
+    int err = dx + dy, e2;
+    struct vfbfs_fb_rect p;
+
+    memset(r, 0, sizeof(*r));
+    for (;;) {
+        if (x0 >= 0 && y0 >= 0 && (unsigned)x0 < fb->fb_width && (unsigned)y0 < fb->fb_height) {
+            memcpy(vfbfs_fb_span(fb, x0, y0, NULL), &px, fb->fb_bpp);
+            p.r_x0 = x0;
+            p.r_y0 = y0;
+            p.r_x1 = x0 + 1;
+            p.r_y1 = y0 + 1;
+            vfbfs_fb_rect_union(r, &p);
+        }
+        if (x0 == x1 && y0 == y1) {
+            break;
+        }
+        e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0  += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0  += sy;
+        }
+    }
+}
+
+/* Draws the glyph of c at (x, y), the background too if bg is not NULL */
+void vfbfs_fb_glyph_locked(struct vfbfs_fb *fb, const struct vfbfs_font *fn, unsigned c
+    , unsigned x, unsigned y, uint32_t fg, const uint32_t *bg, struct vfbfs_fb_rect *r)
+{
+    const uint8_t *g = vfbfs_font_glyph(fn, c), *row;
+    unsigned gx, gy;
+    char *dst;
+
+    r->r_x0 = x;
+    r->r_y0 = y;
+    r->r_x1 = x + fn->fn_width;
+    r->r_y1 = y + fn->fn_height;
+    if (!vfbfs_fb_clip(fb, r)) {
+        return;
+    }
+    for (gy = 0; gy < r->r_y1 - y; gy++) {
+        row = g + gy * fn->fn_row_bytes;
+        dst = vfbfs_fb_span(fb, x, y + gy, NULL);
+        for (gx = 0; gx < r->r_x1 - x; gx++, dst += fb->fb_bpp) {
+            if (row[gx / 8] & (0x80 >> (gx % 8))) {
+                memcpy(dst, &fg, fb->fb_bpp);
+            } else if (bg != NULL) {
+                memcpy(dst, bg, fb->fb_bpp);
+            }
+        }
+    }
+}
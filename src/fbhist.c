@@ -0,0 +1,615 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Frame history. Every flush records the screen into a ring, as the XOR
+ * with the previous recorded frame, or as a keyframe every
+ * FB_HIST_KEY_INTERVAL frames. Both are stored run-length encoded: pairs
+ * of (zero bytes to skip, literal bytes to XOR), so a delta costs about
+ * as much as the pixels which changed. The oldest frames are evicted to
+ * stay within the budget, a delta left first is turned into a keyframe.
+ *
+ *   /fb/<n>/history/<seq>   a recorded screen, raw pixels like the frame,
+ *                           rebuilt from its keyframe when opened
+ *   /fb/<n>/history_budget  "budget, used, frames, keyframes, first, last"
+ *                           lines, writing a byte count (k and m suffixes)
+ *                           sets the budget, 0 stops recording
+ *
+ * The flush thread copies the damaged rows under fb_lock and encodes them
+ * after dropping it. The files of the history directory are never freed:
+ * an evicted frame's file is taken out of the directory and comes back
+ * under the name of a later frame, so an open handle never outlives it.
+*/
+#include <fb.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define FB_HIST_KEY_INTERVAL    32
+#define FB_HIST_MIN_RUN         16  /* zeros ending a literal, more than the varints cost */
+#define FB_HIST_VARINT_MAX      10
+
+/* A file of the history directory */
+struct fb_hist_slot {
+    struct vfbfs_fb        *hs_fb;
+    struct vfbfs_file      *hs_file;
+    uint64_t                hs_seq;         /* the frame it shows, 0 when evicted */
+    struct fb_hist_slot    *hs_next;        /* next free slot */
+};
+
+struct fb_hist_frame {
+    uint64_t                hf_seq;
+    bool                    hf_key;
+    uint8_t                *hf_data;
+    size_t                  hf_len;
+    struct fb_hist_slot    *hf_slot;
+};
+
+struct vfbfs_fb_history {
+    struct vfbfs           *hi_fs;
+    struct vfbfs_dir       *hi_dir;         /* /fb/<n>/history */
+    pthread_mutex_t         hi_lock;        /* protects the fields up to hi_work */
+    struct fb_hist_frame    hi_ring[VFBFS_FB_HISTORY_MAX];
+    unsigned                hi_head;        /* the oldest frame, always a keyframe */
+    unsigned                hi_count;
+    size_t                  hi_budget;
+    size_t                  hi_used;
+    uint64_t                hi_seq;         /* of the newest frame */
+    unsigned                hi_since_key;   /* frames since the newest keyframe */
+    struct fb_hist_slot    *hi_free;
+
+    /* Flush thread only, allocated on the first capture */
+    char                   *hi_work;        /* the screen being recorded */
+    char                   *hi_prev;        /* the newest recorded frame */
+    uint8_t                *hi_scratch;     /* encoder output */
+    unsigned                hi_y0, hi_y1;   /* rows of hi_work not in hi_prev */
+    unsigned                hi_origin, hi_yoffset;
+    bool                    hi_primed;      /* hi_prev holds a frame */
+    bool                    hi_force_key;
+};
+
+static struct vfbfs_file_ops fb_hist_oprs;
+
+static inline unsigned fb_hist_index(struct vfbfs_fb_history *hi, unsigned i)
+{
+    return (hi->hi_head + i) % VFBFS_FB_HISTORY_MAX;
+}
+
+static inline size_t fb_hist_varint_put(uint8_t *p, size_t v)
+{
+    size_t n = 0;
+    do {
+        p[n++] = (v & 0x7f) | ((v >= 0x80) ? 0x80 : 0);
+        v >>= 7;
+    } while (v != 0);
+    return n;
+}
+
+static inline bool fb_hist_varint_get(const uint8_t *d, size_t len, size_t *pos, size_t *v)
+{
+    unsigned shift;
+    for (*v = 0, shift = 0; *pos < len && shift < 64; shift += 7) {
+        *v |= (size_t)(d[*pos] & 0x7f) << shift;
+        if ((d[(*pos)++] & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Byte i of the frame to encode, everything outside [from, to) is unchanged */
+static inline uint8_t fb_hist_byte(const uint8_t *cur, const uint8_t *prev, size_t from, size_t to
+    , size_t i)
+{
+    return (i < from || i >= to) ? 0 : cur[i] ^ ((prev != NULL) ? prev[i] : 0);
+}
+
+/* The zero bytes from p on, by words where the frames are equal */
+static size_t fb_hist_zeros(const uint8_t *cur, const uint8_t *prev, size_t from, size_t to
+    , size_t total, size_t p)
+{
+    size_t start = p;
+    uint64_t a, b = 0;
+
+    p = MAX(p, from);
+    while (p < to) {
+        if (p + 8 <= to) {
+            memcpy(&a, cur + p, 8);
+            if (prev != NULL) {
+                memcpy(&b, prev + p, 8);
+            }
+            if (a == b) {
+                p += 8;
+                continue;
+            }
+        }
+        if (fb_hist_byte(cur, prev, from, to, p) != 0) {
+            return p - start;
+        }
+        p++;
+    }
+    return total - start;
+}
+
+/*
+ * Encodes cur XOR prev (cur alone for a keyframe) into out, which has room
+ * for total + 2 * FB_HIST_VARINT_MAX bytes: a literal only ends at a run
+ * of zeros longer than the two varints starting the next one.
+*/
+static size_t fb_hist_encode(const uint8_t *cur, const uint8_t *prev, size_t from, size_t to
+    , size_t total, uint8_t *out)
+{
+    size_t p = 0, n = 0, z, l, run, i;
+
+    while (p < total) {
+        z = fb_hist_zeros(cur, prev, from, to, total, p);
+        if (p + z >= total) {
+            break;
+        }
+        for (l = 0, run = 0; p + z + l < total; l++) {
+            if (fb_hist_byte(cur, prev, from, to, p + z + l) != 0) {
+                run = 0;
+            } else if (++run == FB_HIST_MIN_RUN) {
+                l++;
+                break;
+            }
+        }
+        l -= run;
+        n += fb_hist_varint_put(out + n, z);
+        n += fb_hist_varint_put(out + n, l);
+        for (i = 0; i < l; i++) {
+            out[n + i] = fb_hist_byte(cur, prev, from, to, p + z + i);
+        }
+        n += l;
+        p += z + l;
+    }
+    return n;
+}
+
+/* XORs an encoded frame into dst */
+static int fb_hist_apply(const uint8_t *d, size_t len, uint8_t *dst, size_t total)
+{
+    size_t in = 0, pos = 0, z, l, i;
+    while (in < len) {
+        if (!fb_hist_varint_get(d, len, &in, &z) || !fb_hist_varint_get(d, len, &in, &l)
+                || z > total - pos || l > total - pos - z || l > len - in) {
+            return -EIO;
+        }
+        pos += z;
+        for (i = 0; i < l; i++) {
+            dst[pos + i] ^= d[in + i];
+        }
+        in  += l;
+        pos += l;
+    }
+    return 0;
+}
+
+/* Rebuilds the i-th oldest frame into dst, with hi_lock held */
+static int fb_hist_rebuild_locked(struct vfbfs_fb *fb, struct vfbfs_fb_history *hi, unsigned i
+    , uint8_t *dst)
+{
+    struct fb_hist_frame *hf;
+    unsigned k = i;
+    int r = 0;
+
+    while (k > 0 && !hi->hi_ring[fb_hist_index(hi, k)].hf_key) {
+        k--;
+    }
+    memset(dst, 0, fb->fb_size);
+    for (; k <= i && r == 0; k++) {
+        hf = &hi->hi_ring[fb_hist_index(hi, k)];
+        r  = fb_hist_apply(hf->hf_data, hf->hf_len, dst, fb->fb_size);
+    }
+    return r;
+}
+
+/* A file named after seq, one of an evicted frame if there is one. With hi_lock held. */
+static struct fb_hist_slot *fb_hist_slot_get_locked(struct vfbfs_fb *fb, struct vfbfs_fb_history *hi
+    , uint64_t seq)
+{
+    struct fb_hist_slot *s = hi->hi_free;
+    struct vfbfs_entry *e;
+    char name[24], *nname;
+
+    snprintf(name, sizeof(name), "%" PRIu64, seq);
+    if (s == NULL) {
+        if ((s = calloc(1, sizeof(*s))) == NULL) {
+            return NULL;
+        }
+        if ((s->hs_file = vfbfs_file_create_in(hi->hi_fs, hi->hi_dir, name)) == NULL) {
+            free(s);
+            return NULL;
+        }
+        s->hs_fb = fb;
+        s->hs_file->f_oprs    = &fb_hist_oprs;
+        s->hs_file->f_private = s;
+        s->hs_file->f_entry->e_stat.st_mode = S_IFREG | 0444;
+        vfbfs_file_set_size(s->hs_file, fb->fb_size);
+    } else {
+        if ((nname = strdup(name)) == NULL) {
+            return NULL;
+        }
+        hi->hi_free = s->hs_next;
+        e = s->hs_file->f_entry;
+        vfbfs_rwlock_wrlock(&hi->hi_dir->d_rwlock, VFBFS_LC_D_RWLOCK);
+        free(e->e_name);
+        e->e_name = nname;
+        RB_INSERT(VFBFS_ENTRY_TREE, &hi->hi_dir->d_entries, e);
+        vfbfs_rwlock_unlock(&hi->hi_dir->d_rwlock, VFBFS_LC_D_RWLOCK);
+    }
+    s->hs_seq = seq;
+    s->hs_file->f_entry->e_stat.st_mtime = time(NULL);
+    return s;
+}
+
+/* Takes the file out of the directory, with hi_lock held */
+static void fb_hist_slot_put_locked(struct vfbfs_fb_history *hi, struct fb_hist_slot *s)
+{
+    vfbfs_rwlock_wrlock(&hi->hi_dir->d_rwlock, VFBFS_LC_D_RWLOCK);
+    RB_REMOVE(VFBFS_ENTRY_TREE, &hi->hi_dir->d_entries, s->hs_file->f_entry);
+    vfbfs_rwlock_unlock(&hi->hi_dir->d_rwlock, VFBFS_LC_D_RWLOCK);
+    s->hs_seq   = 0;
+    s->hs_next  = hi->hi_free;
+    hi->hi_free = s;
+}
+
+/* Turns the second oldest frame into a keyframe, with hi_lock held */
+static void fb_hist_rebase_locked(struct vfbfs_fb *fb, struct vfbfs_fb_history *hi)
+{
+    struct fb_hist_frame *next = &hi->hi_ring[fb_hist_index(hi, 1)];
+    uint8_t *frame = malloc(fb->fb_size), *enc = malloc(fb->fb_size + 2 * FB_HIST_VARINT_MAX);
+    size_t len;
+
+    if (frame != NULL && enc != NULL && fb_hist_rebuild_locked(fb, hi, 1, frame) == 0) {
+        len = fb_hist_encode(frame, NULL, 0, fb->fb_size, fb->fb_size, enc);
+        free(next->hf_data);
+        hi->hi_used   = hi->hi_used - next->hf_len + len;
+        next->hf_data = enc;
+        next->hf_len  = len;
+        next->hf_key  = true;
+        enc = NULL;
+    }
+    free(frame);
+    free(enc);
+}
+
+/* Drops the oldest frame, with hi_lock held */
+static void fb_hist_evict_locked(struct vfbfs_fb *fb, struct vfbfs_fb_history *hi)
+{
+    struct fb_hist_frame *old = &hi->hi_ring[hi->hi_head];
+
+    if (hi->hi_count > 1 && !hi->hi_ring[fb_hist_index(hi, 1)].hf_key) {
+        fb_hist_rebase_locked(fb, hi);
+    }
+    hi->hi_used -= old->hf_len;
+    free(old->hf_data);
+    fb_hist_slot_put_locked(hi, old->hf_slot);
+    memset(old, 0, sizeof(*old));
+    hi->hi_head = fb_hist_index(hi, 1);
+    hi->hi_count--;
+    /* Without the memory to rebase, the deltas up to the next keyframe go too */
+    while (hi->hi_count > 0 && !hi->hi_ring[hi->hi_head].hf_key) {
+        old = &hi->hi_ring[hi->hi_head];
+        hi->hi_used -= old->hf_len;
+        free(old->hf_data);
+        fb_hist_slot_put_locked(hi, old->hf_slot);
+        memset(old, 0, sizeof(*old));
+        hi->hi_head = fb_hist_index(hi, 1);
+        hi->hi_count--;
+    }
+}
+
+/* Evicts until len more bytes (and a frame if frame is set) fit, with hi_lock held */
+static void fb_hist_make_room_locked(struct vfbfs_fb *fb, struct vfbfs_fb_history *hi, size_t len
+    , bool frame)
+{
+    while (hi->hi_count > 0 && ((frame && hi->hi_count == VFBFS_FB_HISTORY_MAX)
+            || hi->hi_used + len > hi->hi_budget || hi->hi_budget == 0)) {
+        fb_hist_evict_locked(fb, hi);
+    }
+}
+
+static int fb_hist_push_locked(struct vfbfs_fb *fb, struct vfbfs_fb_history *hi, uint8_t *data
+    , size_t len, bool key)
+{
+    struct fb_hist_frame *hf;
+    struct fb_hist_slot *s;
+
+    if ((s = fb_hist_slot_get_locked(fb, hi, hi->hi_seq + 1)) == NULL) {
+        return -ENOMEM;
+    }
+    hf = &hi->hi_ring[fb_hist_index(hi, hi->hi_count++)];
+    hf->hf_seq   = ++hi->hi_seq;
+    hf->hf_key   = key;
+    hf->hf_data  = data;
+    hf->hf_len   = len;
+    hf->hf_slot  = s;
+    hi->hi_used += len;
+    hi->hi_since_key = key ? 0 : hi->hi_since_key + 1;
+    return 0;
+}
+
+/*
+ * Copies the screen rows covered by the damage (in page rows) to be
+ * recorded by vfbfs_fb_history_record(), from the flush thread with
+ * fb_lock held. A new origin or pan changes every row.
+*/
+void vfbfs_fb_history_capture_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r)
+{
+    struct vfbfs_fb_history *hi = fb->fb_history;
+    unsigned h = fb->fb_height, y0, y1, y;
+
+    if (hi == NULL) {
+        return;
+    }
+    if (__atomic_load_n(&hi->hi_budget, __ATOMIC_RELAXED) == 0) {
+        hi->hi_primed = false;
+        return;
+    }
+    if (hi->hi_work == NULL) {
+        hi->hi_work    = malloc(fb->fb_size);
+        hi->hi_prev    = malloc(fb->fb_size);
+        hi->hi_scratch = malloc(fb->fb_size + 2 * FB_HIST_VARINT_MAX);
+        if (hi->hi_work == NULL || hi->hi_prev == NULL || hi->hi_scratch == NULL) {
+            free(hi->hi_work);
+            free(hi->hi_prev);
+            free(hi->hi_scratch);
+            hi->hi_work = NULL;
+            return;
+        }
+    }
+    if (!hi->hi_primed || fb->fb_scroll != hi->hi_origin || fb->fb_yoffset != hi->hi_yoffset) {
+        y0 = 0;
+        y1 = h;
+    } else if (vfbfs_fb_rect_empty(r)) {
+        return;
+    } else {
+        y0 = (r->r_y0 + h - fb->fb_scroll) % h;
+        y1 = y0 + (r->r_y1 - r->r_y0);
+        if (y1 > h) {
+            y0 = 0;
+            y1 = h;
+        }
+    }
+    for (y = y0; y < y1; y++) {
+        memcpy(hi->hi_work + (size_t)y * fb->fb_stride, vfbfs_fb_span(fb, 0, y, NULL), fb->fb_stride);
+    }
+    hi->hi_origin  = fb->fb_scroll;
+    hi->hi_yoffset = fb->fb_yoffset;
+    hi->hi_y0      = y0;
+    hi->hi_y1      = y1;
+}
+
+/* Encodes and stores what was captured, from the flush thread without fb_lock */
+void vfbfs_fb_history_record(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_history *hi = fb->fb_history;
+    uint8_t *work, *prev, *data;
+    size_t from, to, len;
+    bool key;
+
+    if (hi == NULL || hi->hi_y0 >= hi->hi_y1) {
+        return;
+    }
+    work = (uint8_t *)hi->hi_work;
+    prev = (uint8_t *)hi->hi_prev;
+    from = (size_t)hi->hi_y0 * fb->fb_stride;
+    to   = (size_t)hi->hi_y1 * fb->fb_stride;
+
+    vfbfs_mutex_lock(&hi->hi_lock, VFBFS_LC_HISTORY);
+    key = !hi->hi_primed || hi->hi_force_key || hi->hi_count == 0
+        || hi->hi_since_key + 1 >= FB_HIST_KEY_INTERVAL;
+    for (;;) {
+        len = key ? fb_hist_encode(work, NULL, 0, fb->fb_size, fb->fb_size, hi->hi_scratch)
+                  : fb_hist_encode(work, prev, from, to, fb->fb_size, hi->hi_scratch);
+        fb_hist_make_room_locked(fb, hi, len, true);
+        /* A delta needs the frame before it */
+        if (key || hi->hi_count > 0) {
+            break;
+        }
+        key = true;
+    }
+    /* Until a frame is stored, the next one has to be a keyframe */
+    hi->hi_force_key = true;
+    if (len <= hi->hi_budget && (data = malloc(MAX(len, 1))) != NULL) {
+        memcpy(data, hi->hi_scratch, len);
+        if (fb_hist_push_locked(fb, hi, data, len, key) == 0) {
+            hi->hi_force_key = false;
+        } else {
+            free(data);
+        }
+    }
+    vfbfs_mutex_unlock(&hi->hi_lock, VFBFS_LC_HISTORY);
+
+    memcpy(prev + from, work + from, to - from);
+    hi->hi_primed = true;
+    hi->hi_y0     = 0;
+    hi->hi_y1     = 0;
+}
+
+static int fb_hist_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct fb_hist_slot *s = f->f_private;
+    struct vfbfs_fb *fb = s->hs_fb;
+    struct vfbfs_fb_history *hi = fb->fb_history;
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    const char *name = strrchr(path, '/');
+    uint64_t seq = strtoull((name != NULL) ? name + 1 : path, NULL, 10);
+    uint8_t *frame;
+    unsigned i;
+    int r = -ENOENT;
+
+    if (h == NULL) {
+        return -EBADF;
+    }
+    if ((frame = malloc(fb->fb_size)) == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_mutex_lock(&hi->hi_lock, VFBFS_LC_HISTORY);
+    /* The file may show a later frame since the lookup */
+    for (i = 0; seq != 0 && seq == s->hs_seq && i < hi->hi_count; i++) {
+        if (hi->hi_ring[fb_hist_index(hi, i)].hf_seq == seq) {
+            r = fb_hist_rebuild_locked(fb, hi, i, frame);
+            break;
+        }
+    }
+    vfbfs_mutex_unlock(&hi->hi_lock, VFBFS_LC_HISTORY);
+    if (r != 0) {
+        free(frame);
+        return r;
+    }
+    h->h_private  = frame;
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fb_hist_read(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fb_hist_slot *s = f->f_private;
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    size_t total = s->hs_fb->fb_size;
+
+    if (h == NULL || h->h_private == NULL) {
+        return -EBADF;
+    }
+    if (off >= (off_t)total) {
+        return 0;
+    }
+    size = MIN(size, total - off);
+    memcpy(data, (char *)h->h_private + off, size);
+    return size;
+}
+
+static int fb_hist_release(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h != NULL) {
+        free(h->h_private);
+        h->h_private = NULL;
+    }
+    return 0;
+}
+
+static struct vfbfs_file_ops fb_hist_oprs = {
+    .f_open     = fb_hist_open,
+    .f_read     = fb_hist_read,
+    .f_release  = fb_hist_release,
+};
+
+static int fb_hist_budget_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_history *hi = fb->fb_history;
+    unsigned i, keys = 0;
+    uint64_t first;
+
+    vfbfs_mutex_lock(&hi->hi_lock, VFBFS_LC_HISTORY);
+    for (i = 0; i < hi->hi_count; i++) {
+        keys += hi->hi_ring[fb_hist_index(hi, i)].hf_key;
+    }
+    first = (hi->hi_count > 0) ? hi->hi_ring[hi->hi_head].hf_seq : 0;
+    fprintf(out, "budget %zu\nused %zu\nframes %u\nkeyframes %u\nfirst %" PRIu64 "\nlast %" PRIu64 "\n"
+        , hi->hi_budget, hi->hi_used, hi->hi_count, keys, first
+        , (hi->hi_count > 0) ? hi->hi_seq : 0);
+    vfbfs_mutex_unlock(&hi->hi_lock, VFBFS_LC_HISTORY);
+    return 0;
+}
+
+static int fb_hist_budget_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_history *hi = fb->fb_history;
+    unsigned long long budget;
+    char buf[64], unit = '\0';
+
+    if (off != 0 || size >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    if (sscanf(buf, "%llu%c", &budget, &unit) < 1) {
+        return -EINVAL;
+    }
+    if (unit == 'k' || unit == 'K') {
+        budget <<= 10;
+    } else if (unit == 'm' || unit == 'M') {
+        budget <<= 20;
+    } else if (unit != '\0' && unit != '\n') {
+        return -EINVAL;
+    }
+    vfbfs_mutex_lock(&hi->hi_lock, VFBFS_LC_HISTORY);
+    __atomic_store_n(&hi->hi_budget, budget, __ATOMIC_RELAXED);
+    fb_hist_make_room_locked(fb, hi, 0, false);
+    vfbfs_mutex_unlock(&hi->hi_lock, VFBFS_LC_HISTORY);
+    return size;
+}
+
+int vfbfs_fb_history_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_history *hi = calloc(1, sizeof(*hi));
+    struct vfbfs_file *f;
+
+    if (hi == NULL) {
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&hi->hi_lock, NULL);
+    hi->hi_fs     = fs;
+    hi->hi_budget = VFBFS_FB_HISTORY_BUDGET;
+    if ((hi->hi_dir = vfbfs_dir_create_in(fs, fb->fb_dir, "history")) == NULL) {
+        free(hi);
+        return -ENOMEM;
+    }
+    /* A file of the client could take the name of a future frame */
+    hi->hi_dir->d_oprs = vfbfs_dir_get_fixed_ops();
+    fb->fb_history = hi;
+    f = vfbfs_gen_create_in(fs, fb->fb_dir, "history_budget", fb_hist_budget_render, fb
+        , VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_gen_from_file(f)->g_write = fb_hist_budget_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
+
+/*
+ * Frees the history of a framebuffer whose creation failed, before the
+ * flush thread ran. The files of hi_dir go with the fb directory.
+*/
+void vfbfs_fb_history_free(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_history *hi = fb->fb_history;
+    if (hi == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&hi->hi_lock);
+    free(hi);
+    fb->fb_history = NULL;
+}
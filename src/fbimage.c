@@ -0,0 +1,651 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * /fb/<n>/image shows encoded images: binary PPM (P5, P6), uncompressed
+ * 24 and 32 bit BMP, and 8 bit PNG. An image is decoded as soon as the
+ * writes of a handle make it complete, so "cat logo.png > image" works and
+ * a bad image fails the write which completed it. It's drawn at the top
+ * left corner, clipped to the screen.
+ *
+ * The decoded pixels are converted to the framebuffer's format in stripes
+ * of rows on the worker pool (see workers.h). PNG rows are inflated and
+ * unfiltered first, which is sequential by nature, only the conversion is
+ * parallel for them. The last converted images are kept with the hash of
+ * their encoded bytes, showing one of them again is a copy.
+*/
+#include <fb.h>
+#include <workers.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define FB_IMAGE_MAX_DIM        16384
+#define FB_IMAGE_MAX_BYTES      (64 << 20)  /* of an encoded image */
+#define FB_IMAGE_MAX_RAW        (64 << 20)  /* of the inflated rows of a PNG */
+#define FB_IMAGE_CACHE_SIZE     4
+#define FB_IMAGE_STRIPE_ROWS    32
+
+/* The layout of a decoded row */
+enum FbImageLayout {
+    FB_IMAGE_GRAY, FB_IMAGE_GRAYA, FB_IMAGE_RGB, FB_IMAGE_RGBA
+  , FB_IMAGE_BGR, FB_IMAGE_BGRX, FB_IMAGE_PAL
+};
+
+/* Decoded pixels, row y starts at s_pixels + y * s_stride */
+struct fb_image_src {
+    unsigned            s_width, s_height;
+    enum FbImageLayout  s_layout;
+    const uint8_t      *s_pixels;
+    ptrdiff_t           s_stride;
+    unsigned            s_maxval;       /* PPM samples go to 0..s_maxval */
+    const uint8_t      *s_palette;      /* RGB triplets */
+    unsigned            s_palette_len;
+    uint8_t            *s_alloc;        /* freed with the source */
+};
+
+/* A converted image: the clipped pixels in the framebuffer's format */
+struct fb_image_entry {
+    uint64_t            ie_hash;
+    size_t              ie_len;         /* of the encoded image */
+    unsigned            ie_width, ie_height;
+    char               *ie_pixels;
+    uint64_t            ie_used;
+};
+
+/* Protected by the image file's f_lock */
+struct vfbfs_fb_image {
+    struct fb_image_entry   im_cache[FB_IMAGE_CACHE_SIZE];
+    uint64_t                im_clock;
+};
+
+/* The bytes of an incomplete image, per open() */
+struct fb_image_carry {
+    char               *ic_buf;
+    size_t              ic_len;
+    size_t              ic_size;
+};
+
+/* One conversion job, split in stripes */
+struct fb_image_job {
+    struct vfbfs_fb            *j_fb;
+    const struct fb_image_src  *j_src;
+    struct fb_image_entry      *j_entry;
+};
+
+static inline uint32_t fb_image_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint32_t fb_image_le32(const uint8_t *p)
+{
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t fb_image_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static bool fb_image_dims_ok(uint64_t w, uint64_t h)
+{
+    return w > 0 && h > 0 && w <= FB_IMAGE_MAX_DIM && h <= FB_IMAGE_MAX_DIM;
+}
+
+/*
+ * Parses "P5|P6 <width> <height> <maxval>" and the whitespace after it.
+ * Returns the header's length, 0 if it isn't complete yet or -EINVAL.
+*/
+static ssize_t fb_image_ppm_header(const uint8_t *d, size_t len, struct fb_image_src *s)
+{
+    unsigned long v[3];
+    size_t pos = 2;
+    int i;
+
+    if (len < 2) {
+        return 0;
+    }
+    if (d[0] != 'P' || (d[1] != '5' && d[1] != '6')) {
+        return -EINVAL;
+    }
+    for (i = 0; i < 3; i++) {
+        for (;;) {
+            if (pos >= len) {
+                return 0;
+            }
+            if (d[pos] == '#') {
+                while (pos < len && d[pos] != '\n') {
+                    pos++;
+                }
+            } else if (d[pos] == ' ' || d[pos] == '\t' || d[pos] == '\r' || d[pos] == '\n') {
+                pos++;
+            } else {
+                break;
+            }
+        }
+        if (d[pos] < '0' || d[pos] > '9') {
+            return -EINVAL;
+        }
+        for (v[i] = 0; pos < len && d[pos] >= '0' && d[pos] <= '9'; pos++) {
+            v[i] = MIN(v[i] * 10 + (d[pos] - '0'), 1UL << 20);
+        }
+        if (pos >= len) {
+            return 0;
+        }
+    }
+    if (!fb_image_dims_ok(v[0], v[1]) || v[2] == 0 || v[2] > 255) {
+        return -EINVAL;
+    }
+    s->s_width  = v[0];
+    s->s_height = v[1];
+    s->s_maxval = v[2];
+    s->s_layout = (d[1] == '5') ? FB_IMAGE_GRAY : FB_IMAGE_RGB;
+    return pos + 1;
+}
+
+/* The length of the image at the start of d, 0 if that isn't known yet or -errno */
+static ssize_t fb_image_length(const uint8_t *d, size_t len)
+{
+    static const uint8_t png_sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    struct fb_image_src s;
+    size_t pos, total;
+    ssize_t hlen;
+
+    if (len < 2) {
+        return 0;
+    }
+    if (d[0] == 'P') {
+        if ((hlen = fb_image_ppm_header(d, len, &s)) <= 0) {
+            return hlen;
+        }
+        total = hlen + (size_t)s.s_width * s.s_height * (s.s_layout == FB_IMAGE_RGB ? 3 : 1);
+    } else if (d[0] == 'B' && d[1] == 'M') {
+        if (len < 6) {
+            return 0;
+        }
+        /* bfSize, at least the headers fb_image_bmp() reads */
+        if ((total = fb_image_le32(d + 2)) < 54) {
+            return -EINVAL;
+        }
+    } else if (d[0] == png_sig[0]) {
+        if (len < sizeof(png_sig)) {
+            return 0;
+        }
+        if (memcmp(d, png_sig, sizeof(png_sig)) != 0) {
+            return -EINVAL;
+        }
+        /* Up to the end of the IEND chunk */
+        for (pos = sizeof(png_sig); pos + 8 <= len; pos += 12 + fb_image_be32(d + pos)) {
+            if (fb_image_be32(d + pos) > FB_IMAGE_MAX_BYTES) {
+                return -EFBIG;
+            }
+            if (memcmp(d + pos + 4, "IEND", 4) == 0) {
+                return (pos + 12 <= len) ? (ssize_t)(pos + 12) : 0;
+            }
+        }
+        return (pos > FB_IMAGE_MAX_BYTES) ? -EFBIG : 0;
+    } else {
+        return -EINVAL;
+    }
+    if (total > FB_IMAGE_MAX_BYTES) {
+        return -EFBIG;
+    }
+    return (total <= len) ? (ssize_t)total : 0;
+}
+
+static int fb_image_ppm(const uint8_t *d, size_t len, struct fb_image_src *s)
+{
+    ssize_t hlen = fb_image_ppm_header(d, len, s);
+    if (hlen <= 0) {
+        return -EINVAL;
+    }
+    s->s_pixels = d + hlen;
+    s->s_stride = (ptrdiff_t)s->s_width * (s->s_layout == FB_IMAGE_RGB ? 3 : 1);
+    return 0;
+}
+
+static int fb_image_bmp(const uint8_t *d, size_t len, struct fb_image_src *s)
+{
+    uint32_t off, hsize, compression;
+    int32_t w, h;
+    unsigned bits;
+    size_t stride;
+
+    if (len < 54) {
+        return -EINVAL;
+    }
+    off         = fb_image_le32(d + 10);
+    hsize       = fb_image_le32(d + 14);
+    w           = (int32_t)fb_image_le32(d + 18);
+    h           = (int32_t)fb_image_le32(d + 22);
+    bits        = fb_image_le16(d + 28);
+    compression = fb_image_le32(d + 30);
+    if (hsize < 40 || w <= 0 || h == 0 || h == INT32_MIN || !fb_image_dims_ok(w, h < 0 ? -h : h)) {
+        return -EINVAL;
+    }
+    /* BI_RGB, or BI_BITFIELDS with the usual masks for 32 bits */
+    if (!(bits == 24 && compression == 0) && !(bits == 32 && (compression == 0 || compression == 3))) {
+        return -EOPNOTSUPP;
+    }
+    s->s_width  = w;
+    s->s_height = (h < 0) ? -h : h;
+    s->s_layout = (bits == 24) ? FB_IMAGE_BGR : FB_IMAGE_BGRX;
+    s->s_maxval = 255;
+    stride      = ((size_t)w * (bits / 8) + 3) & ~(size_t)3;
+    if (off > len || stride * s->s_height > len - off) {
+        return -EINVAL;
+    }
+    if (h < 0) {
+        s->s_pixels = d + off;
+        s->s_stride = stride;
+    } else {
+        /* Bottom-up */
+        s->s_pixels = d + off + stride * (s->s_height - 1);
+        s->s_stride = -(ptrdiff_t)stride;
+    }
+    return 0;
+}
+
+static inline uint8_t fb_image_paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+/* Undoes the PNG filters in place, every row is preceded by its filter type */
+static int fb_image_png_unfilter(uint8_t *raw, unsigned height, size_t row_bytes, unsigned bpp)
+{
+    uint8_t *row, *prev = NULL;
+    unsigned y;
+    size_t i;
+
+    for (y = 0; y < height; y++, prev = row) {
+        row = raw + y * (row_bytes + 1) + 1;
+        switch (row[-1]) {
+        case 0:
+            break;
+        case 1:
+            for (i = bpp; i < row_bytes; i++) {
+                row[i] += row[i - bpp];
+            }
+            break;
+        case 2:
+            for (i = 0; prev != NULL && i < row_bytes; i++) {
+                row[i] += prev[i];
+            }
+            break;
+        case 3:
+            for (i = 0; i < row_bytes; i++) {
+                row[i] += ((i >= bpp ? row[i - bpp] : 0) + (prev != NULL ? prev[i] : 0)) / 2;
+            }
+            break;
+        case 4:
+            for (i = 0; i < row_bytes; i++) {
+                row[i] += fb_image_paeth(i >= bpp ? row[i - bpp] : 0, prev != NULL ? prev[i] : 0
+                    , (i >= bpp && prev != NULL) ? prev[i - bpp] : 0);
+            }
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int fb_image_png(const uint8_t *d, size_t len, struct fb_image_src *s)
+{
+    static const enum FbImageLayout layouts[7] = {
+        [0] = FB_IMAGE_GRAY, [2] = FB_IMAGE_RGB, [3] = FB_IMAGE_PAL
+      , [4] = FB_IMAGE_GRAYA, [6] = FB_IMAGE_RGBA
+    };
+    static const unsigned channels[7] = { [0] = 1, [2] = 3, [3] = 1, [4] = 2, [6] = 4 };
+    const uint8_t *ihdr = d + 16, *chunk;
+    size_t pos, row_bytes, raw_len;
+    uint32_t clen;
+    unsigned type;
+    z_stream zs;
+    int zr = Z_OK;
+
+    if (len < 33 || memcmp(d + 12, "IHDR", 4) != 0) {
+        return -EINVAL;
+    }
+    s->s_width  = fb_image_be32(ihdr);
+    s->s_height = fb_image_be32(ihdr + 4);
+    type        = ihdr[9];
+    if (!fb_image_dims_ok(s->s_width, s->s_height)) {
+        return -EINVAL;
+    }
+    /* 8 bits per sample, not interlaced */
+    if (ihdr[8] != 8 || type > 6 || channels[type] == 0 || ihdr[12] != 0) {
+        return -EOPNOTSUPP;
+    }
+    s->s_layout = layouts[type];
+    s->s_maxval = 255;
+    row_bytes   = (size_t)s->s_width * channels[type];
+    raw_len     = (row_bytes + 1) * s->s_height;
+    if (raw_len > FB_IMAGE_MAX_RAW) {
+        return -EFBIG;
+    }
+    if ((s->s_alloc = malloc(raw_len)) == NULL) {
+        return -ENOMEM;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
+        return -ENOMEM;
+    }
+    zs.next_out  = s->s_alloc;
+    zs.avail_out = raw_len;
+    for (pos = 8; pos + 12 <= len && zr != Z_STREAM_END; pos += 12 + clen) {
+        clen  = fb_image_be32(d + pos);
+        chunk = d + pos + 8;
+        if (clen > len - pos - 12) {
+            break;
+        }
+        if (memcmp(d + pos + 4, "PLTE", 4) == 0) {
+            s->s_palette     = chunk;
+            s->s_palette_len = clen / 3;
+        } else if (memcmp(d + pos + 4, "IDAT", 4) == 0) {
+            zs.next_in  = (Bytef *)chunk;
+            zs.avail_in = clen;
+            zr = inflate(&zs, Z_NO_FLUSH);
+            if (zr != Z_OK && zr != Z_STREAM_END && !(zr == Z_BUF_ERROR && zs.avail_out == 0)) {
+                break;
+            }
+        }
+    }
+    inflateEnd(&zs);
+    if (zs.avail_out != 0 || (type == 3 && s->s_palette == NULL)) {
+        return -EINVAL;
+    }
+    s->s_pixels = s->s_alloc + 1;
+    s->s_stride = row_bytes + 1;
+    return fb_image_png_unfilter(s->s_alloc, s->s_height, row_bytes, channels[type]);
+}
+
+static int fb_image_decode(const uint8_t *d, size_t len, struct fb_image_src *s)
+{
+    memset(s, 0, sizeof(*s));
+    if (d[0] == 'P') {
+        return fb_image_ppm(d, len, s);
+    }
+    if (d[0] == 'B') {
+        return fb_image_bmp(d, len, s);
+    }
+    return fb_image_png(d, len, s);
+}
+
+/* Reads width pixels of row y as RGB888 */
+static void fb_image_row_rgb(const struct fb_image_src *s, unsigned y, unsigned width, uint8_t *rgb)
+{
+    const uint8_t *p = s->s_pixels + (ptrdiff_t)y * s->s_stride, *c;
+    unsigned x;
+
+    switch (s->s_layout) {
+    case FB_IMAGE_GRAY:
+        for (x = 0; x < width; x++, rgb += 3) {
+            rgb[0] = rgb[1] = rgb[2] = p[x];
+        }
+        break;
+    case FB_IMAGE_GRAYA:
+        for (x = 0; x < width; x++, rgb += 3) {
+            rgb[0] = rgb[1] = rgb[2] = p[x * 2];
+        }
+        break;
+    case FB_IMAGE_RGB:
+        memcpy(rgb, p, (size_t)width * 3);
+        break;
+    case FB_IMAGE_RGBA:
+        for (x = 0; x < width; x++, rgb += 3, p += 4) {
+            memcpy(rgb, p, 3);
+        }
+        break;
+    case FB_IMAGE_BGR:
+    case FB_IMAGE_BGRX:
+        for (x = 0; x < width; x++, rgb += 3, p += (s->s_layout == FB_IMAGE_BGR) ? 3 : 4) {
+            rgb[0] = p[2];
+            rgb[1] = p[1];
+            rgb[2] = p[0];
+        }
+        break;
+    case FB_IMAGE_PAL:
+        for (x = 0; x < width; x++, rgb += 3) {
+            if (p[x] < s->s_palette_len) {
+                c = s->s_palette + p[x] * 3;
+                memcpy(rgb, c, 3);
+            } else {
+                memset(rgb, 0, 3);
+            }
+        }
+        break;
+    }
+}
+
+static void fb_image_stripe(void *arg, unsigned stripe)
+{
+    struct fb_image_job *j = arg;
+    const struct fb_image_src *s = j->j_src;
+    struct fb_image_entry *e = j->j_entry;
+    size_t stride = (size_t)e->ie_width * j->j_fb->fb_bpp;
+    unsigned y = stripe * FB_IMAGE_STRIPE_ROWS, y1 = MIN(y + FB_IMAGE_STRIPE_ROWS, e->ie_height);
+    uint8_t *rgb = malloc((size_t)e->ie_width * 3);
+    unsigned i;
+
+    if (rgb == NULL) {
+        /* Shows black instead */
+        memset(e->ie_pixels + y * stride, 0, (y1 - y) * stride);
+        return;
+    }
+    for (; y < y1; y++) {
+        fb_image_row_rgb(s, y, e->ie_width, rgb);
+        if (s->s_maxval != 255) {
+            for (i = 0; i < e->ie_width * 3; i++) {
+                rgb[i] = MIN(rgb[i], s->s_maxval) * 255 / s->s_maxval;
+            }
+        }
+        vfbfs_fb_convert(j->j_fb->fb_format, e->ie_pixels + y * stride
+            , VFBFS_FB_RGB888, rgb, e->ie_width);
+    }
+    free(rgb);
+}
+
+/* Finds the converted image, with the image file's f_lock held */
+static struct fb_image_entry *fb_image_cache_find(struct vfbfs_fb_image *im, uint64_t hash, size_t len)
+{
+    unsigned i;
+    for (i = 0; i < FB_IMAGE_CACHE_SIZE; i++) {
+        if (im->im_cache[i].ie_pixels != NULL && im->im_cache[i].ie_hash == hash
+                && im->im_cache[i].ie_len == len) {
+            return &im->im_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* The least recently used slot, emptied */
+static struct fb_image_entry *fb_image_cache_victim(struct vfbfs_fb_image *im)
+{
+    struct fb_image_entry *e = &im->im_cache[0];
+    unsigned i;
+    for (i = 1; i < FB_IMAGE_CACHE_SIZE; i++) {
+        if (im->im_cache[i].ie_used < e->ie_used) {
+            e = &im->im_cache[i];
+        }
+    }
+    free(e->ie_pixels);
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+/* Decodes (or finds) the image d and draws it, with the image file's f_lock held */
+static int fb_image_show(struct vfbfs_fb *fb, struct vfbfs_fb_image *im, const uint8_t *d, size_t len)
+{
+    uint64_t hash = ((uint64_t)crc32(0, d, len) << 32) | adler32(1, d, len);
+    struct fb_image_entry *e = fb_image_cache_find(im, hash, len);
+    struct vfbfs_fb_rect r;
+    struct fb_image_src s;
+    struct fb_image_job j;
+    bool hit = e != NULL;
+    int err;
+
+    if (e == NULL) {
+        if ((err = fb_image_decode(d, len, &s)) != 0) {
+            free(s.s_alloc);
+            return err;
+        }
+        e = fb_image_cache_victim(im);
+        e->ie_width  = MIN(s.s_width, fb->fb_width);
+        e->ie_height = MIN(s.s_height, fb->fb_height);
+        if ((e->ie_pixels = malloc((size_t)e->ie_width * e->ie_height * fb->fb_bpp)) == NULL) {
+            free(s.s_alloc);
+            return -ENOMEM;
+        }
+        j.j_fb    = fb;
+        j.j_src   = &s;
+        j.j_entry = e;
+        vfbfs_workers_run(fb_image_stripe, &j
+            , (e->ie_height + FB_IMAGE_STRIPE_ROWS - 1) / FB_IMAGE_STRIPE_ROWS);
+        free(s.s_alloc);
+        e->ie_hash = hash;
+        e->ie_len  = len;
+    }
+    e->ie_used = ++im->im_clock;
+
+    r.r_x0 = 0;
+    r.r_y0 = 0;
+    r.r_x1 = e->ie_width;
+    r.r_y1 = e->ie_height;
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    vfbfs_fb_blit_locked(fb, &r, e->ie_pixels, (size_t)e->ie_width * fb->fb_bpp);
+    vfbfs_fb_damage_screen(fb, &r);
+    fb->fb_stats.st_images++;
+    fb->fb_stats.st_image_hits += hit;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+static int fb_image_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h == NULL) {
+        return -EBADF;
+    }
+    if ((h->h_private = calloc(1, sizeof(struct fb_image_carry))) == NULL) {
+        return -ENOMEM;
+    }
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fb_image_write(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_image_carry *ic;
+    ssize_t n = 0;
+    char *nbuf;
+    int err;
+
+    if (h == NULL || h->h_private == NULL) {
+        return -EBADF;
+    }
+    vfbfs_mutex_lock(&h->h_lock, VFBFS_LC_H_LOCK);
+    ic = h->h_private;
+    /* No image is longer, the data can't complete one */
+    if (ic->ic_len + size > FB_IMAGE_MAX_BYTES) {
+        ic->ic_len = 0;
+        vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+        return -EFBIG;
+    }
+    if (ic->ic_len + size > ic->ic_size) {
+        if ((nbuf = realloc(ic->ic_buf, MAX(ic->ic_len + size, ic->ic_size * 2))) == NULL) {
+            vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+            return -ENOMEM;
+        }
+        ic->ic_buf  = nbuf;
+        ic->ic_size = MAX(ic->ic_len + size, ic->ic_size * 2);
+    }
+    memcpy(ic->ic_buf + ic->ic_len, data, size);
+    ic->ic_len += size;
+
+    while (ic->ic_len > 0 && (n = fb_image_length((uint8_t *)ic->ic_buf, ic->ic_len)) > 0) {
+        vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+        err = fb_image_show(fb, fb->fb_image, (uint8_t *)ic->ic_buf, n);
+        vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+        if (err != 0) {
+            n = err;
+            break;
+        }
+        memmove(ic->ic_buf, ic->ic_buf + n, ic->ic_len - n);
+        ic->ic_len -= n;
+    }
+    if (n < 0) {
+        /* Drops the data, the next write starts a new image */
+        ic->ic_len = 0;
+    }
+    vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+    return (n < 0) ? (int)n : (int)size;
+}
+
+static int fb_image_truncate(struct vfbfs *fs, struct vfbfs_file *f, const char *path, off_t size)
+{
+    return 0;
+}
+
+static int fb_image_release(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_image_carry *ic = (h != NULL) ? h->h_private : NULL;
+    if (ic != NULL) {
+        free(ic->ic_buf);
+        free(ic);
+        h->h_private = NULL;
+    }
+    return 0;
+}
+
+static struct vfbfs_file_ops fb_image_oprs = {
+    .f_open     = fb_image_open,
+    .f_write    = fb_image_write,
+    .f_truncate = fb_image_truncate,
+    .f_release  = fb_image_release,
+};
+
+int vfbfs_fb_image_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f;
+
+    if ((fb->fb_image = calloc(1, sizeof(*fb->fb_image))) == NULL) {
+        return -ENOMEM;
+    }
+    if ((f = vfbfs_file_create_in(fs, fb->fb_dir, "image")) == NULL) {
+        return -ENOMEM;
+    }
+    f->f_oprs    = &fb_image_oprs;
+    f->f_private = fb;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0222;
+    return 0;
+}
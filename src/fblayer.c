@@ -0,0 +1,475 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Layers. Every framebuffer has VFBFS_FB_MAX_LAYERS layers above the frame,
+ * each with its own pixels, so the applications sharing a panel (a status
+ * bar over a video) draw independently of each other:
+ *
+ *   /fb/<n>/layers/<k>      premultiplied ARGB pixels (B, G, R, A bytes),
+ *                           4 * w * h bytes, shown at (x, y)
+ *   /fb/<n>/layers/control  "<k> shown|hidden x X y Y w W h H z Z alpha A"
+ *                           lines. Writing "<k> move X Y", "<k> size W H",
+ *                           "<k> z Z", "<k> alpha A", "<k> show" or
+ *                           "<k> hide" lines changes them.
+ *
+ * A change of a layer only damages the screen area it covers, the flush
+ * thread blends the shown layers over the frame bottom up by z (the index
+ * breaks the ties) while converting the damaged rows for the device. The
+ * frame file keeps the application's pixels, only the device gets the
+ * composition. A layer starts at the screen's size at (0, 0) with its
+ * index as z, and is transparent until written.
+*/
+#include <fb.h>
+#include <fbvec.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define FB_LAYER_MAX_SIZE   4096
+
+struct fb_layer {
+    struct vfbfs_fb    *l_fb;
+    unsigned            l_index;
+    int                 l_x, l_y;       /* may be partly off the screen */
+    unsigned            l_w, l_h;
+    int                 l_z;
+    unsigned            l_alpha;        /* applied to the whole layer, 0 to 255 */
+    bool                l_visible;
+    uint8_t            *l_pixels;       /* NULL until the first write */
+    struct vfbfs_file  *l_file;
+};
+
+/* Protected by fb_lock */
+struct vfbfs_fb_layers {
+    struct fb_layer     ly_layers[VFBFS_FB_MAX_LAYERS];
+    struct fb_layer    *ly_order[VFBFS_FB_MAX_LAYERS];  /* the shown ones, bottom up */
+    unsigned            ly_nshown;
+};
+
+/* The screen rectangle of the layer's rows [y0, y1), false if it is off the screen */
+static bool fb_layer_rect(struct vfbfs_fb *fb, const struct fb_layer *l, unsigned y0, unsigned y1
+    , struct vfbfs_fb_rect *r)
+{
+    long x0 = MAX((long)l->l_x, 0L), x1 = MIN((long)l->l_x + l->l_w, (long)fb->fb_width);
+    long sy0 = MAX((long)l->l_y + y0, 0L), sy1 = MIN((long)l->l_y + y1, (long)fb->fb_height);
+
+    if (x0 >= x1 || sy0 >= sy1) {
+        return false;
+    }
+    r->r_x0 = x0;
+    r->r_y0 = sy0;
+    r->r_x1 = x1;
+    r->r_y1 = sy1;
+    return true;
+}
+
+static inline bool fb_layer_shown(const struct fb_layer *l)
+{
+    return l->l_visible && l->l_alpha > 0 && l->l_pixels != NULL;
+}
+
+/* Damages what the layer's rows [y0, y1) cover if it is shown, with fb_lock held */
+static void fb_layer_damage_locked(struct vfbfs_fb *fb, const struct fb_layer *l, unsigned y0, unsigned y1)
+{
+    struct vfbfs_fb_rect r;
+    if (fb_layer_shown(l) && fb_layer_rect(fb, l, y0, y1, &r)) {
+        vfbfs_fb_damage_screen(fb, &r);
+    }
+}
+
+/* Rebuilds ly_order, with fb_lock held */
+static void fb_layers_order_locked(struct vfbfs_fb_layers *ly)
+{
+    struct fb_layer *l;
+    unsigned i, j;
+
+    ly->ly_nshown = 0;
+    for (i = 0; i < VFBFS_FB_MAX_LAYERS; i++) {
+        l = &ly->ly_layers[i];
+        if (!fb_layer_shown(l)) {
+            continue;
+        }
+        /* Insertion by z, few enough layers */
+        for (j = ly->ly_nshown; j > 0 && ly->ly_order[j - 1]->l_z > l->l_z; j--) {
+            ly->ly_order[j] = ly->ly_order[j - 1];
+        }
+        ly->ly_order[j] = l;
+        ly->ly_nshown++;
+    }
+}
+
+/* (v + 127) / 255 for the products of two bytes */
+static inline fb_v8w fb_layer_div255(fb_v8w v)
+{
+    v += 128;
+    return (v + (v >> 8)) >> 8;
+}
+
+/* dst = src * alpha + dst * (1 - src_a * alpha) for 2 pixels */
+static inline void fb_layer_blend2(uint8_t *dst, const uint8_t *src, fb_v8w alpha)
+{
+    const fb_v8w lanes = { 3, 3, 3, 3, 7, 7, 7, 7 };
+    fb_v8 sb, db;
+    fb_v8w s, d;
+
+    memcpy(&sb, src, 8);
+    memcpy(&db, dst, 8);
+    s  = fb_layer_div255(__builtin_convertvector(sb, fb_v8w) * alpha);
+    d  = fb_layer_div255(__builtin_convertvector(db, fb_v8w) * (255 - __builtin_shuffle(s, lanes)));
+    s += d;
+    /* Saturated, pixels which are not premultiplied would wrap around */
+    s |= (fb_v8w)(s > 255);
+    db = __builtin_convertvector(s, fb_v8);
+    memcpy(dst, &db, 8);
+}
+
+/* Blends npix pixels of a layer over dst, both B, G, R, A/X bytes */
+static void fb_layer_blend(uint8_t *dst, const uint8_t *src, unsigned npix, unsigned alpha)
+{
+    const uint64_t amask = 0xff000000ff000000ULL;
+    fb_v8w va = (fb_v8w){ 0 } + (uint16_t)alpha;
+    uint8_t s[16], d[16];
+    uint64_t a0, a1;
+
+    for (; npix >= 4; npix -= 4, dst += 16, src += 16) {
+        memcpy(&a0, src, 8);
+        memcpy(&a1, src + 8, 8);
+        if (((a0 | a1) & amask) == 0) {
+            continue;
+        }
+        if (alpha == 255 && (a0 & a1 & amask) == amask) {
+            memcpy(dst, src, 16);
+            continue;
+        }
+        fb_layer_blend2(dst, src, va);
+        fb_layer_blend2(dst + 8, src + 8, va);
+    }
+    if (npix > 0) {
+        memset(s, 0, sizeof(s));
+        memcpy(s, src, npix * 4);
+        memcpy(d, dst, npix * 4);
+        fb_layer_blend2(d, s, va);
+        fb_layer_blend2(d + 8, s + 8, va);
+        memcpy(dst, d, npix * 4);
+    }
+}
+
+/*
+ * Stores the pixels [x0, x0 + npix) of screen row y in row as XRGB8888,
+ * with the shown layers blended over them, called by the flush thread with
+ * fb_lock held. Returns false without touching row if no layer covers them.
+*/
+bool vfbfs_fb_layers_compose_locked(struct vfbfs_fb *fb, uint8_t *row, unsigned y, unsigned x0
+    , unsigned npix)
+{
+    struct vfbfs_fb_layers *ly = fb->fb_layers;
+    const struct fb_layer *l;
+    long lx0, lx1;
+    unsigned i;
+    bool composed = false;
+
+    if (ly == NULL || ly->ly_nshown == 0) {
+        return false;
+    }
+    for (i = 0; i < ly->ly_nshown; i++) {
+        l   = ly->ly_order[i];
+        lx0 = MAX((long)l->l_x, (long)x0);
+        lx1 = MIN((long)l->l_x + l->l_w, (long)x0 + npix);
+        if ((long)y < l->l_y || (long)y >= (long)l->l_y + l->l_h || lx0 >= lx1) {
+            continue;
+        }
+        if (!composed) {
+            vfbfs_fb_convert(VFBFS_FB_XRGB8888, row, fb->fb_format
+                , vfbfs_fb_span(fb, x0, y, NULL), npix);
+            composed = true;
+        }
+        fb_layer_blend(row + (lx0 - x0) * 4
+            , l->l_pixels + ((size_t)(y - l->l_y) * l->l_w + (lx0 - l->l_x)) * 4
+            , lx1 - lx0, l->l_alpha);
+        fb->fb_stats.st_layer_pixels += lx1 - lx0;
+    }
+    return composed;
+}
+
+/*
+ * Damages every shown layer, with fb_lock held. The layers composed into
+ * the rows of a panel scrolling in hardware move with the content, see
+ * fb_scroll_set_locked().
+*/
+void vfbfs_fb_layers_damage_locked(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_layers *ly = fb->fb_layers;
+    unsigned i;
+
+    if (ly == NULL) {
+        return;
+    }
+    for (i = 0; i < ly->ly_nshown; i++) {
+        fb_layer_damage_locked(fb, ly->ly_order[i], 0, ly->ly_order[i]->l_h);
+    }
+}
+
+static int fb_layer_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    /* The size follows the layer's, don't let the page cache trust it */
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fb_layer_read(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fb_layer *l = (struct fb_layer *)f->f_private;
+    struct vfbfs_fb *fb = l->l_fb;
+    size_t total;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    total = (size_t)l->l_w * l->l_h * 4;
+    if (off >= (off_t)total) {
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        return 0;
+    }
+    size = MIN(size, total - off);
+    if (l->l_pixels != NULL) {
+        memcpy(data, l->l_pixels + off, size);
+    } else {
+        memset(data, 0, size);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return size;
+}
+
+static int fb_layer_write(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct fb_layer *l = (struct fb_layer *)f->f_private;
+    struct vfbfs_fb *fb = l->l_fb;
+    size_t total, stride;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    stride = (size_t)l->l_w * 4;
+    total  = stride * l->l_h;
+    if (off >= (off_t)total) {
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        return -ENOSPC;
+    }
+    if (l->l_pixels == NULL) {
+        if ((l->l_pixels = calloc(1, total)) == NULL) {
+            vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+            return -ENOMEM;
+        }
+        fb_layers_order_locked(fb->fb_layers);
+    }
+    size = MIN(size, total - off);
+    memcpy(l->l_pixels + off, data, size);
+    fb_layer_damage_locked(fb, l, off / stride, (off + size - 1) / stride + 1);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return size;
+}
+
+/* The layer has a fixed size, O_TRUNC is accepted but ignored */
+static int fb_layer_truncate(struct vfbfs *fs, struct vfbfs_file *f, const char *path, off_t size)
+{
+    return 0;
+}
+
+/* Waits until the earlier writes reached the device, like the frame */
+static int fb_layer_fsync(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , int datasync, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = ((struct fb_layer *)f->f_private)->l_fb;
+    uint64_t seq;
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    seq = fb->fb_write_seq;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return vfbfs_fb_wait_flush(fb, seq);
+}
+
+static struct vfbfs_file_ops fb_layer_oprs = {
+    .f_open     = fb_layer_open,
+    .f_read     = fb_layer_read,
+    .f_write    = fb_layer_write,
+    .f_truncate = fb_layer_truncate,
+    .f_fsync    = fb_layer_fsync,
+};
+
+static int fb_layers_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct fb_layer layers[VFBFS_FB_MAX_LAYERS], *l;
+    unsigned i;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    memcpy(layers, fb->fb_layers->ly_layers, sizeof(layers));
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    for (i = 0; i < VFBFS_FB_MAX_LAYERS; i++) {
+        l = &layers[i];
+        fprintf(out, "%u %s x %d y %d w %u h %u z %d alpha %u\n", i
+            , fb_layer_shown(l) ? "shown" : "hidden", l->l_x, l->l_y, l->l_w, l->l_h, l->l_z
+            , l->l_alpha);
+    }
+    return 0;
+}
+
+/* Runs one control line */
+static int fb_layers_command(struct vfbfs_fb *fb, const char *line)
+{
+    struct fb_layer *l;
+    unsigned k, w, h, alpha;
+    uint8_t *pixels = NULL;
+    char cmd[16];
+    int n, a, b;
+
+    if (sscanf(line, "%u %15s %n", &k, cmd, &n) < 2 || k >= VFBFS_FB_MAX_LAYERS) {
+        return -EINVAL;
+    }
+    line += n;
+    l = &fb->fb_layers->ly_layers[k];
+    if (strcmp(cmd, "size") == 0) {
+        if (sscanf(line, "%u %u", &w, &h) != 2 || w == 0 || h == 0
+                || w > FB_LAYER_MAX_SIZE || h > FB_LAYER_MAX_SIZE) {
+            return -EINVAL;
+        }
+        /* The old pixels don't fit, it is transparent until written again */
+        if ((pixels = calloc(1, (size_t)w * h * 4)) == NULL) {
+            return -ENOMEM;
+        }
+    } else if (strcmp(cmd, "move") == 0 || strcmp(cmd, "z") == 0) {
+        if (sscanf(line, "%d %d", &a, &b) != ((cmd[0] == 'm') ? 2 : 1)) {
+            return -EINVAL;
+        }
+    } else if (strcmp(cmd, "alpha") == 0) {
+        if (sscanf(line, "%u", &alpha) != 1 || alpha > 255) {
+            return -EINVAL;
+        }
+    } else if (strcmp(cmd, "show") != 0 && strcmp(cmd, "hide") != 0) {
+        return -EINVAL;
+    }
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    fb_layer_damage_locked(fb, l, 0, l->l_h);
+    switch (cmd[0]) {
+        case 's':
+        if (cmd[1] == 'h') {
+            l->l_visible = true;
+            break;
+        }
+        free(l->l_pixels);
+        l->l_pixels = pixels;
+        l->l_w      = w;
+        l->l_h      = h;
+        vfbfs_file_set_size(l->l_file, (size_t)w * h * 4);
+        break;
+
+        case 'm':
+        l->l_x = a;
+        l->l_y = b;
+        break;
+
+        case 'z':
+        l->l_z = a;
+        break;
+
+        case 'a':
+        l->l_alpha = alpha;
+        break;
+
+        case 'h':
+        l->l_visible = false;
+        break;
+    }
+    fb_layers_order_locked(fb->fb_layers);
+    fb_layer_damage_locked(fb, l, 0, l->l_h);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+static int fb_layers_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    char buf[512], *line, *next;
+    int r;
+
+    if (off != 0 || size >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    for (line = buf; line != NULL && *line != '\0'; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        if (*line != '\0' && (r = fb_layers_command(fb, line)) != 0) {
+            return r;
+        }
+    }
+    return size;
+}
+
+int vfbfs_fb_layers_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_layers *ly = calloc(1, sizeof(*ly));
+    struct vfbfs_dir *dir;
+    struct vfbfs_file *f;
+    struct fb_layer *l;
+    char name[16];
+    unsigned i;
+
+    if (ly == NULL) {
+        return -ENOMEM;
+    }
+    if ((dir = vfbfs_dir_create_in(fs, fb->fb_dir, "layers")) == NULL) {
+        free(ly);
+        return -ENOMEM;
+    }
+    fb->fb_layers = ly;
+    for (i = 0; i < VFBFS_FB_MAX_LAYERS; i++) {
+        l = &ly->ly_layers[i];
+        snprintf(name, sizeof(name), "%u", i);
+        if ((l->l_file = vfbfs_file_create_in(fs, dir, name)) == NULL) {
+            return -ENOMEM;
+        }
+        l->l_fb      = fb;
+        l->l_index   = i;
+        l->l_w       = fb->fb_width;
+        l->l_h       = fb->fb_height;
+        l->l_z       = i;
+        l->l_alpha   = 255;
+        l->l_visible = true;
+        l->l_file->f_oprs    = &fb_layer_oprs;
+        l->l_file->f_private = l;
+        l->l_file->f_entry->e_stat.st_mode = S_IFREG | 0666;
+        vfbfs_file_set_size(l->l_file, (size_t)l->l_w * l->l_h * 4);
+    }
+    f = vfbfs_gen_create_in(fs, dir, "control", fb_layers_render, fb, VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_gen_from_file(f)->g_write = fb_layers_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
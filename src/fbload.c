@@ -0,0 +1,566 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * End-to-end load generator. Mounts vfbfs with virtual framebuffers, then
+ * N producer processes write frames into /fb/<n>/frame (fsync()-ing each
+ * one, which returns when the frame is on the device) while M readers sample
+ * them. Reports the sustained frame rate, the write-to-flush latency and the
+ * CPU time spent per frame, as JSON.
+ *
+ *   make fbload && ./vfbfs-fbload -p 4 -r 2 -s 240x320 -f rgb565 -D 0.25 -T 10
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#ifndef MIN
+# define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+# define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define FBLOAD_MAX_PROCS    256
+#define FBLOAD_MAX_SAMPLES  100000
+
+struct fbload_options {
+    const char *daemon;         /* vfbfs binary */
+    const char *mountpoint;
+    int         producers;
+    int         readers;
+    int         framebuffers;
+    unsigned    width;
+    unsigned    height;
+    const char *format;
+    unsigned    refresh_hz;
+    const char *device;
+    double      dirty;          /* fraction of the rows changed per frame */
+    double      read_hz;        /* samples per second per reader, 0: as fast as possible */
+    int         duration;       /* seconds */
+};
+
+/* Sent back from every child process through a pipe, followed by the samples */
+struct fbload_result {
+    long     r_frames;
+    long     r_errors;
+    uint64_t r_bytes;
+    uint64_t r_cpu_ns;
+    long     r_nsamples;
+};
+
+struct fbload_child {
+    pid_t                c_pid;
+    int                  c_fd;
+    bool                 c_producer;
+    struct fbload_result c_result;
+    uint64_t            *c_samples;
+};
+
+static inline uint64_t fbload_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned fbload_bpp(const char *format)
+{
+    if (strcmp(format, "rgb565") == 0) {
+        return 2;
+    } else if (strcmp(format, "rgb888") == 0) {
+        return 3;
+    } else if (strcmp(format, "xrgb8888") == 0) {
+        return 4;
+    }
+    return 0;
+}
+
+static uint64_t fbload_cpu_self(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL
+         + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* utime + stime of another process, from /proc/<pid>/stat */
+static uint64_t fbload_cpu_of(pid_t pid)
+{
+    char path[64], buf[1024], *p;
+    unsigned long ut = 0, st = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+    if (fgets(buf, sizeof(buf), fp) != NULL && (p = strrchr(buf, ')')) != NULL) {
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st);
+    }
+    fclose(fp);
+    return (ut + st) * (1000000000ULL / sysconf(_SC_CLK_TCK));
+}
+
+static int fbload_write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t r;
+    while (len > 0) {
+        if ((r = write(fd, p, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p   += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int fbload_read_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    ssize_t r;
+    while (len > 0) {
+        if ((r = read(fd, p, len)) <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p   += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static void fbload_frame_path(const struct fbload_options *o, int index, char *buf, size_t len)
+{
+    snprintf(buf, len, "%s/fb/%d/frame", o->mountpoint, index % o->framebuffers);
+}
+
+/*
+ * Producer: every frame rewrites a band of dirty * height rows, moving down
+ * the screen, and waits for it to reach the device.
+*/
+static void fbload_producer(const struct fbload_options *o, int index
+    , struct fbload_result *res, uint64_t *samples)
+{
+    size_t stride = o->width * fbload_bpp(o->format);
+    size_t fsize  = stride * o->height;
+    unsigned rows = MAX(1, (unsigned)(o->dirty * o->height + 0.5)), row = 0, i;
+    uint64_t deadline = fbload_now() + o->duration * 1000000000ULL, start;
+    char path[4096], *frame = malloc(fsize);
+    size_t len;
+    int fd;
+
+    fbload_frame_path(o, index, path, sizeof(path));
+    if (frame == NULL || (fd = open(path, O_RDWR)) < 0) {
+        res->r_errors++;
+        free(frame);
+        return;
+    }
+    memset(frame, index, fsize);
+    while (fbload_now() < deadline) {
+        rows = MIN(rows, o->height - row);
+        len  = rows * stride;
+        for (i = 0; i < len; i++) {
+            frame[row * stride + i] += 1;
+        }
+        start = fbload_now();
+        if (pwrite(fd, frame + row * stride, len, row * stride) != (ssize_t)len
+                || fsync(fd) != 0) {
+            res->r_errors++;
+            break;
+        }
+        if (res->r_nsamples < FBLOAD_MAX_SAMPLES) {
+            samples[res->r_nsamples++] = fbload_now() - start;
+        }
+        res->r_frames++;
+        res->r_bytes += len;
+        row = (row + rows) % o->height;
+        rows = MAX(1, (unsigned)(o->dirty * o->height + 0.5));
+    }
+    close(fd);
+    free(frame);
+}
+
+/* Reader: reads whole frames, at read_hz or as fast as possible */
+static void fbload_reader(const struct fbload_options *o, int index
+    , struct fbload_result *res, uint64_t *samples)
+{
+    size_t fsize = o->width * fbload_bpp(o->format) * o->height;
+    uint64_t deadline = fbload_now() + o->duration * 1000000000ULL, start;
+    uint64_t period = (o->read_hz > 0) ? 1000000000ULL / o->read_hz : 0;
+    char path[4096], *frame = malloc(fsize);
+    struct timespec ts;
+    int fd;
+
+    fbload_frame_path(o, index, path, sizeof(path));
+    if (frame == NULL || (fd = open(path, O_RDONLY)) < 0) {
+        res->r_errors++;
+        free(frame);
+        return;
+    }
+    while ((start = fbload_now()) < deadline) {
+        if (pread(fd, frame, fsize, 0) != (ssize_t)fsize) {
+            res->r_errors++;
+            break;
+        }
+        if (res->r_nsamples < FBLOAD_MAX_SAMPLES) {
+            samples[res->r_nsamples++] = fbload_now() - start;
+        }
+        res->r_frames++;
+        res->r_bytes += fsize;
+        if (period != 0) {
+            ts.tv_sec  = period / 1000000000ULL;
+            ts.tv_nsec = period % 1000000000ULL;
+            nanosleep(&ts, NULL);
+        }
+    }
+    close(fd);
+    free(frame);
+}
+
+static int fbload_spawn(const struct fbload_options *o, struct fbload_child *c
+    , bool producer, int index)
+{
+    struct fbload_result res;
+    uint64_t *samples;
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    c->c_producer = producer;
+    if ((c->c_pid = fork()) < 0) {
+        return -1;
+    }
+    if (c->c_pid == 0) {
+        close(fds[0]);
+        memset(&res, 0, sizeof(res));
+        samples = malloc(FBLOAD_MAX_SAMPLES * sizeof(uint64_t));
+        if (producer) {
+            fbload_producer(o, index, &res, samples);
+        } else {
+            fbload_reader(o, index, &res, samples);
+        }
+        res.r_cpu_ns = fbload_cpu_self();
+        fbload_write_all(fds[1], &res, sizeof(res));
+        fbload_write_all(fds[1], samples, res.r_nsamples * sizeof(uint64_t));
+        _exit(0);
+    }
+    close(fds[1]);
+    c->c_fd = fds[0];
+    return 0;
+}
+
+static int fbload_collect(struct fbload_child *c)
+{
+    int r = fbload_read_all(c->c_fd, &c->c_result, sizeof(c->c_result));
+    if (r == 0) {
+        c->c_samples = malloc(c->c_result.r_nsamples * sizeof(uint64_t) + 1);
+        r = fbload_read_all(c->c_fd, c->c_samples, c->c_result.r_nsamples * sizeof(uint64_t));
+    }
+    close(c->c_fd);
+    waitpid(c->c_pid, NULL, 0);
+    return r;
+}
+
+static pid_t fbload_start_daemon(const struct fbload_options *o)
+{
+    char *argv[FBLOAD_MAX_PROCS + 8], spec[256], path[4096];
+    struct stat st;
+    pid_t pid;
+    int i, argc = 0;
+
+    argv[argc++] = (char *)o->daemon;
+    argv[argc++] = "-f";
+    argv[argc++] = (char *)o->mountpoint;
+    for (i = 0; i < o->framebuffers; i++) {
+        snprintf(spec, sizeof(spec), "--fb=%ux%u:%s@%u,%s", o->width, o->height
+            , o->format, o->refresh_hz, o->device);
+        argv[argc++] = strdup(spec);
+    }
+    argv[argc] = NULL;
+
+    if ((pid = fork()) < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        execv(o->daemon, argv);
+        perror(o->daemon);
+        _exit(127);
+    }
+
+    /* Wait for the mount to appear */
+    snprintf(path, sizeof(path), "%s/fb/%d/frame", o->mountpoint, o->framebuffers - 1);
+    for (i = 0; i < 100; i++) {
+        if (stat(path, &st) == 0) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return -1;
+        }
+        usleep(50000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void fbload_stop_daemon(const struct fbload_options *o, pid_t pid)
+{
+    pid_t um;
+    if ((um = fork()) == 0) {
+        execlp("fusermount", "fusermount", "-u", o->mountpoint, (char *)NULL);
+        _exit(127);
+    }
+    if (um > 0) {
+        waitpid(um, NULL, 0);
+    }
+    if (waitpid(pid, NULL, WNOHANG) == 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+/* Sums the 'key value' lines of every /fb/<n>/stats */
+static uint64_t fbload_fb_stat(const struct fbload_options *o, const char *key)
+{
+    char path[4096], k[64];
+    unsigned long v;
+    uint64_t sum = 0;
+    FILE *fp;
+    int i;
+
+    for (i = 0; i < o->framebuffers; i++) {
+        snprintf(path, sizeof(path), "%s/fb/%d/stats", o->mountpoint, i);
+        if ((fp = fopen(path, "r")) == NULL) {
+            continue;
+        }
+        while (fscanf(fp, "%63s %lu", k, &v) == 2) {
+            if (strcmp(k, key) == 0) {
+                sum += v;
+            }
+        }
+        fclose(fp);
+    }
+    return sum;
+}
+
+static int fbload_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void fbload_print_latency(const char *name, struct fbload_child *children
+    , int nchildren, bool producer)
+{
+    uint64_t *all;
+    long n = 0, i;
+    int c;
+
+    for (c = 0; c < nchildren; c++) {
+        if (children[c].c_producer == producer) {
+            n += children[c].c_result.r_nsamples;
+        }
+    }
+    all = malloc(n * sizeof(uint64_t) + 1);
+    for (c = 0, i = 0; c < nchildren; c++) {
+        if (children[c].c_producer == producer) {
+            memcpy(all + i, children[c].c_samples
+                , children[c].c_result.r_nsamples * sizeof(uint64_t));
+            i += children[c].c_result.r_nsamples;
+        }
+    }
+    qsort(all, n, sizeof(uint64_t), fbload_cmp_u64);
+    printf("  \"%s\": {\"samples\": %ld, \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+           ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 "},\n"
+        , name, n
+        , n ? all[(long)(0.50 * (n - 1))] : 0, n ? all[(long)(0.90 * (n - 1))] : 0
+        , n ? all[(long)(0.99 * (n - 1))] : 0, n ? all[n - 1] : 0);
+    free(all);
+}
+
+static void fbload_usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -d path     vfbfs binary (./vfbfs)\n"
+        "  -m dir      mountpoint (a temporary directory)\n"
+        "  -p n        producer processes (1)\n"
+        "  -r n        reader processes (0)\n"
+        "  -b n        framebuffers (one per producer)\n"
+        "  -s WxH      frame size (240x320)\n"
+        "  -f format   rgb565, rgb888 or xrgb8888 (rgb565)\n"
+        "  -z hz       refresh rate (60)\n"
+        "  -v device   device and its arguments (virtual)\n"
+        "  -D frac     dirty fraction of each frame (1.0)\n"
+        "  -R hz       reader sample rate, 0 is unlimited (10)\n"
+        "  -T sec      duration (10)\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fbload_options o = {
+        .daemon       = "./vfbfs",
+        .mountpoint   = NULL,
+        .producers    = 1,
+        .readers      = 0,
+        .framebuffers = 0,
+        .width        = 240,
+        .height       = 320,
+        .format       = "rgb565",
+        .refresh_hz   = 60,
+        .device       = "virtual",
+        .dirty        = 1.0,
+        .read_hz      = 10,
+        .duration     = 10,
+    };
+    struct fbload_child *children;
+    char tmpdir[] = "/tmp/vfbfs-fbload.XXXXXX";
+    uint64_t dcpu0, dcpu1, flushes0, flushes1, pcpu = 0, rcpu = 0;
+    long frames = 0, samples = 0, errors = 0;
+    uint64_t bytes = 0;
+    int c, i, n = 0;
+    pid_t daemon;
+
+    while ((c = getopt(argc, argv, "d:m:p:r:b:s:f:z:v:D:R:T:h")) != -1) {
+        switch (c) {
+            case 'd': o.daemon       = optarg;               break;
+            case 'm': o.mountpoint   = optarg;               break;
+            case 'p': o.producers    = atoi(optarg);         break;
+            case 'r': o.readers      = atoi(optarg);         break;
+            case 'b': o.framebuffers = atoi(optarg);         break;
+            case 'f': o.format       = optarg;               break;
+            case 'z': o.refresh_hz   = atoi(optarg);         break;
+            case 'v': o.device       = optarg;               break;
+            case 'D': o.dirty        = atof(optarg);         break;
+            case 'R': o.read_hz      = atof(optarg);         break;
+            case 'T': o.duration     = atoi(optarg);         break;
+            case 's':
+            if (sscanf(optarg, "%ux%u", &o.width, &o.height) != 2) {
+                fbload_usage(argv[0]);
+                return 1;
+            }
+            break;
+            default:
+            fbload_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (o.framebuffers <= 0) {
+        o.framebuffers = MAX(1, o.producers);
+    }
+    if (fbload_bpp(o.format) == 0 || o.producers < 0 || o.readers < 0
+            || o.producers + o.readers > FBLOAD_MAX_PROCS || o.framebuffers > FBLOAD_MAX_PROCS
+            || o.dirty <= 0 || o.dirty > 1 || o.duration <= 0) {
+        fbload_usage(argv[0]);
+        return 1;
+    }
+    if (o.mountpoint == NULL && (o.mountpoint = mkdtemp(tmpdir)) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    if ((daemon = fbload_start_daemon(&o)) < 0) {
+        fprintf(stderr, "cannot mount %s on %s\n", o.daemon, o.mountpoint);
+        return 1;
+    }
+    children = calloc(o.producers + o.readers, sizeof(*children));
+    dcpu0    = fbload_cpu_of(daemon);
+    flushes0 = fbload_fb_stat(&o, "flushes");
+    for (i = 0; i < o.producers; i++, n++) {
+        if (fbload_spawn(&o, &children[n], true, i) != 0) {
+            break;
+        }
+    }
+    for (i = 0; i < o.readers; i++, n++) {
+        if (fbload_spawn(&o, &children[n], false, i) != 0) {
+            break;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (fbload_collect(&children[i]) != 0) {
+            errors++;
+        }
+    }
+    dcpu1    = fbload_cpu_of(daemon);
+    flushes1 = fbload_fb_stat(&o, "flushes");
+
+    for (i = 0; i < n; i++) {
+        errors += children[i].c_result.r_errors;
+        if (children[i].c_producer) {
+            frames += children[i].c_result.r_frames;
+            bytes  += children[i].c_result.r_bytes;
+            pcpu   += children[i].c_result.r_cpu_ns;
+        } else {
+            samples += children[i].c_result.r_frames;
+            rcpu    += children[i].c_result.r_cpu_ns;
+        }
+    }
+
+    printf("{\n  \"producers\": %d, \"readers\": %d, \"framebuffers\": %d,\n"
+           "  \"frame\": {\"width\": %u, \"height\": %u, \"format\": \"%s\", \"dirty\": %.3f},\n"
+           "  \"refresh_hz\": %u, \"device\": \"%s\", \"seconds\": %d, \"errors\": %ld,\n"
+        , o.producers, o.readers, o.framebuffers, o.width, o.height, o.format, o.dirty
+        , o.refresh_hz, o.device, o.duration, errors);
+    printf("  \"frames\": %ld, \"fps\": %.2f, \"fps_per_producer\": %.2f, \"mb_per_sec\": %.2f,\n"
+        , frames, (double)frames / o.duration
+        , o.producers ? (double)frames / o.duration / o.producers : 0.0
+        , bytes / (1024.0 * 1024.0) / o.duration);
+    printf("  \"device_flushes\": %" PRIu64 ", \"device_fps\": %.2f,\n"
+        , flushes1 - flushes0, (double)(flushes1 - flushes0) / o.duration);
+    fbload_print_latency("write_to_flush_ns", children, n, true);
+    fbload_print_latency("read_ns", children, n, false);
+    printf("  \"reader_samples\": %ld,\n", samples);
+    printf("  \"cpu_ns_per_frame\": {\"producer\": %" PRIu64 ", \"daemon\": %" PRIu64
+           ", \"readers\": %" PRIu64 "}\n}\n"
+        , frames ? pcpu / frames : 0, frames ? (dcpu1 - dcpu0) / frames : 0
+        , frames ? rcpu / frames : 0);
+
+    fbload_stop_daemon(&o, daemon);
+    if (o.mountpoint == tmpdir) {
+        rmdir(tmpdir);
+    }
+    for (i = 0; i < n; i++) {
+        free(children[i].c_samples);
+    }
+    free(children);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * poll() on the framebuffer files. Everything a renderer waits for happens
+ * on a vsync tick of the flush thread (the flush of the damage, the flip to
+ * the next streamed frame), so the pending poll handles are notified once
+ * per tick and the kernel polls again.
+ *
+ *   /fb/<n>/frame   POLLOUT when every write reached the device
+ *   /fb/<n>/events  POLLIN when a vsync, flush or flip happened since the
+ *                   last read. A read returns one line with the counters:
+ *                   "vsync N flush N flip N time_ns T", it blocks until
+ *                   there is something new unless O_NONBLOCK is set.
+*/
+#include <fb.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+struct vfbfs_fb_poller {
+    struct fuse_pollhandle     *p_ph;
+    struct vfbfs_fb_poller     *p_next;
+};
+
+/* What an events reader has already seen */
+struct fb_events_seen {
+    uint64_t    ev_vsyncs;
+    uint64_t    ev_flush_seq;
+    uint64_t    ev_flip_seq;
+};
+
+/* Keeps ph until the next vsync, with fb_lock held */
+int vfbfs_fb_poll_add_locked(struct vfbfs_fb *fb, struct fuse_pollhandle *ph)
+{
+    struct vfbfs_fb_poller *p;
+    if (ph == NULL) {
+        return 0;
+    }
+    if ((p = malloc(sizeof(*p))) == NULL) {
+        fuse_pollhandle_destroy(ph);
+        return -ENOMEM;
+    }
+    p->p_ph        = ph;
+    p->p_next      = fb->fb_pollers;
+    fb->fb_pollers = p;
+    return 0;
+}
+
+/* Notifies every pending poll(), drops fb_lock meanwhile */
+void vfbfs_fb_poll_wake_locked(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_poller *p = fb->fb_pollers, *next;
+    if (p == NULL) {
+        return;
+    }
+    fb->fb_pollers = NULL;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    for (; p != NULL; p = next) {
+        next = p->p_next;
+        fuse_notify_poll(p->p_ph);
+        fuse_pollhandle_destroy(p->p_ph);
+        free(p);
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+}
+
+int vfbfs_fb_frame_poll(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *revents)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    int r = 0;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    *revents = POLLIN | POLLRDNORM;
+    if (fb->fb_flush_seq >= fb->fb_write_seq) {
+        *revents |= POLLOUT | POLLWRNORM;
+        if (ph != NULL) {
+            fuse_pollhandle_destroy(ph);
+        }
+    } else {
+        r = vfbfs_fb_poll_add_locked(fb, ph);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return r;
+}
+
+/* With fb_lock held */
+static bool fb_events_new(struct vfbfs_fb *fb, const struct fb_events_seen *ev)
+{
+    return ev->ev_vsyncs != fb->fb_stats.st_vsyncs || ev->ev_flush_seq != fb->fb_flush_seq
+        || ev->ev_flip_seq != fb->fb_flip_seq;
+}
+
+static int fb_events_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_events_seen *ev;
+
+    if (h == NULL) {
+        return -EBADF;
+    }
+    if ((ev = malloc(sizeof(*ev))) == NULL) {
+        return -ENOMEM;
+    }
+    /* Only the events after the open() count */
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    ev->ev_vsyncs    = fb->fb_stats.st_vsyncs;
+    ev->ev_flush_seq = fb->fb_flush_seq;
+    ev->ev_flip_seq  = fb->fb_flip_seq;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    h->h_private  = ev;
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fb_events_read(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_events_seen *ev = (h != NULL) ? h->h_private : NULL;
+    uint64_t vsync_ns;
+    char line[128];
+    int len;
+
+    if (ev == NULL) {
+        return -EBADF;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    while (!fb_events_new(fb, ev) && fb->fb_running && !(fi->flags & O_NONBLOCK)) {
+        vfbfs_cond_wait(&fb->fb_cond, &fb->fb_lock, VFBFS_LC_FB_LOCK);
+    }
+    if (!fb_events_new(fb, ev)) {
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        return (fi->flags & O_NONBLOCK) ? -EAGAIN : 0;
+    }
+    ev->ev_vsyncs    = fb->fb_stats.st_vsyncs;
+    ev->ev_flush_seq = fb->fb_flush_seq;
+    ev->ev_flip_seq  = fb->fb_flip_seq;
+    vsync_ns         = fb->fb_vsync_ns;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    len = snprintf(line, sizeof(line), "vsync %" PRIu64 " flush %" PRIu64 " flip %" PRIu64 " time_ns %" PRIu64 "\n"
+        , ev->ev_vsyncs, ev->ev_flush_seq, ev->ev_flip_seq, vsync_ns);
+    size = MIN(size, (size_t)len);
+    memcpy(data, line, size);
+    return size;
+}
+
+static int fb_events_poll(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi, struct fuse_pollhandle *ph, unsigned *revents)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_events_seen *ev = (h != NULL) ? h->h_private : NULL;
+    int r = 0;
+
+    if (ev == NULL) {
+        if (ph != NULL) {
+            fuse_pollhandle_destroy(ph);
+        }
+        return -EBADF;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    *revents = 0;
+    if (fb_events_new(fb, ev)) {
+        *revents = POLLIN | POLLRDNORM;
+        if (ph != NULL) {
+            fuse_pollhandle_destroy(ph);
+        }
+    } else {
+        r = vfbfs_fb_poll_add_locked(fb, ph);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return r;
+}
+
+static int fb_events_release(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h != NULL) {
+        free(h->h_private);
+        h->h_private = NULL;
+    }
+    return 0;
+}
+
+static struct vfbfs_file_ops fb_events_oprs = {
+    .f_open     = fb_events_open,
+    .f_read     = fb_events_read,
+    .f_poll     = fb_events_poll,
+    .f_release  = fb_events_release,
+};
+
+int vfbfs_fb_events_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f = vfbfs_file_create_in(fs, fb->fb_dir, "events");
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    f->f_oprs    = &fb_events_oprs;
+    f->f_private = fb;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0444;
+    return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Static regions. A fixed-layout screen (a dashboard's labels and frames)
+ * declares the rows which rarely change as static: the flush thread only
+ * pushes the damage of the other, dynamic rows on every vsync and holds
+ * back the static damage until the client commits it. A device with
+ * fd_regions() also gets the regions, the ST7781 shows them from its
+ * partial images.
+ *
+ * The regions are page rows. With a device which cannot scroll they only
+ * apply while the scroll origin is 0.
+ *
+ * /fb/<n>/regions reads the "static y0 y1" and "dynamic y0 y1" rows and
+ * the held damage. Writing "static y0 y1 [y0 y1]" sets the regions,
+ * "dynamic" removes them and "commit" flushes the held damage.
+*/
+#include <fb.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int fb_region_cmp(const void *a, const void *b)
+{
+    const struct vfbfs_fb_region *ra = a, *rb = b;
+    return (ra->rg_y0 > rb->rg_y0) - (ra->rg_y0 < rb->rg_y0);
+}
+
+/* Hands the held damage to the next flush, with fb_lock held */
+static void fb_regions_release_locked(struct vfbfs_fb *fb)
+{
+    if (vfbfs_fb_rect_empty(&fb->fb_static_damage)) {
+        return;
+    }
+    vfbfs_fb_damage(fb, &fb->fb_static_damage);
+    memset(&fb->fb_static_damage, 0, sizeof(fb->fb_static_damage));
+    fb->fb_regions_commit = true;
+}
+
+int vfbfs_fb_set_regions(struct vfbfs_fb *fb, const struct vfbfs_fb_region *regions, unsigned n)
+{
+    struct vfbfs_fb_region sorted[VFBFS_FB_MAX_REGIONS];
+    unsigned i;
+
+    if (n > VFBFS_FB_MAX_REGIONS) {
+        return -EINVAL;
+    }
+    memcpy(sorted, regions, n * sizeof(*regions));
+    qsort(sorted, n, sizeof(*sorted), fb_region_cmp);
+    for (i = 0; i < n; i++) {
+        if (sorted[i].rg_y0 >= sorted[i].rg_y1 || sorted[i].rg_y1 > fb->fb_height
+                || (i > 0 && sorted[i].rg_y0 < sorted[i - 1].rg_y1)) {
+            return -EINVAL;
+        }
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    /* Whatever was held may belong to a dynamic row now */
+    fb_regions_release_locked(fb);
+    memcpy(fb->fb_regions, sorted, n * sizeof(*sorted));
+    fb->fb_nregions = n;
+    fb->fb_regions_seq++;
+    if (fb->fb_dev_oprs->fd_regions != NULL) {
+        fb->fb_write_seq++;
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+/* The next flush pushes the held damage of the static regions too */
+int vfbfs_fb_regions_commit(struct vfbfs_fb *fb)
+{
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    fb_regions_release_locked(fb);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+/* Cuts the static regions out of r, see below */
+static unsigned fb_regions_cut_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r
+    , struct vfbfs_fb_rect *parts, bool *holding)
+{
+    const struct vfbfs_fb_region *rg;
+    struct vfbfs_fb_rect held;
+    unsigned i, n = 0, y = r->r_y0;
+
+    for (i = 0; i < fb->fb_nregions && y < r->r_y1; i++) {
+        rg = &fb->fb_regions[i];
+        if (rg->rg_y1 <= y) {
+            continue;
+        }
+        if (rg->rg_y0 >= r->r_y1) {
+            break;
+        }
+        if (rg->rg_y0 > y) {
+            parts[n] = *r;
+            parts[n].r_y0 = y;
+            parts[n].r_y1 = rg->rg_y0;
+            n++;
+        }
+        held = *r;
+        held.r_y0 = MAX(y, rg->rg_y0);
+        held.r_y1 = MIN(r->r_y1, rg->rg_y1);
+        vfbfs_fb_rect_union(&fb->fb_static_damage, &held);
+        *holding = true;
+        y = held.r_y1;
+    }
+    if (y < r->r_y1) {
+        parts[n] = *r;
+        parts[n].r_y0 = y;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Cuts the static regions out of the n damaged rectangles r, which don't
+ * overlap, called by the flush thread with fb_lock held. The dynamic
+ * parts are stored in parts (at most n + VFBFS_FB_MAX_REGIONS) and their
+ * number is returned, the static parts are held in fb_static_damage.
+*/
+unsigned vfbfs_fb_regions_split_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r
+    , unsigned n, struct vfbfs_fb_rect *parts)
+{
+    unsigned i, nparts = 0;
+    bool holding = false;
+
+    if (fb->fb_nregions == 0 || fb->fb_regions_commit) {
+        fb->fb_regions_commit = false;
+        memcpy(parts, r, n * sizeof(*r));
+        return n;
+    }
+    for (i = 0; i < n; i++) {
+        nparts += fb_regions_cut_locked(fb, &r[i], parts + nparts, &holding);
+    }
+    fb->fb_stats.st_static_held += holding;
+    return nparts;
+}
+
+static int fb_regions_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_region regions[VFBFS_FB_MAX_REGIONS];
+    struct vfbfs_fb_rect held;
+    unsigned i, n, y = 0;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    n = fb->fb_nregions;
+    memcpy(regions, fb->fb_regions, sizeof(regions));
+    held = fb->fb_static_damage;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    for (i = 0; i <= n; i++) {
+        if (i < n && regions[i].rg_y0 > y) {
+            fprintf(out, "dynamic %u %u\n", y, regions[i].rg_y0);
+        } else if (i == n && y < fb->fb_height) {
+            fprintf(out, "dynamic %u %u\n", y, fb->fb_height);
+        }
+        if (i < n) {
+            fprintf(out, "static %u %u\n", regions[i].rg_y0, regions[i].rg_y1);
+            y = regions[i].rg_y1;
+        }
+    }
+    if (vfbfs_fb_rect_empty(&held)) {
+        fprintf(out, "held none\n");
+    } else {
+        fprintf(out, "held %u %u %u %u\n", held.r_x0, held.r_y0, held.r_x1, held.r_y1);
+    }
+    return 0;
+}
+
+static int fb_regions_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_region rg[VFBFS_FB_MAX_REGIONS];
+    char buf[128];
+    int n, r;
+
+    if (off != 0 || size >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    n = sscanf(buf, "static %u %u %u %u", &rg[0].rg_y0, &rg[0].rg_y1, &rg[1].rg_y0, &rg[1].rg_y1);
+    if (n == 2 || n == 4) {
+        r = vfbfs_fb_set_regions(fb, rg, n / 2);
+    } else if (strncmp(buf, "dynamic", 7) == 0) {
+        r = vfbfs_fb_set_regions(fb, rg, 0);
+    } else if (strncmp(buf, "commit", 6) == 0) {
+        r = vfbfs_fb_regions_commit(fb);
+    } else {
+        r = -EINVAL;
+    }
+    return (r == 0) ? (int)size : r;
+}
+
+int vfbfs_fb_regions_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f;
+    struct vfbfs_gen *g;
+
+    f = vfbfs_gen_create_in(fs, fb->fb_dir, "regions", fb_regions_render, fb, VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    g = vfbfs_gen_from_file(f);
+    g->g_write = fb_regions_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
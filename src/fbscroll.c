@@ -0,0 +1,151 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Vertical scrolling. The shown page is a ring of rows, like the memory of
+ * a panel with a scroll register: the screen starts at the page row origin.
+ * Scrolling by n lines only moves the origin and clears the n exposed rows,
+ * so a device with fd_scroll() gets one register write and the new rows
+ * instead of the whole frame. Other devices get the whole frame rotated.
+ *
+ * /fb/<n>/scroll reads "origin N" and "hardware 0|1". Writing "N" scrolls
+ * the content up by N lines (down if negative), "origin N" only moves the
+ * origin, for clients which draw into the frame file in ring order.
+*/
+#include <fb.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Sets the origin with fb_lock held, the whole screen changes without
+ * fd_scroll() or with a transformed screen, which is scrolled in software.
+ * The panel's rows move with the origin, the layers composed into them are
+ * redrawn where they were and where they belong now.
+*/
+static void fb_scroll_set_locked(struct vfbfs_fb *fb, unsigned origin)
+{
+    struct vfbfs_fb_rect all = { 0, 0, fb->fb_width, fb->fb_height };
+    if (origin == fb->fb_scroll) {
+        return;
+    }
+    if (fb->fb_dev_oprs->fd_scroll == NULL || vfbfs_fb_xform_active_locked(fb)) {
+        fb->fb_scroll = origin;
+        vfbfs_fb_damage(fb, &all);
+        return;
+    }
+    vfbfs_fb_layers_damage_locked(fb);
+    fb->fb_scroll = origin;
+    vfbfs_fb_layers_damage_locked(fb);
+    /* Nothing else to copy, only the register changes on the next vsync */
+    fb->fb_write_seq++;
+}
+
+int vfbfs_fb_set_origin(struct vfbfs_fb *fb, unsigned origin)
+{
+    if (origin >= fb->fb_height) {
+        return -EINVAL;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    fb_scroll_set_locked(fb, origin);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+/* Scrolls the content up by lines (down if negative), the exposed rows are cleared */
+int vfbfs_fb_scroll(struct vfbfs_fb *fb, int lines)
+{
+    unsigned h = fb->fb_height, n = (lines < 0) ? 0U - (unsigned)lines : (unsigned)lines, y, y0;
+    struct vfbfs_fb_rect exposed = { 0, 0, fb->fb_width, 0 };
+
+    if (lines == 0) {
+        return 0;
+    }
+    n = MIN(n, h);
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    if (lines > 0) {
+        fb_scroll_set_locked(fb, (fb->fb_scroll + n) % h);
+        y0 = h - n;
+    } else {
+        fb_scroll_set_locked(fb, (fb->fb_scroll + h - n) % h);
+        y0 = 0;
+    }
+    for (y = y0; y < y0 + n; y++) {
+        memset(vfbfs_fb_span(fb, 0, y, NULL), 0, fb->fb_stride);
+    }
+    exposed.r_y0 = y0;
+    exposed.r_y1 = y0 + n;
+    vfbfs_fb_damage_screen(fb, &exposed);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return 0;
+}
+
+static int fb_scroll_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    unsigned origin;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    origin = fb->fb_scroll;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    fprintf(out, "origin %u\nhardware %d\n", origin, fb->fb_dev_oprs->fd_scroll != NULL);
+    return 0;
+}
+
+static int fb_scroll_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    unsigned origin;
+    char buf[64];
+    int lines, r;
+
+    if (off != 0 || size >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    if (sscanf(buf, "origin %u", &origin) == 1) {
+        r = vfbfs_fb_set_origin(fb, origin);
+    } else if (sscanf(buf, "%d", &lines) == 1) {
+        r = vfbfs_fb_scroll(fb, lines);
+    } else {
+        r = -EINVAL;
+    }
+    return (r == 0) ? (int)size : r;
+}
+
+int vfbfs_fb_scroll_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f;
+    struct vfbfs_gen *g;
+
+    f = vfbfs_gen_create_in(fs, fb->fb_dir, "scroll", fb_scroll_render, fb, VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    g = vfbfs_gen_from_file(f);
+    g->g_write = fb_scroll_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
@@ -0,0 +1,342 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * /fb/<n>/snapshot.ppm and /fb/<n>/snapshot.png, the screen as an image.
+ * They are generated files (see gen.h) versioned by the framebuffer's
+ * write and flip counters: the image is encoded on the first open after
+ * a change and every open is served from it until the screen changes
+ * again, so polling an idle screen costs nothing.
+ *
+ * The screen is copied under fb_lock and encoded outside of it on the
+ * worker pool. The PNG rows are converted and filtered in stripes, then
+ * every stripe is deflated on its own with the 32K before it as the
+ * dictionary, like pigz does: the streams are cut with Z_SYNC_FLUSH so
+ * they can be concatenated, and the checksums are put together with
+ * adler32_combine() and crc32_combine().
+*/
+#include <fb.h>
+#include <gen.h>
+#include <workers.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define FB_SNAP_STRIPE_BYTES    (64 << 10)  /* of filtered rows, at least */
+#define FB_SNAP_WINDOW          32768
+
+/* The encoding of one screen, split in stripes of rows */
+struct fb_snap_job {
+    struct vfbfs_fb    *j_fb;
+    unsigned            j_width, j_height;
+    const char         *j_screen;       /* the copied rows, in the framebuffer's format */
+    uint8_t            *j_rgb;          /* RGB888 rows */
+    uint8_t            *j_filtered;     /* PNG rows, each with its filter type */
+    unsigned            j_rows;         /* per stripe */
+    unsigned            j_nstripes;
+    struct fb_snap_stripe {
+        unsigned char  *s_out;
+        size_t          s_len;
+        uLong           s_adler;
+        uLong           s_crc;
+        int             s_err;
+    }                  *j_stripes;
+};
+
+static uint64_t fb_snap_version(struct vfbfs *fs, struct vfbfs_file *f, void *priv)
+{
+    struct vfbfs_fb *fb = priv;
+    uint64_t v;
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    v = fb->fb_write_seq + fb->fb_flip_seq;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return v;
+}
+
+/* Copies the screen rows, the scroll origin undone */
+static char *fb_snap_capture(struct vfbfs_fb *fb)
+{
+    size_t row = (size_t)fb->fb_width * fb->fb_bpp;
+    char *screen = malloc(row * fb->fb_height);
+    unsigned y;
+
+    if (screen == NULL) {
+        return NULL;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    for (y = 0; y < fb->fb_height; y++) {
+        memcpy(screen + y * row, vfbfs_fb_span(fb, 0, y, NULL), row);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    return screen;
+}
+
+static void fb_snap_rgb_stripe(void *arg, unsigned stripe)
+{
+    struct fb_snap_job *j = arg;
+    unsigned y = stripe * j->j_rows, y1 = MIN(y + j->j_rows, j->j_height);
+    for (; y < y1; y++) {
+        vfbfs_fb_convert(VFBFS_FB_RGB888, j->j_rgb + (size_t)y * j->j_width * 3, j->j_fb->fb_format
+            , j->j_screen + (size_t)y * j->j_width * j->j_fb->fb_bpp, j->j_width);
+    }
+}
+
+/* Converts the copied screen to RGB888 in parallel */
+static int fb_snap_rgb(struct fb_snap_job *j)
+{
+    if ((j->j_rgb = malloc((size_t)j->j_width * j->j_height * 3)) == NULL) {
+        return -ENOMEM;
+    }
+    j->j_rows     = MAX(1, FB_SNAP_STRIPE_BYTES / (j->j_width * 3));
+    j->j_nstripes = (j->j_height + j->j_rows - 1) / j->j_rows;
+    vfbfs_workers_run(fb_snap_rgb_stripe, j, j->j_nstripes);
+    return 0;
+}
+
+static inline uint8_t fb_snap_paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+/*
+ * Filters one row with each of the five filters and keeps the one with the
+ * smallest sum of the bytes taken as signed, the usual heuristic.
+*/
+static void fb_snap_filter_row(const uint8_t *row, const uint8_t *prev, size_t n, uint8_t *out)
+{
+    uint8_t *cand = out + 1, best_type = 0;
+    unsigned long sum, best = ULONG_MAX;
+    uint8_t tmp[n], a, b, c, v;
+    unsigned type;
+    size_t i;
+
+    for (type = 0; type < 5; type++) {
+        for (i = 0, sum = 0; i < n; i++) {
+            a = (i >= 3) ? row[i - 3] : 0;
+            b = (prev != NULL) ? prev[i] : 0;
+            c = (i >= 3 && prev != NULL) ? prev[i - 3] : 0;
+            switch (type) {
+            case 0: v = row[i]; break;
+            case 1: v = row[i] - a; break;
+            case 2: v = row[i] - b; break;
+            case 3: v = row[i] - ((a + b) >> 1); break;
+            default: v = row[i] - fb_snap_paeth(a, b, c); break;
+            }
+            tmp[i] = v;
+            sum += (v < 128) ? v : 256 - v;
+        }
+        if (sum < best) {
+            best      = sum;
+            best_type = type;
+            memcpy(cand, tmp, n);
+        }
+    }
+    out[0] = best_type;
+}
+
+static void fb_snap_filter_stripe(void *arg, unsigned stripe)
+{
+    struct fb_snap_job *j = arg;
+    size_t n = (size_t)j->j_width * 3;
+    unsigned y = stripe * j->j_rows, y1 = MIN(y + j->j_rows, j->j_height);
+    for (; y < y1; y++) {
+        fb_snap_filter_row(j->j_rgb + y * n, (y > 0) ? j->j_rgb + (y - 1) * n : NULL, n
+            , j->j_filtered + y * (n + 1));
+    }
+}
+
+static void fb_snap_deflate_stripe(void *arg, unsigned stripe)
+{
+    struct fb_snap_job *j = arg;
+    struct fb_snap_stripe *s = &j->j_stripes[stripe];
+    size_t row = (size_t)j->j_width * 3 + 1;
+    const uint8_t *in = j->j_filtered + (size_t)stripe * j->j_rows * row;
+    size_t len = (size_t)(MIN((stripe + 1) * j->j_rows, j->j_height) - stripe * j->j_rows) * row;
+    size_t dict = MIN((size_t)(in - j->j_filtered), FB_SNAP_WINDOW);
+    bool last = stripe + 1 == j->j_nstripes;
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        s->s_err = -ENOMEM;
+        return;
+    }
+    /* Room for the worst case and the flush marker */
+    s->s_len = deflateBound(&zs, len) + 16;
+    if ((s->s_out = malloc(s->s_len)) == NULL) {
+        deflateEnd(&zs);
+        s->s_err = -ENOMEM;
+        return;
+    }
+    if (dict > 0) {
+        deflateSetDictionary(&zs, in - dict, dict);
+    }
+    zs.next_in   = (Bytef *)in;
+    zs.avail_in  = len;
+    zs.next_out  = s->s_out;
+    zs.avail_out = s->s_len;
+    if (deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH) != (last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0) {
+        s->s_err = -EIO;
+    }
+    s->s_len   = zs.total_out;
+    s->s_adler = adler32(1, in, len);
+    s->s_crc   = crc32(0, s->s_out, s->s_len);
+    deflateEnd(&zs);
+}
+
+static void fb_snap_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void fb_snap_png_chunk(FILE *out, const char *type, const uint8_t *data, size_t len)
+{
+    uint8_t hdr[8], crc[4];
+    uLong c;
+    fb_snap_be32(hdr, len);
+    memcpy(hdr + 4, type, 4);
+    /* crc32() with no data returns the initial value */
+    c = crc32(0, hdr + 4, 4);
+    fb_snap_be32(crc, (len > 0) ? crc32(c, data, len) : c);
+    fwrite(hdr, 1, sizeof(hdr), out);
+    fwrite(data, 1, len, out);
+    fwrite(crc, 1, sizeof(crc), out);
+}
+
+static int fb_snap_png_write(struct fb_snap_job *j, FILE *out)
+{
+    static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    static const uint8_t zhdr[2] = { 0x78, 0x9c };
+    size_t row = (size_t)j->j_width * 3 + 1, idat_len = sizeof(zhdr) + 4, slen;
+    uint8_t ihdr[13] = { 0 }, hdr[8], tail[8];
+    uLong adler = 1, crc;
+    unsigned i;
+
+    for (i = 0; i < j->j_nstripes; i++) {
+        if (j->j_stripes[i].s_err != 0) {
+            return j->j_stripes[i].s_err;
+        }
+        idat_len += j->j_stripes[i].s_len;
+    }
+    fb_snap_be32(ihdr, j->j_width);
+    fb_snap_be32(ihdr + 4, j->j_height);
+    ihdr[8] = 8;                /* bits per sample */
+    ihdr[9] = 2;                /* RGB */
+    fwrite(sig, 1, sizeof(sig), out);
+    fb_snap_png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+    /* One IDAT made of the stripes, its CRC combined from theirs */
+    fb_snap_be32(hdr, idat_len);
+    memcpy(hdr + 4, "IDAT", 4);
+    fwrite(hdr, 1, sizeof(hdr), out);
+    fwrite(zhdr, 1, sizeof(zhdr), out);
+    crc = crc32(crc32(0, hdr + 4, 4), zhdr, sizeof(zhdr));
+    for (i = 0; i < j->j_nstripes; i++) {
+        slen  = (size_t)(MIN((i + 1) * j->j_rows, j->j_height) - i * j->j_rows) * row;
+        adler = adler32_combine(adler, j->j_stripes[i].s_adler, slen);
+        crc   = crc32_combine(crc, j->j_stripes[i].s_crc, j->j_stripes[i].s_len);
+        fwrite(j->j_stripes[i].s_out, 1, j->j_stripes[i].s_len, out);
+    }
+    fb_snap_be32(tail, adler);
+    fb_snap_be32(tail + 4, crc32(crc, tail, 4));
+    fwrite(tail, 1, sizeof(tail), out);
+
+    fb_snap_png_chunk(out, "IEND", NULL, 0);
+    return 0;
+}
+
+static int fb_snap_png_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct fb_snap_job j = { .j_fb = priv };
+    size_t row;
+    unsigned i;
+    int r;
+
+    j.j_width  = j.j_fb->fb_width;
+    j.j_height = j.j_fb->fb_height;
+    row        = (size_t)j.j_width * 3 + 1;
+    if ((j.j_screen = fb_snap_capture(j.j_fb)) == NULL || (r = fb_snap_rgb(&j)) != 0) {
+        r = -ENOMEM;
+        goto out;
+    }
+    if ((j.j_filtered = malloc(row * j.j_height)) == NULL) {
+        r = -ENOMEM;
+        goto out;
+    }
+    vfbfs_workers_run(fb_snap_filter_stripe, &j, j.j_nstripes);
+    if ((j.j_stripes = calloc(j.j_nstripes, sizeof(*j.j_stripes))) == NULL) {
+        r = -ENOMEM;
+        goto out;
+    }
+    vfbfs_workers_run(fb_snap_deflate_stripe, &j, j.j_nstripes);
+    r = fb_snap_png_write(&j, out);
+out:
+    for (i = 0; j.j_stripes != NULL && i < j.j_nstripes; i++) {
+        free(j.j_stripes[i].s_out);
+    }
+    free(j.j_stripes);
+    free(j.j_filtered);
+    free(j.j_rgb);
+    free((char *)j.j_screen);
+    return r;
+}
+
+static int fb_snap_ppm_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct fb_snap_job j = { .j_fb = priv };
+    int r = -ENOMEM;
+
+    j.j_width  = j.j_fb->fb_width;
+    j.j_height = j.j_fb->fb_height;
+    if ((j.j_screen = fb_snap_capture(j.j_fb)) != NULL && (r = fb_snap_rgb(&j)) == 0) {
+        fprintf(out, "P6\n%u %u\n255\n", j.j_width, j.j_height);
+        fwrite(j.j_rgb, 1, (size_t)j.j_width * j.j_height * 3, out);
+    }
+    free(j.j_rgb);
+    free((char *)j.j_screen);
+    return r;
+}
+
+static int fb_snap_create(struct vfbfs *fs, struct vfbfs_fb *fb, const char *name
+    , int (*render)(struct vfbfs *, struct vfbfs_file *, void *, FILE *))
+{
+    struct vfbfs_file *f = vfbfs_gen_create_in(fs, fb->fb_dir, name, render, fb, VFBFS_GEN_TTL_FOREVER);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_gen_from_file(f)->g_version = fb_snap_version;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0444;
+    return 0;
+}
+
+int vfbfs_fb_snapshot_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    int r;
+    if ((r = fb_snap_create(fs, fb, "snapshot.ppm", fb_snap_ppm_render)) != 0) {
+        return r;
+    }
+    return fb_snap_create(fs, fb, "snapshot.png", fb_snap_png_render);
+}
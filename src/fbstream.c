@@ -0,0 +1,304 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Streaming frames. /fb/<n>/stream takes a continuous stream of raw frames
+ * in the framebuffer's format, the write offsets are ignored. Every open()
+ * assembles its own frames (in the handle), a complete frame is queued into
+ * the ring and shown on one of the next vsyncs. When the ring is full the
+ * policy decides: block the producer, drop the oldest queued frame or drop
+ * the new one. /fb/<n>/stream_policy reads and sets it as "policy [depth]",
+ * changing the depth drops the queued frames.
+*/
+#include <fb.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+static const char *fb_stream_policy_names[VFBFS_FB_STREAM_POLICY_MAX] = {
+    [VFBFS_FB_STREAM_BLOCK]       = "block",
+    [VFBFS_FB_STREAM_DROP_OLDEST] = "drop-oldest",
+    [VFBFS_FB_STREAM_DROP_NEWEST] = "drop-newest",
+};
+
+/* The frame a handle is assembling */
+struct fb_stream_fill {
+    char       *sf_buf;
+    size_t      sf_len;
+};
+
+static inline uint64_t fb_stream_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Drops the queued frames and the slots, with fb_lock held */
+static void fb_stream_reset_locked(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_stream *s = &fb->fb_stream;
+    unsigned i;
+    if (s->s_slots != NULL) {
+        for (i = 0; i < s->s_depth; i++) {
+            free(s->s_slots[i]);
+        }
+        free(s->s_slots);
+        s->s_slots = NULL;
+    }
+    fb->fb_stats.st_stream_dropped += s->s_count;
+    s->s_head  = 0;
+    s->s_count = 0;
+}
+
+/*
+ * Queues the complete frame in fill. The buffer is swapped with a free slot,
+ * so the producer gets a buffer back instead of copying the frame again.
+*/
+static int fb_stream_queue(struct vfbfs_fb *fb, struct fb_stream_fill *fill)
+{
+    struct vfbfs_fb_stream *s = &fb->fb_stream;
+    uint64_t start;
+    unsigned tail;
+    char *tmp;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    if (s->s_slots == NULL && (s->s_slots = calloc(s->s_depth, sizeof(char *))) == NULL) {
+        vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+        return -ENOMEM;
+    }
+    if (s->s_count == s->s_depth && s->s_policy == VFBFS_FB_STREAM_BLOCK && fb->fb_running) {
+        /* The flush thread broadcasts fb_cond on every vsync, a policy change too */
+        start = fb_stream_now();
+        while (s->s_count == s->s_depth && s->s_slots != NULL && fb->fb_running
+                && s->s_policy == VFBFS_FB_STREAM_BLOCK) {
+            vfbfs_cond_wait(&fb->fb_cond, &fb->fb_lock, VFBFS_LC_FB_LOCK);
+        }
+        fb->fb_stats.st_stream_blocked_ns += fb_stream_now() - start;
+        if (s->s_slots == NULL) {
+            /* The depth was changed meanwhile */
+            vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+            return fb_stream_queue(fb, fill);
+        }
+    }
+    if (s->s_count == s->s_depth) {
+        fb->fb_stats.st_stream_dropped++;
+        if (s->s_policy == VFBFS_FB_STREAM_DROP_NEWEST) {
+            vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+            fill->sf_len = 0;
+            return 0;
+        }
+        /* drop-oldest, or block without a flush thread to wait for */
+        s->s_head = (s->s_head + 1) % s->s_depth;
+        s->s_count--;
+    }
+    tail = (s->s_head + s->s_count) % s->s_depth;
+    tmp  = s->s_slots[tail];
+    s->s_slots[tail] = fill->sf_buf;
+    s->s_count++;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    fill->sf_buf = tmp;
+    fill->sf_len = 0;
+    return 0;
+}
+
+/*
+ * Shows the oldest queued frame, called by the flush thread on vsync with
+ * fb_lock held. Returns true if the frame changed.
+*/
+bool vfbfs_fb_stream_next(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_stream *s = &fb->fb_stream;
+    struct vfbfs_fb_rect all = { 0, 0, fb->fb_width, fb->fb_height };
+    char *tmp;
+
+    if (s->s_count == 0) {
+        return false;
+    }
+    /* A streamed frame is in screen order */
+    fb->fb_scroll = 0;
+    if (fb->fb_vsize == fb->fb_size) {
+        tmp = fb->fb_frame->f_content;
+        fb->fb_frame->f_content = s->s_slots[s->s_head];
+        s->s_slots[s->s_head]   = tmp;
+    } else {
+        /* Panning: the frame is a page of the virtual buffer, copy into the shown one */
+        memcpy(vfbfs_fb_span(fb, 0, 0, NULL), s->s_slots[s->s_head], fb->fb_size);
+    }
+    s->s_head = (s->s_head + 1) % s->s_depth;
+    s->s_count--;
+    fb->fb_flip_seq++;
+    fb->fb_stats.st_stream_frames++;
+    vfbfs_fb_damage(fb, &all);
+    return true;
+}
+
+static int fb_stream_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h == NULL) {
+        return -EBADF;
+    }
+    if ((h->h_private = calloc(1, sizeof(struct fb_stream_fill))) == NULL) {
+        return -ENOMEM;
+    }
+    /* Nothing to cache, the stream reads as empty */
+    fi->direct_io = 1;
+    return 0;
+}
+
+static int fb_stream_write(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_fb *fb = vfbfs_fb_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_stream_fill *fill;
+    size_t done = 0, n;
+    int r = 0;
+
+    if (h == NULL || h->h_private == NULL) {
+        return -EBADF;
+    }
+    vfbfs_mutex_lock(&h->h_lock, VFBFS_LC_H_LOCK);
+    fill = h->h_private;
+    while (done < size) {
+        if (fill->sf_buf == NULL && (fill->sf_buf = malloc(fb->fb_size)) == NULL) {
+            r = -ENOMEM;
+            break;
+        }
+        n = MIN(size - done, fb->fb_size - fill->sf_len);
+        memcpy(fill->sf_buf + fill->sf_len, data + done, n);
+        fill->sf_len += n;
+        done         += n;
+        if (fill->sf_len == fb->fb_size && (r = fb_stream_queue(fb, fill)) != 0) {
+            break;
+        }
+    }
+    vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+    return (done > 0) ? (int)done : r;
+}
+
+static int fb_stream_truncate(struct vfbfs *fs, struct vfbfs_file *f, const char *path, off_t size)
+{
+    return 0;
+}
+
+/* A partial frame left at close is dropped */
+static int fb_stream_release(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct fb_stream_fill *fill = (h != NULL) ? h->h_private : NULL;
+    if (fill != NULL) {
+        free(fill->sf_buf);
+        free(fill);
+        h->h_private = NULL;
+    }
+    return 0;
+}
+
+static struct vfbfs_file_ops fb_stream_oprs = {
+    .f_open     = fb_stream_open,
+    .f_write    = fb_stream_write,
+    .f_truncate = fb_stream_truncate,
+    .f_release  = fb_stream_release,
+};
+
+static int fb_stream_policy_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    enum VfbfsFbStreamPolicy policy;
+    unsigned depth, count;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    policy = fb->fb_stream.s_policy;
+    depth  = fb->fb_stream.s_depth;
+    count  = fb->fb_stream.s_count;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    fprintf(out, "%s %u\nqueued %u\n", fb_stream_policy_names[policy], depth, count);
+    return 0;
+}
+
+static int fb_stream_policy_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    char buf[64], name[32];
+    unsigned depth = 0;
+    int i, n;
+
+    if (off != 0 || size >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    if ((n = sscanf(buf, "%31s %u", name, &depth)) < 1
+            || (n == 2 && (depth == 0 || depth > VFBFS_FB_STREAM_MAX_DEPTH))) {
+        return -EINVAL;
+    }
+    for (i = 0; i < VFBFS_FB_STREAM_POLICY_MAX && strcmp(name, fb_stream_policy_names[i]) != 0; i++)
+        ;
+    if (i == VFBFS_FB_STREAM_POLICY_MAX) {
+        return -EINVAL;
+    }
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    fb->fb_stream.s_policy = (enum VfbfsFbStreamPolicy)i;
+    if (n == 2 && depth != fb->fb_stream.s_depth) {
+        fb_stream_reset_locked(fb);
+        fb->fb_stream.s_depth = depth;
+    }
+    /* Wakes the blocked producers, they look at the new policy */
+    pthread_cond_broadcast(&fb->fb_cond);
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    vfbfs_gen_invalidate(f);
+    return size;
+}
+
+int vfbfs_fb_stream_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    struct vfbfs_file *f;
+    struct vfbfs_gen *g;
+
+    fb->fb_stream.s_policy = VFBFS_FB_STREAM_DROP_OLDEST;
+    fb->fb_stream.s_depth  = VFBFS_FB_STREAM_DEPTH;
+    if ((f = vfbfs_file_create_in(fs, fb->fb_dir, "stream")) == NULL) {
+        return -ENOMEM;
+    }
+    f->f_oprs    = &fb_stream_oprs;
+    f->f_private = fb;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0222;
+
+    f = vfbfs_gen_create_in(fs, fb->fb_dir, "stream_policy", fb_stream_policy_render
+        , fb, VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    g = vfbfs_gen_from_file(f);
+    g->g_write = fb_stream_policy_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
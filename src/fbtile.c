@@ -0,0 +1,219 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Damage tiles. Besides the bounding rectangle in fb_damage, the damage is
+ * kept as a bitmap of VFBFS_FB_TILE x VFBFS_FB_TILE tiles of the shown
+ * page, so two small writes in opposite corners don't flush the whole
+ * screen between them: the flush thread pushes, per row of tiles, each run
+ * of adjacent damaged tiles, and merges the runs with the same columns in
+ * consecutive rows of tiles into one rectangle.
+ *
+ * Only the damage is tiled, the pages stay linear in the frame file: the
+ * flush reads every tile run row by row out of the linear page, pixels are
+ * not swizzled into tile order.
+ *
+ * Every tile also keeps the fb_write_seq of its last damage, a client
+ * mirroring the screen remembers the write_seq it copied at and reads back
+ * only the tiles which changed since:
+ *
+ *   /fb/<n>/tiles  "tile T cols C rows R write_seq S" and a line per row
+ *                  of tiles with the write_seq of each tile, in page rows
+*/
+#include <fb.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+static inline uint64_t *fb_tile_row(struct vfbfs_fb *fb, unsigned ty)
+{
+    return fb->fb_tile_dirty + (size_t)ty * fb->fb_tile_words;
+}
+
+/* Marks the tiles under a clipped rectangle of the page, with fb_lock held */
+void vfbfs_fb_tiles_damage_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r)
+{
+    unsigned tx0 = r->r_x0 / VFBFS_FB_TILE, tx1 = (r->r_x1 - 1) / VFBFS_FB_TILE + 1;
+    unsigned ty0 = r->r_y0 / VFBFS_FB_TILE, ty1 = (r->r_y1 - 1) / VFBFS_FB_TILE + 1;
+    unsigned tx, ty;
+    uint64_t *row, *gen;
+
+    for (ty = ty0; ty < ty1; ty++) {
+        row = fb_tile_row(fb, ty);
+        gen = fb->fb_tile_gen + (size_t)ty * fb->fb_tiles_x;
+        for (tx = tx0; tx < tx1; tx++) {
+            row[tx / 64] |= 1ULL << (tx % 64);
+            gen[tx]       = fb->fb_write_seq;
+        }
+    }
+}
+
+/* Most runs of damaged tiles in a row of tiles, they are separated by clean tiles */
+static inline unsigned fb_tiles_runs_max(const struct vfbfs_fb *fb)
+{
+    return (fb->fb_tiles_x + 1) / 2;
+}
+
+/*
+ * The next run of damaged tiles [tx0, tx1) of a row of tiles, starting at
+ * column from, false if there is none. Bits past fb_tiles_x are never set.
+*/
+static bool fb_tiles_run(const struct vfbfs_fb *fb, const uint64_t *row, unsigned from
+    , unsigned *tx0, unsigned *tx1)
+{
+    unsigned w = from / 64;
+    uint64_t bits;
+
+    if (from >= fb->fb_tiles_x) {
+        return false;
+    }
+    for (bits = row[w] & (~0ULL << (from % 64)); bits == 0; bits = row[w]) {
+        if (++w == fb->fb_tile_words) {
+            return false;
+        }
+    }
+    *tx0 = w * 64 + __builtin_ctzll(bits);
+    for (bits = ~row[w] & (~0ULL << (*tx0 % 64)); bits == 0; bits = ~row[w]) {
+        if (++w == fb->fb_tile_words) {
+            *tx1 = fb->fb_tiles_x;
+            return true;
+        }
+    }
+    *tx1 = MIN(w * 64 + __builtin_ctzll(bits), fb->fb_tiles_x);
+    return true;
+}
+
+/*
+ * Splits the damaged rectangle r (fb_damage) into the rectangles of the
+ * runs of damaged tiles, called by the flush thread with fb_lock held.
+ * Stores at most fb_tiles_y * fb_tiles_runs_max() rectangles, clipped to
+ * r, and clears the bitmap. A run is merged into the rectangle above it
+ * when that one ends on the previous row of tiles with the same columns,
+ * fb_tile_runs holds the indexes of those, in column order.
+*/
+unsigned vfbfs_fb_tiles_split_locked(struct vfbfs_fb *fb, const struct vfbfs_fb_rect *r
+    , struct vfbfs_fb_rect *rects)
+{
+    unsigned *prev = fb->fb_tile_runs, *cur = prev + fb_tiles_runs_max(fb), *swap;
+    unsigned ty, tx0, tx1, k, nprev = 0, ncur, n = 0;
+    const uint64_t *row;
+    struct vfbfs_fb_rect t;
+
+    if (vfbfs_fb_rect_empty(r)) {
+        return 0;
+    }
+    for (ty = r->r_y0 / VFBFS_FB_TILE; ty * VFBFS_FB_TILE < r->r_y1; ty++) {
+        row  = fb_tile_row(fb, ty);
+        ncur = 0;
+        k    = 0;
+        for (tx1 = 0; fb_tiles_run(fb, row, tx1, &tx0, &tx1); ) {
+            t.r_x0 = MAX(tx0 * VFBFS_FB_TILE, r->r_x0);
+            t.r_x1 = MIN(tx1 * VFBFS_FB_TILE, r->r_x1);
+            t.r_y0 = MAX(ty * VFBFS_FB_TILE, r->r_y0);
+            t.r_y1 = MIN((ty + 1) * VFBFS_FB_TILE, r->r_y1);
+            if (vfbfs_fb_rect_empty(&t)) {
+                continue;
+            }
+            while (k < nprev && rects[prev[k]].r_x0 < t.r_x0) {
+                k++;
+            }
+            if (k < nprev && rects[prev[k]].r_x0 == t.r_x0 && rects[prev[k]].r_x1 == t.r_x1
+                    && rects[prev[k]].r_y1 == t.r_y0) {
+                rects[prev[k]].r_y1 = t.r_y1;
+                cur[ncur++] = prev[k];
+            } else {
+                cur[ncur++] = n;
+                rects[n++]  = t;
+            }
+        }
+        swap  = prev;
+        prev  = cur;
+        cur   = swap;
+        nprev = ncur;
+    }
+    memset(fb->fb_tile_dirty, 0, (size_t)fb->fb_tiles_y * fb->fb_tile_words * sizeof(uint64_t));
+    fb->fb_stats.st_tile_rects += n;
+    return n;
+}
+
+static int fb_tiles_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    size_t n = (size_t)fb->fb_tiles_x * fb->fb_tiles_y;
+    uint64_t *gen = malloc(n * sizeof(*gen)), seq;
+    unsigned tx, ty;
+
+    if (gen == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    memcpy(gen, fb->fb_tile_gen, n * sizeof(*gen));
+    seq = fb->fb_write_seq;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    fprintf(out, "tile %u cols %u rows %u write_seq %" PRIu64 "\n", VFBFS_FB_TILE, fb->fb_tiles_x
+        , fb->fb_tiles_y, seq);
+    for (ty = 0; ty < fb->fb_tiles_y; ty++) {
+        for (tx = 0; tx < fb->fb_tiles_x; tx++) {
+            fprintf(out, (tx > 0) ? " %" PRIu64 : "%" PRIu64, gen[(size_t)ty * fb->fb_tiles_x + tx]);
+        }
+        fputc('\n', out);
+    }
+    free(gen);
+    return 0;
+}
+
+int vfbfs_fb_tiles_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    size_t n;
+
+    fb->fb_tiles_x    = (fb->fb_width + VFBFS_FB_TILE - 1) / VFBFS_FB_TILE;
+    fb->fb_tiles_y    = (fb->fb_height + VFBFS_FB_TILE - 1) / VFBFS_FB_TILE;
+    fb->fb_tile_words = (fb->fb_tiles_x + 63) / 64;
+    fb->fb_tile_dirty = calloc((size_t)fb->fb_tiles_y * fb->fb_tile_words, sizeof(uint64_t));
+    fb->fb_tile_gen   = calloc((size_t)fb->fb_tiles_x * fb->fb_tiles_y, sizeof(uint64_t));
+    fb->fb_tile_runs  = calloc(2 * (size_t)fb_tiles_runs_max(fb), sizeof(unsigned));
+    /* A rectangle per run of tiles, plus the cuts at the origin or around the regions */
+    n = (size_t)fb->fb_tiles_y * fb_tiles_runs_max(fb);
+    fb->fb_tile_rects = calloc(n, sizeof(struct vfbfs_fb_rect));
+    fb->fb_flush_parts = calloc(2 * n + 2 * VFBFS_FB_MAX_REGIONS + 1, sizeof(struct vfbfs_fb_rect));
+    if (fb->fb_tile_dirty == NULL || fb->fb_tile_gen == NULL || fb->fb_tile_runs == NULL
+            || fb->fb_tile_rects == NULL || fb->fb_flush_parts == NULL) {
+        return -ENOMEM;
+    }
+    if (vfbfs_gen_create_in(fs, fb->fb_dir, "tiles", fb_tiles_render, fb, VFBFS_GEN_TTL_NONE) == NULL) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Frees the tiles of a framebuffer whose creation failed, the tiles file goes with its directory */
+void vfbfs_fb_tiles_free(struct vfbfs_fb *fb)
+{
+    free(fb->fb_tile_dirty);
+    free(fb->fb_tile_gen);
+    free(fb->fb_tile_runs);
+    free(fb->fb_tile_rects);
+    free(fb->fb_flush_parts);
+}
@@ -0,0 +1,547 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Scaling and rotation between the framebuffer and the panel. Producers
+ * render at the framebuffer's geometry, the panel (fb_dev_width x
+ * fb_dev_height, set by the driver) may have another size or lie on its
+ * side. Then the flush maps every damaged rectangle of the screen to the
+ * panel: scaled to the panel's size before the rotation, then turned.
+ *
+ *   scale    nearest or bilinear, in 8.8 fixed point. The bilinear taps
+ *            are blended 2 pixels at a time, both source pixels of an
+ *            output one in a vector.
+ *   rotate   0, 90, 180 or 270 degrees clockwise. A driver with
+ *            fd_rotate() turns the pixels for free while writing them (the
+ *            entry mode of the ST7781), for the others they are turned in
+ *            4x4 transposes, a 32x32 tile at a time to stay in the cache.
+ *
+ * Meanwhile the scroll origin is applied in software and the static
+ * regions don't apply, like for a device which cannot scroll.
+ *
+ * /fb/<n>/transform reads "logical WxH", "panel WxH", "scale S",
+ * "rotate D" and "rotation hardware|software" lines. Writing "scale
+ * nearest|bilinear", "rotate 0|90|180|270" or "reset" lines changes it.
+*/
+#include <fb.h>
+#include <fbvec.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+/* Side of the blocks turned at a time */
+#define FB_XFORM_TILE 32
+
+/* Protected by fb_lock, the buffers are used by the flush thread only */
+struct vfbfs_fb_xform {
+    bool        x_bilinear;
+    unsigned    x_quarters;     /* clockwise */
+    bool        x_active;       /* not the identity */
+    unsigned    x_sw, x_sh;     /* the panel's size before the rotation */
+    uint32_t   *x_xmap;         /* per scaled column: source column << 8 | weight */
+    uint32_t   *x_ymap;         /* the same per scaled row */
+    uint8_t    *x_rows[2];      /* source rows as XRGB8888, a pixel of padding after */
+    unsigned    x_rows_y[2];    /* the screen rows in x_rows, or UINT_MAX */
+    uint8_t    *x_vrow;         /* x_rows blended */
+    uint32_t   *x_scaled;       /* the scaled rectangle, NULL until needed */
+    uint32_t   *x_turned;       /* x_scaled turned */
+};
+
+/* Where the quarters turned clockwise put r of a width x height panel */
+void vfbfs_fb_rect_turn(struct vfbfs_fb_rect *dst, const struct vfbfs_fb_rect *r, unsigned quarters
+    , unsigned width, unsigned height)
+{
+    struct vfbfs_fb_rect t = *r;
+    switch (quarters & 3) {
+    case 1:
+        t = (struct vfbfs_fb_rect){ width - r->r_y1, r->r_x0, width - r->r_y0, r->r_x1 };
+        break;
+    case 2:
+        t = (struct vfbfs_fb_rect){ width - r->r_x1, height - r->r_y1, width - r->r_x0, height - r->r_y0 };
+        break;
+    case 3:
+        t = (struct vfbfs_fb_rect){ r->r_y0, height - r->r_x1, r->r_y1, height - r->r_x0 };
+        break;
+    }
+    *dst = t;
+}
+
+/* True if the quarters turn the panel's size or the logical one differs from it */
+static bool fb_xform_needed(struct vfbfs_fb *fb, unsigned quarters)
+{
+    unsigned sw = (quarters & 1) ? fb->fb_dev_height : fb->fb_dev_width;
+    unsigned sh = (quarters & 1) ? fb->fb_dev_width : fb->fb_dev_height;
+    return quarters != 0 || sw != fb->fb_width || sh != fb->fb_height;
+}
+
+/* n scaled pixels from src ones, sampled at their centers */
+static void fb_xform_map(uint32_t *map, unsigned n, unsigned src, bool bilinear)
+{
+    int64_t u;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (!bilinear || n == src) {
+            map[i] = (uint32_t)((2 * (uint64_t)i + 1) * src / (2 * n)) << 8;
+            continue;
+        }
+        u = (2 * (int64_t)i + 1) * src * 256 / (2 * n) - 128;
+        map[i] = MIN(MAX(u, 0), ((int64_t)src - 1) * 256);
+    }
+}
+
+/* With fb_lock held */
+static void fb_xform_prepare(struct vfbfs_fb *fb, struct vfbfs_fb_xform *x)
+{
+    x->x_sw     = (x->x_quarters & 1) ? fb->fb_dev_height : fb->fb_dev_width;
+    x->x_sh     = (x->x_quarters & 1) ? fb->fb_dev_width : fb->fb_dev_height;
+    x->x_active = fb_xform_needed(fb, x->x_quarters);
+    fb_xform_map(x->x_xmap, x->x_sw, fb->fb_width, x->x_bilinear);
+    fb_xform_map(x->x_ymap, x->x_sh, fb->fb_height, x->x_bilinear);
+}
+
+bool vfbfs_fb_xform_active_locked(struct vfbfs_fb *fb)
+{
+    return fb->fb_xform->x_active;
+}
+
+/* The rotation the driver has to apply, if it has fd_rotate() */
+unsigned vfbfs_fb_xform_quarters_locked(struct vfbfs_fb *fb)
+{
+    return fb->fb_xform->x_quarters;
+}
+
+/* The scaled rectangle which the screen rectangle r affects */
+static void fb_xform_cover(struct vfbfs_fb *fb, const struct vfbfs_fb_xform *x
+    , const struct vfbfs_fb_rect *r, struct vfbfs_fb_rect *d)
+{
+    unsigned m = x->x_bilinear ? 1 : 0;
+    d->r_x0 = (uint64_t)(r->r_x0 - MIN(r->r_x0, m)) * x->x_sw / fb->fb_width;
+    d->r_y0 = (uint64_t)(r->r_y0 - MIN(r->r_y0, m)) * x->x_sh / fb->fb_height;
+    d->r_x1 = MIN(((uint64_t)(r->r_x1 + m) * x->x_sw + fb->fb_width - 1) / fb->fb_width, x->x_sw);
+    d->r_y1 = MIN(((uint64_t)(r->r_y1 + m) * x->x_sh + fb->fb_height - 1) / fb->fb_height, x->x_sh);
+}
+
+/*
+ * Keeps the flushed parts within the staging buffer: if the scaled parts
+ * together are larger than the panel, they become their union.
+*/
+unsigned vfbfs_fb_xform_fit_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *parts, unsigned n)
+{
+    struct vfbfs_fb_xform *x = fb->fb_xform;
+    struct vfbfs_fb_rect d, all = { 0 };
+    uint64_t area = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        fb_xform_cover(fb, x, &parts[i], &d);
+        area += (uint64_t)(d.r_x1 - d.r_x0) * (d.r_y1 - d.r_y0);
+        vfbfs_fb_rect_union(&all, &parts[i]);
+    }
+    if (area <= (uint64_t)x->x_sw * x->x_sh) {
+        return n;
+    }
+    parts[0] = all;
+    return 1;
+}
+
+/* Screen row sy from column sx0 on into x_rows[k], unless it is there */
+static void fb_xform_row(struct vfbfs_fb *fb, struct vfbfs_fb_xform *x, unsigned k, unsigned sy
+    , unsigned sx0, unsigned npix)
+{
+    enum VfbfsFbFormat sfmt;
+    const void *src;
+
+    if (x->x_rows_y[k] == sy) {
+        return;
+    }
+    src = vfbfs_fb_flush_row_locked(fb, (sy + fb->fb_scroll) % fb->fb_height, sx0, npix, &sfmt);
+    vfbfs_fb_convert(VFBFS_FB_XRGB8888, x->x_rows[k], sfmt, src, npix);
+    memcpy(x->x_rows[k] + npix * 4, x->x_rows[k] + (npix - 1) * 4, 4);
+    x->x_rows_y[k] = sy;
+}
+
+/* dst = (a * (256 - w) + b * w) / 256 for npix pixels */
+static void fb_xform_blend_rows(uint8_t *dst, const uint8_t *a, const uint8_t *b, unsigned npix
+    , unsigned w)
+{
+    const fb_v8w wb = (fb_v8w){ 0 } + (uint16_t)w, wa = 256 - wb;
+    fb_v8 va, vb;
+    fb_v8w v;
+    unsigned i, k;
+
+    for (i = 0; i + 2 <= npix; i += 2) {
+        memcpy(&va, a + i * 4, 8);
+        memcpy(&vb, b + i * 4, 8);
+        v  = (__builtin_convertvector(va, fb_v8w) * wa + __builtin_convertvector(vb, fb_v8w) * wb) >> 8;
+        va = __builtin_convertvector(v, fb_v8);
+        memcpy(dst + i * 4, &va, 8);
+    }
+    for (k = i * 4; k < npix * 4; k++) {
+        dst[k] = (a[k] * (256 - w) + b[k] * w) >> 8;
+    }
+}
+
+/* npix scaled pixels of a row starting at source column sx0, both taps in one vector */
+static void fb_xform_blend_cols(uint32_t *dst, const uint8_t *row, const uint32_t *map, unsigned sx0
+    , unsigned npix)
+{
+    const fb_v8w base = { 256, 256, 256, 256, 0, 0, 0, 0 };
+    const fb_v8w dir = { 0xffff, 0xffff, 0xffff, 0xffff, 1, 1, 1, 1 };
+    const fb_v8w swap = { 4, 5, 6, 7, 0, 1, 2, 3 };
+    fb_v8 ab;
+    fb_v8w v;
+    unsigned i;
+
+    for (i = 0; i < npix; i++) {
+        memcpy(&ab, row + ((map[i] >> 8) - sx0) * 4, 8);
+        /* 256 - w for the left pixel and w for the right one, wrapping around */
+        v  = __builtin_convertvector(ab, fb_v8w) * (base + (uint16_t)(map[i] & 255) * dir);
+        v  = (v + __builtin_shuffle(v, swap)) >> 8;
+        ab = __builtin_convertvector(v, fb_v8);
+        memcpy(&dst[i], &ab, 4);
+    }
+}
+
+/* Scales the screen into the scaled rectangle d of x_scaled, d's width per row */
+static void fb_xform_scale(struct vfbfs_fb *fb, struct vfbfs_fb_xform *x, const struct vfbfs_fb_rect *d)
+{
+    const uint32_t *xmap = x->x_xmap + d->r_x0;
+    unsigned dw = d->r_x1 - d->r_x0, sx0 = xmap[0] >> 8, sx1, npix, dy, sy, wy, i;
+    uint32_t *out = x->x_scaled;
+    const uint8_t *row;
+
+    sx1  = MIN((xmap[dw - 1] >> 8) + 1, fb->fb_width - 1);
+    npix = sx1 - sx0 + 1;
+    x->x_rows_y[0] = x->x_rows_y[1] = UINT_MAX;
+    for (dy = d->r_y0; dy < d->r_y1; dy++, out += dw) {
+        sy  = x->x_ymap[dy] >> 8;
+        wy  = x->x_ymap[dy] & 255;
+        fb_xform_row(fb, x, sy & 1, sy, sx0, npix);
+        row = x->x_rows[sy & 1];
+        if (wy != 0) {
+            fb_xform_row(fb, x, (sy + 1) & 1, sy + 1, sx0, npix);
+            fb_xform_blend_rows(x->x_vrow, row, x->x_rows[(sy + 1) & 1], npix + 1, wy);
+            row = x->x_vrow;
+        }
+        if (x->x_sw == fb->fb_width) {
+            memcpy(out, row, (size_t)dw * 4);
+        } else if (x->x_bilinear) {
+            fb_xform_blend_cols(out, row, xmap, sx0, dw);
+        } else {
+            for (i = 0; i < dw; i++) {
+                memcpy(&out[i], row + ((xmap[i] >> 8) - sx0) * 4, 4);
+            }
+        }
+    }
+}
+
+/* Turns the 4x4 pixels at row a, column b of the w x h src into dst */
+static inline void fb_xform_turn4(uint32_t *dst, const uint32_t *src, unsigned w, unsigned h
+    , unsigned a, unsigned b, unsigned quarters)
+{
+    const fb_v4u lo = { 0, 4, 1, 5 }, hi = { 2, 6, 3, 7 }, lo2 = { 0, 1, 4, 5 }, hi2 = { 2, 3, 6, 7 };
+    const fb_v4u rev = { 3, 2, 1, 0 };
+    fb_v4u r[4], t[4], c[4];
+    unsigned k;
+
+    for (k = 0; k < 4; k++) {
+        memcpy(&r[k], src + (size_t)(a + k) * w + b, 16);
+    }
+    t[0] = __builtin_shuffle(r[0], r[1], lo);
+    t[1] = __builtin_shuffle(r[0], r[1], hi);
+    t[2] = __builtin_shuffle(r[2], r[3], lo);
+    t[3] = __builtin_shuffle(r[2], r[3], hi);
+    /* c[k] is column b + k */
+    c[0] = __builtin_shuffle(t[0], t[2], lo2);
+    c[1] = __builtin_shuffle(t[0], t[2], hi2);
+    c[2] = __builtin_shuffle(t[1], t[3], lo2);
+    c[3] = __builtin_shuffle(t[1], t[3], hi2);
+    for (k = 0; k < 4; k++) {
+        if (quarters == 1) {
+            c[k] = __builtin_shuffle(c[k], rev);
+            memcpy(dst + (size_t)(b + k) * h + (h - 4 - a), &c[k], 16);
+        } else {
+            memcpy(dst + (size_t)(w - 1 - b - k) * h + a, &c[k], 16);
+        }
+    }
+}
+
+/* One pixel of turn4 */
+static inline void fb_xform_turn1(uint32_t *dst, const uint32_t *src, unsigned w, unsigned h
+    , unsigned a, unsigned b, unsigned quarters)
+{
+    if (quarters == 1) {
+        dst[(size_t)b * h + (h - 1 - a)] = src[(size_t)a * w + b];
+    } else {
+        dst[(size_t)(w - 1 - b) * h + a] = src[(size_t)a * w + b];
+    }
+}
+
+/* Turns the w x h pixels of src into dst clockwise, dst is h wide for odd quarters */
+static void fb_xform_turn(uint32_t *dst, const uint32_t *src, unsigned w, unsigned h, unsigned quarters)
+{
+    const fb_v4u rev = { 3, 2, 1, 0 };
+    unsigned ta, tb, a, b, ae, be, a4, b4;
+    fb_v4u v;
+
+    if (quarters == 2) {
+        for (a = 0; a < h; a++) {
+            const uint32_t *s = src + (size_t)a * w;
+            uint32_t *d = dst + (size_t)(h - 1 - a) * w;
+            for (b = 0; b + 4 <= w; b += 4) {
+                memcpy(&v, s + b, 16);
+                v = __builtin_shuffle(v, rev);
+                memcpy(d + w - 4 - b, &v, 16);
+            }
+            for (; b < w; b++) {
+                d[w - 1 - b] = s[b];
+            }
+        }
+        return;
+    }
+    for (ta = 0; ta < h; ta += FB_XFORM_TILE) {
+        ae = MIN(ta + FB_XFORM_TILE, h);
+        a4 = ta + ((ae - ta) & ~3U);
+        for (tb = 0; tb < w; tb += FB_XFORM_TILE) {
+            be = MIN(tb + FB_XFORM_TILE, w);
+            b4 = tb + ((be - tb) & ~3U);
+            for (a = ta; a < a4; a += 4) {
+                for (b = tb; b < b4; b += 4) {
+                    fb_xform_turn4(dst, src, w, h, a, b, quarters);
+                }
+                for (; b < be; b++) {
+                    fb_xform_turn1(dst, src, w, h, a, b, quarters);
+                    fb_xform_turn1(dst, src, w, h, a + 1, b, quarters);
+                    fb_xform_turn1(dst, src, w, h, a + 2, b, quarters);
+                    fb_xform_turn1(dst, src, w, h, a + 3, b, quarters);
+                }
+            }
+            for (; a < ae; a++) {
+                for (b = tb; b < be; b++) {
+                    fb_xform_turn1(dst, src, w, h, a, b, quarters);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Renders the damaged screen rectangle *r for the panel into dst, in the
+ * device's format. *r becomes the panel's rectangle, still unturned if the
+ * driver turns it. Called by the flush thread with fb_lock held, returns
+ * the end of the pixels.
+*/
+char *vfbfs_fb_xform_part_locked(struct vfbfs_fb *fb, struct vfbfs_fb_rect *r, char *dst)
+{
+    struct vfbfs_fb_xform *x = fb->fb_xform;
+    struct vfbfs_fb_rect d;
+    const uint32_t *px = x->x_scaled;
+    unsigned q = x->x_quarters, w, h, i;
+    size_t dstride;
+
+    fb_xform_cover(fb, x, r, &d);
+    fb_xform_scale(fb, x, &d);
+    w  = d.r_x1 - d.r_x0;
+    h  = d.r_y1 - d.r_y0;
+    *r = d;
+    if (q != 0 && fb->fb_dev_oprs->fd_rotate == NULL) {
+        fb_xform_turn(x->x_turned, x->x_scaled, w, h, q);
+        px = x->x_turned;
+        vfbfs_fb_rect_turn(r, &d, q, fb->fb_dev_width, fb->fb_dev_height);
+        if (q & 1) {
+            w = d.r_y1 - d.r_y0;
+            h = d.r_x1 - d.r_x0;
+        }
+    }
+    dstride = (size_t)w * vfbfs_fb_format_bpp(fb->fb_dev_format);
+    for (i = 0; i < h; i++) {
+        vfbfs_fb_dither_row_locked(fb, dst + i * dstride, px + (size_t)i * w, VFBFS_FB_XRGB8888, w
+            , r->r_x0, r->r_y0 + i, i);
+    }
+    vfbfs_fb_dither_part_locked(fb, dst, dstride, w, h, r->r_x0, r->r_y0);
+    fb->fb_stats.st_xform_pixels += (uint64_t)w * h;
+    return dst + h * dstride;
+}
+
+/* The buffers for a panel sized rectangle, NULL without memory */
+static uint32_t *fb_xform_buffers(struct vfbfs_fb *fb)
+{
+    return malloc((size_t)fb->fb_dev_width * fb->fb_dev_height * 4 * 2);
+}
+
+static int fb_xform_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    bool bilinear;
+    unsigned q;
+
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    bilinear = fb->fb_xform->x_bilinear;
+    q        = fb->fb_xform->x_quarters;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    fprintf(out, "logical %ux%u\npanel %ux%u\nscale %s\nrotate %u\nrotation %s\n"
+        , fb->fb_width, fb->fb_height, fb->fb_dev_width, fb->fb_dev_height
+        , bilinear ? "bilinear" : "nearest", q * 90
+        , (fb->fb_dev_oprs->fd_rotate != NULL) ? "hardware" : "software");
+    return 0;
+}
+
+/* Runs one control line */
+static int fb_xform_command(char *line, bool *bilinear, unsigned *quarters)
+{
+    char cmd[16], arg[16];
+    int n = sscanf(line, "%15s %15s", cmd, arg);
+
+    if (n == 1 && strcmp(cmd, "reset") == 0) {
+        *bilinear = false;
+        *quarters = 0;
+    } else if (n == 2 && strcmp(cmd, "scale") == 0
+            && (strcmp(arg, "nearest") == 0 || strcmp(arg, "bilinear") == 0)) {
+        *bilinear = (arg[0] == 'b');
+    } else if (n == 2 && strcmp(cmd, "rotate") == 0
+            && (strcmp(arg, "0") == 0 || strcmp(arg, "90") == 0 || strcmp(arg, "180") == 0
+                || strcmp(arg, "270") == 0)) {
+        *quarters = atoi(arg) / 90;
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int fb_xform_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    struct vfbfs_fb *fb = (struct vfbfs_fb *)priv;
+    struct vfbfs_fb_xform *x = fb->fb_xform;
+    struct vfbfs_fb_rect all = { 0, 0, fb->fb_width, fb->fb_height };
+    uint32_t *bufs = NULL;
+    char *buf, *line, *next;
+    bool bilinear, has_bufs;
+    unsigned q;
+    int r = 0;
+
+    if (off != 0 || size > 4096) {
+        return -EINVAL;
+    }
+    if ((buf = malloc(size + 1)) == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(buf, data, size);
+    buf[size] = '\0';
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    bilinear = x->x_bilinear;
+    q        = x->x_quarters;
+    has_bufs = x->x_scaled != NULL;
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+
+    /* All lines or none */
+    for (line = buf; r == 0 && line != NULL && *line != '\0'; line = next) {
+        if ((next = strchr(line, '\n')) != NULL) {
+            *next++ = '\0';
+        }
+        if (*line != '\0') {
+            r = fb_xform_command(line, &bilinear, &q);
+        }
+    }
+    free(buf);
+    if (r != 0) {
+        return r;
+    }
+    if (!has_bufs && fb_xform_needed(fb, q) && (bufs = fb_xform_buffers(fb)) == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_mutex_lock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    if (x->x_scaled == NULL && bufs != NULL) {
+        x->x_scaled = bufs;
+        x->x_turned = bufs + (size_t)fb->fb_dev_width * fb->fb_dev_height;
+        bufs = NULL;
+    }
+    if (x->x_bilinear != bilinear || x->x_quarters != q) {
+        x->x_bilinear = bilinear;
+        x->x_quarters = q;
+        fb_xform_prepare(fb, x);
+        /* The device gets its regions again, none while transformed */
+        fb->fb_regions_seq++;
+        vfbfs_fb_damage(fb, &all);
+    }
+    vfbfs_mutex_unlock(&fb->fb_lock, VFBFS_LC_FB_LOCK);
+    free(bufs);
+    return size;
+}
+
+/* After the device is open, its panel size is known */
+int vfbfs_fb_xform_create(struct vfbfs *fs, struct vfbfs_fb *fb)
+{
+    unsigned side = MAX(fb->fb_dev_width, fb->fb_dev_height);
+    struct vfbfs_fb_xform *x;
+    struct vfbfs_file *f;
+
+    if ((x = calloc(1, sizeof(*x))) == NULL) {
+        return -ENOMEM;
+    }
+    fb->fb_xform = x;
+    x->x_xmap    = malloc(side * sizeof(*x->x_xmap));
+    x->x_ymap    = malloc(side * sizeof(*x->x_ymap));
+    x->x_rows[0] = malloc(((size_t)fb->fb_width + 1) * 4);
+    x->x_rows[1] = malloc(((size_t)fb->fb_width + 1) * 4);
+    x->x_vrow    = malloc(((size_t)fb->fb_width + 1) * 4);
+    if (x->x_xmap == NULL || x->x_ymap == NULL || x->x_rows[0] == NULL || x->x_rows[1] == NULL
+            || x->x_vrow == NULL) {
+        return -ENOMEM;
+    }
+    /* A panel of another size is scaled to from the start */
+    if (fb_xform_needed(fb, 0)) {
+        if ((x->x_scaled = fb_xform_buffers(fb)) == NULL) {
+            return -ENOMEM;
+        }
+        x->x_turned = x->x_scaled + (size_t)fb->fb_dev_width * fb->fb_dev_height;
+    }
+    fb_xform_prepare(fb, x);
+    f = vfbfs_gen_create_in(fs, fb->fb_dir, "transform", fb_xform_render, fb, VFBFS_GEN_TTL_NONE);
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    vfbfs_gen_from_file(f)->g_write = fb_xform_write;
+    f->f_entry->e_stat.st_mode = S_IFREG | 0644;
+    return 0;
+}
+
+/* Frees the transform of a framebuffer whose creation failed */
+void vfbfs_fb_xform_free(struct vfbfs_fb *fb)
+{
+    struct vfbfs_fb_xform *x = fb->fb_xform;
+    if (x == NULL) {
+        return;
+    }
+    free(x->x_xmap);
+    free(x->x_ymap);
+    free(x->x_rows[0]);
+    free(x->x_rows[1]);
+    free(x->x_vrow);
+    free(x->x_scaled);
+    free(x);
+    fb->fb_xform = NULL;
+}
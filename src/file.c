@@ -19,16 +19,19 @@
  */
 
 #include <vfbfs.h>
+#include <fileioctl.h>
 
 #include <sys/param.h>
 #include <fcntl.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <poll.h>
 
 void vfbfs_entry_init(struct vfbfs_entry *e)
 {
@@ -54,10 +57,10 @@ void vfbfs_entry_init_generic(struct vfbfs_entry *e)
 
 mode_t vfbfs_entry_set_mode(struct vfbfs_entry *e, mode_t mode)
 {
-    pthread_mutex_lock(&e->e_wlock);
+    vfbfs_mutex_lock(&e->e_wlock, VFBFS_LC_E_WLOCK);
     mode_t omod = e->e_stat.st_mode;
     e->e_stat.st_mode |= mode;
-    pthread_mutex_unlock(&e->e_wlock);
+    vfbfs_mutex_unlock(&e->e_wlock, VFBFS_LC_E_WLOCK);
     return omod;
 }
 
@@ -119,9 +122,9 @@ off_t vfbfs_file_set_size(struct vfbfs_file *f, off_t new_size)
     }
     fe = f->f_entry;
     off_t old_size = fe->e_stat.st_size;
-    pthread_mutex_lock(&fe->e_wlock);
+    vfbfs_mutex_lock(&fe->e_wlock, VFBFS_LC_E_WLOCK);
     fe->e_stat.st_size = new_size;
-    pthread_mutex_unlock(&fe->e_wlock);
+    vfbfs_mutex_unlock(&fe->e_wlock, VFBFS_LC_E_WLOCK);
     return old_size;
 }
 
@@ -204,96 +207,166 @@ int vfbfs_mem_file_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
         }
     }
     #endif
-    pthread_mutex_lock(&f->f_lock);
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
     f->f_open_count++;
-    pthread_mutex_unlock(&f->f_lock);
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
     return 0;
 }
 
 int vfbfs_mem_file_close(struct vfbfs *fs, struct vfbfs_file *f, const char *path, struct fuse_file_info *in)
 {
     (void) in;
-    pthread_mutex_lock(&f->f_lock);
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
     f->f_open_count--;
-    pthread_mutex_unlock(&f->f_lock);
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
     return 0;
 }
 
 int vfbfs_mem_file_read(struct vfbfs *fs, struct vfbfs_file *file, const char *path
     , char *data, size_t size, off_t off, struct fuse_file_info *fi)
 {
-    off_t fsize = vfbfs_file_get_size(file);
-//    pthread_mutex_lock(&file->f_lock);
-    if (file->f_content != NULL) {
-        size = MIN(size, fsize);
+    off_t fsize;
+    /* write(), truncate() and a clone can move or free the content */
+    vfbfs_mutex_lock(&file->f_lock, VFBFS_LC_F_LOCK);
+    fsize = file->f_content_size;
+    if (file->f_content != NULL && off < fsize) {
+        size = MIN(size, fsize - off);
         memcpy(data, file->f_content+off, size);
-        return size;
     } else {
         size = 0;
     }
-//    pthread_mutex_unlock(&file->f_lock);
+    vfbfs_mutex_unlock(&file->f_lock, VFBFS_LC_F_LOCK);
     return size;
 }
 
-int vfbfs_mem_file_truncate(struct vfbfs *fs, struct vfbfs_file *file, const char *path, off_t size)
+static void vfbfs_content_put(struct vfbfs_content *c)
 {
-//    pthread_mutex_lock(&file->f_lock);
-    if (file->f_content != NULL) {
-        free(file->f_content);
+    if (__atomic_sub_fetch(&c->c_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(c->c_data);
+        free(c);
     }
-    file->f_content      = calloc(size, sizeof(char));
-    pthread_mutex_unlock(&file->f_lock);
+}
 
-    if (file->f_content == NULL) {
-        file->f_content_size = size * sizeof(char);
-        vfbfs_file_set_size(file, 0);
+/*
+ * Gives the file a private copy of size bytes of its content when it still
+ * points into an image mapping (VFBFS_FILE_MAPPED) or shares it with its
+ * clones (VFBFS_FILE_SHARED), the rest is zeroed. The last file sharing a
+ * content takes the buffer over as it is. With f_lock held.
+*/
+int vfbfs_file_unshare(struct vfbfs_file *file, off_t size)
+{
+    struct vfbfs_content *c = file->f_shared;
+    off_t keep = MIN(size, file->f_content_size);
+    char *nptr;
+    if (!(file->f_flags & (VFBFS_FILE_MAPPED | VFBFS_FILE_SHARED))) {
+        return 0;
+    }
+    /* Only a clone of this file could take a new reference, that needs our f_lock */
+    if (c != NULL && __atomic_load_n(&c->c_refs, __ATOMIC_ACQUIRE) == 1) {
+        free(c);
+        file->f_shared = NULL;
+        file->f_flags &= ~VFBFS_FILE_SHARED;
+        return 0;
+    }
+    if ((nptr = malloc(MAX(size, 1))) == NULL) {
         return -ENOSPC;
     }
-    // this function locks file->f_lock by itself
-    vfbfs_file_set_size(file, size);
+    memcpy(nptr, file->f_content, keep);
+    memset(nptr + keep, 0, size - keep);
+    if (c != NULL) {
+        vfbfs_content_put(c);
+    }
+    file->f_content      = nptr;
+    file->f_content_size = size;
+    file->f_shared       = NULL;
+    file->f_flags       &= ~(VFBFS_FILE_MAPPED | VFBFS_FILE_SHARED);
     return 0;
 }
 
-int vfbfs_mem_file_write(struct vfbfs *fs, struct vfbfs_file *file, const char *path
-    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+int vfbfs_mem_file_truncate(struct vfbfs *fs, struct vfbfs_file *file, const char *path, off_t size)
 {
-    off_t fsize = vfbfs_file_get_size(file);
-    off_t nsize = fsize;
-    void *nptr = NULL;
-//    pthread_mutex_lock(&file->f_lock);
-    if (file->f_content != NULL) {
-        if (off + size > file->f_content_size) {
-            nptr = realloc(file->f_content, off+size+1);
-        } else {
-            memcpy(file->f_content + off, data, size);
-            return size;
+    char *nptr;
+    int r;
+    vfbfs_mutex_lock(&file->f_lock, VFBFS_LC_F_LOCK);
+    /* The content up to size is kept, growing the file reads as zeroes */
+    r = vfbfs_file_unshare(file, size);
+    if (r == 0 && (nptr = realloc(file->f_content, MAX(size, 1))) != NULL) {
+        if (size > file->f_content_size) {
+            memset(nptr + file->f_content_size, 0, size - file->f_content_size);
         }
-    } else {
-        nptr = calloc(off+size+1, sizeof(char));
+        file->f_content      = nptr;
+        file->f_content_size = size;
+        /* Under f_lock, so st_size never disagrees with the content */
+        vfbfs_file_set_size(file, size);
+    } else if (r == 0) {
+        r = -ENOSPC;
     }
-    if (nptr == NULL) {
+    vfbfs_mutex_unlock(&file->f_lock, VFBFS_LC_F_LOCK);
+    return r;
+}
+
+/* With f_lock held, st_size follows the content */
+static int vfbfs_mem_file_write_locked(struct vfbfs_file *file, const char *data, size_t size, off_t off)
+{
+    char *nptr = NULL;
+    /* Copy-on-write: the image mapping is read-only, the clones keep the old content */
+    if (vfbfs_file_unshare(file, MAX(file->f_content_size, off + (off_t)size)) != 0) {
         return -ENOSPC;
     }
-    nsize = off+size+1;
-    file->f_content = nptr;
-    file->f_content_size = nsize;
-    memcpy(file->f_content + off, data, size);
-//    pthread_mutex_unlock(&file->f_lock);
-    if (fsize != nsize) {
-        vfbfs_file_set_size(file, nsize);
+    if (off + size > file->f_content_size) {
+        nptr = realloc(file->f_content, off+size);
+        if (nptr == NULL) {
+            return -ENOSPC;
+        }
+        /* Writing past the end leaves a hole, which reads as zeroes */
+        if (off > file->f_content_size) {
+            memset(nptr + file->f_content_size, 0, off - file->f_content_size);
+        }
+        file->f_content = nptr;
+        file->f_content_size = off+size;
+        vfbfs_file_set_size(file, file->f_content_size);
     }
+    memcpy(file->f_content + off, data, size);
     return size;
 }
 
+int vfbfs_mem_file_write(struct vfbfs *fs, struct vfbfs_file *file, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    int r;
+    /* A clone taken meanwhile would share a buffer realloc() frees */
+    vfbfs_mutex_lock(&file->f_lock, VFBFS_LC_F_LOCK);
+    r = vfbfs_mem_file_write_locked(file, data, size, off);
+    vfbfs_mutex_unlock(&file->f_lock, VFBFS_LC_F_LOCK);
+    return r;
+}
+
 int vfbfs_mem_file_release(struct vfbfs *fs, struct vfbfs_file *file
     , const char *path, struct fuse_file_info *fi)
 {
-    //pthread_mutex_lock(&file->vf_lock);
-    //vfbfs_file_free(fs, file);
-    /* No unlock, the mutex is already destroyed by now */
+    /* The last release() of an unlinked file frees it */
+    vfbfs_file_put(fs, file);
     return 0;
 }
 
+static int vfbfs_mem_file_ioctl(struct vfbfs *fs, struct vfbfs_file *file, const char *path
+    , int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, void *data)
+{
+    struct vfbfs_clone_range *cr = (struct vfbfs_clone_range *)data;
+    struct vfbfs_file *src;
+    int r;
+    if ((unsigned)cmd != VFBFS_IOC_CLONE_RANGE) {
+        return -ENOTTY;
+    }
+    cr->cr_src[sizeof(cr->cr_src) - 1] = '\0';
+    if ((src = vfbfs_file_get(fs, cr->cr_src)) == NULL) {
+        return -ENOENT;
+    }
+    r = vfbfs_file_clone(fs, file, src, cr->cr_src_off, cr->cr_len, cr->cr_dst_off);
+    vfbfs_file_put(fs, src);
+    return r;
+}
+
 static struct vfbfs_file_ops vfbfs_mem_file_oprs = {
     .f_open       = vfbfs_mem_file_open,
     .f_close      = vfbfs_mem_file_close,
@@ -302,6 +375,7 @@ static struct vfbfs_file_ops vfbfs_mem_file_oprs = {
     .f_truncate   = vfbfs_mem_file_truncate,
     .f_getattr    = NULL,
     .f_release    = vfbfs_mem_file_release,
+    .f_ioctl      = vfbfs_mem_file_ioctl,
 };
 
 struct vfbfs_file_ops *vfbfs_file_get_mem_ops(void)
@@ -327,6 +401,8 @@ void vfbfs_file_init(struct vfbfs_file *f)
     f->f_open_count   = 0;
     f->f_content_size = 0;
     f->f_content      = NULL;
+    f->f_flags        = 0;
+    f->f_shared       = NULL;
     f->f_private      = NULL;
     pthread_mutex_init(&f->f_lock, NULL);
 }
@@ -341,9 +417,224 @@ struct vfbfs_file *vfbfs_file_alloc(struct vfbfs *fs)
     return f;
 }
 
+/* Lets go of the content, whoever it belongs to. With f_lock held. */
+static void vfbfs_file_drop_content(struct vfbfs_file *file)
+{
+    if (file->f_flags & VFBFS_FILE_SHARED) {
+        vfbfs_content_put(file->f_shared);
+    } else if (!(file->f_flags & VFBFS_FILE_MAPPED)) {
+        free(file->f_content);
+    }
+    file->f_content      = NULL;
+    file->f_content_size = 0;
+    file->f_shared       = NULL;
+    file->f_flags       &= ~(VFBFS_FILE_MAPPED | VFBFS_FILE_SHARED);
+}
+
+/* The nodes of vfbfs_build_file() only lose their content, see build.h */
 void vfbfs_file_free(struct vfbfs *fs, struct vfbfs_file *file)
 {
+    struct vfbfs_entry *e = file->f_entry;
+    vfbfs_file_drop_content(file);
+    if (file->f_flags & VFBFS_FILE_BUILT) {
+        /* Renamed, the name is not in the arena any more */
+        if (!(file->f_flags & VFBFS_FILE_ARENA_NAME)) {
+            free(e->e_name);
+            e->e_name = NULL;
+        }
+        return;
+    }
+    pthread_mutex_destroy(&file->f_lock);
+    pthread_mutex_destroy(&e->e_wlock);
+    free(e->e_name);
+    free(e);
+    free(file);
+}
+
+/* Plain files which nothing else points to, see VFBFS_FILE_PINNED */
+bool vfbfs_file_is_removable(struct vfbfs_file *f)
+{
+    return f != NULL && f->f_oprs == &vfbfs_mem_file_oprs && f->f_private == NULL
+        && !(f->f_flags & VFBFS_FILE_PINNED);
+}
+
+/* The directory of e, NULL once it's unlinked */
+static struct vfbfs_dir *vfbfs_entry_parent(struct vfbfs_entry *e)
+{
+    struct vfbfs_dir *parent;
+    vfbfs_mutex_lock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    parent = e->e_parent;
+    vfbfs_mutex_unlock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    return parent;
+}
+
+/*
+ * Marks f unlinked once it's out of its directory's tree, with the
+ * directory's d_rwlock held for writing, so a racing unlink() or rename()
+ * sees the file gone. Returns true if nothing holds f any more.
+*/
+static bool vfbfs_file_detach_locked(struct vfbfs_file *f)
+{
+    struct vfbfs_entry *e = f->f_entry;
+    bool gone;
+
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    vfbfs_mutex_lock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    e->e_parent = NULL;
+    vfbfs_mutex_unlock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    gone = (f->f_open_count == 0);
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    return gone;
+}
+
+/*
+ * Called after vfbfs_file_detach_locked(). The file is freed now, or by
+ * vfbfs_file_put() of the last reference if it's still held.
+*/
+static void vfbfs_file_unlinked(struct vfbfs *fs, struct vfbfs_file *f, bool gone)
+{
+    struct vfbfs_superblock *sb = fs->fs_superblock;
+
+    vfbfs_mutex_lock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+    sb->sb_file_count--;
+    vfbfs_mutex_unlock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
+    if (gone) {
+        vfbfs_file_free(fs, f);
+    }
+}
+
+/* The caller holds a reference on f, see vfbfs_file_get() */
+int vfbfs_file_unlink(struct vfbfs *fs, struct vfbfs_file *f)
+{
+    struct vfbfs_entry *e = f->f_entry;
+    struct vfbfs_dir *parent;
+    bool gone;
+
+    if (!vfbfs_file_is_removable(f)) {
+        return -EPERM;
+    }
+    if ((parent = vfbfs_entry_parent(e)) == NULL) {
+        return -ENOENT;
+    }
+    vfbfs_rwlock_wrlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
+    /* Unlinked or moved away meanwhile */
+    if (e->e_parent != parent) {
+        vfbfs_rwlock_unlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
+        return -ENOENT;
+    }
+    RB_REMOVE(VFBFS_ENTRY_TREE, &parent->d_entries, e);
+    gone = vfbfs_file_detach_locked(f);
+    vfbfs_rwlock_unlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
+    vfbfs_file_unlinked(fs, f, gone);
+    return 0;
+}
+
+/* Both directories of a rename(), the one at the lower address first */
+static void vfbfs_dir_wrlock_pair(struct vfbfs_dir *a, struct vfbfs_dir *b)
+{
+    if (a == b) {
+        vfbfs_rwlock_wrlock(&a->d_rwlock, VFBFS_LC_D_RWLOCK);
+        return;
+    }
+    if (a > b) {
+        struct vfbfs_dir *t = a;
+        a = b;
+        b = t;
+    }
+    vfbfs_rwlock_wrlock(&a->d_rwlock, VFBFS_LC_D_RWLOCK);
+    vfbfs_rwlock_wrlock(&b->d_rwlock, VFBFS_LC_D_RWLOCK);
+}
+
+static void vfbfs_dir_unlock_pair(struct vfbfs_dir *a, struct vfbfs_dir *b)
+{
+    vfbfs_rwlock_unlock(&a->d_rwlock, VFBFS_LC_D_RWLOCK);
+    if (a != b) {
+        vfbfs_rwlock_unlock(&b->d_rwlock, VFBFS_LC_D_RWLOCK);
+    }
+}
+
+/*
+ * Moves f into dir as name, replacing the file of that name. A file with
+ * f_replace (the frame of a framebuffer) takes over the content of f
+ * instead, and f is unlinked. The caller holds a reference on f.
+*/
+int vfbfs_file_rename(struct vfbfs *fs, struct vfbfs_file *f, struct vfbfs_dir *dir
+    , const char *name, const char *path)
+{
+    struct vfbfs_entry *e = f->f_entry, *old = NULL, key;
+    struct vfbfs_dir *from;
+    struct vfbfs_file *of = NULL;
+    char *nname, *oname = NULL;
+    bool arena = false, gone = false;
+    int r = 0;
 
+    if (!vfbfs_file_is_removable(f)) {
+        return -EPERM;
+    }
+    if ((from = vfbfs_entry_parent(e)) == NULL) {
+        return -ENOENT;
+    }
+    /* Only a directory which creates files takes them, see vfbfs_dir_get_fixed_ops() */
+    if (dir->d_oprs == NULL || dir->d_oprs->d_create == NULL) {
+        return -EPERM;
+    }
+    if ((nname = strdup(name)) == NULL) {
+        return -ENOMEM;
+    }
+    key.e_name = (char *)name;
+    vfbfs_dir_wrlock_pair(from, dir);
+    /* Unlinked or moved away meanwhile */
+    if (e->e_parent != from) {
+        r = -ENOENT;
+        goto unlock;
+    }
+    old = RB_FIND(VFBFS_ENTRY_TREE, &dir->d_entries, &key);
+    of  = vfbfs_entry_get_file(old);
+    if (old == e) {
+        goto unlock;
+    }
+    if (of != NULL && of->f_oprs != NULL && of->f_oprs->f_replace != NULL) {
+        /* Not under the directory locks, the content is swapped under the file's own lock */
+        vfbfs_dir_unlock_pair(from, dir);
+        free(nname);
+        if ((r = vfbfs_file_call_operation(fs, of, VFBFS_F_REPLACE, path, f)) != 0) {
+            return r;
+        }
+        /* f is still held, an unlink() meanwhile only leaves nothing to do */
+        r = vfbfs_file_unlink(fs, f);
+        return (r == -ENOENT) ? 0 : r;
+    }
+    if (old != NULL && !vfbfs_file_is_removable(of)) {
+        r = vfbfs_entry_is_dir(old) ? -EISDIR : -EPERM;
+        goto unlock;
+    }
+    if (old != NULL) {
+        RB_REMOVE(VFBFS_ENTRY_TREE, &dir->d_entries, old);
+        gone = vfbfs_file_detach_locked(of);
+    }
+    /* The tree is ordered by name, the entry can't be in it while the name changes */
+    RB_REMOVE(VFBFS_ENTRY_TREE, &from->d_entries, e);
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    vfbfs_mutex_lock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    oname       = e->e_name;
+    e->e_name   = nname;
+    e->e_parent = dir;
+    arena       = f->f_flags & VFBFS_FILE_ARENA_NAME;
+    f->f_flags &= ~VFBFS_FILE_ARENA_NAME;
+    vfbfs_mutex_unlock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    RB_INSERT(VFBFS_ENTRY_TREE, &dir->d_entries, e);
+    nname = NULL;
+unlock:
+    vfbfs_dir_unlock_pair(from, dir);
+    free(nname);
+    if (old != NULL && r == 0 && old != e) {
+        vfbfs_file_unlinked(fs, of, gone);
+    }
+    if (!arena) {
+        free(oname);
+    }
+    return r;
 }
 
 struct vfbfs_file *vfbfs_file_new(struct vfbfs *fs, char *name)
@@ -367,27 +658,27 @@ void vfbfs_file_inherit(struct vfbfs_dir *d, struct vfbfs_file *f)
 {
     struct vfbfs_entry *fe = f->f_entry;
     /* Lock file */
-    pthread_mutex_lock(&f->f_lock);
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
     /* Lock parent directory readlock  */
-    pthread_rwlock_rdlock(&d->d_rwlock);
+    vfbfs_rwlock_rdlock(&d->d_rwlock, VFBFS_LC_D_RWLOCK);
 
     /* Lock entry */
-    pthread_mutex_lock(&fe->e_wlock);
+    vfbfs_mutex_lock(&fe->e_wlock, VFBFS_LC_E_WLOCK);
     fe->e_parent = d;
     /* Use the directory's default file operations if none is set */
     if (fe->e_oprs == NULL) {
         fe->e_oprs   = d->d_dentry_oprs;
     }
     /* Unlock entry */
-    pthread_mutex_unlock(&fe->e_wlock);
+    vfbfs_mutex_unlock(&fe->e_wlock, VFBFS_LC_E_WLOCK);
 
     if (f->f_oprs == NULL) {
         f->f_oprs = d->d_dfile_oprs;
     }
     /* Unlock parent-reader */
-    pthread_rwlock_unlock(&d->d_rwlock);
+    vfbfs_rwlock_unlock(&d->d_rwlock, VFBFS_LC_D_RWLOCK);
     /* Unlock file */
-    pthread_mutex_unlock(&f->f_lock);
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
 }
 
 int vfbfs_entry_add_to(struct vfbfs *fs, struct vfbfs_dir *parent, struct vfbfs_entry *e)
@@ -395,14 +686,14 @@ int vfbfs_entry_add_to(struct vfbfs *fs, struct vfbfs_dir *parent, struct vfbfs_
     if (parent == NULL || e == NULL) {
         return -ENOENT;
     }
-    pthread_rwlock_wrlock(&parent->d_rwlock);
-    RB_INSERT(VFBFS_ENTRY_TREE, &parent->d_entries, e);
-    pthread_rwlock_unlock(&parent->d_rwlock);
-
-    pthread_mutex_lock(&e->e_wlock);
+    /* Linked before it can be found, vfbfs_file_put() frees what isn't */
+    vfbfs_rwlock_wrlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
+    vfbfs_mutex_lock(&e->e_wlock, VFBFS_LC_E_WLOCK);
     e->e_parent = parent;
     e->e_oprs   = parent->d_dentry_oprs;
-    pthread_mutex_unlock(&e->e_wlock);
+    vfbfs_mutex_unlock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    RB_INSERT(VFBFS_ENTRY_TREE, &parent->d_entries, e);
+    vfbfs_rwlock_unlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
     return 0;
 }
 
@@ -424,19 +715,110 @@ struct vfbfs_file *vfbfs_file_add_to(struct vfbfs *fs, struct vfbfs_dir *d, stru
 
     vfbfs_file_inherit(d, f);
 
-    pthread_mutex_lock(&sb->sb_wlock);
+    vfbfs_mutex_lock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
     sb->sb_file_count++;
-    pthread_mutex_unlock(&sb->sb_wlock);
+    vfbfs_mutex_unlock(&sb->sb_wlock, VFBFS_LC_SB_WLOCK);
     return f;
 }
 
+static void vfbfs_file_lock_pair(struct vfbfs_file *a, struct vfbfs_file *b)
+{
+    if (a == b) {
+        vfbfs_mutex_lock(&a->f_lock, VFBFS_LC_F_LOCK);
+        return;
+    }
+    if (a > b) {
+        struct vfbfs_file *t = a;
+        a = b;
+        b = t;
+    }
+    vfbfs_mutex_lock(&a->f_lock, VFBFS_LC_F_LOCK);
+    vfbfs_mutex_lock(&b->f_lock, VFBFS_LC_F_LOCK);
+}
+
+static void vfbfs_file_unlock_pair(struct vfbfs_file *a, struct vfbfs_file *b)
+{
+    vfbfs_mutex_unlock(&a->f_lock, VFBFS_LC_F_LOCK);
+    if (a != b) {
+        vfbfs_mutex_unlock(&b->f_lock, VFBFS_LC_F_LOCK);
+    }
+}
+
+/* dst shares the content of src, with the f_lock of both held */
+static int vfbfs_file_share_locked(struct vfbfs_file *dst, struct vfbfs_file *src)
+{
+    struct vfbfs_content *c = src->f_shared;
+    if (!(src->f_flags & (VFBFS_FILE_MAPPED | VFBFS_FILE_SHARED)) && src->f_content != NULL) {
+        /* The buffer of src is adopted as it is */
+        if ((c = malloc(sizeof(*c))) == NULL) {
+            return -ENOMEM;
+        }
+        c->c_refs      = 1;
+        c->c_data      = src->f_content;
+        src->f_shared  = c;
+        src->f_flags  |= VFBFS_FILE_SHARED;
+    }
+    vfbfs_file_drop_content(dst);
+    if (c != NULL) {
+        __atomic_add_fetch(&c->c_refs, 1, __ATOMIC_RELAXED);
+    }
+    dst->f_content      = src->f_content;
+    dst->f_content_size = src->f_content_size;
+    dst->f_shared       = c;
+    dst->f_flags       |= src->f_flags & (VFBFS_FILE_MAPPED | VFBFS_FILE_SHARED);
+    return 0;
+}
+
+/*
+ * Copies len bytes of src at soff into dst at doff, len 0 meaning up to
+ * the end of src. The whole of src onto the start of a dst no longer than
+ * it doesn't copy anything, dst becomes a clone sharing the content until
+ * one of them is modified. Both have to be plain memory files, and within
+ * one file only the copy onto itself is accepted.
+*/
+int vfbfs_file_clone(struct vfbfs *fs, struct vfbfs_file *dst, struct vfbfs_file *src
+    , off_t soff, off_t len, off_t doff)
+{
+    off_t ssize, dsize;
+    int r;
+
+    if (src->f_oprs != &vfbfs_mem_file_oprs || dst->f_oprs != &vfbfs_mem_file_oprs) {
+        return -EINVAL;
+    }
+    if (soff < 0 || len < 0 || doff < 0) {
+        return -EINVAL;
+    }
+    /* The sizes only hold under the locks, truncate() shrinks the content first */
+    vfbfs_file_lock_pair(src, dst);
+    ssize = src->f_content_size;
+    dsize = dst->f_content_size;
+    len   = (soff >= ssize) ? 0 : (len == 0 || len > ssize - soff) ? ssize - soff : len;
+    if (src == dst) {
+        r   = (soff == doff || len == 0) ? 0 : -EINVAL;
+        len = 0;
+    } else if (len > INT64_MAX - doff) {
+        r = -EFBIG;
+    } else if (soff == 0 && doff == 0 && len == ssize && dsize <= ssize) {
+        r = vfbfs_file_share_locked(dst, src);
+    } else if (len == 0) {
+        r = 0;
+    } else {
+        r = vfbfs_mem_file_write_locked(dst, src->f_content + soff, len, doff);
+    }
+    if (r >= 0 && len > 0) {
+        vfbfs_file_set_size(dst, dst->f_content_size);
+    }
+    vfbfs_file_unlock_pair(src, dst);
+    return (r < 0) ? r : 0;
+}
+
 struct vfbfs_entry *vfbfs_entry_find_in(struct vfbfs *fs, struct vfbfs_dir *d, const char *name)
 {
     struct vfbfs_entry ent, *re; 
     ent.e_name = (char *)name;
-    pthread_rwlock_rdlock(&d->d_rwlock);
+    vfbfs_rwlock_rdlock(&d->d_rwlock, VFBFS_LC_D_RWLOCK);
     re = RB_FIND(VFBFS_ENTRY_TREE, &d->d_entries, &ent);
-    pthread_rwlock_unlock(&d->d_rwlock);
+    vfbfs_rwlock_unlock(&d->d_rwlock, VFBFS_LC_D_RWLOCK);
     return re;
 }
 
@@ -456,46 +838,61 @@ vfbfs_file_create_in(struct vfbfs *fs, struct vfbfs_dir *parent, const char *fna
     return vfbfs_file_add_to(fs, parent, f);
 }
 
-struct vfbfs_entry *vfbfs_entry_lookup(struct vfbfs *fs, const char *path)
+/*
+ * Walks path, *dirp is the directory of the last entry or NULL if it's a
+ * file. That's decided under the directory lock: a file can be freed by an
+ * unlink() as soon as it's released, directories stay.
+*/
+static struct vfbfs_entry *vfbfs_entry_walk(struct vfbfs *fs, const char *path, struct vfbfs_dir **dirp)
 {
     struct vfbfs_superblock *sb  = fs->fs_superblock;
-    struct vfbfs_dir        *dir = sb->sb_root;
+    struct vfbfs_dir        *dir = sb->sb_root, *sub = dir;
+    struct vfbfs_entry *e = dir->d_entry, key;
+    char *apath, *pptr, *svptr, *entry;
 
+    *dirp = dir;
     if (path[0] == '/' && path[1] == '\0') {
-        return dir->d_entry;
+        return e;
     }
-
-    char *apath = strdup(path);
-    char *pptr = apath;
-    char *svptr, *entry;
-    struct vfbfs_entry *e;
-
-    if (apath == NULL) {
+    if ((apath = strdup(path)) == NULL) {
+        *dirp = NULL;
         return NULL;
     }
-
-    while ((entry = strtok_r(pptr, "/", &svptr))) {
-        e = vfbfs_entry_find_in(fs, dir, entry);
+    for (pptr = apath; (entry = strtok_r(pptr, "/", &svptr)) != NULL; pptr = NULL) {
+        /* Only the last entry may be a file */
+        if (sub == NULL) {
+            e = NULL;
+            break;
+        }
+        dir = sub;
+        key.e_name = entry;
+        vfbfs_rwlock_rdlock(&dir->d_rwlock, VFBFS_LC_D_RWLOCK);
+        e   = RB_FIND(VFBFS_ENTRY_TREE, &dir->d_entries, &key);
+        sub = vfbfs_entry_is_dir(e) ? e->e_elem.dir : NULL;
+        vfbfs_rwlock_unlock(&dir->d_rwlock, VFBFS_LC_D_RWLOCK);
         if (e == NULL) {
-            return NULL;
-        } else {
-            if (vfbfs_entry_is_dir(e)) {
-                dir = e->e_elem.dir;
-            }
+            break;
         }
-        pptr = NULL;
     }
-    /* FIXME: should check the last entry's name? */
     free(apath);
+    *dirp = (e != NULL) ? sub : NULL;
     return e;
 }
 
+/* The entry isn't held, see vfbfs_entry_get() for files which may go away */
+struct vfbfs_entry *vfbfs_entry_lookup(struct vfbfs *fs, const char *path)
+{
+    struct vfbfs_dir *dir;
+    return vfbfs_entry_walk(fs, path, &dir);
+}
+
 int vfbfs_entry_lookup_parent(struct vfbfs *fs, const char *path
     , struct vfbfs_dir **parent, struct vfbfs_entry **entry, char **file_name)
 {
     char *dirname;
     const char *fname;
     struct vfbfs_entry *pent, *fent;
+    struct vfbfs_dir *pdir;
     int r = 0;
 
     *parent = NULL;
@@ -516,21 +913,21 @@ int vfbfs_entry_lookup_parent(struct vfbfs *fs, const char *path
         goto free_and_return;
     }
 
-    /* The directory's path ends on the last '/' charecter */
-    dirname[fname-path-1] = '\0';
-    pent = vfbfs_entry_lookup(fs, dirname);
+    /* The directory's path ends on the last '/' charecter, or it's the root */
+    dirname[MAX(fname-path-1, 1)] = '\0';
+    pent = vfbfs_entry_walk(fs, dirname, &pdir);
     if (pent == NULL) {
         r = -ENOENT;
         goto free_and_return;
     }
-    if (!vfbfs_entry_is_dir(pent)) {
+    if (pdir == NULL) {
         r = -ENOTDIR;
         goto free_and_return;
     }
-    *parent = pent->e_elem.dir;
-    *file_name = fname;
+    *parent = pdir;
+    *file_name = (char *)fname;
     /* Optionaly we can get the file (if it exsits) */
-    fent = vfbfs_entry_find_in(fs,  pent, fname);
+    fent = vfbfs_entry_find_in(fs, *parent, fname);
     if (fent == NULL) {
         r = -ENOENT;
         goto free_and_return;
@@ -542,21 +939,203 @@ free_and_return:
     return r;
 }
 
+struct vfbfs_handle *vfbfs_handle_get(struct fuse_file_info *fi)
+{
+    return (fi != NULL) ? (struct vfbfs_handle *)fi->fh : NULL;
+}
+
+struct vfbfs_entry *vfbfs_handle_entry(struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    return (h != NULL) ? h->h_entry : NULL;
+}
+
+/* Readahead windows grow up to this many times the read size */
+#define VFBFS_HANDLE_RA_SHIFT   5
+#define VFBFS_HANDLE_SLAB       64
+
+static struct vfbfs_handle *vfbfs_handle_pool = NULL;
+static pthread_mutex_t vfbfs_handle_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The slabs are never freed, the pool only grows to the peak of open files */
+static struct vfbfs_handle *vfbfs_handle_alloc(void)
+{
+    struct vfbfs_handle *h, *slab;
+    int i;
+
+    vfbfs_mutex_lock(&vfbfs_handle_pool_lock, VFBFS_LC_H_POOL);
+    if (vfbfs_handle_pool == NULL) {
+        if ((slab = calloc(VFBFS_HANDLE_SLAB, sizeof(*slab))) == NULL) {
+            vfbfs_mutex_unlock(&vfbfs_handle_pool_lock, VFBFS_LC_H_POOL);
+            return NULL;
+        }
+        for (i = 0; i < VFBFS_HANDLE_SLAB; i++) {
+            pthread_mutex_init(&slab[i].h_lock, NULL);
+            slab[i].h_next = (i + 1 < VFBFS_HANDLE_SLAB) ? &slab[i + 1] : NULL;
+        }
+        vfbfs_handle_pool = slab;
+    }
+    h = vfbfs_handle_pool;
+    vfbfs_handle_pool = h->h_next;
+    vfbfs_mutex_unlock(&vfbfs_handle_pool_lock, VFBFS_LC_H_POOL);
+    return h;
+}
+
+static int vfbfs_handle_open(struct vfbfs_entry *e, struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h;
+    if (fi == NULL) {
+        return 0;
+    }
+    if ((h = vfbfs_handle_alloc()) == NULL) {
+        return -ENOMEM;
+    }
+    h->h_entry   = e;
+    h->h_private = NULL;
+    h->h_pos     = 0;
+    h->h_seq_run = 0;
+    h->h_reads   = h->h_read_bytes = h->h_seq_reads = 0;
+    h->h_writes  = h->h_write_bytes = 0;
+    h->h_next    = NULL;
+    fi->fh = (uint64_t)h;
+    return 0;
+}
+
+static void vfbfs_handle_close(struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h == NULL) {
+        return;
+    }
+    fi->fh = 0;
+    vfbfs_mutex_lock(&vfbfs_handle_pool_lock, VFBFS_LC_H_POOL);
+    h->h_next = vfbfs_handle_pool;
+    vfbfs_handle_pool = h;
+    vfbfs_mutex_unlock(&vfbfs_handle_pool_lock, VFBFS_LC_H_POOL);
+}
+
+/* Called before the read is passed on, so the backend already sees it counted */
+static void vfbfs_handle_read_begin(struct vfbfs_handle *h, off_t off)
+{
+    vfbfs_mutex_lock(&h->h_lock, VFBFS_LC_H_LOCK);
+    if (h->h_reads > 0 && off == h->h_pos) {
+        h->h_seq_run++;
+        h->h_seq_reads++;
+    } else {
+        h->h_seq_run = (off == 0) ? 1 : 0;
+    }
+    vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+}
+
+static void vfbfs_handle_done(struct vfbfs_handle *h, bool write, off_t off, int r)
+{
+    vfbfs_mutex_lock(&h->h_lock, VFBFS_LC_H_LOCK);
+    if (write) {
+        h->h_writes++;
+        h->h_seq_run = 0;
+    } else {
+        h->h_reads++;
+    }
+    if (r > 0) {
+        *(write ? &h->h_write_bytes : &h->h_read_bytes) += r;
+        h->h_pos = off + r;
+    }
+    vfbfs_mutex_unlock(&h->h_lock, VFBFS_LC_H_LOCK);
+}
+
+bool vfbfs_handle_is_sequential(struct vfbfs_handle *h)
+{
+    return h != NULL && h->h_seq_run >= VFBFS_HANDLE_SEQ_MIN;
+}
+
+/*
+ * How much a backend should fetch for a read of size bytes: size itself for
+ * random access, a window doubling with every sequential read up to max.
+*/
+size_t vfbfs_handle_readahead(struct vfbfs_handle *h, size_t size, size_t max)
+{
+    unsigned shift;
+    if (!vfbfs_handle_is_sequential(h)) {
+        return size;
+    }
+    shift = MIN(h->h_seq_run - VFBFS_HANDLE_SEQ_MIN + 1, VFBFS_HANDLE_RA_SHIFT);
+    return MAX(size, MIN(size << shift, max));
+}
+
 struct vfbfs_file *vfbfs_file_lookup(struct vfbfs *fs, const char *path)
 {
-    struct vfbfs_entry *e = vfbfs_entry_lookup(fs, path);
-    return vfbfs_entry_is_dir(e) ? NULL : e->e_elem.file;
+    return vfbfs_entry_get_file(vfbfs_entry_lookup(fs, path));
+}
+
+/*
+ * Looks up the entry at path, a file gets an open reference on it and an
+ * unlink() meanwhile leaves the file to vfbfs_entry_put(). Directories
+ * aren't removed, they need none.
+*/
+struct vfbfs_entry *vfbfs_entry_get(struct vfbfs *fs, const char *path)
+{
+    struct vfbfs_dir *parent;
+    struct vfbfs_entry *e, key;
+    struct vfbfs_file *f;
+    char *name;
+
+    vfbfs_entry_lookup_parent(fs, path, &parent, &e, &name);
+    if (parent == NULL) {
+        /* The root, or the directory isn't there */
+        return e;
+    }
+    key.e_name = name;
+    vfbfs_rwlock_rdlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
+    e = RB_FIND(VFBFS_ENTRY_TREE, &parent->d_entries, &key);
+    if ((f = vfbfs_entry_get_file(e)) != NULL) {
+        vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+        f->f_open_count++;
+        vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    }
+    vfbfs_rwlock_unlock(&parent->d_rwlock, VFBFS_LC_D_RWLOCK);
+    return e;
+}
+
+void vfbfs_entry_put(struct vfbfs *fs, struct vfbfs_entry *e)
+{
+    struct vfbfs_file *f = vfbfs_entry_get_file(e);
+    if (f != NULL) {
+        vfbfs_file_put(fs, f);
+    }
+}
+
+/* The file at path with a reference, NULL for a directory */
+struct vfbfs_file *vfbfs_file_get(struct vfbfs *fs, const char *path)
+{
+    return vfbfs_entry_get_file(vfbfs_entry_get(fs, path));
+}
+
+/* Drops an open reference, the last one of an unlinked file frees it */
+void vfbfs_file_put(struct vfbfs *fs, struct vfbfs_file *f)
+{
+    bool gone;
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    f->f_open_count--;
+    gone = (f->f_open_count == 0 && f->f_entry->e_parent == NULL);
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    if (gone) {
+        vfbfs_file_free(fs, f);
+    }
 }
 
 int vfbfs_file_call_operation_va_with(struct vfbfs *fs, struct vfbfs_file *file
                     , struct vfbfs_file_ops *oprs, enum VfbfsFileOperation op, va_list ap)
 {
     struct fuse_file_info *fi;
+    struct fuse_pollhandle *ph;
+    struct vfbfs_handle *h;
     struct vfbfs_entry *e;
+    unsigned *revents;
     const char *path, *wdata;
     char *rdata;
     off_t off;
     size_t size;
+    int r = 0;
 
     if (file == NULL) {
         return -ENOENT;
@@ -571,14 +1150,14 @@ int vfbfs_file_call_operation_va_with(struct vfbfs *fs, struct vfbfs_file *file
     path = va_arg(ap, const char *);
     switch (op) {
         case VFBFS_F_OPEN:
-        if (oprs->f_open != NULL) {
-            fi = va_arg(ap, struct fuse_file_info *);
-            if (fi != NULL) {
-                fi->fh = (uint64_t)e;
-            }
-            return oprs->f_open(fs, file, path, fi);
+        fi = va_arg(ap, struct fuse_file_info *);
+        if ((r = vfbfs_handle_open(e, fi)) != 0) {
+            return r;
         }
-        break;
+        if (oprs->f_open != NULL && (r = oprs->f_open(fs, file, path, fi)) != 0) {
+            vfbfs_handle_close(fi);
+        }
+        return r;
 
         case VFBFS_F_CLOSE:
         if (oprs->f_close != NULL) {
@@ -592,7 +1171,14 @@ int vfbfs_file_call_operation_va_with(struct vfbfs *fs, struct vfbfs_file *file
         off   = va_arg(ap, off_t); 
         fi    = va_arg(ap, struct fuse_file_info *);
         if (oprs->f_read != NULL) {
-            return oprs->f_read(fs, file, path, rdata, size, off, fi);
+            if ((h = vfbfs_handle_get(fi)) != NULL) {
+                vfbfs_handle_read_begin(h, off);
+            }
+            r = oprs->f_read(fs, file, path, rdata, size, off, fi);
+            if (h != NULL) {
+                vfbfs_handle_done(h, false, off, r);
+            }
+            return r;
         }
         break;
 
@@ -602,7 +1188,11 @@ int vfbfs_file_call_operation_va_with(struct vfbfs *fs, struct vfbfs_file *file
         off   = va_arg(ap, off_t); 
         fi    = va_arg(ap, struct fuse_file_info *);
         if (oprs->f_write != NULL) {
-            return oprs->f_write(fs, file, path, wdata, size, off, fi);
+            r = oprs->f_write(fs, file, path, wdata, size, off, fi);
+            if ((h = vfbfs_handle_get(fi)) != NULL) {
+                vfbfs_handle_done(h, true, off, r);
+            }
+            return r;
         }
         break;
 
@@ -623,14 +1213,52 @@ int vfbfs_file_call_operation_va_with(struct vfbfs *fs, struct vfbfs_file *file
         break;
 
         case VFBFS_F_RELEASE:
+        fi = va_arg(ap, struct fuse_file_info *);
         if (oprs->f_release != NULL) {
-            return oprs->f_release(fs, file, path, va_arg(ap, struct fuse_file_info *));
-        } else {
-            if (e != NULL && e->e_oprs != NULL && e->e_oprs->e_release) {
-                return e->e_oprs->e_release(fs, e, path, va_arg(ap, struct fuse_file_info *));
-            }
+            r = oprs->f_release(fs, file, path, fi);
+        } else if (e != NULL && e->e_oprs != NULL && e->e_oprs->e_release) {
+            r = e->e_oprs->e_release(fs, e, path, fi);
+        }
+        /* The handle of the open() is gone after this */
+        vfbfs_handle_close(fi);
+        return r;
+
+        case VFBFS_F_FSYNC:
+        if (oprs->f_fsync != NULL) {
+            int datasync = va_arg(ap, int);
+            return oprs->f_fsync(fs, file, path, datasync, va_arg(ap, struct fuse_file_info *));
         }
         break;
+
+        case VFBFS_F_POLL:
+        fi      = va_arg(ap, struct fuse_file_info *);
+        ph      = va_arg(ap, struct fuse_pollhandle *);
+        revents = va_arg(ap, unsigned *);
+        if (oprs->f_poll != NULL) {
+            return oprs->f_poll(fs, file, path, fi, ph, revents);
+        }
+        /* Regular files are always ready */
+        if (ph != NULL) {
+            fuse_pollhandle_destroy(ph);
+        }
+        *revents = POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+        return 0;
+
+        case VFBFS_F_IOCTL:
+        if (oprs->f_ioctl != NULL) {
+            int cmd     = va_arg(ap, int);
+            void *arg   = va_arg(ap, void *);
+            fi          = va_arg(ap, struct fuse_file_info *);
+            unsigned fl = va_arg(ap, unsigned);
+            return oprs->f_ioctl(fs, file, path, cmd, arg, fi, fl, va_arg(ap, void *));
+        }
+        return -ENOTTY;
+
+        case VFBFS_F_REPLACE:
+        if (oprs->f_replace != NULL) {
+            return oprs->f_replace(fs, file, path, va_arg(ap, struct vfbfs_file *));
+        }
+        return -EPERM;
     }
     return 0;
 }
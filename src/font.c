@@ -0,0 +1,157 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <font.h>
+
+#include <string.h>
+#include <errno.h>
+
+#define PSF1_MAGIC0     0x36
+#define PSF1_MAGIC1     0x04
+#define PSF1_MODE512    0x01
+#define PSF1_MODEHASTAB 0x02
+#define PSF1_MODEHASSEQ 0x04
+#define PSF1_SEPARATOR  0xFFFF
+#define PSF1_STARTSEQ   0xFFFE
+
+#define PSF2_MAGIC      0x864ab572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+#define PSF2_SEPARATOR  0xFF
+#define PSF2_STARTSEQ   0xFE
+
+/* Largest PSF2 glyph side, the console fonts go up to 64 */
+#define PSF2_MAX_SIDE   256
+
+struct psf2_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t headersize;
+    uint32_t flags;
+    uint32_t length;
+    uint32_t charsize;
+    uint32_t height;
+    uint32_t width;
+};
+
+/* Returns 0 or -EINVAL if data is not a complete PSF font */
+int vfbfs_font_parse(struct vfbfs_font *fn, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    struct psf2_header h;
+    bool table;
+
+    if (len >= 4 && p[0] == PSF1_MAGIC0 && p[1] == PSF1_MAGIC1) {
+        fn->fn_width      = 8;
+        fn->fn_height     = p[3];
+        fn->fn_count      = (p[2] & PSF1_MODE512) ? 512 : 256;
+        fn->fn_row_bytes  = 1;
+        fn->fn_glyph_size = p[3];
+        fn->fn_glyphs     = p + 4;
+        fn->fn_psf1       = true;
+        table = p[2] & (PSF1_MODEHASTAB | PSF1_MODEHASSEQ);
+        len -= 4;
+    } else if (len >= sizeof(h) && (memcpy(&h, p, sizeof(h)), h.magic == PSF2_MAGIC)) {
+        if (h.headersize < sizeof(h) || h.headersize > len || h.width == 0
+                || h.width > PSF2_MAX_SIDE || h.height > PSF2_MAX_SIDE) {
+            return -EINVAL;
+        }
+        fn->fn_width      = h.width;
+        fn->fn_height     = h.height;
+        fn->fn_count      = h.length;
+        fn->fn_row_bytes  = (h.width + 7) / 8;
+        fn->fn_glyph_size = h.charsize;
+        fn->fn_glyphs     = p + h.headersize;
+        fn->fn_psf1       = false;
+        table = h.flags & PSF2_HAS_UNICODE_TABLE;
+        len -= h.headersize;
+        if (h.charsize < (size_t)fn->fn_row_bytes * h.height) {
+            return -EINVAL;
+        }
+    } else {
+        return -EINVAL;
+    }
+    if (fn->fn_height == 0 || fn->fn_count == 0
+            || (size_t)fn->fn_count * fn->fn_glyph_size > len) {
+        return -EINVAL;
+    }
+    fn->fn_unicode     = table ? fn->fn_glyphs + fn->fn_count * fn->fn_glyph_size : NULL;
+    fn->fn_unicode_len = table ? len - fn->fn_count * fn->fn_glyph_size : 0;
+    return 0;
+}
+
+/* Decodes one UTF-8 sequence of the PSF2 table, returns its length */
+static size_t font_utf8(const uint8_t *p, size_t len, uint32_t *cp)
+{
+    size_t n, i;
+    if (p[0] < 0x80) {
+        *cp = p[0];
+        return 1;
+    }
+    n   = (p[0] >= 0xF0) ? 4 : (p[0] >= 0xE0) ? 3 : 2;
+    *cp = p[0] & (0x3F >> (n - 1));
+    for (i = 1; i < n && i < len; i++) {
+        *cp = (*cp << 6) | (p[i] & 0x3F);
+    }
+    return i;
+}
+
+/*
+ * The glyph index of a code point, by a linear scan of the unicode table,
+ * the callers cache it. Without a table the code point is the index. The
+ * glyph of '?' stands for the missing ones.
+*/
+unsigned vfbfs_font_index(const struct vfbfs_font *fn, uint32_t cp)
+{
+    const uint8_t *p = fn->fn_unicode, *end = p + fn->fn_unicode_len;
+    unsigned glyph = 0;
+    bool seq = false;
+    uint32_t v;
+
+    if (p == NULL) {
+        return (cp < fn->fn_count) ? cp : ('?' < fn->fn_count) ? '?' : 0;
+    }
+    while (p < end && glyph < fn->fn_count) {
+        if (fn->fn_psf1) {
+            if (end - p < 2) {
+                break;
+            }
+            v  = p[0] | (p[1] << 8);
+            p += 2;
+            if (v == PSF1_SEPARATOR || v == PSF1_STARTSEQ) {
+                glyph += (v == PSF1_SEPARATOR);
+                seq    = (v == PSF1_STARTSEQ);
+                continue;
+            }
+        } else {
+            if (*p == PSF2_SEPARATOR || *p == PSF2_STARTSEQ) {
+                glyph += (*p == PSF2_SEPARATOR);
+                seq    = (*p == PSF2_STARTSEQ);
+                p++;
+                continue;
+            }
+            p += font_utf8(p, end - p, &v);
+        }
+        /* Only single code points, not the combining sequences */
+        if (!seq && v == cp) {
+            return glyph;
+        }
+    }
+    return (cp != '?') ? vfbfs_font_index(fn, '?') : 0;
+}
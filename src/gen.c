@@ -0,0 +1,236 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <gen.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* One rendering, freed when the cache and the last open() drop it */
+struct vfbfs_gen_snap {
+    unsigned    s_refs;
+    size_t      s_len;
+    char       *s_data;
+};
+
+static inline uint64_t gen_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void gen_snap_put(struct vfbfs_gen_snap *s)
+{
+    if (s != NULL && __atomic_sub_fetch(&s->s_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(s->s_data);
+        free(s);
+    }
+}
+
+static int gen_render(struct vfbfs *fs, struct vfbfs_file *f, struct vfbfs_gen *g
+    , struct vfbfs_gen_snap **snap)
+{
+    struct vfbfs_gen_snap *s;
+    FILE *fp;
+    int r;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL) {
+        return -ENOMEM;
+    }
+    if ((fp = open_memstream(&s->s_data, &s->s_len)) == NULL) {
+        free(s);
+        return -ENOMEM;
+    }
+    r = g->g_render(fs, f, g->g_private, fp);
+    if (fclose(fp) != 0 && r == 0) {
+        r = -ENOMEM;
+    }
+    if (r != 0) {
+        free(s->s_data);
+        free(s);
+        return r;
+    }
+    s->s_refs = 1;
+    *snap = s;
+    return 0;
+}
+
+static int gen_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_gen *g = vfbfs_gen_from_file(f);
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct vfbfs_gen_snap *s = NULL, *old = NULL;
+    uint64_t now = gen_now(), version = 0;
+    int r = 0;
+
+    if (h == NULL) {
+        return -EBADF;
+    }
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    if (g->g_version != NULL) {
+        version = g->g_version(fs, f, g->g_private);
+    }
+    if (g->g_snap != NULL && g->g_ttl_ns != VFBFS_GEN_TTL_NONE
+            && now - g->g_snap_ns < g->g_ttl_ns
+            && (g->g_version == NULL || version == g->g_snap_version)) {
+        s = g->g_snap;
+        g->g_hits++;
+    } else if ((r = gen_render(fs, f, g, &s)) == 0) {
+        /* Rendering under f_lock, the concurrent opens wait for this one */
+        old = g->g_snap;
+        g->g_snap         = s;
+        g->g_snap_ns      = now;
+        g->g_snap_version = version;
+        g->g_renders++;
+    }
+    if (s != NULL) {
+        __atomic_add_fetch(&s->s_refs, 1, __ATOMIC_RELAXED);
+        f->f_open_count++;
+    }
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+
+    if (r != 0) {
+        return r;
+    }
+    gen_snap_put(old);
+    h->h_private = s;
+    /* The size changes from one rendering to the next, don't let the page cache trust it */
+    fi->direct_io = 1;
+    vfbfs_file_set_size(f, s->s_len);
+    return 0;
+}
+
+static int gen_read(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    struct vfbfs_gen_snap *s = (h != NULL) ? h->h_private : NULL;
+    if (s == NULL) {
+        return -EBADF;
+    }
+    if (off >= (off_t)s->s_len) {
+        return 0;
+    }
+    size = MIN(size, s->s_len - off);
+    memcpy(data, s->s_data + off, size);
+    return size;
+}
+
+static int gen_write(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , const char *data, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_gen *g = vfbfs_gen_from_file(f);
+    if (g->g_write == NULL) {
+        return -EACCES;
+    }
+    return g->g_write(fs, f, g->g_private, data, size, off);
+}
+
+/* "echo > file" truncates first, which is fine for the writable ones */
+static int gen_truncate(struct vfbfs *fs, struct vfbfs_file *f, const char *path, off_t size)
+{
+    struct vfbfs_gen *g = vfbfs_gen_from_file(f);
+    return (g->g_write != NULL) ? 0 : -EACCES;
+}
+
+static int gen_release(struct vfbfs *fs, struct vfbfs_file *f, const char *path
+    , struct fuse_file_info *fi)
+{
+    struct vfbfs_handle *h = vfbfs_handle_get(fi);
+    if (h != NULL && h->h_private != NULL) {
+        vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+        f->f_open_count--;
+        vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+        gen_snap_put(h->h_private);
+        h->h_private = NULL;
+    }
+    return 0;
+}
+
+static struct vfbfs_file_ops vfbfs_gen_oprs = {
+    .f_open     = gen_open,
+    .f_read     = gen_read,
+    .f_write    = gen_write,
+    .f_truncate = gen_truncate,
+    .f_release  = gen_release,
+};
+
+struct vfbfs_gen *vfbfs_gen_from_file(struct vfbfs_file *f)
+{
+    return (f != NULL && f->f_oprs == &vfbfs_gen_oprs) ? (struct vfbfs_gen *)f->f_private : NULL;
+}
+
+/* Turns f into a generated file, f_private is taken by the generator */
+struct vfbfs_gen *vfbfs_gen_attach(struct vfbfs_file *f
+    , int (*render)(struct vfbfs *, struct vfbfs_file *, void *, FILE *)
+    , void *priv, uint64_t ttl_ns)
+{
+    struct vfbfs_gen *g = calloc(1, sizeof(*g));
+    if (g == NULL) {
+        return NULL;
+    }
+    g->g_render  = render;
+    g->g_private = priv;
+    g->g_ttl_ns  = ttl_ns;
+    f->f_private = g;
+    f->f_oprs    = &vfbfs_gen_oprs;
+    return g;
+}
+
+struct vfbfs_file *vfbfs_gen_create_in(struct vfbfs *fs, struct vfbfs_dir *parent, const char *name
+    , int (*render)(struct vfbfs *, struct vfbfs_file *, void *, FILE *)
+    , void *priv, uint64_t ttl_ns)
+{
+    struct vfbfs_file *f = vfbfs_file_create_in(fs, parent, name);
+    if (f == NULL || vfbfs_gen_attach(f, render, priv, ttl_ns) == NULL) {
+        return NULL;
+    }
+    return f;
+}
+
+/* Frees the generator of a file which is being freed, see vfbfs_dir_free() */
+void vfbfs_gen_free(struct vfbfs_file *f)
+{
+    struct vfbfs_gen *g = vfbfs_gen_from_file(f);
+    if (g != NULL) {
+        gen_snap_put(g->g_snap);
+        free(g);
+        f->f_private = NULL;
+    }
+}
+
+/* The next open() renders the file again, the current readers keep their snapshot */
+void vfbfs_gen_invalidate(struct vfbfs_file *f)
+{
+    struct vfbfs_gen *g = vfbfs_gen_from_file(f);
+    struct vfbfs_gen_snap *old;
+    if (g == NULL) {
+        return;
+    }
+    vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+    old = g->g_snap;
+    g->g_snap = NULL;
+    vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+    gen_snap_put(old);
+}
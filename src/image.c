@@ -0,0 +1,358 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Snapshot images (--image=FILE). The image is mapped at startup and the
+ * files are served straight from the mapping, a file gets its own copy only
+ * when it's first written or truncated (see VFBFS_FILE_MAPPED). On unmount
+ * the tree is written back to a new image, which replaces the old one.
+ *
+ * Only the plain in-memory files are saved: generated files (with their own
+ * operations) and the framebuffer directories are recreated at startup
+ * anyway. Entries which already exist when the image is loaded are kept.
+*/
+#include <image.h>
+#include <fb.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IMAGE_ALIGN_UP(x) (((x) + VFBFS_IMAGE_ALIGN - 1) & ~(uint64_t)(VFBFS_IMAGE_ALIGN - 1))
+
+struct image_node {
+    struct vfbfs_entry *n_entry;
+    uint32_t            n_parent;
+};
+
+struct image_builder {
+    struct image_node  *b_nodes;
+    size_t              b_nnodes;
+    size_t              b_cap;
+};
+
+static bool image_is_fb_dir(struct vfbfs *fs, struct vfbfs_dir *dir)
+{
+    struct vfbfs_fb *fb;
+    for (fb = fs->fs_superblock->sb_fbs; fb != NULL; fb = fb->fb_next) {
+        if (fb->fb_dir == dir) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int image_add_node(struct image_builder *b, struct vfbfs_entry *e, uint32_t parent)
+{
+    struct image_node *nodes;
+    if (b->b_nnodes == b->b_cap) {
+        b->b_cap = MAX(64, b->b_cap * 2);
+        if ((nodes = realloc(b->b_nodes, b->b_cap * sizeof(*nodes))) == NULL) {
+            return -ENOMEM;
+        }
+        b->b_nodes = nodes;
+    }
+    b->b_nodes[b->b_nnodes].n_entry  = e;
+    b->b_nodes[b->b_nnodes].n_parent = parent;
+    b->b_nnodes++;
+    return 0;
+}
+
+/* Collects the saved entries breadth-first, so every directory precedes its entries */
+static int image_collect(struct vfbfs *fs, struct image_builder *b)
+{
+    struct vfbfs_file_ops *mem_oprs = vfbfs_file_get_mem_ops();
+    struct vfbfs_dir *dir;
+    struct vfbfs_entry *e;
+    size_t i;
+    int r = 0;
+
+    if ((r = image_add_node(b, vfbfs_get_rootdir(fs)->d_entry, 0)) != 0) {
+        return r;
+    }
+    for (i = 0; i < b->b_nnodes && r == 0; i++) {
+        if ((dir = vfbfs_entry_get_dir(b->b_nodes[i].n_entry)) == NULL) {
+            continue;
+        }
+        vfbfs_rwlock_rdlock(&dir->d_rwlock, VFBFS_LC_D_RWLOCK);
+        RB_FOREACH(e, VFBFS_ENTRY_TREE, &dir->d_entries) {
+            if (vfbfs_entry_is_dir(e) ? image_is_fb_dir(fs, e->e_elem.dir)
+                                      : e->e_elem.file->f_oprs != mem_oprs) {
+                continue;
+            }
+            if ((r = image_add_node(b, e, i)) != 0) {
+                break;
+            }
+        }
+        vfbfs_rwlock_unlock(&dir->d_rwlock, VFBFS_LC_D_RWLOCK);
+    }
+    return r;
+}
+
+static int image_write(int fd, const void *buf, size_t len, uint64_t *pos)
+{
+    const char *p = (const char *)buf;
+    ssize_t w;
+    while (len > 0) {
+        if ((w = write(fd, p, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        p    += w;
+        len  -= w;
+        *pos += w;
+    }
+    return 0;
+}
+
+/* Writes zeroes up to the offset to */
+static int image_pad_to(int fd, uint64_t to, uint64_t *pos)
+{
+    static const char zero[4096];
+    int r = 0;
+    while (*pos < to && r == 0) {
+        r = image_write(fd, zero, MIN(sizeof(zero), to - *pos), pos);
+    }
+    return r;
+}
+
+/*
+ * Writes the tree into path. The image is built in path.tmp and renamed
+ * over path, the mapping of the old image stays valid.
+*/
+int vfbfs_image_save(struct vfbfs *fs, const char *path)
+{
+    struct image_builder b = { NULL, 0, 0 };
+    struct vfbfs_image_header hdr;
+    struct vfbfs_image_entry *ents = NULL;
+    struct vfbfs_entry *e;
+    struct vfbfs_file *f;
+    uint64_t names_len = 0, data = 0, pos = 0;
+    char *tmp = NULL;
+    size_t i;
+    int fd = -1, r;
+
+    if ((r = image_collect(fs, &b)) != 0) {
+        goto out;
+    }
+    if ((ents = calloc(b.b_nnodes, sizeof(*ents))) == NULL
+            || asprintf(&tmp, "%s.tmp", path) < 0) {
+        tmp = NULL;
+        r = -ENOMEM;
+        goto out;
+    }
+
+    /* Lay the image out: entries, names, then the contents */
+    for (i = 0; i < b.b_nnodes; i++) {
+        e = b.b_nodes[i].n_entry;
+        ents[i].ie_parent   = b.b_nodes[i].n_parent;
+        ents[i].ie_name_off = names_len;
+        ents[i].ie_mode     = e->e_stat.st_mode;
+        ents[i].ie_uid      = e->e_stat.st_uid;
+        ents[i].ie_gid      = e->e_stat.st_gid;
+        ents[i].ie_atime    = e->e_stat.st_atime;
+        ents[i].ie_mtime    = e->e_stat.st_mtime;
+        ents[i].ie_ctime    = e->e_stat.st_ctime;
+        ents[i].ie_size     = e->e_stat.st_size;
+        names_len += strlen(e->e_name) + 1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.ih_magic, VFBFS_IMAGE_MAGIC, sizeof(hdr.ih_magic));
+    hdr.ih_version   = VFBFS_IMAGE_VERSION;
+    hdr.ih_nentries  = b.b_nnodes;
+    hdr.ih_names_off = sizeof(hdr) + b.b_nnodes * sizeof(*ents);
+    hdr.ih_data_off  = IMAGE_ALIGN_UP(hdr.ih_names_off + names_len);
+    data = hdr.ih_data_off;
+    for (i = 0; i < b.b_nnodes; i++) {
+        if (vfbfs_entry_is_file(b.b_nodes[i].n_entry)) {
+            ents[i].ie_data_off = data;
+            data = IMAGE_ALIGN_UP(data + ents[i].ie_size);
+        }
+    }
+    hdr.ih_size = data;
+
+    if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0) {
+        r = -errno;
+        goto out;
+    }
+    if ((r = image_write(fd, &hdr, sizeof(hdr), &pos)) != 0
+            || (r = image_write(fd, ents, b.b_nnodes * sizeof(*ents), &pos)) != 0) {
+        goto out;
+    }
+    for (i = 0; i < b.b_nnodes; i++) {
+        e = b.b_nodes[i].n_entry;
+        if ((r = image_write(fd, e->e_name, strlen(e->e_name) + 1, &pos)) != 0) {
+            goto out;
+        }
+    }
+    for (i = 0; i < b.b_nnodes; i++) {
+        if ((f = vfbfs_entry_get_file(b.b_nodes[i].n_entry)) == NULL) {
+            continue;
+        }
+        if ((r = image_pad_to(fd, ents[i].ie_data_off, &pos)) != 0) {
+            goto out;
+        }
+        /* If the file shrank since the layout was made the rest stays zero */
+        vfbfs_mutex_lock(&f->f_lock, VFBFS_LC_F_LOCK);
+        if (f->f_content != NULL) {
+            r = image_write(fd, f->f_content
+                , MIN(ents[i].ie_size, (uint64_t)vfbfs_file_get_size(f)), &pos);
+        }
+        vfbfs_mutex_unlock(&f->f_lock, VFBFS_LC_F_LOCK);
+        if (r != 0) {
+            goto out;
+        }
+    }
+    if (ftruncate(fd, hdr.ih_size) != 0 || fsync(fd) != 0) {
+        r = -errno;
+        goto out;
+    }
+    if (rename(tmp, path) != 0) {
+        r = -errno;
+    }
+
+out:
+    if (fd >= 0) {
+        close(fd);
+        if (r != 0) {
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(ents);
+    free(b.b_nodes);
+    return r;
+}
+
+static void image_set_attrs(struct vfbfs_entry *e, const struct vfbfs_image_entry *ie)
+{
+    vfbfs_mutex_lock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+    e->e_stat.st_mode  = ie->ie_mode;
+    e->e_stat.st_uid   = ie->ie_uid;
+    e->e_stat.st_gid   = ie->ie_gid;
+    e->e_stat.st_atime = ie->ie_atime;
+    e->e_stat.st_mtime = ie->ie_mtime;
+    e->e_stat.st_ctime = ie->ie_ctime;
+    e->e_stat.st_size  = ie->ie_size;
+    vfbfs_mutex_unlock(&e->e_wlock, VFBFS_LC_E_WLOCK);
+}
+
+/*
+ * Maps the image at path and adds its entries to the tree. Returns -ENOENT
+ * if there is no image yet and -EINVAL if it's not a valid one.
+*/
+int vfbfs_image_load(struct vfbfs *fs, const char *path)
+{
+    const struct vfbfs_image_header *hdr;
+    const struct vfbfs_image_entry *ents, *ie;
+    struct vfbfs_dir **dirs = NULL, *parent;
+    struct vfbfs_image *im;
+    struct vfbfs_entry *e;
+    struct vfbfs_file *f;
+    const char *names, *name;
+    struct stat st;
+    char *map;
+    uint32_t i;
+    int fd, r = 0;
+
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0) {
+        return -errno;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -EINVAL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+
+    hdr   = (const struct vfbfs_image_header *)map;
+    ents  = (const struct vfbfs_image_entry *)(hdr + 1);
+    names = map + hdr->ih_names_off;
+    if (memcmp(hdr->ih_magic, VFBFS_IMAGE_MAGIC, sizeof(hdr->ih_magic)) != 0
+            || hdr->ih_version != VFBFS_IMAGE_VERSION || hdr->ih_nentries == 0
+            || hdr->ih_size > (uint64_t)st.st_size || hdr->ih_data_off > hdr->ih_size
+            || hdr->ih_names_off != sizeof(*hdr) + (uint64_t)hdr->ih_nentries * sizeof(*ents)
+            || hdr->ih_names_off > hdr->ih_data_off) {
+        munmap(map, st.st_size);
+        return -EINVAL;
+    }
+    if ((dirs = calloc(hdr->ih_nentries, sizeof(*dirs))) == NULL
+            || (im = calloc(1, sizeof(*im))) == NULL) {
+        free(dirs);
+        munmap(map, st.st_size);
+        return -ENOMEM;
+    }
+
+    dirs[0] = vfbfs_get_rootdir(fs);
+    for (i = 1; i < hdr->ih_nentries; i++) {
+        ie = &ents[i];
+        if (ie->ie_parent >= i || (parent = dirs[ie->ie_parent]) == NULL
+                || ie->ie_name_off >= hdr->ih_data_off - hdr->ih_names_off) {
+            r = -EINVAL;
+            continue;
+        }
+        name = names + ie->ie_name_off;
+        /* One path component, ending within the name table */
+        if (memchr(name, '\0', hdr->ih_data_off - hdr->ih_names_off - ie->ie_name_off) == NULL
+                || name[0] == '\0' || strchr(name, '/') != NULL
+                || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            r = -EINVAL;
+            continue;
+        }
+        e    = vfbfs_entry_find_in(fs, parent, name);
+        if (S_ISDIR(ie->ie_mode)) {
+            if (e == NULL && (dirs[i] = vfbfs_dir_create_in(fs, parent, name)) != NULL) {
+                image_set_attrs(dirs[i]->d_entry, ie);
+            } else {
+                dirs[i] = vfbfs_entry_get_dir(e);
+            }
+        } else if (e == NULL) {
+            /* Written so that a huge ie_size can't wrap around */
+            if (ie->ie_data_off < hdr->ih_data_off || ie->ie_data_off > hdr->ih_size
+                    || ie->ie_size > hdr->ih_size - ie->ie_data_off) {
+                r = -EINVAL;
+                continue;
+            }
+            if ((f = vfbfs_file_create_in(fs, parent, name)) != NULL) {
+                f->f_content      = map + ie->ie_data_off;
+                f->f_content_size = ie->ie_size;
+                f->f_flags       |= VFBFS_FILE_MAPPED;
+                image_set_attrs(f->f_entry, ie);
+            }
+        }
+    }
+    free(dirs);
+
+    im->im_path = strdup(path);
+    im->im_map  = map;
+    im->im_size = st.st_size;
+    fs->fs_superblock->sb_image = im;
+    return r;
+}
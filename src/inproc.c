@@ -0,0 +1,52 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <inproc.h>
+
+#include <string.h>
+#include <unistd.h>
+
+static struct fuse_context inproc_ctx;
+
+/*
+ * Stands in for the one in libfuse, so vfbfs_get_fs() works without a
+ * mounted filesystem.
+*/
+struct fuse_context *fuse_get_context(void)
+{
+    return &inproc_ctx;
+}
+
+/* Does what fuse_main() would before the first operation */
+void vfbfs_inproc_start(struct vfbfs *fs)
+{
+    struct fuse_conn_info conn;
+    inproc_ctx.private_data = fs;
+    inproc_ctx.uid          = getuid();
+    inproc_ctx.gid          = getgid();
+    inproc_ctx.pid          = getpid();
+    memset(&conn, 0, sizeof(conn));
+    fs->fs_superblock->sb_fs_oprs.init(&conn);
+}
+
+void vfbfs_inproc_stop(struct vfbfs *fs)
+{
+    fs->fs_superblock->sb_fs_oprs.destroy(fs);
+}
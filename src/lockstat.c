@@ -0,0 +1,369 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Lock contention profiling. Build with 'make LOCKSTAT=y' to enable it,
+ * otherwise this file compiles to nothing and the lock wrappers in lockstat.h
+ * are the bare pthread calls.
+*/
+#include <vfbfs.h>
+
+#ifdef VFBFS_LOCKSTAT
+
+#include <config.h>
+#include <gen.h>
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+
+#define LOCKSTAT_MAX_HELD 32
+
+static const char *lockstat_class_names[VFBFS_LC_MAX] = {
+    [VFBFS_LC_F_LOCK]    = "f_lock",
+    [VFBFS_LC_E_WLOCK]   = "e_wlock",
+    [VFBFS_LC_D_RWLOCK]  = "d_rwlock",
+    [VFBFS_LC_SB_WLOCK]  = "sb_wlock",
+    [VFBFS_LC_FB_LOCK]   = "fb_lock",
+    [VFBFS_LC_TRACE_LOCK] = "t_lock",
+    [VFBFS_LC_H_LOCK]    = "h_lock",
+    [VFBFS_LC_H_POOL]    = "h_pool",
+    [VFBFS_LC_WORKERS]   = "workers",
+    [VFBFS_LC_HISTORY]   = "history",
+};
+
+/* Registered call sites, the list is only ever prepended */
+static struct vfbfs_lockstat_site *lockstat_sites = NULL;
+static pthread_mutex_t lockstat_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The locks currently held by this thread, to be able to measure the hold
+ * time at unlock. Nesting deeper than LOCKSTAT_MAX_HELD is not accounted.
+*/
+static __thread struct {
+    void                       *h_lock;
+    struct vfbfs_lockstat_site *h_site;
+    uint64_t                    h_since;
+} lockstat_held[LOCKSTAT_MAX_HELD];
+static __thread int lockstat_nheld = 0;
+
+static inline uint64_t lockstat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lockstat_register(struct vfbfs_lockstat_site *site)
+{
+    pthread_mutex_lock(&lockstat_sites_lock);
+    if (!site->ls_registered) {
+        site->ls_next  = lockstat_sites;
+        lockstat_sites = site;
+        __atomic_store_n(&site->ls_registered, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lockstat_sites_lock);
+}
+
+static void lockstat_max(uint64_t *max, uint64_t val)
+{
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > cur) {
+        if (__atomic_compare_exchange_n(max, &cur, val, true
+                    , __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+static void lockstat_acquired(void *lock, struct vfbfs_lockstat_site *site
+    , uint64_t start, bool contended)
+{
+    uint64_t now = lockstat_now();
+
+    if (!__atomic_load_n(&site->ls_registered, __ATOMIC_ACQUIRE)) {
+        lockstat_register(site);
+    }
+    __atomic_fetch_add(&site->ls_acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_fetch_add(&site->ls_contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&site->ls_wait_ns, now - start, __ATOMIC_RELAXED);
+        lockstat_max(&site->ls_wait_max_ns, now - start);
+    }
+    if (lockstat_nheld < LOCKSTAT_MAX_HELD) {
+        lockstat_held[lockstat_nheld].h_lock  = lock;
+        lockstat_held[lockstat_nheld].h_site  = site;
+        lockstat_held[lockstat_nheld].h_since = now;
+    }
+    lockstat_nheld++;
+}
+
+static void lockstat_released(void *lock)
+{
+    int i, n = MIN(lockstat_nheld, LOCKSTAT_MAX_HELD);
+    uint64_t held;
+    struct vfbfs_lockstat_site *site;
+
+    /* Locks are usually released in the reverse order */
+    for (i = n - 1; i >= 0; i--) {
+        if (lockstat_held[i].h_lock == lock) {
+            site = lockstat_held[i].h_site;
+            held = lockstat_now() - lockstat_held[i].h_since;
+            __atomic_fetch_add(&site->ls_hold_ns, held, __ATOMIC_RELAXED);
+            lockstat_max(&site->ls_hold_max_ns, held);
+            memmove(&lockstat_held[i], &lockstat_held[i+1]
+                , (n - i - 1) * sizeof(lockstat_held[0]));
+            lockstat_nheld--;
+            return;
+        }
+    }
+    /* Not taken through the wrappers (or nested too deep) */
+    if (lockstat_nheld > LOCKSTAT_MAX_HELD) {
+        lockstat_nheld--;
+    }
+}
+
+void vfbfs_lockstat_mutex_lock(pthread_mutex_t *m, struct vfbfs_lockstat_site *site)
+{
+    uint64_t start = 0;
+    bool contended = false;
+    if (pthread_mutex_trylock(m) != 0) {
+        contended = true;
+        start     = lockstat_now();
+        pthread_mutex_lock(m);
+    }
+    lockstat_acquired(m, site, start, contended);
+}
+
+void vfbfs_lockstat_mutex_unlock(pthread_mutex_t *m)
+{
+    lockstat_released(m);
+    pthread_mutex_unlock(m);
+}
+
+void vfbfs_lockstat_rdlock(pthread_rwlock_t *l, struct vfbfs_lockstat_site *site)
+{
+    uint64_t start = 0;
+    bool contended = false;
+    if (pthread_rwlock_tryrdlock(l) != 0) {
+        contended = true;
+        start     = lockstat_now();
+        pthread_rwlock_rdlock(l);
+    }
+    lockstat_acquired(l, site, start, contended);
+}
+
+void vfbfs_lockstat_wrlock(pthread_rwlock_t *l, struct vfbfs_lockstat_site *site)
+{
+    uint64_t start = 0;
+    bool contended = false;
+    if (pthread_rwlock_trywrlock(l) != 0) {
+        contended = true;
+        start     = lockstat_now();
+        pthread_rwlock_wrlock(l);
+    }
+    lockstat_acquired(l, site, start, contended);
+}
+
+void vfbfs_lockstat_rwunlock(pthread_rwlock_t *l)
+{
+    lockstat_released(l);
+    pthread_rwlock_unlock(l);
+}
+
+/*
+ * The mutex is released while waiting, the time spent in the wait is not
+ * counted as hold time. Reacquiring it is accounted to the waiting site.
+*/
+int vfbfs_lockstat_cond_wait(pthread_cond_t *c, pthread_mutex_t *m
+    , const struct timespec *abstime, struct vfbfs_lockstat_site *site)
+{
+    int r;
+    lockstat_released(m);
+    if (abstime != NULL) {
+        r = pthread_cond_timedwait(c, m, abstime);
+    } else {
+        r = pthread_cond_wait(c, m);
+    }
+    lockstat_acquired(m, site, 0, false);
+    return r;
+}
+
+static struct vfbfs_lockstat_site *lockstat_first_site(void)
+{
+    struct vfbfs_lockstat_site *s;
+    pthread_mutex_lock(&lockstat_sites_lock);
+    s = lockstat_sites;
+    pthread_mutex_unlock(&lockstat_sites_lock);
+    return s;
+}
+
+void vfbfs_lockstat_print(FILE *fp)
+{
+    struct vfbfs_lockstat_site *s, *first = lockstat_first_site();
+    struct vfbfs_lockstat_site cls[VFBFS_LC_MAX];
+    int i;
+
+    memset(cls, 0, sizeof(cls));
+    for (s = first; s != NULL; s = s->ls_next) {
+        struct vfbfs_lockstat_site *c = &cls[s->ls_class];
+        c->ls_acquired  += __atomic_load_n(&s->ls_acquired, __ATOMIC_RELAXED);
+        c->ls_contended += __atomic_load_n(&s->ls_contended, __ATOMIC_RELAXED);
+        c->ls_wait_ns   += __atomic_load_n(&s->ls_wait_ns, __ATOMIC_RELAXED);
+        c->ls_hold_ns   += __atomic_load_n(&s->ls_hold_ns, __ATOMIC_RELAXED);
+        c->ls_wait_max_ns = MAX(c->ls_wait_max_ns, s->ls_wait_max_ns);
+        c->ls_hold_max_ns = MAX(c->ls_hold_max_ns, s->ls_hold_max_ns);
+    }
+
+    fprintf(fp, "%-10s %12s %12s %14s %12s %14s %12s\n", "class", "acquired", "contended"
+        , "wait_ns", "wait_max_ns", "hold_ns", "hold_max_ns");
+    for (i = 0; i < VFBFS_LC_MAX; i++) {
+        fprintf(fp, "%-10s %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12" PRIu64
+                    " %14" PRIu64 " %12" PRIu64 "\n", lockstat_class_names[i]
+            , cls[i].ls_acquired, cls[i].ls_contended, cls[i].ls_wait_ns
+            , cls[i].ls_wait_max_ns, cls[i].ls_hold_ns, cls[i].ls_hold_max_ns);
+    }
+
+    fprintf(fp, "\n%-10s %12s %12s %14s %12s %14s %12s  %s\n", "class", "acquired", "contended"
+        , "wait_ns", "wait_max_ns", "hold_ns", "hold_max_ns", "site");
+    for (s = first; s != NULL; s = s->ls_next) {
+        fprintf(fp, "%-10s %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12" PRIu64
+                    " %14" PRIu64 " %12" PRIu64 "  %s (%s:%d)\n"
+            , lockstat_class_names[s->ls_class]
+            , s->ls_acquired, s->ls_contended, s->ls_wait_ns
+            , s->ls_wait_max_ns, s->ls_hold_ns, s->ls_hold_max_ns
+            , s->ls_func, s->ls_file, s->ls_line);
+    }
+}
+
+void vfbfs_lockstat_reset(void)
+{
+    struct vfbfs_lockstat_site *s;
+    for (s = lockstat_first_site(); s != NULL; s = s->ls_next) {
+        __atomic_store_n(&s->ls_acquired, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->ls_contended, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->ls_wait_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->ls_wait_max_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->ls_hold_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->ls_hold_max_ns, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * The lockstat generated file renders the statistics when opened,
+ * writing anything to it resets the counters.
+*/
+static int lockstat_file_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    vfbfs_lockstat_print(out);
+    return 0;
+}
+
+static int lockstat_file_write(struct vfbfs *fs, struct vfbfs_file *f, void *priv
+    , const char *data, size_t size, off_t off)
+{
+    vfbfs_lockstat_reset();
+    return size;
+}
+
+/* Dumps the statistics to the syslog on every SIGUSR1 */
+static void *lockstat_signal_thread(void *arg)
+{
+    sigset_t set;
+    int sig;
+    char *buf, *line, *svptr;
+    size_t len;
+    FILE *fp;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (sigwait(&set, &sig) == 0) {
+        buf = NULL;
+        if ((fp = open_memstream(&buf, &len)) == NULL) {
+            continue;
+        }
+        vfbfs_lockstat_print(fp);
+        fclose(fp);
+        for (line = strtok_r(buf, "\n", &svptr); line != NULL
+                ; line = strtok_r(NULL, "\n", &svptr)) {
+            syslog(LOG_INFO, "lockstat: %s", line);
+        }
+        free(buf);
+    }
+    return NULL;
+}
+
+static int lockstat_gen_setup(struct vfbfs *fs, struct vfbfs_file *f, const char *args)
+{
+    struct vfbfs_gen *g;
+    (void) fs;
+    (void) args;
+    if ((g = vfbfs_gen_attach(f, lockstat_file_render, NULL, VFBFS_GEN_TTL_NONE)) == NULL) {
+        return -ENOMEM;
+    }
+    g->g_write = lockstat_file_write;
+    return 0;
+}
+
+/* "gen /config/lockstat.txt lockstat" in the configuration, see config.c */
+static struct vfbfs_generator lockstat_generator = {
+    .g_name  = "lockstat",
+    .g_setup = lockstat_gen_setup,
+};
+
+static void __attribute__((constructor)) lockstat_register_generator(void)
+{
+    vfbfs_generator_register(&lockstat_generator);
+}
+
+/*
+ * Must be called before the FUSE threads are started, all of them inherit
+ * the blocked SIGUSR1, so only the dumper thread receives it.
+*/
+int vfbfs_lockstat_init(struct vfbfs *fs)
+{
+    sigset_t set;
+    (void) fs;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    return -pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/* Called from the FUSE init, after the daemon has forked into the background */
+int vfbfs_lockstat_start(struct vfbfs *fs)
+{
+    pthread_t th;
+    int r;
+    (void) fs;
+    if ((r = pthread_create(&th, NULL, lockstat_signal_thread, NULL)) != 0) {
+        return -r;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
+#endif /* VFBFS_LOCKSTAT */
@@ -0,0 +1,73 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <vfbfs.h>
+#include <config.h>
+#include <gen.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+
+static long opencount = 0;
+
+/* Rendered on every open, each opener reads its own count */
+static int oc_render(struct vfbfs *fs, struct vfbfs_file *f, void *priv, FILE *out)
+{
+    long n = __atomic_fetch_add(&opencount, 1, __ATOMIC_RELAXED);
+    fprintf(out, "This file has been opened %ld time%s.\n", n, n < 2 ? "" : "s");
+    return 0;
+}
+
+static int oc_setup(struct vfbfs *fs, struct vfbfs_file *f, const char *args)
+{
+    return (vfbfs_gen_attach(f, oc_render, NULL, VFBFS_GEN_TTL_NONE) != NULL) ? 0 : -ENOMEM;
+}
+
+static struct vfbfs_generator oc_generator = {
+    .g_name  = "opencount",
+    .g_setup = oc_setup,
+};
+
+/* The tree when no --config is given, see config.c for the format */
+static const char *main_config =
+    "dir  /fb\n"
+    "dir  /config\n"
+    "file /config/readme.txt \"This is a readme file!\\n\"\n"
+    "file /config/empty.txt\n"
+    "gen  /config/opencount.txt opencount\n"
+#ifdef VFBFS_LOCKSTAT
+    "gen  /config/lockstat.txt lockstat\n"
+#endif
+    ;
+
+int main(int argc, char *argv[])
+{
+    struct vfbfs fs;
+
+    /* TODO --help */
+    openlog("vfbfs", LOG_CONS|LOG_PID, LOG_USER);
+    vfbfs_init(&fs);
+    vfbfs_generator_register(&oc_generator);
+    vfbfs_set_default_config(main_config);
+    return vfbfs_main(&fs, argc, argv);
+}
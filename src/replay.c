@@ -0,0 +1,539 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Replays a trace recorded with --trace=FILE against an in-process
+ * filesystem (see inproc.h). Files and directories which the trace uses
+ * without creating them are created first, framebuffers are given with -b
+ * like --fb= to the daemon.
+ *
+ * By default the records are replayed one after the other in the recorded
+ * order, as fast as possible, which is deterministic. -s replays at the
+ * recorded speed (or a multiple of it) and -t replays every recorded thread
+ * in its own thread. The results are printed as JSON.
+ *
+ *   vfbfs -f mnt --trace=app.trace; make replay && ./vfbfs-replay -t -s 1 app.trace
+*/
+#include <vfbfs.h>
+#include <inproc.h>
+#include <trace.h>
+#include <fb.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <search.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REPLAY_MAX_THREADS 256
+#define REPLAY_HASH_SIZE   1024
+
+struct replay_options {
+    double  speed;              /* 0: as fast as possible, 1: recorded speed */
+    bool    threaded;
+    bool    verbose;
+};
+
+/* Open handles of the replay, by the fi->fh of the recording */
+struct replay_handle {
+    uint64_t               h_fh;
+    struct fuse_file_info  h_fi;
+    int                    h_refs;
+    struct replay_handle  *h_next;
+};
+
+struct replay_stats {
+    uint64_t s_count;
+    uint64_t s_mismatches;      /* returned something else than in the recording */
+    uint64_t s_ns;
+    uint64_t s_recorded_ns;
+};
+
+struct replay_thread {
+    pthread_t            rt_thread;
+    uint32_t             rt_tid;     /* recorded thread id, 0 replays everything */
+    char                *rt_buf;
+    struct replay_stats  rt_stats[VFBFS_TR_MAX];
+    uint64_t             rt_skipped; /* no handle for the recorded fh */
+};
+
+static const struct replay_options *replay_opts;
+static struct fuse_operations *replay_oprs;
+static struct vfbfs_trace_rec **replay_recs;
+static size_t replay_nrecs;
+static size_t replay_bufsize = 4096;
+static uint64_t replay_start;
+
+static struct replay_handle *replay_handles[REPLAY_HASH_SIZE];
+static pthread_mutex_t replay_handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline const char *replay_rec_path(const struct vfbfs_trace_rec *rec, char *buf)
+{
+    memcpy(buf, rec + 1, rec->tr_pathlen);
+    buf[rec->tr_pathlen] = '\0';
+    return buf;
+}
+
+static struct fuse_file_info *replay_handle_new(uint64_t fh)
+{
+    struct replay_handle **hp, *h;
+    pthread_mutex_lock(&replay_handles_lock);
+    hp = &replay_handles[fh % REPLAY_HASH_SIZE];
+    for (h = *hp; h != NULL && h->h_fh != fh; h = h->h_next)
+        ;
+    if (h == NULL && (h = calloc(1, sizeof(*h))) != NULL) {
+        h->h_fh   = fh;
+        h->h_next = *hp;
+        *hp       = h;
+    }
+    if (h != NULL) {
+        h->h_refs++;
+    }
+    pthread_mutex_unlock(&replay_handles_lock);
+    return (h != NULL) ? &h->h_fi : NULL;
+}
+
+static struct fuse_file_info *replay_handle_get(uint64_t fh)
+{
+    struct replay_handle *h;
+    pthread_mutex_lock(&replay_handles_lock);
+    for (h = replay_handles[fh % REPLAY_HASH_SIZE]; h != NULL && h->h_fh != fh; h = h->h_next)
+        ;
+    pthread_mutex_unlock(&replay_handles_lock);
+    return (h != NULL) ? &h->h_fi : NULL;
+}
+
+/* Drops a reference, the handle is freed after the last release */
+static void replay_handle_put(uint64_t fh)
+{
+    struct replay_handle **hp, *h;
+    pthread_mutex_lock(&replay_handles_lock);
+    for (hp = &replay_handles[fh % REPLAY_HASH_SIZE]; (h = *hp) != NULL; hp = &h->h_next) {
+        if (h->h_fh == fh) {
+            if (--h->h_refs == 0) {
+                *hp = h->h_next;
+                free(h);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replay_handles_lock);
+}
+
+static int replay_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    (void) buf;
+    (void) name;
+    (void) st;
+    (void) off;
+    return 0;
+}
+
+static int replay_one(struct replay_thread *rt, const struct vfbfs_trace_rec *rec)
+{
+    struct fuse_file_info *fi = NULL, nofi;
+    char path[UINT16_MAX + 1];
+    struct stat st;
+    unsigned revents;
+    int r;
+
+    replay_rec_path(rec, path);
+    memset(&nofi, 0, sizeof(nofi));
+    switch (rec->tr_op) {
+        case VFBFS_TR_GETATTR:
+        return replay_oprs->getattr(path, &st);
+
+        case VFBFS_TR_OPEN:
+        case VFBFS_TR_CREATE:
+        case VFBFS_TR_OPENDIR:
+        nofi.flags = (rec->tr_op == VFBFS_TR_OPEN) ? (int)rec->tr_flags : O_RDWR;
+        if (rec->tr_op == VFBFS_TR_OPEN) {
+            r = replay_oprs->open(path, &nofi);
+        } else if (rec->tr_op == VFBFS_TR_CREATE) {
+            r = replay_oprs->create(path, rec->tr_flags, &nofi);
+        } else {
+            r = replay_oprs->opendir(path, &nofi);
+        }
+        if (r == 0 && rec->tr_result == 0 && (fi = replay_handle_new(rec->tr_fh)) != NULL) {
+            *fi = nofi;
+        }
+        return r;
+
+        case VFBFS_TR_TRUNCATE:
+        return replay_oprs->truncate(path, rec->tr_off);
+
+        case VFBFS_TR_MKDIR:
+        return replay_oprs->mkdir(path, rec->tr_flags);
+
+        case VFBFS_TR_UNLINK:
+        return replay_oprs->unlink(path);
+
+        case VFBFS_TR_RENAME:
+        return replay_oprs->rename(path, path + rec->tr_size + 1);
+
+        default:
+        break;
+    }
+
+    /* The rest works on an open handle */
+    if ((fi = replay_handle_get(rec->tr_fh)) == NULL) {
+        if (rec->tr_op != VFBFS_TR_IOCTL && rec->tr_op != VFBFS_TR_READDIR) {
+            rt->rt_skipped++;
+            return rec->tr_result;
+        }
+        fi = &nofi;
+    }
+    switch (rec->tr_op) {
+        case VFBFS_TR_READ:
+        return replay_oprs->read(path, rt->rt_buf, rec->tr_size, rec->tr_off, fi);
+
+        case VFBFS_TR_WRITE:
+        return replay_oprs->write(path, rt->rt_buf, rec->tr_size, rec->tr_off, fi);
+
+        case VFBFS_TR_FSYNC:
+        return replay_oprs->fsync(path, rec->tr_flags, fi);
+
+        case VFBFS_TR_POLL:
+        /* Without a poll handle, nothing is notified */
+        return replay_oprs->poll(path, fi, NULL, &revents);
+
+        case VFBFS_TR_IOCTL:
+        memset(rt->rt_buf, 0, replay_bufsize);
+        return replay_oprs->ioctl(path, rec->tr_flags, rt->rt_buf, fi, 0, rt->rt_buf);
+
+        case VFBFS_TR_READDIR:
+        return replay_oprs->readdir(path, NULL, replay_filler, rec->tr_off, fi);
+
+        case VFBFS_TR_RELEASE:
+        r = replay_oprs->release(path, fi);
+        replay_handle_put(rec->tr_fh);
+        return r;
+
+        case VFBFS_TR_RELEASEDIR:
+        r = replay_oprs->releasedir(path, fi);
+        replay_handle_put(rec->tr_fh);
+        return r;
+
+        default:
+        return -ENOSYS;
+    }
+}
+
+static void *replay_thread_main(void *arg)
+{
+    struct replay_thread *rt = (struct replay_thread *)arg;
+    const struct vfbfs_trace_rec *rec;
+    struct replay_stats *s;
+    struct timespec ts;
+    uint64_t at, start;
+    size_t i;
+    int r;
+
+    for (i = 0; i < replay_nrecs; i++) {
+        rec = replay_recs[i];
+        if (rt->rt_tid != 0 && rec->tr_tid != rt->rt_tid) {
+            continue;
+        }
+        if (replay_opts->speed > 0) {
+            at = replay_start + (uint64_t)(rec->tr_start_ns / replay_opts->speed);
+            ts.tv_sec  = at / 1000000000ULL;
+            ts.tv_nsec = at % 1000000000ULL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        start = replay_now();
+        r = replay_one(rt, rec);
+        s = &rt->rt_stats[rec->tr_op];
+        s->s_ns          += replay_now() - start;
+        s->s_recorded_ns += rec->tr_dur_ns;
+        s->s_count++;
+        if (r != rec->tr_result) {
+            s->s_mismatches++;
+            if (replay_opts->verbose) {
+                char path[UINT16_MAX + 1];
+                fprintf(stderr, "%s %s: %d, recorded %d\n", vfbfs_trace_op_name(rec->tr_op)
+                    , replay_rec_path(rec, path), r, rec->tr_result);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Creates path and its parents unless they exist */
+static void replay_populate_path(struct vfbfs *fs, const char *path, bool dir, off_t size)
+{
+    char *apath = strdup(path), *name, *svptr, *next;
+    struct vfbfs_dir *parent = vfbfs_get_rootdir(fs);
+    struct vfbfs_entry *e;
+    struct vfbfs_file *f;
+    size_t len = 0;
+
+    for (name = strtok_r(apath, "/", &svptr); name != NULL; name = next) {
+        next = strtok_r(NULL, "/", &svptr);
+        len  = name - apath + strlen(name);
+        apath[len] = '\0';
+        if ((e = vfbfs_entry_lookup(fs, apath)) == NULL) {
+            if (next != NULL || dir) {
+                vfbfs_dir_create_in(fs, parent, name);
+            } else if ((f = vfbfs_file_create_in(fs, parent, name)) != NULL && size > 0) {
+                vfbfs_file_call_operation(fs, f, VFBFS_F_TRUNCATE, apath, size);
+            }
+            e = vfbfs_entry_lookup(fs, apath);
+        }
+        if ((parent = vfbfs_entry_get_dir(e)) == NULL) {
+            break;
+        }
+        if (next != NULL) {
+            apath[len] = '/';
+        }
+    }
+    free(apath);
+}
+
+/*
+ * Creates everything the trace finds without creating it: the first
+ * successful operation on a path which is not create or mkdir.
+*/
+static int replay_path_cmp(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+static void replay_populate(struct vfbfs *fs)
+{
+    struct vfbfs_trace_rec *rec;
+    char path[UINT16_MAX + 1], *p;
+    void *created = NULL;       /* paths created by the trace itself */
+    bool dir;
+    size_t i;
+
+    for (i = 0; i < replay_nrecs; i++) {
+        rec = replay_recs[i];
+        replay_rec_path(rec, path);
+        /* The target of a rename is made by the trace */
+        if (rec->tr_op == VFBFS_TR_RENAME && rec->tr_result == 0
+                && tfind(path + rec->tr_size + 1, &created, replay_path_cmp) == NULL) {
+            tsearch(strdup(path + rec->tr_size + 1), &created, replay_path_cmp);
+        }
+        if (rec->tr_result < 0 || tfind(path, &created, replay_path_cmp) != NULL
+                || vfbfs_entry_lookup(fs, path) != NULL) {
+            continue;
+        }
+        if (rec->tr_op == VFBFS_TR_CREATE || rec->tr_op == VFBFS_TR_MKDIR) {
+            tsearch(strdup(path), &created, replay_path_cmp);
+            /* Only its parent has to exist */
+            if ((p = strrchr(path, '/')) != NULL && p != path) {
+                *p = '\0';
+                replay_populate_path(fs, path, true, 0);
+            }
+            continue;
+        }
+        dir = rec->tr_op == VFBFS_TR_OPENDIR || rec->tr_op == VFBFS_TR_READDIR
+           || rec->tr_op == VFBFS_TR_RELEASEDIR
+           || (rec->tr_op == VFBFS_TR_GETATTR && S_ISDIR(rec->tr_flags));
+        replay_populate_path(fs, path, dir
+            , (rec->tr_op == VFBFS_TR_GETATTR) ? (off_t)rec->tr_size : 0);
+    }
+    tdestroy(created, free);
+}
+
+/* Maps the trace and indexes its records */
+static int replay_load(const char *file)
+{
+    const struct vfbfs_trace_header *hdr;
+    struct vfbfs_trace_rec *rec;
+    struct stat st;
+    size_t off, cap = 0;
+    char *map;
+    int fd;
+
+    if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        return -errno;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -EINVAL;
+    }
+    close(fd);
+    hdr = (const struct vfbfs_trace_header *)map;
+    if (memcmp(hdr->th_magic, VFBFS_TRACE_MAGIC, sizeof(hdr->th_magic)) != 0
+            || hdr->th_version != VFBFS_TRACE_VERSION) {
+        return -EINVAL;
+    }
+    for (off = sizeof(*hdr); off + sizeof(*rec) <= (size_t)st.st_size; off += vfbfs_trace_rec_len(rec)) {
+        rec = (struct vfbfs_trace_rec *)(map + off);
+        if (rec->tr_op >= VFBFS_TR_MAX || off + vfbfs_trace_rec_len(rec) > (size_t)st.st_size) {
+            break;
+        }
+        /* Both paths of a rename have to be there */
+        if (rec->tr_op == VFBFS_TR_RENAME && rec->tr_size >= rec->tr_pathlen) {
+            break;
+        }
+        if (replay_nrecs == cap) {
+            cap = MAX(1024, cap * 2);
+            if ((replay_recs = realloc(replay_recs, cap * sizeof(*replay_recs))) == NULL) {
+                return -ENOMEM;
+            }
+        }
+        replay_recs[replay_nrecs++] = rec;
+        if (rec->tr_op == VFBFS_TR_READ || rec->tr_op == VFBFS_TR_WRITE) {
+            replay_bufsize = MAX(replay_bufsize, rec->tr_size);
+        }
+    }
+    return 0;
+}
+
+static void replay_usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s speed] [-t] [-v] [-b WxH[:fmt][@hz][,device]]... trace\n"
+                    "  -s speed   1 replays at the recorded speed, 0 (default) as fast as possible\n"
+                    "  -t         replay each recorded thread in its own thread\n"
+                    "  -b spec    create a framebuffer, like --fb=\n"
+                    "  -v         print the operations returning something else\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_options opts = {
+        .speed    = 0,
+        .threaded = false,
+        .verbose  = false,
+    };
+    struct replay_thread *threads;
+    struct replay_stats total[VFBFS_TR_MAX];
+    uint64_t elapsed, count = 0, mismatches = 0, skipped = 0;
+    uint32_t tids[REPLAY_MAX_THREADS];
+    int c, i, j, nthreads = 0, r;
+    struct vfbfs *fs;
+    bool first = true;
+    size_t k;
+
+    if ((fs = vfbfs_new()) == NULL) {
+        fprintf(stderr, "cannot allocate the filesystem\n");
+        return 1;
+    }
+    while ((c = getopt(argc, argv, "s:tvb:h")) != -1) {
+        switch (c) {
+            case 's': opts.speed    = atof(optarg); break;
+            case 't': opts.threaded = true;         break;
+            case 'v': opts.verbose  = true;         break;
+            case 'b':
+            if (vfbfs_fb_create_spec(fs, optarg) == NULL) {
+                fprintf(stderr, "invalid framebuffer '%s'\n", optarg);
+                return 1;
+            }
+            break;
+            default:
+            replay_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || opts.speed < 0) {
+        replay_usage(argv[0]);
+        return 1;
+    }
+    if ((r = replay_load(argv[optind])) != 0) {
+        fprintf(stderr, "cannot load %s: %s\n", argv[optind], strerror(-r));
+        return 1;
+    }
+
+    /* One replay thread per recorded thread, or a single one for everything */
+    if (opts.threaded) {
+        for (k = 0; k < replay_nrecs; k++) {
+            for (i = 0; i < nthreads && tids[i] != replay_recs[k]->tr_tid; i++)
+                ;
+            if (i == nthreads) {
+                if (nthreads == REPLAY_MAX_THREADS) {
+                    fprintf(stderr, "more than %d threads in the trace\n", REPLAY_MAX_THREADS);
+                    return 1;
+                }
+                tids[nthreads++] = replay_recs[k]->tr_tid;
+            }
+        }
+    } else {
+        tids[nthreads++] = 0;
+    }
+
+    replay_opts = &opts;
+    replay_oprs = &fs->fs_superblock->sb_fs_oprs;
+    vfbfs_inproc_start(fs);
+    replay_populate(fs);
+
+    threads = calloc(nthreads, sizeof(*threads));
+    replay_start = replay_now();
+    for (i = 0; i < nthreads; i++) {
+        threads[i].rt_tid = tids[i];
+        threads[i].rt_buf = malloc(replay_bufsize);
+        memset(threads[i].rt_buf, 'v', replay_bufsize);
+        pthread_create(&threads[i].rt_thread, NULL, replay_thread_main, &threads[i]);
+    }
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].rt_thread, NULL);
+        for (j = 0; j < VFBFS_TR_MAX; j++) {
+            total[j].s_count       += threads[i].rt_stats[j].s_count;
+            total[j].s_mismatches  += threads[i].rt_stats[j].s_mismatches;
+            total[j].s_ns          += threads[i].rt_stats[j].s_ns;
+            total[j].s_recorded_ns += threads[i].rt_stats[j].s_recorded_ns;
+        }
+        skipped += threads[i].rt_skipped;
+        free(threads[i].rt_buf);
+    }
+    elapsed = replay_now() - replay_start;
+    vfbfs_inproc_stop(fs);
+
+    for (j = 0; j < VFBFS_TR_MAX; j++) {
+        count      += total[j].s_count;
+        mismatches += total[j].s_mismatches;
+    }
+    printf("{\"trace\": \"%s\", \"records\": %zu, \"threads\": %d, \"speed\": %.3f"
+           ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mismatches\": %" PRIu64 ", \"skipped\": %" PRIu64
+           ", \"ops\": [\n"
+        , argv[optind], replay_nrecs, nthreads, opts.speed, elapsed / 1e9
+        , elapsed ? count / (elapsed / 1e9) : 0.0, mismatches, skipped);
+    for (j = 0; j < VFBFS_TR_MAX; j++) {
+        if (total[j].s_count == 0) {
+            continue;
+        }
+        printf("%s    {\"op\": \"%s\", \"count\": %" PRIu64 ", \"mismatches\": %" PRIu64
+               ", \"avg_ns\": %" PRIu64 ", \"recorded_avg_ns\": %" PRIu64 "}"
+            , first ? "" : ",\n", vfbfs_trace_op_name(j), total[j].s_count, total[j].s_mismatches
+            , total[j].s_ns / total[j].s_count, total[j].s_recorded_ns / total[j].s_count);
+        first = false;
+    }
+    printf("\n]}\n");
+    free(threads);
+    return 0;
+}
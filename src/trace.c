@@ -0,0 +1,442 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * FUSE operation trace recorder (--trace=FILE). vfbfs_trace_open() replaces
+ * the operations in sb_fs_oprs with wrappers which call the original one and
+ * append a record to a ring buffer. The records are written to the file by
+ * a separate thread, so the operations never wait for the disk: when the
+ * ring is full the record is dropped and counted instead.
+ * The trace can be replayed with vfbfs-replay, see replay.c.
+*/
+#include <trace.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+struct vfbfs_trace {
+    int                     t_fd;
+    struct fuse_operations  t_oprs;        /* the traced operations */
+    uint64_t                t_start;       /* CLOCK_MONOTONIC of th_start_ns */
+
+    pthread_mutex_t         t_lock;        /* protects the fields below */
+    pthread_cond_t          t_cond;        /* signalled when the ring is half full */
+    char                   *t_ring;
+    uint64_t                t_head;        /* bytes ever appended */
+    uint64_t                t_tail;        /* bytes ever written to t_fd */
+    uint64_t                t_records;
+    uint64_t                t_dropped;
+    bool                    t_running;
+    pthread_t               t_thread;
+};
+
+static const char *trace_op_names[VFBFS_TR_MAX] = {
+    [VFBFS_TR_GETATTR]    = "getattr",
+    [VFBFS_TR_OPEN]       = "open",
+    [VFBFS_TR_READ]       = "read",
+    [VFBFS_TR_WRITE]      = "write",
+    [VFBFS_TR_TRUNCATE]   = "truncate",
+    [VFBFS_TR_FSYNC]      = "fsync",
+    [VFBFS_TR_RELEASE]    = "release",
+    [VFBFS_TR_IOCTL]      = "ioctl",
+    [VFBFS_TR_CREATE]     = "create",
+    [VFBFS_TR_MKDIR]      = "mkdir",
+    [VFBFS_TR_OPENDIR]    = "opendir",
+    [VFBFS_TR_READDIR]    = "readdir",
+    [VFBFS_TR_RELEASEDIR] = "releasedir",
+    [VFBFS_TR_UNLINK]     = "unlink",
+    [VFBFS_TR_RENAME]     = "rename",
+    [VFBFS_TR_POLL]       = "poll",
+};
+
+const char *vfbfs_trace_op_name(enum VfbfsTraceOperation op)
+{
+    return (op < VFBFS_TR_MAX) ? trace_op_names[op] : "unknown";
+}
+
+static inline uint64_t trace_clock(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t trace_tid(void)
+{
+    static __thread uint32_t tid = 0;
+    if (tid == 0) {
+        tid = (uint32_t)syscall(SYS_gettid);
+    }
+    return tid;
+}
+
+static inline struct vfbfs_trace *trace_get(void)
+{
+    return vfbfs_get_fs()->fs_superblock->sb_trace;
+}
+
+/* Copies len bytes into the ring at pos, wrapping around its end */
+static void trace_ring_put(struct vfbfs_trace *t, uint64_t pos, const void *data, size_t len)
+{
+    size_t at = pos % VFBFS_TRACE_RING, n = MIN(len, VFBFS_TRACE_RING - at);
+    memcpy(t->t_ring + at, data, n);
+    memcpy(t->t_ring, (const char *)data + n, len - n);
+}
+
+/* A second path (of a rename) follows the first after a NUL, tr_size is the length of the first */
+static void trace_record_paths(struct vfbfs_trace *t, enum VfbfsTraceOperation op, const char *path
+    , const char *path2, int result, uint64_t start, uint32_t flags, uint64_t fh, uint64_t off
+    , uint64_t size)
+{
+    static const char pad[VFBFS_TRACE_ALIGN];
+    uint64_t end = trace_clock(CLOCK_MONOTONIC);
+    size_t max = (path2 != NULL) ? UINT16_MAX / 2 : UINT16_MAX, len;
+    size_t pathlen = (path != NULL) ? MIN(strlen(path), max) : 0;
+    size_t path2len = (path2 != NULL) ? MIN(strlen(path2), max - 1) : 0;
+    struct vfbfs_trace_rec rec = {
+        .tr_op       = op,
+        .tr_pathlen  = (path2 != NULL) ? pathlen + 1 + path2len : pathlen,
+        .tr_tid      = trace_tid(),
+        .tr_result   = result,
+        .tr_flags    = flags,
+        .tr_start_ns = start - t->t_start,
+        .tr_dur_ns   = end - start,
+        .tr_fh       = fh,
+        .tr_off      = off,
+        .tr_size     = (path2 != NULL) ? pathlen : size,
+    };
+
+    len = vfbfs_trace_rec_len(&rec);
+    vfbfs_mutex_lock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+    if (t->t_head - t->t_tail + len > VFBFS_TRACE_RING) {
+        t->t_dropped++;
+    } else {
+        trace_ring_put(t, t->t_head, &rec, sizeof(rec));
+        trace_ring_put(t, t->t_head + sizeof(rec), path, pathlen);
+        if (path2 != NULL) {
+            trace_ring_put(t, t->t_head + sizeof(rec) + pathlen, pad, 1);
+            trace_ring_put(t, t->t_head + sizeof(rec) + pathlen + 1, path2, path2len);
+        }
+        trace_ring_put(t, t->t_head + sizeof(rec) + rec.tr_pathlen, pad
+            , len - sizeof(rec) - rec.tr_pathlen);
+        t->t_head += len;
+        t->t_records++;
+        if (t->t_head - t->t_tail >= VFBFS_TRACE_RING / 2) {
+            pthread_cond_signal(&t->t_cond);
+        }
+    }
+    vfbfs_mutex_unlock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+}
+
+static void trace_record(struct vfbfs_trace *t, enum VfbfsTraceOperation op, const char *path
+    , int result, uint64_t start, uint32_t flags, uint64_t fh, uint64_t off, uint64_t size)
+{
+    trace_record_paths(t, op, path, NULL, result, start, flags, fh, off, size);
+}
+
+/* Writes the ring out every 100ms or when it gets half full */
+static void *trace_writer_thread(void *arg)
+{
+    struct vfbfs_trace *t = (struct vfbfs_trace *)arg;
+    uint64_t head, tail, deadline;
+    struct timespec ts;
+    size_t at, n;
+    bool running = true;
+
+    while (running) {
+        vfbfs_mutex_lock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+        if (t->t_running && t->t_head - t->t_tail < VFBFS_TRACE_RING / 2) {
+            deadline   = trace_clock(CLOCK_REALTIME) + 100000000ULL;
+            ts.tv_sec  = deadline / 1000000000ULL;
+            ts.tv_nsec = deadline % 1000000000ULL;
+            vfbfs_cond_timedwait(&t->t_cond, &t->t_lock, &ts, VFBFS_LC_TRACE_LOCK);
+        }
+        running = t->t_running;
+        head    = t->t_head;
+        tail    = t->t_tail;
+        vfbfs_mutex_unlock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+
+        /* [tail, head) is not touched by the writers until t_tail moves */
+        while (tail < head) {
+            at = tail % VFBFS_TRACE_RING;
+            n  = MIN(head - tail, VFBFS_TRACE_RING - at);
+            if (write(t->t_fd, t->t_ring + at, n) != (ssize_t)n) {
+                syslog(LOG_ERR, "trace: write failed: %m");
+                break;
+            }
+            tail += n;
+        }
+        vfbfs_mutex_lock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+        t->t_tail = head;
+        vfbfs_mutex_unlock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+    }
+    return NULL;
+}
+
+static void *trace_fo_init(struct fuse_conn_info *ci)
+{
+    struct vfbfs_trace *t = trace_get();
+    void *r = t->t_oprs.init(ci);
+    int err;
+    t->t_running = true;
+    if ((err = pthread_create(&t->t_thread, NULL, trace_writer_thread, t)) != 0) {
+        syslog(LOG_ERR, "trace: cannot start the writer thread: %s", strerror(err));
+        t->t_running = false;
+    }
+    return r;
+}
+
+static void trace_fo_destroy(void *p)
+{
+    struct vfbfs_trace *t = ((struct vfbfs *)p)->fs_superblock->sb_trace;
+    t->t_oprs.destroy(p);
+    if (t->t_running) {
+        vfbfs_mutex_lock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+        t->t_running = false;
+        pthread_cond_signal(&t->t_cond);
+        vfbfs_mutex_unlock(&t->t_lock, VFBFS_LC_TRACE_LOCK);
+        pthread_join(t->t_thread, NULL);
+    }
+    syslog(LOG_INFO, "trace: %" PRIu64 " records, %" PRIu64 " dropped", t->t_records, t->t_dropped);
+    close(t->t_fd);
+}
+
+static int trace_fo_getattr(const char *path, struct stat *st)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.getattr(path, st);
+    trace_record(t, VFBFS_TR_GETATTR, path, r, start
+        , (r == 0) ? st->st_mode : 0, 0, 0, (r == 0) ? st->st_size : 0);
+    return r;
+}
+
+static int trace_fo_open(const char *path, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.open(path, fi);
+    trace_record(t, VFBFS_TR_OPEN, path, r, start, fi->flags, fi->fh, 0, 0);
+    return r;
+}
+
+static int trace_fo_read(const char *path, char *data, size_t size
+    , off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.read(path, data, size, off, fi);
+    trace_record(t, VFBFS_TR_READ, path, r, start, 0, fi->fh, off, size);
+    return r;
+}
+
+static int trace_fo_write(const char *path, const char *data, size_t size
+    , off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.write(path, data, size, off, fi);
+    trace_record(t, VFBFS_TR_WRITE, path, r, start, 0, fi->fh, off, size);
+    return r;
+}
+
+static int trace_fo_truncate(const char *path, off_t size)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.truncate(path, size);
+    trace_record(t, VFBFS_TR_TRUNCATE, path, r, start, 0, 0, size, 0);
+    return r;
+}
+
+static int trace_fo_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.fsync(path, datasync, fi);
+    trace_record(t, VFBFS_TR_FSYNC, path, r, start, datasync, fi->fh, 0, 0);
+    return r;
+}
+
+static int trace_fo_release(const char *path, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    uint64_t fh = fi->fh;
+    int r = t->t_oprs.release(path, fi);
+    trace_record(t, VFBFS_TR_RELEASE, path, r, start, fi->flags, fh, 0, 0);
+    return r;
+}
+
+static int trace_fo_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi
+        , unsigned int flags, void *data)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.ioctl(path, cmd, arg, fi, flags, data);
+    trace_record(t, VFBFS_TR_IOCTL, path, r, start, cmd, fi->fh, 0, 0);
+    return r;
+}
+
+static int trace_fo_poll(const char *path, struct fuse_file_info *fi
+    , struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.poll(path, fi, ph, reventsp);
+    trace_record(t, VFBFS_TR_POLL, path, r, start, (r == 0) ? *reventsp : 0, fi->fh, 0, 0);
+    return r;
+}
+
+static int trace_fo_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.create(path, mode, fi);
+    trace_record(t, VFBFS_TR_CREATE, path, r, start, mode, fi->fh, 0, 0);
+    return r;
+}
+
+static int trace_fo_mkdir(const char *path, mode_t mode)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.mkdir(path, mode);
+    trace_record(t, VFBFS_TR_MKDIR, path, r, start, mode, 0, 0, 0);
+    return r;
+}
+
+static int trace_fo_unlink(const char *path)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.unlink(path);
+    trace_record(t, VFBFS_TR_UNLINK, path, r, start, 0, 0, 0, 0);
+    return r;
+}
+
+static int trace_fo_rename(const char *from, const char *to)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.rename(from, to);
+    trace_record_paths(t, VFBFS_TR_RENAME, from, to, r, start, 0, 0, 0, 0);
+    return r;
+}
+
+static int trace_fo_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.opendir(path, fi);
+    trace_record(t, VFBFS_TR_OPENDIR, path, r, start, fi->flags, fi->fh, 0, 0);
+    return r;
+}
+
+static int trace_fo_readdir(const char *path, void *buf, fuse_fill_dir_t filler
+    , off_t off, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    int r = t->t_oprs.readdir(path, buf, filler, off, fi);
+    trace_record(t, VFBFS_TR_READDIR, path, r, start, 0, fi->fh, off, 0);
+    return r;
+}
+
+static int trace_fo_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct vfbfs_trace *t = trace_get();
+    uint64_t start = trace_clock(CLOCK_MONOTONIC);
+    uint64_t fh = fi->fh;
+    int r = t->t_oprs.releasedir(path, fi);
+    trace_record(t, VFBFS_TR_RELEASEDIR, path, r, start, 0, fh, 0, 0);
+    return r;
+}
+
+/*
+ * Starts tracing the filesystem's operations into path. Must be called
+ * before fuse_main(), the writer thread is started from init().
+*/
+int vfbfs_trace_open(struct vfbfs *fs, const char *path)
+{
+    struct vfbfs_superblock *sb = fs->fs_superblock;
+    struct fuse_operations *ops = &sb->sb_fs_oprs;
+    struct vfbfs_trace_header hdr;
+    struct vfbfs_trace *t;
+    int r;
+
+    if (sb->sb_trace != NULL) {
+        return -EBUSY;
+    }
+    if ((t = calloc(1, sizeof(*t))) == NULL
+            || (t->t_ring = malloc(VFBFS_TRACE_RING)) == NULL) {
+        free(t);
+        return -ENOMEM;
+    }
+    if ((t->t_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0) {
+        r = -errno;
+        free(t->t_ring);
+        free(t);
+        return r;
+    }
+    memcpy(hdr.th_magic, VFBFS_TRACE_MAGIC, sizeof(hdr.th_magic));
+    hdr.th_version  = VFBFS_TRACE_VERSION;
+    hdr.th_start_ns = trace_clock(CLOCK_REALTIME);
+    t->t_start      = trace_clock(CLOCK_MONOTONIC);
+    if (write(t->t_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        r = -errno;
+        close(t->t_fd);
+        free(t->t_ring);
+        free(t);
+        return r;
+    }
+    pthread_mutex_init(&t->t_lock, NULL);
+    pthread_cond_init(&t->t_cond, NULL);
+
+    t->t_oprs       = *ops;
+    ops->init       = trace_fo_init;
+    ops->destroy    = trace_fo_destroy;
+    ops->getattr    = trace_fo_getattr;
+    ops->open       = trace_fo_open;
+    ops->read       = trace_fo_read;
+    ops->write      = trace_fo_write;
+    ops->truncate   = trace_fo_truncate;
+    ops->fsync      = trace_fo_fsync;
+    ops->release    = trace_fo_release;
+    ops->ioctl      = trace_fo_ioctl;
+    ops->poll       = trace_fo_poll;
+    ops->create     = trace_fo_create;
+    ops->mkdir      = trace_fo_mkdir;
+    ops->unlink     = trace_fo_unlink;
+    ops->rename     = trace_fo_rename;
+    ops->opendir    = trace_fo_opendir;
+    ops->readdir    = trace_fo_readdir;
+    ops->releasedir = trace_fo_releasedir;
+    sb->sb_trace    = t;
+    return 0;
+}
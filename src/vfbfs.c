@@ -19,6 +19,10 @@
  */
 
 #include <vfbfs.h>
+#include <fb.h>
+#include <trace.h>
+#include <image.h>
+#include <config.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,17 +37,54 @@ extern struct vfbfs_file_ops vfbfs_gen_file_oprs;
 
 static struct vfbfs_options {
     int show_help;
+    struct vfbfs *fs;
+    char *image;
+    char *config;
+    const char *default_config;
 } vfbfs_options;
 
 #define OPTION(t, p) \
     { t, offsetof(struct vfbfs_options, p), 1 }
 
+enum {
+    VFBFS_KEY_FB,
+    VFBFS_KEY_TRACE,
+};
+
 static const struct fuse_opt option_spec[] = {
 //    OPTION("--help", show_help),
 //    OPTION("-h", show_help),
+    FUSE_OPT_KEY("--fb=", VFBFS_KEY_FB),
+    FUSE_OPT_KEY("--trace=", VFBFS_KEY_TRACE),
+    OPTION("--image=%s", image),
+    OPTION("--config=%s", config),
     FUSE_OPT_END
 };
 
+static int vfbfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    struct vfbfs_options *opts = (struct vfbfs_options *)data;
+    int r;
+    switch (key) {
+        case VFBFS_KEY_FB:
+        if (vfbfs_fb_create_spec(opts->fs, arg + strlen("--fb=")) == NULL) {
+            fprintf(stderr, "vfbfs: invalid framebuffer '%s'\n", arg);
+            return -1;
+        }
+        return 0;
+
+        case VFBFS_KEY_TRACE:
+        if ((r = vfbfs_trace_open(opts->fs, arg + strlen("--trace="))) != 0) {
+            fprintf(stderr, "vfbfs: cannot trace to '%s': %s\n"
+                , arg + strlen("--trace="), strerror(-r));
+            return -1;
+        }
+        return 0;
+    }
+    /* Everything else goes to FUSE */
+    return 1;
+}
+
 struct vfbfs *vfbfs_get_fs(void)
 {
     struct fuse_context *ctx = fuse_get_context();
@@ -55,34 +96,57 @@ struct vfbfs *vfbfs_get_fs(void)
 
 static void *vfbfs_fo_init(struct fuse_conn_info *ci)
 {
+    struct vfbfs *fs = vfbfs_get_fs();
+    struct fuse_context *ctx = fuse_get_context();
+    int r;
     (void) ci;
-    return vfbfs_get_fs();
+    vfbfs_lockstat_start(fs);
+    /* Nothing would reach the devices, the mount is useless */
+    if ((r = vfbfs_fb_start_all(fs)) != 0) {
+        syslog(LOG_ERR, "cannot start the framebuffers: %s", strerror(-r));
+        if (ctx->fuse != NULL) {
+            fuse_exit(ctx->fuse);
+        }
+    }
+    return fs;
 }
 
 static void vfbfs_fo_destroy(void *p)
 {
-    (void)p;
+    struct vfbfs *fs = (struct vfbfs *)p;
+    int r;
+    if (fs != NULL) {
+        vfbfs_fb_stop_all(fs);
+        if (fs->fs_superblock->sb_image != NULL
+                && (r = vfbfs_image_save(fs, fs->fs_superblock->sb_image->im_path)) != 0) {
+            syslog(LOG_ERR, "cannot save the image %s: %s"
+                , fs->fs_superblock->sb_image->im_path, strerror(-r));
+        }
+    }
 }
 
 static int vfbfs_fo_open(const char *path, struct fuse_file_info *fi)
 {
     struct vfbfs *fs      = vfbfs_get_fs();
-    struct vfbfs_entry *e = vfbfs_entry_lookup(fs, path);
+    struct vfbfs_entry *e = vfbfs_entry_get(fs, path);
     struct vfbfs_file  *f = vfbfs_entry_get_file(e);
+    int r = -EISDIR;
     if (e == NULL) {
         return -ENOENT;
     }
     if (f) {
-        return vfbfs_file_call_operation(fs, f, VFBFS_F_OPEN, path, fi);
+        /* The open() takes its own reference */
+        r = vfbfs_file_call_operation(fs, f, VFBFS_F_OPEN, path, fi);
     }
-    return -EISDIR;
+    vfbfs_entry_put(fs, e);
+    return r;
 }
 
 static int vfbfs_fo_read(const char *path, char *data, size_t size
     , off_t off, struct fuse_file_info *fi)
 {
     struct vfbfs *fs      = vfbfs_get_fs();
-    struct vfbfs_entry *e = (struct vfbfs_entry *)fi->fh;
+    struct vfbfs_entry *e = vfbfs_handle_entry(fi);
     struct vfbfs_file  *f = vfbfs_entry_get_file(e);
     if (e == NULL) {
         return -EBADF;
@@ -97,7 +161,7 @@ static int vfbfs_fo_write(const char *path, const char *data, size_t size
     , off_t off, struct fuse_file_info *fi)
 {
     struct vfbfs *fs      = vfbfs_get_fs();
-    struct vfbfs_entry *e = (struct vfbfs_entry *)fi->fh;
+    struct vfbfs_entry *e = vfbfs_handle_entry(fi);
     struct vfbfs_file  *f = vfbfs_entry_get_file(e);
     if (e == NULL) {
         return -EBADF;
@@ -111,29 +175,37 @@ static int vfbfs_fo_write(const char *path, const char *data, size_t size
 static int vfbfs_fo_truncate(const char *path, off_t size)
 {
     struct vfbfs *fs      = vfbfs_get_fs();
-    struct vfbfs_entry *e = vfbfs_entry_lookup(fs, path);
+    struct vfbfs_entry *e = vfbfs_entry_get(fs, path);
     struct vfbfs_file  *f = vfbfs_entry_get_file(e);
+    int r = -EISDIR;
     if (e == NULL) {
         return -EBADF;
     }
     if (f) {
-        return vfbfs_file_call_operation(fs, f, VFBFS_F_TRUNCATE, path, size);
+        r = vfbfs_file_call_operation(fs, f, VFBFS_F_TRUNCATE, path, size);
     }
-    return -EISDIR;
+    vfbfs_entry_put(fs, e);
+    return r;
 }
 
 int vfbfs_fo_fsync(const char *path, int op, struct fuse_file_info *fi)
 {
-    (void)path;
-    (void)op;
-    (void)fi;
+    struct vfbfs *fs      = vfbfs_get_fs();
+    struct vfbfs_entry *e = vfbfs_handle_entry(fi);
+    struct vfbfs_file  *f = vfbfs_entry_get_file(e);
+    if (e == NULL) {
+        return -EBADF;
+    }
+    if (f) {
+        return vfbfs_file_call_operation(fs, f, VFBFS_F_FSYNC, path, op, fi);
+    }
     return 0;
 }
 
 static int vfbfs_fo_close(const char *path, struct fuse_file_info *fi)
 {
     struct vfbfs *fs      = vfbfs_get_fs();
-    struct vfbfs_entry *e = (struct vfbfs_entry *)fi->fh;
+    struct vfbfs_entry *e = vfbfs_handle_entry(fi);
     struct vfbfs_file  *f = vfbfs_entry_get_file(e);
     if (e == NULL) {
         return -EBADF;
@@ -147,7 +219,7 @@ static int vfbfs_fo_close(const char *path, struct fuse_file_info *fi)
 static int vfbfs_fo_release(const char *path, struct fuse_file_info *fi)
 {
     struct vfbfs *fs      = vfbfs_get_fs();
-    struct vfbfs_entry *e = (struct vfbfs_entry *)fi->fh;
+    struct vfbfs_entry *e = vfbfs_handle_entry(fi);
     struct vfbfs_file  *f = vfbfs_entry_get_file(e);
     if (e == NULL) {
         return -EBADF;
@@ -158,25 +230,57 @@ static int vfbfs_fo_release(const char *path, struct fuse_file_info *fi)
     return -ENOENT;
 }
 
+static int vfbfs_fo_poll(const char *path, struct fuse_file_info *fi
+    , struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+    struct vfbfs *fs      = vfbfs_get_fs();
+    struct vfbfs_entry *e = vfbfs_handle_entry(fi);
+    struct vfbfs_file  *f = vfbfs_entry_get_file(e);
+    if (f == NULL) {
+        if (ph != NULL) {
+            fuse_pollhandle_destroy(ph);
+        }
+        return (e == NULL) ? -EBADF : -EISDIR;
+    }
+    return vfbfs_file_call_operation(fs, f, VFBFS_F_POLL, path, fi, ph, reventsp);
+}
+
 static int vfbfs_fo_getattr(const char *path, struct stat *st)
 {
     struct vfbfs *fs        = vfbfs_get_fs();
-    struct vfbfs_entry *e   = vfbfs_entry_lookup(fs, path);
-    if (e != NULL) {
-        if (vfbfs_entry_is_dir(e)) {
-            return vfbfs_dir_call_operation(fs, e->e_elem.dir, VFBFS_D_GETATTR, path, st);
-        } else {
-            return vfbfs_file_call_operation(fs, e->e_elem.file, VFBFS_F_GETATTR, path, st);
-        }
+    struct vfbfs_entry *e   = vfbfs_entry_get(fs, path);
+    int r;
+    if (e == NULL) {
+        return -ENOENT;
     }
-    return -ENOENT;
+    if (vfbfs_entry_is_dir(e)) {
+        r = vfbfs_dir_call_operation(fs, e->e_elem.dir, VFBFS_D_GETATTR, path, st);
+    } else {
+        r = vfbfs_file_call_operation(fs, e->e_elem.file, VFBFS_F_GETATTR, path, st);
+    }
+    vfbfs_entry_put(fs, e);
+    return r;
 }
 
 static int vfbfs_fo_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi
         , unsigned int flags, void *data)
 {
     struct vfbfs *fs        = vfbfs_get_fs();
-    struct vfbfs_entry *e   = vfbfs_entry_lookup(fs, path);
+    struct vfbfs_entry *e;
+    struct vfbfs_file  *f;
+    /* The fh of a directory is not a handle */
+    if (flags & FUSE_IOCTL_DIR) {
+        return -ENOTTY;
+    }
+    e = vfbfs_handle_entry(fi);
+    f = vfbfs_entry_get_file(e);
+    if (e == NULL) {
+        return -EBADF;
+    }
+    if (f) {
+        return vfbfs_file_call_operation(fs, f, VFBFS_F_IOCTL, path, cmd, arg, fi, flags, data);
+    }
+    return -ENOTTY;
 }
 
 static int vfbfs_fo_create(const char *path, mode_t mode, struct fuse_file_info *fi)
@@ -186,51 +290,118 @@ static int vfbfs_fo_create(const char *path, mode_t mode, struct fuse_file_info
     struct vfbfs_entry *e;
     struct vfbfs_dir *parent;
     int r;
-    if ((r = vfbfs_entry_lookup_parent(fs, path, &parent, &e, &name)) != 0) {
+    /* -ENOENT just means that the file itself doesn't exist yet */
+    if ((r = vfbfs_entry_lookup_parent(fs, path, &parent, &e, &name)) != 0
+            && parent == NULL) {
+        return r;
+    }
+    if (e != NULL) {
+        return -EEXIST;
+    }
+    if ((r = vfbfs_dir_call_operation(fs, parent, VFBFS_D_CREATE, path, name, mode, fi)) != 0) {
+        return r;
+    }
+    /* create() also opens the new file */
+    return vfbfs_fo_open(path, fi);
+}
+
+static int vfbfs_fo_mkdir(const char *path, mode_t mode)
+{
+    struct vfbfs *fs        = vfbfs_get_fs();
+    char *name;
+    struct vfbfs_entry *e;
+    struct vfbfs_dir *parent;
+    int r;
+    if ((r = vfbfs_entry_lookup_parent(fs, path, &parent, &e, &name)) != 0
+            && parent == NULL) {
         return r;
     }
-    return vfbfs_dir_call_operation(fs, parent, VFBFS_D_CREATE, path, name, mode, fi);
+    if (e != NULL) {
+        return -EEXIST;
+    }
+    return vfbfs_dir_call_operation(fs, parent, VFBFS_D_MKDIR, path, name, mode);
 }
 
-static int vfbfs_fo_mkdir(const char *path, mode_t mode, struct fuse_file_info *fi)
+static int vfbfs_fo_unlink(const char *path)
 {
+    struct vfbfs *fs        = vfbfs_get_fs();
+    struct vfbfs_entry *e   = vfbfs_entry_get(fs, path);
+    struct vfbfs_file  *f   = vfbfs_entry_get_file(e);
+    int r = -EISDIR;
+    if (e == NULL) {
+        return -ENOENT;
+    }
+    if (f) {
+        r = vfbfs_file_unlink(fs, f);
+    }
+    /* Frees the file unless it's still open */
+    vfbfs_entry_put(fs, e);
+    return r;
+}
 
+/*
+ * Only files move, the directories stay where they were created. Renaming
+ * onto a framebuffer's frame publishes the file as the next frame.
+*/
+static int vfbfs_fo_rename(const char *from, const char *to)
+{
+    struct vfbfs *fs        = vfbfs_get_fs();
+    struct vfbfs_entry *e   = vfbfs_entry_get(fs, from);
+    struct vfbfs_file  *f   = vfbfs_entry_get_file(e);
+    struct vfbfs_entry *te;
+    struct vfbfs_dir *parent;
+    char *name;
+    int r;
+    if (e == NULL) {
+        return -ENOENT;
+    }
+    if (f == NULL) {
+        return -EPERM;
+    }
+    if ((r = vfbfs_entry_lookup_parent(fs, to, &parent, &te, &name)) == 0 || parent != NULL) {
+        r = vfbfs_file_rename(fs, f, parent, name, to);
+    }
+    vfbfs_entry_put(fs, e);
+    return r;
 }
 
 static int vfbfs_fo_opendir(const char *path, struct fuse_file_info *fi)
 {
     struct vfbfs *fs        = vfbfs_get_fs();
-    struct vfbfs_entry *e   = vfbfs_entry_lookup(fs, path);
+    struct vfbfs_entry *e   = vfbfs_entry_get(fs, path);
     struct vfbfs_dir  *dir  = vfbfs_entry_get_dir(e);
-    if (e != NULL) {
-        if (dir == NULL) {
-            return -ENOTDIR;
-        }
-        return vfbfs_dir_call_operation(fs, dir, VFBFS_D_OPEN, path, fi);
+    if (e == NULL) {
+        return -ENOENT;
     }
-    return -ENOENT;
+    if (dir == NULL) {
+        vfbfs_entry_put(fs, e);
+        return -ENOTDIR;
+    }
+    return vfbfs_dir_call_operation(fs, dir, VFBFS_D_OPEN, path, fi);
 }
 
 static int vfbfs_fo_readdir(const char *path, void *buf, fuse_fill_dir_t filler
     , off_t off, struct fuse_file_info *fi)
 {
     struct vfbfs *fs        = vfbfs_get_fs();
-    struct vfbfs_entry *e   = vfbfs_entry_lookup(fs, path);
+    struct vfbfs_entry *e   = vfbfs_entry_get(fs, path);
     struct vfbfs_dir  *dir  = vfbfs_entry_get_dir(e);
     if (dir) {
         return vfbfs_dir_call_operation(fs, dir, VFBFS_D_READ, path, buf, filler, off, fi);
     }
+    vfbfs_entry_put(fs, e);
     return -EBADF;
 }
 
 static int vfbfs_fo_releasedir(const char *path, struct fuse_file_info *fi)
 {
     struct vfbfs *fs        = vfbfs_get_fs();
-    struct vfbfs_entry *e   = vfbfs_entry_lookup(fs, path);
+    struct vfbfs_entry *e   = vfbfs_entry_get(fs, path);
     struct vfbfs_dir  *dir  = vfbfs_entry_get_dir(e);
     if (dir) {
         return vfbfs_dir_call_operation(fs, dir, VFBFS_D_RELEASE, fi);
     }
+    vfbfs_entry_put(fs, e);
     return -EBADF;
 }
 
@@ -240,6 +411,9 @@ struct vfbfs_superblock *vfbfs_superblock_alloc(struct vfbfs *fs)
     struct vfbfs_superblock *sb = (struct vfbfs_superblock *)malloc(sizeof(struct vfbfs_superblock));
     sb->sb_mountpoint = NULL;
     sb->sb_file_count = 0;
+    sb->sb_fbs        = NULL;
+    sb->sb_trace      = NULL;
+    sb->sb_image      = NULL;
     sb->sb_dfile_oprs  = vfbfs_file_get_mem_ops();
     sb->sb_dentry_oprs = vfbfs_entry_get_mem_ops();
     sb->sb_ddir_oprs   = vfbfs_dir_get_generic_ops();
@@ -260,9 +434,12 @@ struct vfbfs_superblock *vfbfs_superblock_alloc(struct vfbfs *fs)
         .release    = vfbfs_fo_release,
         .getattr    = vfbfs_fo_getattr,
         .ioctl      = vfbfs_fo_ioctl,
+        .poll       = vfbfs_fo_poll,
 
         .create     = vfbfs_fo_create,
         .mkdir      = vfbfs_fo_mkdir,
+        .unlink     = vfbfs_fo_unlink,
+        .rename     = vfbfs_fo_rename,
         .opendir    = vfbfs_fo_opendir,
         .readdir    = vfbfs_fo_readdir,
         .releasedir = vfbfs_fo_releasedir
@@ -306,64 +483,65 @@ struct vfbfs *vfbfs_new(void)
     return vfbfs_init(fs);
 }
 
-int vfbfs_main(struct vfbfs *fs, int argc, char *argv[])
-{
-    struct vfbfs_superblock *sb = fs->fs_superblock;
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    if (fuse_opt_parse(&args, &vfbfs_options, option_spec, NULL) == -1) {
-        return 1;
-    }
-    fs->fs_abs_path = get_current_dir_name();
-    return fuse_main(args.argc, args.argv, &sb->sb_fs_oprs, fs);
-}
-
-static long opencount = 0;
-#define BUFF_SIZE 60
-static char buff[BUFF_SIZE];
-static off_t buff_len = 0;
-void make_buff(struct vfbfs_file *f)
+/*
+ * Loads the --image, the path is made absolute because the daemon changes
+ * its directory before saving it on unmount.
+*/
+static int vfbfs_main_image(struct vfbfs *fs, const char *image)
 {
-    snprintf(buff, BUFF_SIZE, "This file has been opened %ld time%s.\n", opencount, opencount < 2 ? "" : "s");
-    buff_len = strlen(buff);
-    vfbfs_file_set_size(f, buff_len);
-}
+    struct vfbfs_image *im;
+    char *path = NULL;
+    int r;
 
-int oc_open(struct vfbfs *fs, struct vfbfs_file *f, const char *path, struct fuse_file_info *fi)
-{
-    make_buff(f);
-    opencount++;
-    return 0;
+    if (image[0] != '/' && asprintf(&path, "%s/%s", fs->fs_abs_path, image) < 0) {
+        return -ENOMEM;
+    }
+    if ((r = vfbfs_image_load(fs, (path != NULL) ? path : image)) == -ENOENT) {
+        /* No image yet, it will be created on unmount */
+        im = (struct vfbfs_image *)calloc(1, sizeof(*im));
+        im->im_path = (path != NULL) ? strdup(path) : strdup(image);
+        fs->fs_superblock->sb_image = im;
+        r = 0;
+    } else if (r != 0) {
+        fprintf(stderr, "vfbfs: cannot load the image %s: %s\n", image, strerror(-r));
+    }
+    free(path);
+    return r;
 }
 
-int oc_read(struct vfbfs *fs, struct vfbfs_file *f, const char *path
-        , char *data, size_t size, off_t off, struct fuse_file_info *fi)
+/* The tree to build when no --config is given */
+void vfbfs_set_default_config(const char *text)
 {
-    size = MIN(size, buff_len);
-    memcpy(data, buff+off, size);
-    return size;
+    vfbfs_options.default_config = text;
 }
 
-int main(int argc, char *argv[])
+int vfbfs_main(struct vfbfs *fs, int argc, char *argv[])
 {
-    struct vfbfs fs;
-    struct vfbfs_dir *fb, *config;
-    struct vfbfs_file *readme, *empty, *oc;
-    char *msg = strdup("This is a readme file!\n");
-
-    /* TODO --help */
-    openlog("vfbfs", LOG_CONS|LOG_PID, LOG_USER);
-    vfbfs_init(&fs);
-
-    fb = vfbfs_dir_create_in(&fs, NULL, "fb");
-    config = vfbfs_dir_create_in(&fs, NULL, "config");
-    readme = vfbfs_file_create_in(&fs, config, "readme.txt");
-    empty  = vfbfs_file_create_in(&fs, config, "empty.txt");
-    readme->f_content = msg;
-    oc  = vfbfs_file_create_in(&fs, config, "opencount.txt");
-    oc->f_oprs->f_open = oc_open;
-    oc->f_oprs->f_read = oc_read;
-    make_buff(oc);
-    vfbfs_file_set_size(readme, strlen(msg));
-
-    return vfbfs_main(&fs, argc, argv);
+    struct vfbfs_superblock *sb = fs->fs_superblock;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int r;
+    vfbfs_options.fs = fs;
+    if (fuse_opt_parse(&args, &vfbfs_options, option_spec, vfbfs_opt_proc) == -1) {
+        return 1;
+    }
+    if (vfbfs_options.config != NULL) {
+        r = vfbfs_config_load(fs, vfbfs_options.config);
+    } else if (vfbfs_options.default_config != NULL) {
+        r = vfbfs_config_load_string(fs, vfbfs_options.default_config, "default configuration");
+    } else {
+        r = 0;
+    }
+    if (r != 0) {
+        return 1;
+    }
+    if (sb->sb_fbs == NULL && vfbfs_fb_create_spec(fs, VFBFS_FB_DEFAULT_SPEC) == NULL) {
+        fprintf(stderr, "vfbfs: cannot create the default framebuffer\n");
+        return 1;
+    }
+    fs->fs_abs_path = get_current_dir_name();
+    if (vfbfs_options.image != NULL && (r = vfbfs_main_image(fs, vfbfs_options.image)) != 0) {
+        return 1;
+    }
+    vfbfs_lockstat_init(fs);
+    return fuse_main(args.argc, args.argv, &sb->sb_fs_oprs, fs);
 }
@@ -0,0 +1,142 @@
+/*
+ * Virtual userspace filesystem for framebuffers
+ *
+ * Copyright (C) 2017 Akos Kovacs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <vfbfs.h>
+#include <workers.h>
+
+#include <unistd.h>
+
+struct workers_job {
+    void              (*j_fn)(void *, unsigned);
+    void               *j_arg;
+    unsigned            j_n;
+    unsigned            j_next;     /* the next i to hand out */
+    unsigned            j_done;
+    struct workers_job *j_link;     /* next job with i left to hand out */
+};
+
+static pthread_mutex_t     workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      workers_cond = PTHREAD_COND_INITIALIZER;  /* a job was queued */
+static pthread_cond_t      workers_done = PTHREAD_COND_INITIALIZER;  /* a job completed */
+static struct workers_job *workers_jobs = NULL;
+static pthread_once_t      workers_once = PTHREAD_ONCE_INIT;
+static unsigned            workers_nthreads = 0;
+
+/* Takes the next i of the first job, with workers_lock held */
+static struct workers_job *workers_claim_locked(struct workers_job *job, unsigned *i)
+{
+    struct workers_job **pp;
+    if (job == NULL) {
+        job = workers_jobs;
+    }
+    if (job == NULL || job->j_next >= job->j_n) {
+        return NULL;
+    }
+    *i = job->j_next++;
+    if (job->j_next == job->j_n) {
+        for (pp = &workers_jobs; *pp != NULL && *pp != job; pp = &(*pp)->j_link)
+            ;
+        if (*pp != NULL) {
+            *pp = job->j_link;
+        }
+    }
+    return job;
+}
+
+/* Runs one i of job, with workers_lock held, dropped meanwhile */
+static void workers_run_one_locked(struct workers_job *job, unsigned i)
+{
+    vfbfs_mutex_unlock(&workers_lock, VFBFS_LC_WORKERS);
+    job->j_fn(job->j_arg, i);
+    vfbfs_mutex_lock(&workers_lock, VFBFS_LC_WORKERS);
+    if (++job->j_done == job->j_n) {
+        pthread_cond_broadcast(&workers_done);
+    }
+}
+
+static void *workers_thread(void *arg)
+{
+    struct workers_job *job;
+    unsigned i;
+
+    vfbfs_mutex_lock(&workers_lock, VFBFS_LC_WORKERS);
+    for (;;) {
+        if ((job = workers_claim_locked(NULL, &i)) == NULL) {
+            vfbfs_cond_wait(&workers_cond, &workers_lock, VFBFS_LC_WORKERS);
+            continue;
+        }
+        workers_run_one_locked(job, i);
+    }
+    return NULL;
+}
+
+/* One thread per CPU besides the callers, none on a single CPU */
+static void workers_start(void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_t attr;
+    pthread_t th;
+    unsigned i;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i + 1 < (unsigned)MIN(MAX(ncpu, 1), VFBFS_WORKERS_MAX); i++) {
+        if (pthread_create(&th, &attr, workers_thread, NULL) != 0) {
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    workers_nthreads = i;
+}
+
+/* The threads a job can run on, the caller included */
+unsigned vfbfs_workers_count(void)
+{
+    pthread_once(&workers_once, workers_start);
+    return workers_nthreads + 1;
+}
+
+void vfbfs_workers_run(void (*fn)(void *arg, unsigned i), void *arg, unsigned n)
+{
+    struct workers_job job = { fn, arg, n, 0, 0, NULL }, **pp;
+    unsigned i;
+
+    if (n == 0) {
+        return;
+    }
+    if (n == 1 || vfbfs_workers_count() == 1) {
+        for (i = 0; i < n; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+    vfbfs_mutex_lock(&workers_lock, VFBFS_LC_WORKERS);
+    for (pp = &workers_jobs; *pp != NULL; pp = &(*pp)->j_link)
+        ;
+    *pp = &job;
+    pthread_cond_broadcast(&workers_cond);
+    while (workers_claim_locked(&job, &i) != NULL) {
+        workers_run_one_locked(&job, i);
+    }
+    while (job.j_done < job.j_n) {
+        vfbfs_cond_wait(&workers_done, &workers_lock, VFBFS_LC_WORKERS);
+    }
+    vfbfs_mutex_unlock(&workers_lock, VFBFS_LC_WORKERS);
+}